@@ -24,36 +24,58 @@
 
 #if CS_ENABLE_UBJSON
 
-struct link {
-  struct link *next;
-  /* arrays need a finalizer; don't bother using tagged pointers */
-  int is_array;
+/*
+ * Nodes are carved from blocks of an arena owned by ub_ctx and are all freed
+ * together with it. Blocks grow from UB_ARENA_MIN_BLOCK_SIZE up to
+ * UB_ARENA_MAX_BLOCK_SIZE bytes.
+ */
+#ifndef UB_ARENA_MIN_BLOCK_SIZE
+#define UB_ARENA_MIN_BLOCK_SIZE 256
+#endif
+
+#ifndef UB_ARENA_MAX_BLOCK_SIZE
+#define UB_ARENA_MAX_BLOCK_SIZE 8192
+#endif
+
+/* Alignment of the nodes, enough for ub_val_t */
+#define UB_ARENA_ALIGN 8
+#define UB_ARENA_ROUND(n) (((n) + UB_ARENA_ALIGN - 1) & ~(UB_ARENA_ALIGN - 1))
+
+struct ub_block {
+  struct ub_block *next;
+  size_t size; /* Usable size */
+  size_t used;
 };
 
+#define UB_BLOCK_DATA(b) \
+  ((char *) (b) + UB_ARENA_ROUND(sizeof(struct ub_block)))
+
 struct prop {
-  struct link link; /* for freeing up */
   struct prop *next;
   struct ub_str *name;
   ub_val_t val;
 };
 
 struct ub_obj {
-  struct link link;
   struct prop *props;
 };
 
 struct ub_arr {
-  struct link link;
+  struct ub_arr *next; /* elems need freeing */
   struct mbuf elems;
 };
 
 struct ub_str {
-  struct link link;
   char s[1];
 };
 
+struct ub_typed_arr {
+  enum cs_ubjson_elem_type type;
+  size_t n;
+  char data[1];
+};
+
 struct ub_bin {
-  struct link link; /* for freeing up */
   size_t size;
   ub_bin_cb_t cb;
   void *user_data;
@@ -67,7 +89,8 @@ struct ub_ctx {
   ub_cb_t cb;        /* called to render data */
   void *user_data;   /* passed to cb */
   size_t bytes_left; /* bytes left in current Bin generator */
-  struct link *head; /* all allocated objects */
+  struct ub_block *blocks; /* arena, the current block first */
+  struct ub_arr *arrays;   /* all allocated arrays */
 };
 
 struct visit {
@@ -112,14 +135,14 @@ struct ub_ctx *ub_ctx_new(void) {
 void ub_ctx_free(struct ub_ctx *ctx) {
   mbuf_free(&ctx->out);
   mbuf_free(&ctx->stack);
-  struct link *l, *tmp;
-  for (l = ctx->head; l != NULL; l = tmp) {
-    tmp = l->next;
-    if (l->is_array) {
-      /* l points to the beginning of the array object */
-      mbuf_free(&((struct ub_arr *) l)->elems);
-    }
-    free(l);
+  struct ub_arr *a;
+  struct ub_block *b, *tmp;
+  for (a = ctx->arrays; a != NULL; a = a->next) {
+    mbuf_free(&a->elems);
+  }
+  for (b = ctx->blocks; b != NULL; b = tmp) {
+    tmp = b->next;
+    free(b);
   }
   free(ctx);
 }
@@ -167,6 +190,9 @@ static void ub_render_cont(struct ub_ctx *ctx) {
         /* skip default popping of visitor frame */
         continue;
       }
+    } else if (obj.kind == UBJSON_TYPE_TYPED_ARRAY) {
+      cs_ubjson_emit_typed_array(buf, obj.val.t->type, obj.val.t->data,
+                                 obj.val.t->n);
     } else if (obj.kind == UBJSON_TYPE_BIN) {
       ctx->bytes_left = obj.val.b->size;
       cs_ubjson_emit_bin_header(buf, ctx->bytes_left);
@@ -236,15 +262,37 @@ void ub_bin_send(struct ub_ctx *ctx, void *d, size_t n) {
 }
 
 static void *ub_alloc(struct ub_ctx *ctx, size_t size) {
-  struct link *res = calloc(1, size);
-  res->next = ctx->head;
-  ctx->head = res;
+  struct ub_block *b = ctx->blocks;
+  char *res;
+  size = UB_ARENA_ROUND(size);
+  if (b == NULL || b->size - b->used < size) {
+    /* Blocks double in size; large nodes get a block of their own. */
+    size_t bsize = (b == NULL ? UB_ARENA_MIN_BLOCK_SIZE : b->size * 2);
+    if (bsize > UB_ARENA_MAX_BLOCK_SIZE) bsize = UB_ARENA_MAX_BLOCK_SIZE;
+    if (bsize < size) bsize = size;
+    b = malloc(UB_ARENA_ROUND(sizeof(*b)) + bsize);
+    if (b == NULL) abort();
+    b->size = bsize;
+    b->used = 0;
+    if (ctx->blocks != NULL && bsize == size) {
+      /* Keep filling the current block */
+      b->next = ctx->blocks->next;
+      ctx->blocks->next = b;
+    } else {
+      b->next = ctx->blocks;
+      ctx->blocks = b;
+    }
+  }
+  res = UB_BLOCK_DATA(b) + b->used;
+  b->used += size;
+  memset(res, 0, size);
   return res;
 }
 
 struct ub_str *create_ub_str(struct ub_ctx *ctx, const struct mg_str s) {
   struct ub_str *res = ub_alloc(ctx, sizeof(*res) + s.len);
-  memcpy((char *) res->s, s.p, s.len + 1);
+  memcpy((char *) res->s, s.p, s.len);
+  res->s[s.len] = '\0';
   return res;
 }
 
@@ -256,12 +304,25 @@ ub_val_t ub_create_object(struct ub_ctx *ctx) {
 
 ub_val_t ub_create_array(struct ub_ctx *ctx) {
   struct ub_arr *a = ub_alloc(ctx, sizeof(*a));
-  a->link.is_array = 1;
+  a->next = ctx->arrays;
+  ctx->arrays = a;
   mbuf_init(&a->elems, 0);
   ub_val_t res = {UBJSON_TYPE_ARRAY, {.a = a}};
   return res;
 }
 
+ub_val_t ub_create_typed_array(struct ub_ctx *ctx,
+                               enum cs_ubjson_elem_type type, const void *v,
+                               size_t n) {
+  size_t size = cs_ubjson_elem_size(type) * n;
+  struct ub_typed_arr *t = ub_alloc(ctx, sizeof(*t) + size);
+  t->type = type;
+  t->n = n;
+  if (size > 0) memcpy(t->data, v, size);
+  ub_val_t res = {UBJSON_TYPE_TYPED_ARRAY, {.t = t}};
+  return res;
+}
+
 ub_val_t ub_create_bin(struct ub_ctx *ctx, size_t n, ub_bin_cb_t cb,
                        void *user_data) {
   struct ub_bin *b = ub_alloc(ctx, sizeof(*b));
@@ -23,6 +23,7 @@
 #if CS_ENABLE_UBJSON
 
 #include "common/mg_str.h"
+#include "common/ubjson.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +36,7 @@ struct ub_arr;
 struct ub_bin;
 struct ub_obj;
 struct ub_str;
+struct ub_typed_arr;
 
 enum ubjson_type {
   UBJSON_TYPE_ARRAY,
@@ -45,6 +47,7 @@ enum ubjson_type {
   UBJSON_TYPE_OBJECT,
   UBJSON_TYPE_STRING,
   UBJSON_TYPE_TRUE,
+  UBJSON_TYPE_TYPED_ARRAY,
   UBJSON_TYPE_UNDEFINED,
 };
 
@@ -56,6 +59,7 @@ typedef struct {
     struct ub_arr *a;
     struct ub_bin *b;
     struct ub_obj *o;
+    struct ub_typed_arr *t;
   } val;
 } ub_val_t;
 
@@ -77,6 +81,10 @@ ub_val_t ub_create_number(double n);
 ub_val_t ub_create_object(struct ub_ctx *ctx);
 ub_val_t ub_create_string(struct ub_ctx *ctx, const struct mg_str s);
 ub_val_t ub_create_cstring(struct ub_ctx *ctx, const char *s);
+/* Copies `n` values of the C array `v`, rendered as a typed array */
+ub_val_t ub_create_typed_array(struct ub_ctx *ctx,
+                               enum cs_ubjson_elem_type type, const void *v,
+                               size_t n);
 ub_val_t ub_create_undefined(void);
 
 int ub_is_bin(ub_val_t);
@@ -17,6 +17,10 @@
 
 #if CS_ENABLE_UBJSON
 
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+
 #include "common/ubjson.h"
 
 void cs_ubjson_emit_null(struct mbuf *buf) {
@@ -172,6 +176,535 @@ void cs_ubjson_close_array(struct mbuf *buf) {
   mbuf_append(buf, "]", 1);
 }
 
+size_t cs_ubjson_elem_size(enum cs_ubjson_elem_type type) {
+  switch (type) {
+    case CS_UBJSON_ELEM_INT8:
+    case CS_UBJSON_ELEM_UINT8:
+      return 1;
+    case CS_UBJSON_ELEM_INT16:
+      return 2;
+    case CS_UBJSON_ELEM_INT32:
+    case CS_UBJSON_ELEM_FLOAT32:
+      return 4;
+    case CS_UBJSON_ELEM_INT64:
+    case CS_UBJSON_ELEM_FLOAT64:
+      return 8;
+  }
+  return 0;
+}
+
+/*
+ * Copies `n` values of `size` bytes to `b` in big-endian order. The loops
+ * compile to byte swaps, and are vectorized at -O3.
+ */
+static void encode_array(uint8_t *b, const uint8_t *v, size_t n,
+                         size_t size) {
+  size_t i;
+  switch (size) {
+    case 2:
+      for (i = 0; i < n; i++) {
+        uint16_t x;
+        memcpy(&x, v + i * 2, sizeof(x));
+        b[i * 2] = x >> 8;
+        b[i * 2 + 1] = x & 0xff;
+      }
+      break;
+    case 4:
+      for (i = 0; i < n; i++) {
+        uint32_t x;
+        memcpy(&x, v + i * 4, sizeof(x));
+        encode_uint32(b + i * 4, x);
+      }
+      break;
+    case 8:
+      for (i = 0; i < n; i++) {
+        uint64_t x;
+        memcpy(&x, v + i * 8, sizeof(x));
+        encode_uint64(b + i * 8, x);
+      }
+      break;
+    default:
+      memcpy(b, v, n * size);
+      break;
+  }
+}
+
+void cs_ubjson_emit_typed_array(struct mbuf *buf,
+                                enum cs_ubjson_elem_type type, const void *v,
+                                size_t n) {
+  size_t size = cs_ubjson_elem_size(type), pos;
+  char hdr[4] = {'[', '$', (char) type, '#'};
+  mbuf_append(buf, hdr, sizeof(hdr));
+  cs_ubjson_emit_size(buf, n);
+  pos = buf->len;
+  if (n > 0 && mbuf_append(buf, NULL, n * size) == n * size) {
+    encode_array((uint8_t *) buf->buf + pos, (const uint8_t *) v, n, size);
+  }
+}
+
+void cs_ubjson_emit_int8_array(struct mbuf *buf, const int8_t *v, size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_INT8, v, n);
+}
+
+void cs_ubjson_emit_uint8_array(struct mbuf *buf, const uint8_t *v, size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_UINT8, v, n);
+}
+
+void cs_ubjson_emit_int16_array(struct mbuf *buf, const int16_t *v, size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_INT16, v, n);
+}
+
+void cs_ubjson_emit_int32_array(struct mbuf *buf, const int32_t *v, size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_INT32, v, n);
+}
+
+void cs_ubjson_emit_int64_array(struct mbuf *buf, const int64_t *v, size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_INT64, v, n);
+}
+
+void cs_ubjson_emit_float32_array(struct mbuf *buf, const float *v, size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_FLOAT32, v, n);
+}
+
+void cs_ubjson_emit_float64_array(struct mbuf *buf, const double *v,
+                                  size_t n) {
+  cs_ubjson_emit_typed_array(buf, CS_UBJSON_ELEM_FLOAT64, v, n);
+}
+
+/* Parsing */
+
+struct cs_ubjson_cursor {
+  const unsigned char *start; /* Beginning of the item */
+  const unsigned char *p, *end;
+  size_t *need; /* Set to length of the item so far if it is incomplete */
+};
+
+/* Returns 1 if `n` more bytes are available, else records how many are. */
+static int ubj_avail(struct cs_ubjson_cursor *c, size_t n) {
+  if ((size_t)(c->end - c->p) >= n) return 1;
+  *c->need = (size_t)(c->p - c->start) + n;
+  return 0;
+}
+
+/* Skips no-ops. Returns the next marker, or -1 if there is none yet. */
+static int ubj_next_marker(struct cs_ubjson_cursor *c) {
+  for (;;) {
+    if (!ubj_avail(c, 1)) return -1;
+    if (*c->p != 'N') return *c->p;
+    c->p++;
+  }
+}
+
+static int ubj_int_size(int m) {
+  switch (m) {
+    case 'i':
+    case 'U':
+      return 1;
+    case 'I':
+      return 2;
+    case 'l':
+      return 4;
+    case 'L':
+      return 8;
+    default:
+      return -1;
+  }
+}
+
+static uint64_t decode_uint(const unsigned char *b, int size) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < size; i++) v = (v << 8) | b[i];
+  return v;
+}
+
+static int64_t ubj_decode_int(int m, const unsigned char *b) {
+  uint64_t v = decode_uint(b, ubj_int_size(m));
+  switch (m) {
+    case 'i':
+      return (int8_t) v;
+    case 'U':
+      return (uint8_t) v;
+    case 'I':
+      return (int16_t) v;
+    case 'l':
+      return (int32_t) v;
+    default:
+      return (int64_t) v;
+  }
+}
+
+/*
+ * Reads a length or a count. Returns 1 on success, 0 if it is incomplete and
+ * -1 if it is not a non-negative integer.
+ */
+static int ubj_read_len(struct cs_ubjson_cursor *c, int *len) {
+  int64_t v;
+  int n;
+  if (!ubj_avail(c, 1)) return 0;
+  if ((n = ubj_int_size(c->p[0])) < 0) return -1;
+  if (!ubj_avail(c, 1 + n)) return 0;
+  v = ubj_decode_int(c->p[0], c->p + 1);
+  if (v < 0 || v > INT_MAX) return -1;
+  *len = (int) v;
+  c->p += 1 + n;
+  return 1;
+}
+
+static int ubj_fmt_int(char *buf, int64_t v) {
+  char tmp[20];
+  uint64_t u = (v < 0 ? -(uint64_t) v : (uint64_t) v);
+  int n = 0, len = 0;
+  do {
+    tmp[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (v < 0) buf[len++] = '-';
+  while (n > 0) buf[len++] = tmp[--n];
+  return len;
+}
+
+/* Prints m / 10^k in fixed notation. */
+static int ubj_fmt_fixed(char *buf, int neg, int64_t m, int k) {
+  char digits[20];
+  int n = ubj_fmt_int(digits, m), len = 0;
+  if (neg) buf[len++] = '-';
+  if (n <= k) {
+    buf[len++] = '0';
+    buf[len++] = '.';
+    memset(buf + len, '0', k - n);
+    len += k - n;
+  } else {
+    memcpy(buf + len, digits, n - k);
+    len += n - k;
+    if (k > 0) buf[len++] = '.';
+  }
+  memcpy(buf + len, digits + n - (n < k ? n : k), (n < k ? n : k));
+  return len + (n < k ? n : k);
+}
+
+/* Prints the shortest text that reads back as the same float or double. */
+static int ubj_fmt_float(char *buf, size_t size, double v, int is_float) {
+  static const double pow10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+  int prec = (is_float ? 6 : 15), n = 0, k;
+  /* Subnormals have fewer significant digits. */
+  if (fabs(v) < (is_float ? FLT_MIN : DBL_MIN)) prec = 1;
+  /*
+   * Most values have a few decimals: find them without converting text.
+   * The scaled value stays below 2^53, so the quotient is correctly rounded.
+   */
+  if (fabs(v) < 9e9) {
+    for (k = 0; k < (int) (sizeof(pow10) / sizeof(pow10[0])); k++) {
+      int64_t m = (int64_t)(fabs(v) * pow10[k] + 0.5);
+      double r = m / pow10[k];
+      if (is_float ? (float) r == (float) fabs(v) : r == fabs(v)) {
+        return ubj_fmt_fixed(buf, signbit(v), m, k);
+      }
+    }
+  }
+  for (; prec <= (is_float ? 9 : 17); prec++) {
+    double r;
+    n = snprintf(buf, size, "%.*g", prec, v);
+    r = strtod(buf, NULL);
+    if (is_float ? (float) r == (float) v : r == v) break;
+  }
+  return n;
+}
+
+static void ubj_emit(struct cs_ubjson_walk_ctx *ctx, const char *name,
+                     size_t name_len, enum json_token_type type,
+                     const char *ptr, int len) {
+  struct json_token t = {ptr, len, type};
+  /* Like json_walk(), skip containers under an empty key but not values. */
+  if (ctx->callback != NULL &&
+      (ctx->path_len == 0 || ctx->path[ctx->path_len - 1] != '.')) {
+    ctx->callback(ctx->callback_data, name, name_len, ctx->path, &t);
+  }
+}
+
+static void ubj_append_path(struct cs_ubjson_walk_ctx *ctx, const char *s,
+                            size_t len) {
+  size_t left = sizeof(ctx->path) - ctx->path_len - 1;
+  if (len > left) len = left;
+  memcpy(ctx->path + ctx->path_len, s, len);
+  ctx->path_len += len;
+  ctx->path[ctx->path_len] = '\0';
+}
+
+static void ubj_truncate_path(struct cs_ubjson_walk_ctx *ctx, size_t len) {
+  ctx->path_len = len;
+  ctx->path[len] = '\0';
+}
+
+/* Pops the innermost container, which ends at document offset `end`. */
+static void ubj_close(struct cs_ubjson_walk_ctx *ctx, long end) {
+  struct cs_ubjson_frame *fr = &ctx->stack[--ctx->depth];
+  const char *ptr = NULL;
+  if (fr->start >= ctx->base_pos) ptr = ctx->base + (fr->start - ctx->base_pos);
+  ubj_emit(ctx, NULL, 0,
+           fr->type == '{' ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END, ptr,
+           (int) (end - fr->start));
+  ubj_truncate_path(ctx, fr->path_len);
+  if (ctx->depth == 0) ctx->done = 1;
+}
+
+/*
+ * Parses the next item at `s`: an end marker, or a value together with its
+ * key and, for containers, the header. Returns number of bytes consumed,
+ * JSON_STRING_INCOMPLETE (`ctx->need` is then set) or JSON_STRING_INVALID.
+ */
+static int ubj_step(struct cs_ubjson_walk_ctx *ctx, const char *s,
+                    size_t len) {
+  struct cs_ubjson_frame *fr =
+      (ctx->depth > 0 ? &ctx->stack[ctx->depth - 1] : NULL);
+  struct cs_ubjson_cursor c;
+  const unsigned char *value;
+  const char *name = NULL, *ptr = NULL;
+  size_t name_len = 0, path_len = ctx->path_len;
+  enum json_token_type type = JSON_TYPE_INVALID;
+  int m, n, tok_len = 0, elem_type = 0, count = -1;
+  char idx[12];
+
+  c.start = c.p = (const unsigned char *) s;
+  c.end = c.start + len;
+  c.need = &ctx->need;
+
+  /* Values of typed arrays have no marker, and there are no no-ops. */
+  if (fr == NULL || fr->type == '{' || fr->elem_type == 0) {
+    if ((m = ubj_next_marker(&c)) < 0) return JSON_STRING_INCOMPLETE;
+    if (fr != NULL && fr->count < 0 && m == (fr->type == '{' ? '}' : ']')) {
+      n = (int) (c.p + 1 - c.start);
+      ctx->pos += n;
+      ubj_close(ctx, ctx->pos);
+      return n;
+    }
+  }
+
+  if (fr != NULL && fr->type == '{') {
+    if ((n = ubj_read_len(&c, &tok_len)) <= 0) {
+      return n < 0 ? JSON_STRING_INVALID : JSON_STRING_INCOMPLETE;
+    }
+    if (!ubj_avail(&c, tok_len)) return JSON_STRING_INCOMPLETE;
+    name = (const char *) c.p;
+    name_len = tok_len;
+    c.p += tok_len;
+  } else if (fr != NULL) {
+    name = idx;
+    name_len = ubj_fmt_int(idx, fr->index);
+  }
+
+  if (fr != NULL && fr->elem_type != 0) {
+    value = c.p;
+    m = fr->elem_type;
+  } else {
+    if ((m = ubj_next_marker(&c)) < 0) return JSON_STRING_INCOMPLETE;
+    value = c.p++;
+  }
+
+  switch (m) {
+    case 'Z':
+      type = JSON_TYPE_NULL;
+      ptr = "null";
+      tok_len = 4;
+      break;
+    case 'T':
+      type = JSON_TYPE_TRUE;
+      ptr = "true";
+      tok_len = 4;
+      break;
+    case 'F':
+      type = JSON_TYPE_FALSE;
+      ptr = "false";
+      tok_len = 5;
+      break;
+    case 'i':
+    case 'U':
+    case 'I':
+    case 'l':
+    case 'L':
+      if (!ubj_avail(&c, ubj_int_size(m))) return JSON_STRING_INCOMPLETE;
+      type = JSON_TYPE_NUMBER;
+      ptr = ctx->num;
+      tok_len = ubj_fmt_int(ctx->num, ubj_decode_int(m, c.p));
+      c.p += ubj_int_size(m);
+      break;
+    case 'd':
+    case 'D': {
+      double v;
+      if (!ubj_avail(&c, m == 'd' ? 4 : 8)) return JSON_STRING_INCOMPLETE;
+      if (m == 'd') {
+        uint32_t u = (uint32_t) decode_uint(c.p, 4);
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        v = f;
+      } else {
+        uint64_t u = decode_uint(c.p, 8);
+        memcpy(&v, &u, sizeof(v));
+      }
+      c.p += (m == 'd' ? 4 : 8);
+      if (isnan(v) || isinf(v)) {
+        type = JSON_TYPE_NULL;
+        ptr = "null";
+        tok_len = 4;
+      } else {
+        type = JSON_TYPE_NUMBER;
+        ptr = ctx->num;
+        tok_len = ubj_fmt_float(ctx->num, sizeof(ctx->num), v, m == 'd');
+      }
+      break;
+    }
+    case 'C':
+      if (!ubj_avail(&c, 1)) return JSON_STRING_INCOMPLETE;
+      type = JSON_TYPE_STRING;
+      ptr = (const char *) c.p++;
+      tok_len = 1;
+      break;
+    case 'S':
+    case 'H':
+      if ((n = ubj_read_len(&c, &tok_len)) <= 0) {
+        return n < 0 ? JSON_STRING_INVALID : JSON_STRING_INCOMPLETE;
+      }
+      if (!ubj_avail(&c, tok_len)) return JSON_STRING_INCOMPLETE;
+      type = (m == 'S' ? JSON_TYPE_STRING : JSON_TYPE_NUMBER);
+      ptr = (const char *) c.p;
+      c.p += tok_len;
+      break;
+    case '[':
+    case '{':
+      if (!ubj_avail(&c, 1)) return JSON_STRING_INCOMPLETE;
+      if (*c.p == '$') {
+        if (!ubj_avail(&c, 3)) return JSON_STRING_INCOMPLETE;
+        elem_type = c.p[1];
+        if (elem_type == 0 || strchr("ZTFiUIlLdDCSH[{", elem_type) == NULL ||
+            c.p[2] != '#') {
+          return JSON_STRING_INVALID;
+        }
+        /*
+         * Values of a typed array of nulls or booleans take no input, so
+         * a few bytes could make us report billions of them.
+         */
+        if (m == '[' && strchr("ZTF", elem_type) != NULL) {
+          return JSON_STRING_INVALID;
+        }
+        c.p += 2;
+      }
+      if (*c.p == '#') {
+        c.p++;
+        if ((n = ubj_read_len(&c, &count)) <= 0) {
+          return n < 0 ? JSON_STRING_INVALID : JSON_STRING_INCOMPLETE;
+        }
+      }
+      if (ctx->depth >= CS_UBJSON_WALK_MAX_DEPTH) return JSON_STRING_INVALID;
+      type = (m == '{' ? JSON_TYPE_OBJECT_START : JSON_TYPE_ARRAY_START);
+      break;
+    default:
+      return JSON_STRING_INVALID;
+  }
+
+  /* The item is complete: update the state and report it. */
+  if (fr != NULL) {
+    ubj_append_path(ctx, fr->type == '{' ? "." : "[", 1);
+    ubj_append_path(ctx, name, name_len);
+    if (fr->type == '[') ubj_append_path(ctx, "]", 1);
+    fr->index++;
+    if (fr->count > 0) fr->count--;
+  }
+  if (type == JSON_TYPE_OBJECT_START || type == JSON_TYPE_ARRAY_START) {
+    struct cs_ubjson_frame *child = &ctx->stack[ctx->depth++];
+    child->type = m;
+    child->elem_type = elem_type;
+    child->count = count;
+    child->index = 0;
+    child->path_len = path_len;
+    child->start = ctx->pos + (long) (value - c.start);
+    ubj_emit(ctx, name, name_len, type, NULL, 0);
+  } else {
+    ubj_emit(ctx, name, name_len, type, ptr, tok_len);
+    ubj_truncate_path(ctx, path_len);
+    if (fr == NULL) ctx->done = 1;
+  }
+  n = (int) (c.p - c.start);
+  ctx->pos += n;
+  return n;
+}
+
+/*
+ * Parses complete items of `s` until the document ends. Returns number of
+ * bytes consumed, or JSON_STRING_INVALID.
+ */
+static int ubj_run(struct cs_ubjson_walk_ctx *ctx, const char *s,
+                   size_t len) {
+  size_t off = 0;
+  int n;
+  ctx->base = s;
+  ctx->base_pos = ctx->pos;
+  while (!ctx->done) {
+    /* Counted containers end after their last value. */
+    if (ctx->depth > 0 && ctx->stack[ctx->depth - 1].count == 0) {
+      ubj_close(ctx, ctx->pos);
+      continue;
+    }
+    n = ubj_step(ctx, s + off, len - off);
+    if (n == JSON_STRING_INCOMPLETE) break;
+    if (n < 0) return n;
+    off += n;
+  }
+  return (int) off;
+}
+
+void cs_ubjson_walk_ctx_init(struct cs_ubjson_walk_ctx *ctx,
+                             json_walk_callback_t callback,
+                             void *callback_data) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->callback = callback;
+  ctx->callback_data = callback_data;
+  mbuf_init(&ctx->carry, 0);
+}
+
+int cs_ubjson_walk_ctx_feed(struct cs_ubjson_walk_ctx *ctx, const char *buf,
+                            int len) {
+  int used = 0, n;
+  if (ctx->result < 0) return ctx->result;
+  if (ctx->done || len <= 0) return 0;
+
+  /* Complete the item that started in a previous chunk. */
+  while (ctx->carry.len > 0) {
+    size_t take = ctx->need - ctx->carry.len;
+    if (take > (size_t)(len - used)) take = len - used;
+    mbuf_append(&ctx->carry, buf + used, take);
+    used += take;
+    if (ctx->carry.len < ctx->need) return used;
+    if ((n = ubj_run(ctx, ctx->carry.buf, ctx->carry.len)) < 0) {
+      return ctx->result = n;
+    }
+    /* A container header looks one byte ahead, which may stay. */
+    mbuf_remove(&ctx->carry, n);
+    if (ctx->done) return used;
+  }
+
+  if ((n = ubj_run(ctx, buf + used, len - used)) < 0) return ctx->result = n;
+  used += n;
+  if (!ctx->done && used < len) {
+    mbuf_append(&ctx->carry, buf + used, len - used);
+    used = len;
+  }
+  return used;
+}
+
+int cs_ubjson_walk_ctx_finish(struct cs_ubjson_walk_ctx *ctx) {
+  mbuf_free(&ctx->carry);
+  if (ctx->result < 0) return ctx->result;
+  return ctx->done ? (int) ctx->pos : JSON_STRING_INCOMPLETE;
+}
+
+int cs_ubjson_walk(const char *buf, int len, json_walk_callback_t callback,
+                   void *callback_data) {
+  struct cs_ubjson_walk_ctx ctx;
+  cs_ubjson_walk_ctx_init(&ctx, callback, callback_data);
+  cs_ubjson_walk_ctx_feed(&ctx, buf, len);
+  return cs_ubjson_walk_ctx_finish(&ctx);
+}
+
 #else
 void cs_ubjson_dummy();
 #endif
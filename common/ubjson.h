@@ -20,6 +20,7 @@
 
 #include "common/mbuf.h"
 #include "common/platform.h"
+#include "frozen.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,132 @@ void cs_ubjson_close_object(struct mbuf *buf);
 void cs_ubjson_open_array(struct mbuf *buf);
 void cs_ubjson_close_array(struct mbuf *buf);
 
+/* Element types of typed arrays, the values are UBJSON type markers. */
+enum cs_ubjson_elem_type {
+  CS_UBJSON_ELEM_INT8 = 'i',
+  CS_UBJSON_ELEM_UINT8 = 'U',
+  CS_UBJSON_ELEM_INT16 = 'I',
+  CS_UBJSON_ELEM_INT32 = 'l',
+  CS_UBJSON_ELEM_INT64 = 'L',
+  CS_UBJSON_ELEM_FLOAT32 = 'd',
+  CS_UBJSON_ELEM_FLOAT64 = 'D',
+};
+
+size_t cs_ubjson_elem_size(enum cs_ubjson_elem_type type);
+
+/*
+ * Emit `n` values of the C array `v` as a complete typed, counted array
+ * (`[$I#...`), which has no per-value type markers and no closing marker.
+ */
+void cs_ubjson_emit_typed_array(struct mbuf *buf,
+                                enum cs_ubjson_elem_type type, const void *v,
+                                size_t n);
+void cs_ubjson_emit_int8_array(struct mbuf *buf, const int8_t *v, size_t n);
+void cs_ubjson_emit_uint8_array(struct mbuf *buf, const uint8_t *v, size_t n);
+void cs_ubjson_emit_int16_array(struct mbuf *buf, const int16_t *v, size_t n);
+void cs_ubjson_emit_int32_array(struct mbuf *buf, const int32_t *v, size_t n);
+void cs_ubjson_emit_int64_array(struct mbuf *buf, const int64_t *v, size_t n);
+void cs_ubjson_emit_float32_array(struct mbuf *buf, const float *v, size_t n);
+void cs_ubjson_emit_float64_array(struct mbuf *buf, const double *v,
+                                  size_t n);
+
+#ifndef CS_UBJSON_WALK_MAX_DEPTH
+#define CS_UBJSON_WALK_MAX_DEPTH 32
+#endif
+
+/* An open container of the UBJSON parser. */
+struct cs_ubjson_frame {
+  char type;       /* '{' or '[' */
+  char elem_type;  /* Marker of all the values ('$'), or 0 */
+  int count;       /* Values left ('#'), or -1 if ended by a marker */
+  int index;       /* Index of the next array element */
+  size_t path_len; /* Path length before the container */
+  long start;      /* Offset of the opening marker */
+};
+
+/*
+ * State of the UBJSON parser, see `cs_ubjson_walk_ctx_init()`. All the fields
+ * are private.
+ */
+struct cs_ubjson_walk_ctx {
+  json_walk_callback_t callback;
+  void *callback_data;
+  int result;
+  int done;
+  long pos; /* Offset of the next item in the document */
+
+  /* Buffer being parsed and its offset in the document */
+  const char *base;
+  long base_pos;
+
+  /* Item that crosses chunks, and its length once complete */
+  struct mbuf carry;
+  size_t need;
+
+  char num[32]; /* Text of the current number */
+  char path[JSON_MAX_PATH_LEN];
+  size_t path_len;
+  int depth;
+  struct cs_ubjson_frame stack[CS_UBJSON_WALK_MAX_DEPTH];
+};
+
+/*
+ * Parse UBJSON document `buf, len`, invoking `callback` with the same events
+ * and paths `json_walk()` would give for the equivalent JSON, so that
+ * a `json_walk()` consumer can read either format. Differences are:
+ *
+ *  - STRING tokens point to the raw bytes of the string, without escapes;
+ *  - NUMBER tokens point to a decimal representation of the value owned by
+ *    the parser (high-precision numbers point to the input), NaN and infinity
+ *    are reported as NULL;
+ *  - END tokens have `ptr` set to NULL if the container started in
+ *    a previous chunk.
+ *
+ * Optimized containers (`$` type and `#` count) are supported, except typed
+ * arrays of nulls and booleans (`[$Z`, `[$T`, `[$F`): their values take no
+ * input, so a short document could produce billions of them.
+ * Strings, keys and high-precision numbers are not copied, and pointers
+ * passed to the callback are only valid during the call.
+ * Return number of processed bytes, or a negative error code.
+ */
+int cs_ubjson_walk(const char *buf, int len, json_walk_callback_t callback,
+                   void *callback_data);
+
+/*
+ * Incremental version of `cs_ubjson_walk()`, for input that arrives in
+ * chunks of any size. An item that crosses chunks is copied, all others
+ * are passed to the callback in place.
+ *
+ * Example:
+ *
+ * ```c
+ * struct cs_ubjson_walk_ctx ctx;
+ * cs_ubjson_walk_ctx_init(&ctx, my_cb, NULL);
+ * while ((n = read(fd, buf, sizeof(buf))) > 0) {
+ *   if (cs_ubjson_walk_ctx_feed(&ctx, buf, n) < 0) break;
+ * }
+ * res = cs_ubjson_walk_ctx_finish(&ctx);
+ * ```
+ */
+void cs_ubjson_walk_ctx_init(struct cs_ubjson_walk_ctx *ctx,
+                             json_walk_callback_t callback,
+                             void *callback_data);
+
+/*
+ * Parses the next chunk of the document. Returns number of bytes consumed,
+ * which is less than `len` if the document ended within the chunk, or
+ * `JSON_STRING_INVALID`.
+ */
+int cs_ubjson_walk_ctx_feed(struct cs_ubjson_walk_ctx *ctx, const char *buf,
+                            int len);
+
+/*
+ * Finishes parsing and frees memory held by the parser. Must be called even
+ * if parsing failed. Returns what `cs_ubjson_walk()` would return for the
+ * whole document.
+ */
+int cs_ubjson_walk_ctx_finish(struct cs_ubjson_walk_ctx *ctx);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
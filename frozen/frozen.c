@@ -21,6 +21,8 @@
 #include "frozen.h"
 
 #include <ctype.h>
+#include <float.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -72,6 +74,19 @@ typedef unsigned _int64 uint64_t;
 #define JSON_ENABLE_ARRAY 1
 #endif
 
+#if JSON_ENABLE_SIMD && defined(__GNUC__)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JSON_SIMD_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SIMD_WIDTH 16
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JSON_SIMD_WIDTH 16
+#endif
+#endif
+
 struct frozen {
   const char *end;
   const char *cur;
@@ -150,8 +165,106 @@ static int json_isspace(int ch) {
   return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
 
+#ifdef JSON_SIMD_WIDTH
+#if defined(__AVX2__)
+static int json_simd_string_mask(const char *p) {
+  __m256i v = _mm256_loadu_si256((const __m256i *) p);
+  /* Signed compare: catches both control chars and non-ASCII bytes. */
+  __m256i m = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v);
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+  return _mm256_movemask_epi8(m);
+}
+
+static int json_simd_space_mask(const char *p) {
+  __m256i v = _mm256_loadu_si256((const __m256i *) p);
+  __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+  return ~_mm256_movemask_epi8(m);
+}
+#define JSON_SIMD_FIRST(mask) __builtin_ctz((unsigned int) (mask))
+#elif defined(__SSE2__)
+static int json_simd_string_mask(const char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i *) p);
+  /* Signed compare: catches both control chars and non-ASCII bytes. */
+  __m128i m = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  return _mm_movemask_epi8(m);
+}
+
+static int json_simd_space_mask(const char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i *) p);
+  __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  return ~_mm_movemask_epi8(m) & 0xffff;
+}
+#define JSON_SIMD_FIRST(mask) __builtin_ctz((unsigned int) (mask))
+#elif defined(__ARM_NEON)
+/* NEON has no movemask, narrow the byte mask to 4 bits per byte instead. */
+static uint64_t json_simd_neon_mask(uint8x16_t m) {
+  uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+static uint64_t json_simd_string_mask(const char *p) {
+  uint8x16_t v = vld1q_u8((const uint8_t *) p);
+  /* Signed compare: catches both control chars and non-ASCII bytes. */
+  uint8x16_t m = vcltq_s8(vreinterpretq_s8_u8(v), vdupq_n_s8(0x20));
+  m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+  m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+  return json_simd_neon_mask(m);
+}
+
+static uint64_t json_simd_space_mask(const char *p) {
+  uint8x16_t v = vld1q_u8((const uint8_t *) p);
+  uint8x16_t m = vceqq_u8(v, vdupq_n_u8(' '));
+  m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\n')));
+  m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\r')));
+  m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\t')));
+  return ~json_simd_neon_mask(m);
+}
+#define JSON_SIMD_FIRST(mask) (__builtin_ctzll(mask) / 4)
+#endif
+
+/*
+ * Skips string characters that need no checks: printable ASCII other than
+ * '"' and '\\'. Stops at the first other byte, or where no more than
+ * JSON_SIMD_WIDTH bytes are left; the rest is up to the caller. Never returns
+ * `end`.
+ */
+static const char *json_scan_string(const char *p, const char *end) {
+  for (; end - p > JSON_SIMD_WIDTH; p += JSON_SIMD_WIDTH) {
+    uint64_t mask = json_simd_string_mask(p);
+    if (mask != 0) return p + JSON_SIMD_FIRST(mask);
+  }
+  return p;
+}
+
+/* Same as json_scan_string, but skips whitespace. */
+static const char *json_scan_spaces(const char *p, const char *end) {
+  for (; end - p > JSON_SIMD_WIDTH; p += JSON_SIMD_WIDTH) {
+    uint64_t mask = json_simd_space_mask(p);
+    if (mask != 0) return p + JSON_SIMD_FIRST(mask);
+  }
+  return p;
+}
+#else
+#define json_scan_string(p, end) (p)
+#define json_scan_spaces(p, end) (p)
+#endif /* JSON_SIMD_WIDTH */
+
 static void json_skip_whitespaces(struct frozen *f) {
-  while (f->cur < f->end && json_isspace(*f->cur)) f->cur++;
+  int n = 0;
+  while (f->cur < f->end && json_isspace(*f->cur)) {
+    f->cur++;
+    /* Most runs are short, only go wide for longer ones. */
+    if (++n == 4) f->cur = json_scan_spaces(f->cur, f->end);
+  }
 }
 
 static int json_cur(struct frozen *f) {
@@ -237,6 +350,8 @@ static int json_parse_string(struct frozen *f) {
   {
     SET_STATE(f, f->cur, "", 0);
     for (; f->cur < f->end; f->cur += len) {
+      /* Skip ahead at the start and after escapes and non-ASCII chars. */
+      if (len != 1) f->cur = json_scan_string(f->cur, f->end);
       ch = *(unsigned char *) f->cur;
       len = json_get_utf8_char_len((unsigned char) ch);
       EXPECT(ch >= 32 && len > 0, JSON_STRING_INVALID); /* No control chars */
@@ -436,27 +551,39 @@ static int json_doit(struct frozen *f) {
 
 int json_escape(struct json_out *out, const char *p, size_t len) WEAK;
 int json_escape(struct json_out *out, const char *p, size_t len) {
-  size_t i, cl, n = 0;
+  size_t i, cl, run, n = 0;
   const char *hex_digits = "0123456789abcdef";
   const char *specials = "btnvfr";
+  char buf[6] = {'\\', 'u', '0', '0'};
 
   for (i = 0; i < len; i++) {
     unsigned char ch = ((unsigned char *) p)[i];
     if (ch == '"' || ch == '\\') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, p + i, 1);
+      buf[1] = ch;
+      n += out->printer(out, buf, 2);
     } else if (ch >= '\b' && ch <= '\r') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, &specials[ch - '\b'], 1);
-    } else if (isprint(ch)) {
-      n += out->printer(out, p + i, 1);
-    } else if ((cl = json_get_utf8_char_len(ch)) == 1) {
-      n += out->printer(out, "\\u00", 4);
-      n += out->printer(out, &hex_digits[(ch >> 4) % 0xf], 1);
-      n += out->printer(out, &hex_digits[ch % 0xf], 1);
+      buf[1] = specials[ch - '\b'];
+      n += out->printer(out, buf, 2);
+    } else if (isprint(ch) || (cl = json_get_utf8_char_len(ch)) > 1) {
+      /* Print the run of chars that need no escaping in one go. */
+      for (run = i; run < len;) {
+        ch = ((unsigned char *) p)[run];
+        if (isprint(ch) && ch != '"' && ch != '\\') {
+          run++;
+        } else if ((cl = json_get_utf8_char_len(ch)) > 1) {
+          run += cl;
+        } else {
+          break;
+        }
+      }
+      if (run > len) run = len;
+      n += out->printer(out, p + i, run - i);
+      i = run - 1;
     } else {
-      n += out->printer(out, p + i, cl);
-      i += cl - 1;
+      buf[1] = 'u';
+      buf[4] = hex_digits[(ch >> 4) & 0xf];
+      buf[5] = hex_digits[ch & 0xf];
+      n += out->printer(out, buf, 6);
     }
   }
 
@@ -555,55 +682,170 @@ static unsigned char hexdec(const char *s) {
 }
 #endif /* JSON_ENABLE_HEX */
 
-int json_vprintf(struct json_out *out, const char *fmt, va_list xap) WEAK;
-int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+/* Formats `v` so that it ends at `end`, returns the first digit. */
+static char *json_fmt_ulong(char *end, unsigned long v) {
+  static const char digits[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233"
+      "34353637383940414243444546474849505152535455565758596061626364656667"
+      "6869707172737475767778798081828384858687888990919293949596979899";
+  while (v >= 100) {
+    const char *d = &digits[(v % 100) * 2];
+    v /= 100;
+    *--end = d[1];
+    *--end = d[0];
+  }
+  if (v >= 10) {
+    *--end = digits[v * 2 + 1];
+    *--end = digits[v * 2];
+  } else {
+    *--end = '0' + (char) v;
+  }
+  return end;
+}
+
+static char *json_fmt_u64(char *end, uint64_t v) {
+  /* 64-bit division is slow on 32-bit targets, only use it when needed. */
+  while (v > ULONG_MAX) {
+    *--end = '0' + (char) (v % 10);
+    v /= 10;
+  }
+  return json_fmt_ulong(end, (unsigned long) v);
+}
+
+static char *json_fmt_i64(char *end, int64_t v) {
+  if (v >= 0) return json_fmt_u64(end, (uint64_t) v);
+  end = json_fmt_u64(end, 0 - (uint64_t) v);
+  *--end = '-';
+  return end;
+}
+
+/*
+ * Formats `d` with as few digits as needed to read back the same value.
+ * `buf` must be at least 32 bytes. Returns the length.
+ */
+static int json_fmt_double(char *buf, double d) {
+  static const double pow10[] = {1, 10, 100, 1e3, 1e4, 1e5, 1e6};
+  char tmp[24], *end = tmp + sizeof(tmp), *p;
+  double a = (d < 0 ? -d : d);
+  int k, j, n;
+
+  /*
+   * Most values are integers or have a few decimals, find the smallest k
+   * such that some integer i is exactly d * 10^k. i / 10^k is correctly
+   * rounded, so if it gives back d, it is a round-trip representation.
+   * The exact product is within 1 of i, the nearest integer to the computed
+   * one is off by at most 1 too.
+   */
+  for (k = 0; a == a && k < (int) (sizeof(pow10) / sizeof(pow10[0])); k++) {
+    double x = a * pow10[k];
+    if (x >= 9007199254740992.0 /* 2^53 */) break;
+    x = (double) (int64_t)(x + 0.5);
+    for (j = -1; j <= 1; j++) {
+      if ((x + j) / pow10[k] == a && x + j >= 0) {
+        p = json_fmt_u64(end, (uint64_t)(x + j));
+        n = 0;
+        if (d < 0 || (d == 0 && 1 / d < 0)) buf[n++] = '-';
+        if (end - p <= k) {
+          buf[n++] = '0';
+          buf[n++] = '.';
+          while (end - p < k--) buf[n++] = '0';
+        } else {
+          memcpy(buf + n, p, end - p - k);
+          n += end - p - k;
+          p = end - k;
+          if (k > 0) buf[n++] = '.';
+        }
+        memcpy(buf + n, p, end - p);
+        return n + (end - p);
+      }
+    }
+  }
+
+  /*
+   * DBL_DIG (15) digits always read back if any shorter form does, except
+   * for subnormals which have less precision.
+   */
+  for (k = (a < DBL_MIN ? 1 : DBL_DIG); k <= 17; k++) {
+    n = snprintf(buf, 32, "%.*g", k, d);
+    if (strtod(buf, NULL) == d || d != d) break;
+  }
+  return n;
+}
+
+/* Same as json_vprintf(), but advances `ap` past the consumed arguments. */
+static int json_vprintf_ap(struct json_out *out, const char *fmt,
+                           va_list *ap) {
   int len = 0;
   const char *quote = "\"", *null = "null";
-  va_list ap;
-  va_copy(ap, xap);
 
   while (*fmt != '\0') {
-    if (strchr(":, \r\n\t[]{}\"", *fmt) != NULL) {
-      len += out->printer(out, fmt, 1);
-      fmt++;
-    } else if (fmt[0] == '%') {
-      char buf[21];
+    if (fmt[0] == '%') {
+      char buf[32], *end = buf + sizeof(buf), *num = NULL;
       size_t skip = 2;
 
       if (fmt[1] == 'l' && fmt[2] == 'l' && (fmt[3] == 'd' || fmt[3] == 'u')) {
-        int64_t val = va_arg(ap, int64_t);
-        const char *fmt2 = fmt[3] == 'u' ? "%" UINT64_FMT : "%" INT64_FMT;
-        snprintf(buf, sizeof(buf), fmt2, val);
-        len += out->printer(out, buf, strlen(buf));
+        int64_t val = va_arg(*ap, int64_t);
+        num = (fmt[3] == 'u' ? json_fmt_u64(end, (uint64_t) val)
+                             : json_fmt_i64(end, val));
         skip += 2;
       } else if (fmt[1] == 'z' && fmt[2] == 'u') {
-        size_t val = va_arg(ap, size_t);
-        snprintf(buf, sizeof(buf), "%lu", (unsigned long) val);
-        len += out->printer(out, buf, strlen(buf));
+        num = json_fmt_u64(end, va_arg(*ap, size_t));
         skip += 1;
+      } else if (fmt[1] == 'l' && (fmt[2] == 'd' || fmt[2] == 'u')) {
+        long val = va_arg(*ap, long);
+        num = (fmt[2] == 'u' ? json_fmt_ulong(end, (unsigned long) val)
+                             : json_fmt_i64(end, val));
+        skip += 1;
+      } else if (fmt[1] == 'd' || fmt[1] == 'u') {
+        int val = va_arg(*ap, int);
+        num = (fmt[1] == 'u' ? json_fmt_ulong(end, (unsigned int) val)
+                             : json_fmt_i64(end, val));
+      } else if (fmt[1] == 'D') {
+        int n = json_fmt_double(buf, va_arg(*ap, double));
+        len += out->printer(out, buf, n);
+      } else if (fmt[1] == 's' ||
+                 (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 's')) {
+        size_t l = (size_t) -1, n = 0;
+        const char *p;
+        if (fmt[1] == '.') {
+          l = (size_t) va_arg(*ap, int);
+          skip += 2;
+        }
+        if ((p = va_arg(*ap, const char *)) == NULL) p = "(null)";
+        while (n < l && p[n] != '\0') n++;
+        len += out->printer(out, p, n);
       } else if (fmt[1] == 'M') {
-        json_printf_callback_t f = va_arg(ap, json_printf_callback_t);
-        len += f(out, &ap);
+        json_printf_callback_t f = va_arg(*ap, json_printf_callback_t);
+        len += f(out, ap);
       } else if (fmt[1] == 'B') {
-        int val = va_arg(ap, int);
+        int val = va_arg(*ap, int);
         const char *str = val ? "true" : "false";
         len += out->printer(out, str, strlen(str));
       } else if (fmt[1] == 'H') {
 #if JSON_ENABLE_HEX
         const char *hex = "0123456789abcdef";
-        int i, n = va_arg(ap, int);
-        const unsigned char *p = va_arg(ap, const unsigned char *);
-        len += out->printer(out, quote, 1);
+        int i, j = 1, n = va_arg(*ap, int);
+        const unsigned char *p = va_arg(*ap, const unsigned char *);
+        buf[0] = '"';
         for (i = 0; i < n; i++) {
-          len += out->printer(out, &hex[(p[i] >> 4) & 0xf], 1);
-          len += out->printer(out, &hex[p[i] & 0xf], 1);
+          if (j + 2 > (int) sizeof(buf)) {
+            len += out->printer(out, buf, j);
+            j = 0;
+          }
+          buf[j++] = hex[(p[i] >> 4) & 0xf];
+          buf[j++] = hex[p[i] & 0xf];
         }
-        len += out->printer(out, quote, 1);
+        if (j + 1 > (int) sizeof(buf)) {
+          len += out->printer(out, buf, j);
+          j = 0;
+        }
+        buf[j++] = '"';
+        len += out->printer(out, buf, j);
 #endif /* JSON_ENABLE_HEX */
       } else if (fmt[1] == 'V') {
 #if JSON_ENABLE_BASE64
-        const unsigned char *p = va_arg(ap, const unsigned char *);
-        int n = va_arg(ap, int);
+        const unsigned char *p = va_arg(*ap, const unsigned char *);
+        int n = va_arg(*ap, int);
         len += out->printer(out, quote, 1);
         len += b64enc(out, p, n);
         len += out->printer(out, quote, 1);
@@ -614,10 +856,10 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
         const char *p;
 
         if (fmt[1] == '.') {
-          l = (size_t) va_arg(ap, int);
+          l = (size_t) va_arg(*ap, int);
           skip += 2;
         }
-        p = va_arg(ap, char *);
+        p = va_arg(*ap, char *);
 
         if (p == NULL) {
           len += out->printer(out, null, 4);
@@ -636,9 +878,8 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
          * printf, as you can see below we still have to parse the format
          * types.
          *
-         * Currently, %s with strings longer than 20 chars will require
+         * Results longer than 31 chars, e.g. %s with a field width, require
          * double-buffering (an auxiliary buffer will be allocated from heap).
-         * TODO(dfrank): reimplement %s and %.*s in order to avoid that.
          */
 
         const char *end_of_format_specifier = "sdfFeEgGlhuIcx.*-0123456789";
@@ -651,7 +892,7 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
                 n + 1 > (int) sizeof(fmt2) ? sizeof(fmt2) : (size_t) n + 1);
         fmt2[n + 1] = '\0';
 
-        va_copy(ap_copy, ap);
+        va_copy(ap_copy, *ap);
         need_len = vsnprintf(pbuf, size, fmt2, ap_copy);
         va_end(ap_copy);
 
@@ -665,7 +906,7 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
             free(pbuf);
             size *= 2;
             if ((pbuf = (char *) malloc(size)) == NULL) break;
-            va_copy(ap_copy, ap);
+            va_copy(ap_copy, *ap);
             need_len = vsnprintf(pbuf, size, fmt2, ap_copy);
             va_end(ap_copy);
           }
@@ -675,7 +916,7 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
            * so we need to allocate a new buffer from heap and use it
            */
           if ((pbuf = (char *) malloc(need_len + 1)) != NULL) {
-            va_copy(ap_copy, ap);
+            va_copy(ap_copy, *ap);
             vsnprintf(pbuf, need_len + 1, fmt2, ap_copy);
             va_end(ap_copy);
           }
@@ -693,26 +934,26 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
          */
         if ((n + 1 == strlen("%" PRId64) && strcmp(fmt2, "%" PRId64) == 0) ||
             (n + 1 == strlen("%" PRIu64) && strcmp(fmt2, "%" PRIu64) == 0)) {
-          (void) va_arg(ap, int64_t);
+          (void) va_arg(*ap, int64_t);
         } else if (strcmp(fmt2, "%.*s") == 0) {
-          (void) va_arg(ap, int);
-          (void) va_arg(ap, char *);
+          (void) va_arg(*ap, int);
+          (void) va_arg(*ap, char *);
         } else {
           switch (fmt2[n]) {
             case 'u':
             case 'd':
-              (void) va_arg(ap, int);
+              (void) va_arg(*ap, int);
               break;
             case 'g':
             case 'f':
-              (void) va_arg(ap, double);
+              (void) va_arg(*ap, double);
               break;
             case 'p':
-              (void) va_arg(ap, void *);
+              (void) va_arg(*ap, void *);
               break;
             default:
               /* many types are promoted to int */
-              (void) va_arg(ap, int);
+              (void) va_arg(*ap, int);
           }
         }
 
@@ -725,21 +966,47 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
           pbuf = NULL;
         }
       }
+      if (num != NULL) len += out->printer(out, num, end - num);
       fmt += skip;
     } else if (*fmt == '_' || json_isalpha(*fmt)) {
-      len += out->printer(out, quote, 1);
-      while (*fmt == '_' || json_isalpha(*fmt) || json_isdigit(*fmt)) {
-        len += out->printer(out, fmt, 1);
-        fmt++;
+      /* Unquoted key, print it quoted in one go if it is not too long. */
+      char buf[32];
+      size_t n = 0;
+      while (fmt[n] == '_' || json_isalpha(fmt[n]) || json_isdigit(fmt[n])) {
+        n++;
+      }
+      if (n + 2 <= sizeof(buf)) {
+        buf[0] = '"';
+        memcpy(buf + 1, fmt, n);
+        buf[n + 1] = '"';
+        len += out->printer(out, buf, n + 2);
+      } else {
+        len += out->printer(out, quote, 1);
+        len += out->printer(out, fmt, n);
+        len += out->printer(out, quote, 1);
       }
-      len += out->printer(out, quote, 1);
+      fmt += n;
     } else {
-      len += out->printer(out, fmt, 1);
-      fmt++;
+      /* A run of punctuation, spaces and such is printed as is. */
+      size_t n = 1;
+      while (fmt[n] != '\0' && fmt[n] != '%' && fmt[n] != '_' &&
+             !json_isalpha(fmt[n])) {
+        n++;
+      }
+      len += out->printer(out, fmt, n);
+      fmt += n;
     }
   }
-  va_end(ap);
+  return len;
+}
 
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) WEAK;
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  int len;
+  va_list ap;
+  va_copy(ap, xap);
+  len = json_vprintf_ap(out, fmt, &ap);
+  va_end(ap);
   return len;
 }
 
@@ -753,6 +1020,59 @@ int json_printf(struct json_out *out, const char *fmt, ...) {
   return n;
 }
 
+struct json_out_scratch {
+  struct json_out out; /* Must be first: printer gets a pointer to it */
+  struct json_out *dst;
+};
+
+static void json_scratch_flush(struct json_out_scratch *sc) {
+  if (sc->out.u.buf.len > 0) {
+    sc->dst->printer(sc->dst, sc->out.u.buf.buf, sc->out.u.buf.len);
+    sc->out.u.buf.len = 0;
+  }
+}
+
+static int json_printer_scratch(struct json_out *out, const char *str,
+                                size_t len) {
+  struct json_out_scratch *sc = (struct json_out_scratch *) out;
+  if (out->u.buf.len + len > out->u.buf.size) json_scratch_flush(sc);
+  if (len >= out->u.buf.size) {
+    sc->dst->printer(sc->dst, str, len);
+  } else {
+    memcpy(out->u.buf.buf + out->u.buf.len, str, len);
+    out->u.buf.len += len;
+  }
+  return len;
+}
+
+int json_vprintf_buffered(struct json_out *out, char *buf, size_t size,
+                          const char *fmt, va_list ap) WEAK;
+int json_vprintf_buffered(struct json_out *out, char *buf, size_t size,
+                          const char *fmt, va_list ap) {
+  struct json_out_scratch sc;
+  int len;
+  memset(&sc, 0, sizeof(sc));
+  sc.out.printer = json_printer_scratch;
+  sc.out.u.buf.buf = buf;
+  sc.out.u.buf.size = size;
+  sc.dst = out;
+  len = json_vprintf(&sc.out, fmt, ap);
+  json_scratch_flush(&sc);
+  return len;
+}
+
+int json_printf_buffered(struct json_out *out, char *buf, size_t size,
+                         const char *fmt, ...) WEAK;
+int json_printf_buffered(struct json_out *out, char *buf, size_t size,
+                         const char *fmt, ...) {
+  int n;
+  va_list ap;
+  va_start(ap, fmt);
+  n = json_vprintf_buffered(out, buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
 int json_printf_array(struct json_out *out, va_list *ap) WEAK;
 int json_printf_array(struct json_out *out, va_list *ap) {
   int len = 0;
@@ -819,6 +1139,431 @@ int json_walk(const char *json_string, int json_string_length,
   return frozen.cur - json_string;
 }
 
+/*
+ * Incremental parser. It follows json_walk() step by step: the recursion of
+ * json_parse_object() and json_parse_array() is replaced with an explicit
+ * stack, and the position within a token is kept in `sub_state`.
+ */
+enum json_walk_ctx_state {
+  JW_VALUE,     /* Expecting a value */
+  JW_OBJ_START, /* After '{' or ',': a key or '}' */
+  JW_OBJ_NEXT,  /* After a pair: ',', a key or '}' */
+  JW_COLON,     /* After a key */
+  JW_ARR_START, /* After '[' or ',': a value or ']' */
+  JW_ARR_NEXT,  /* After a value: ',', a value or ']' */
+  JW_STRING,
+  JW_IDENT,
+  JW_NUMBER,
+  JW_LITERAL,
+  JW_DONE,
+  JW_ERROR,
+};
+
+/*
+ * String sub-states: 0 - a regular char is expected, 1 - after '\\', 2-5 -
+ * that many hex digits of "\\u" escape minus 2 have been seen (with
+ * JW_STR_BAD_HEX set if any of them is not a hex digit), negative - number of
+ * UTF-8 continuation bytes left to skip.
+ */
+#define JW_STR_ESCAPE 1
+#define JW_STR_HEX 2
+#define JW_STR_BAD_HEX 0x10
+
+/* Number sub-states, "can end" ones last. */
+enum {
+  JW_NUM_SIGN,       /* After '-' */
+  JW_NUM_HEX_START,  /* After "0x" */
+  JW_NUM_FRAC_START, /* After '.' */
+  JW_NUM_EXP_START,  /* After 'e' */
+  JW_NUM_EXP_SIGN,   /* After "e+" */
+  JW_NUM_ZERO,       /* After the leading '0' */
+  JW_NUM_INT,
+  JW_NUM_HEX,
+  JW_NUM_FRAC,
+  JW_NUM_EXP,
+};
+
+static const struct {
+  const char *s;
+  int len;
+  enum json_token_type type;
+} s_json_literals[] = {
+    {"null", 4, JSON_TYPE_NULL},
+    {"true", 4, JSON_TYPE_TRUE},
+    {"false", 5, JSON_TYPE_FALSE},
+};
+
+static bool json_ctx_grow(char **buf, size_t *size, size_t new_size) {
+  char *p;
+  if (new_size <= *size) return true;
+  if (new_size < *size * 2) new_size = *size * 2;
+  if ((p = (char *) realloc(*buf, new_size)) == NULL) return false;
+  *buf = p;
+  *size = new_size;
+  return true;
+}
+
+static size_t json_ctx_append_to_path(struct json_walk_ctx *ctx,
+                                      const char *str, size_t size) {
+  size_t n = ctx->path_len;
+  size_t left = sizeof(ctx->path) - n - 1;
+  if (size > left) size = left;
+  memcpy(ctx->path + n, str, size);
+  ctx->path[n + size] = '\0';
+  ctx->path_len += size;
+  return n;
+}
+
+static void json_ctx_truncate_path(struct json_walk_ctx *ctx, size_t len) {
+  ctx->path_len = len;
+  ctx->path[len] = '\0';
+}
+
+/* Same as CALL_BACK() */
+static void json_ctx_call(struct json_walk_ctx *ctx,
+                          enum json_token_type type, const char *ptr,
+                          size_t len) {
+  if (ctx->callback &&
+      (ctx->path_len == 0 || ctx->path[ctx->path_len - 1] != '.')) {
+    struct json_token t = {ptr, (int) len, type};
+    ctx->callback(ctx->callback_data, ctx->cur_name, ctx->cur_name_len,
+                  ctx->path, &t);
+    ctx->cur_name = NULL;
+    ctx->cur_name_len = 0;
+  }
+}
+
+static void json_ctx_begin_token(struct json_walk_ctx *ctx, int state,
+                                 int sub_state, const char *p) {
+  ctx->state = state;
+  ctx->sub_state = sub_state;
+  ctx->tok_begin = p;
+  ctx->tok_copied = false;
+  ctx->tok_len = 0;
+}
+
+/* Appends the part of the token that is in the current chunk to `tok`. */
+static bool json_ctx_copy_token(struct json_walk_ctx *ctx, const char *p) {
+  size_t n = p - ctx->tok_begin;
+  /* Always allocate, so that copied tokens never have a NULL pointer. */
+  if (!json_ctx_grow(&ctx->tok, &ctx->tok_size, ctx->tok_len + n + 1)) {
+    return false;
+  }
+  if (n > 0) memcpy(ctx->tok + ctx->tok_len, ctx->tok_begin, n);
+  ctx->tok_len += n;
+  ctx->tok_copied = true;
+  return true;
+}
+
+/* Called when a value is complete, `pos` is the offset after it. */
+static void json_ctx_value_done(struct json_walk_ctx *ctx, long pos) {
+  struct json_walk_frame *fr;
+  if (ctx->depth == 0) {
+    ctx->state = JW_DONE;
+    ctx->result = (int) pos;
+    return;
+  }
+  fr = &ctx->stack[ctx->depth - 1];
+  json_ctx_truncate_path(ctx, fr->elem_path_len);
+  ctx->state = (fr->type == '{' ? JW_OBJ_NEXT : JW_ARR_NEXT);
+}
+
+/* Finishes the token that ends before `p`, which is in the current chunk. */
+static bool json_ctx_end_token(struct json_walk_ctx *ctx, const char *p,
+                               long pos) {
+  const char *ptr = ctx->tok_begin;
+  size_t len = p - ctx->tok_begin;
+  if (ctx->tok_copied) {
+    if (!json_ctx_copy_token(ctx, p)) return false;
+    ptr = ctx->tok;
+    len = ctx->tok_len;
+  }
+  ctx->tok_copied = false;
+  if (ctx->state == JW_NUMBER) {
+    json_ctx_call(ctx, JSON_TYPE_NUMBER, ptr, len);
+  } else if (ctx->state == JW_LITERAL) {
+    json_ctx_call(ctx, s_json_literals[ctx->sub_state >> 4].type, ptr, len);
+  } else {
+    json_ctx_call(ctx, JSON_TYPE_STRING, ptr, len);
+    if (ctx->tok_is_key) {
+      struct json_walk_frame *fr = &ctx->stack[ctx->depth - 1];
+      if (ptr == ctx->tok) {
+        /* The value can be long enough to need `tok`, move the name out. */
+        if (!json_ctx_grow(&ctx->name, &ctx->name_size, len + 1)) {
+          return false;
+        }
+        memcpy(ctx->name, ptr, len);
+        ptr = ctx->name;
+      }
+      ctx->cur_name = ptr;
+      ctx->cur_name_len = len;
+      fr->elem_path_len = json_ctx_append_to_path(ctx, ptr, len);
+      ctx->state = JW_COLON;
+      return true;
+    }
+  }
+  json_ctx_value_done(ctx, pos);
+  return true;
+}
+
+/*
+ * Returns the number sub-state after `ch`, or -1 if `ch` is not a part of the
+ * number: then the number either ends before `ch`, or is invalid.
+ */
+static int json_ctx_number_next(int sub_state, int ch) {
+  switch (sub_state) {
+    case JW_NUM_SIGN:
+      if (ch == '0') return JW_NUM_ZERO;
+      return json_isdigit(ch) ? JW_NUM_INT : -1;
+    case JW_NUM_HEX_START:
+    case JW_NUM_HEX:
+      return json_isxdigit(ch) ? JW_NUM_HEX : -1;
+    case JW_NUM_FRAC_START:
+      return json_isdigit(ch) ? JW_NUM_FRAC : -1;
+    case JW_NUM_EXP_START:
+      if (ch == '+' || ch == '-') return JW_NUM_EXP_SIGN;
+      return json_isdigit(ch) ? JW_NUM_EXP : -1;
+    case JW_NUM_EXP_SIGN:
+    case JW_NUM_EXP:
+      return json_isdigit(ch) ? JW_NUM_EXP : -1;
+    case JW_NUM_ZERO:
+    case JW_NUM_INT:
+      if (ch == 'x' && sub_state == JW_NUM_ZERO) return JW_NUM_HEX_START;
+      if (json_isdigit(ch)) return JW_NUM_INT;
+      if (ch == '.') return JW_NUM_FRAC_START;
+      return (ch == 'e' || ch == 'E') ? JW_NUM_EXP_START : -1;
+    case JW_NUM_FRAC:
+      if (json_isdigit(ch)) return JW_NUM_FRAC;
+      return (ch == 'e' || ch == 'E') ? JW_NUM_EXP_START : -1;
+  }
+  return -1;
+}
+
+/* Handles a char of a string token, returns false if the string is invalid. */
+static bool json_ctx_string_char(struct json_walk_ctx *ctx, int ch) {
+  int st = ctx->sub_state;
+  if (st < 0) {
+    ctx->sub_state++;
+  } else if (st == JW_STR_ESCAPE) {
+    if (ch == 'u') {
+      ctx->sub_state = JW_STR_HEX;
+    } else if (strchr("\"\\/bfnrt", ch) != NULL && ch != '\0') {
+      ctx->sub_state = 0;
+    } else {
+      return false;
+    }
+  } else if (st >= JW_STR_HEX) {
+    /* Like json_get_escape_len(), check all 4 digits are there first. */
+    if (!json_isxdigit(ch)) st |= JW_STR_BAD_HEX;
+    st++;
+    if ((st & ~JW_STR_BAD_HEX) == JW_STR_HEX + 4) {
+      if (st & JW_STR_BAD_HEX) return false;
+      st = 0;
+    }
+    ctx->sub_state = st;
+  } else if (ch < 32) {
+    return false;
+  } else if (ch == '\\') {
+    ctx->sub_state = JW_STR_ESCAPE;
+  } else {
+    ctx->sub_state = 1 - json_get_utf8_char_len((unsigned char) ch);
+  }
+  return true;
+}
+
+void json_walk_ctx_init(struct json_walk_ctx *ctx,
+                        json_walk_callback_t callback, void *callback_data) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->callback = callback;
+  ctx->callback_data = callback_data;
+  ctx->state = JW_VALUE;
+}
+
+int json_walk_ctx_feed(struct json_walk_ctx *ctx, const char *buf, int len) {
+  const char *p = buf, *end = buf + len;
+  struct json_walk_frame *fr;
+  int ch, st;
+
+#define JW_POS(p) (ctx->offset + ((p) - buf))
+#define JW_FAIL()              \
+  do {                         \
+    ctx->state = JW_ERROR;     \
+    return JSON_STRING_INVALID; \
+  } while (0)
+
+  if (ctx->state == JW_ERROR) return JSON_STRING_INVALID;
+  if (ctx->state == JW_DONE) return 0;
+  /* A token that continues from the previous chunk. */
+  ctx->tok_begin = buf;
+  while (p < end && ctx->state != JW_DONE) {
+    ch = *(unsigned char *) p;
+    switch (ctx->state) {
+      case JW_STRING:
+        if (ctx->sub_state == 0) {
+          p = json_scan_string(p, end);
+          ch = *(unsigned char *) p;
+          if (ch == '"') {
+            if (!json_ctx_end_token(ctx, p, JW_POS(p + 1))) JW_FAIL();
+            p++;
+            continue;
+          }
+        }
+        if (!json_ctx_string_char(ctx, ch)) JW_FAIL();
+        p++;
+        continue;
+      case JW_IDENT:
+        if (ch == '_' || json_isalpha(ch) || json_isdigit(ch)) {
+          p++;
+        } else if (!json_ctx_end_token(ctx, p, JW_POS(p))) {
+          JW_FAIL();
+        }
+        continue;
+      case JW_NUMBER:
+        st = json_ctx_number_next(ctx->sub_state, ch);
+        if (st >= 0) {
+          ctx->sub_state = st;
+          p++;
+        } else if (ctx->sub_state < JW_NUM_ZERO ||
+                   !json_ctx_end_token(ctx, p, JW_POS(p))) {
+          JW_FAIL();
+        }
+        continue;
+      case JW_LITERAL:
+        st = ctx->sub_state;
+        if (ch != s_json_literals[st >> 4].s[st & 0xf]) JW_FAIL();
+        p++;
+        ctx->sub_state = ++st;
+        if ((st & 0xf) == s_json_literals[st >> 4].len &&
+            !json_ctx_end_token(ctx, p, JW_POS(p))) {
+          JW_FAIL();
+        }
+        continue;
+      default:
+        break;
+    }
+
+    /* Outside of tokens, whitespace is skipped. */
+    if (json_isspace(ch)) {
+      p++;
+      continue;
+    }
+    fr = (ctx->depth > 0 ? &ctx->stack[ctx->depth - 1] : NULL);
+    switch (ctx->state) {
+      case JW_OBJ_NEXT:
+      case JW_ARR_NEXT:
+        if (ch == ',') {
+          ctx->state = (ctx->state == JW_OBJ_NEXT ? JW_OBJ_START : JW_ARR_START);
+          p++;
+          continue;
+        }
+      /* fall through */
+      case JW_OBJ_START:
+      case JW_ARR_START:
+        if (ch == (fr->type == '{' ? '}' : ']')) {
+          p++;
+          json_ctx_truncate_path(ctx, fr->path_len);
+          ctx->depth--;
+          json_ctx_call(ctx,
+                        fr->type == '{' ? JSON_TYPE_OBJECT_END
+                                        : JSON_TYPE_ARRAY_END,
+                        fr->start >= ctx->offset ? buf + (fr->start - ctx->offset)
+                                                 : NULL,
+                        JW_POS(p) - fr->start);
+          json_ctx_value_done(ctx, JW_POS(p));
+        } else if (fr->type == '[') {
+          char idx[20];
+          snprintf(idx, sizeof(idx), "[%d]", fr->index++);
+          fr->elem_path_len = json_ctx_append_to_path(ctx, idx, strlen(idx));
+          ctx->cur_name =
+              ctx->path + strlen(ctx->path) - strlen(idx) + 1 /*opening brace*/;
+          ctx->cur_name_len = strlen(idx) - 2 /*braces*/;
+          ctx->state = JW_VALUE;
+        } else if (ch == '"') {
+          ctx->tok_is_key = true;
+          json_ctx_begin_token(ctx, JW_STRING, 0, ++p);
+        } else if (json_isalpha(ch)) {
+          ctx->tok_is_key = true;
+          json_ctx_begin_token(ctx, JW_IDENT, 0, p++);
+        } else {
+          JW_FAIL();
+        }
+        break;
+      case JW_COLON:
+        if (ch != ':') JW_FAIL();
+        ctx->state = JW_VALUE;
+        p++;
+        break;
+      case JW_VALUE:
+        ctx->tok_is_key = false;
+        if (ch == '"') {
+          json_ctx_begin_token(ctx, JW_STRING, 0, ++p);
+        } else if (ch == '{' || ch == '[') {
+          if (ctx->depth == JSON_WALK_MAX_DEPTH) JW_FAIL();
+          json_ctx_call(ctx, ch == '{' ? JSON_TYPE_OBJECT_START
+                                       : JSON_TYPE_ARRAY_START,
+                        NULL, 0);
+          fr = &ctx->stack[ctx->depth++];
+          fr->type = ch;
+          fr->index = 0;
+          fr->path_len = ctx->path_len;
+          fr->elem_path_len = ctx->path_len;
+          fr->start = JW_POS(p);
+          if (ch == '{') json_ctx_append_to_path(ctx, ".", 1);
+          ctx->state = (ch == '{' ? JW_OBJ_START : JW_ARR_START);
+          p++;
+        } else if (ch == 'n' || ch == 't' || ch == 'f') {
+          st = (ch == 'n' ? 0 : ch == 't' ? 1 : 2);
+          json_ctx_begin_token(ctx, JW_LITERAL, (st << 4) | 1, p++);
+        } else if (ch == '-' || json_isdigit(ch)) {
+          st = (ch == '-' ? JW_NUM_SIGN : ch == '0' ? JW_NUM_ZERO : JW_NUM_INT);
+          json_ctx_begin_token(ctx, JW_NUMBER, st, p++);
+        } else {
+          JW_FAIL();
+        }
+        break;
+    }
+  }
+
+  /* Keep what is needed from this chunk. */
+  if (ctx->state >= JW_STRING && ctx->state <= JW_LITERAL &&
+      !json_ctx_copy_token(ctx, end)) {
+    JW_FAIL();
+  }
+  if (ctx->cur_name >= buf && ctx->cur_name < end) {
+    if (!json_ctx_grow(&ctx->name, &ctx->name_size, ctx->cur_name_len + 1)) {
+      JW_FAIL();
+    }
+    memmove(ctx->name, ctx->cur_name, ctx->cur_name_len);
+    ctx->cur_name = ctx->name;
+  }
+  ctx->offset += p - buf;
+  return p - buf;
+#undef JW_POS
+#undef JW_FAIL
+}
+
+int json_walk_ctx_finish(struct json_walk_ctx *ctx) {
+  int res;
+  /* These tokens end at the first char that is not a part of them. */
+  if ((ctx->state == JW_NUMBER && ctx->sub_state >= JW_NUM_ZERO) ||
+      ctx->state == JW_IDENT) {
+    ctx->tok_begin = NULL;
+    if (!json_ctx_end_token(ctx, NULL, ctx->offset)) ctx->state = JW_ERROR;
+  }
+  if (ctx->state == JW_DONE) {
+    res = ctx->result;
+  } else if (ctx->state == JW_ERROR) {
+    res = JSON_STRING_INVALID;
+  } else {
+    res = JSON_STRING_INCOMPLETE;
+  }
+  free(ctx->tok);
+  free(ctx->name);
+  ctx->tok = ctx->name = NULL;
+  ctx->tok_size = ctx->name_size = 0;
+  return res;
+}
+
 struct scan_array_info {
   int found;
   char path[JSON_MAX_PATH_LEN];
@@ -1024,8 +1769,12 @@ static void json_scanf_cb(void *callback_data, const char *name,
   }
 }
 
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) WEAK;
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
+static void json_tape_scan(const struct json_tape *tape,
+                           struct json_scanf_info *info);
+
+/* Scans `s,len`, or the document indexed by `tape` if it is not NULL. */
+static int json_scanf_fmt(const char *s, int len, const struct json_tape *tape,
+                          const char *fmt, va_list ap) {
   char path[JSON_MAX_PATH_LEN] = "", fmtbuf[20];
   int i = 0;
   char *p = NULL;
@@ -1062,7 +1811,11 @@ int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
           break;
         }
       }
-      json_walk(s, len, json_scanf_cb, &info);
+      if (tape != NULL) {
+        json_tape_scan(tape, &info);
+      } else {
+        json_walk(s, len, json_scanf_cb, &info);
+      }
     } else if (json_isalpha(fmt[i]) || json_get_utf8_char_len(fmt[i]) > 1) {
       char *pe;
       const char *delims = ": \r\n\t";
@@ -1079,6 +1832,11 @@ int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
   return info.num_conversions;
 }
 
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) WEAK;
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
+  return json_scanf_fmt(s, len, NULL, fmt, ap);
+}
+
 int json_scanf(const char *str, int len, const char *fmt, ...) WEAK;
 int json_scanf(const char *str, int len, const char *fmt, ...) {
   int result;
@@ -1144,9 +1902,16 @@ struct json_setf_data {
   int prev;         /* Offset of the previous token end */
 };
 
+/* Length of the common prefix of two paths, in whole path components. */
 static int get_matched_prefix_len(const char *s1, const char *s2) {
   int i = 0;
   while (s1[i] && s2[i] && s1[i] == s2[i]) i++;
+  if ((s1[i] == '\0' || s1[i] == '.' || s1[i] == '[') &&
+      (s2[i] == '\0' || s2[i] == '.' || s2[i] == '[')) {
+    return i;
+  }
+  /* Back off to the beginning of the partially matched component. */
+  while (i > 0 && s1[i - 1] != '.' && s1[i - 1] != '[') i--;
   return i;
 }
 
@@ -1192,60 +1957,85 @@ static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
   (void) name_len;
 }
 
+/* Returns the offset where the unchanged rest of the string resumes. */
+static int json_setf_resume(const char *s, int len,
+                            const struct json_setf_data *data, int del) {
+  /* Trim comma after the deleted value that begins at object/array start */
+  if (del && data->prev > 0 &&
+      (s[data->prev - 1] == '{' || s[data->prev - 1] == '[')) {
+    int i = data->end;
+    while (i < len && json_isspace(s[i])) i++;
+    if (s[i] == ',') return i + 1; /* Point after comma */
+  }
+  return data->end;
+}
+
+/*
+ * Prints the unchanged string from `from` up to the mutation, and the missing
+ * keys for the new value. Returns the offset in the path past added keys.
+ */
+static int json_setf_head(const char *s, struct json_out *out,
+                          const struct json_setf_data *data,
+                          const char *json_path, int del, int from) {
+  int n, off = data->matched, depth = 0;
+  if (del) {
+    json_printf(out, "%.*s", data->prev - from, s + from);
+    return off;
+  }
+
+  /* Print the unchanged beginning */
+  json_printf(out, "%.*s", data->pos - from, s + from);
+
+  /* Add missing keys */
+  while ((n = strcspn(&json_path[off], ".[")) > 0) {
+    if ((data->prev == 0 ||
+         (s[data->prev - 1] != '{' && s[data->prev - 1] != '[')) &&
+        depth == 0) {
+      json_printf(out, ",");
+    }
+    if (off > 0 && json_path[off - 1] != '.') break;
+    json_printf(out, "%.*Q:", n, json_path + off);
+    off += n;
+    if (json_path[off] != '\0') {
+      json_printf(out, "%c", json_path[off] == '.' ? '{' : '[');
+      depth++;
+      off++;
+    }
+  }
+  return off;
+}
+
+/* Closes brackets/braces of the added missing keys */
+static void json_setf_tail(struct json_out *out,
+                           const struct json_setf_data *data,
+                           const char *json_path, int off) {
+  for (; off > data->matched; off--) {
+    int ch = json_path[off];
+    const char *p = ch == '.' ? "}" : ch == '[' ? "]" : "";
+    json_printf(out, "%s", p);
+  }
+}
+
 int json_vsetf(const char *s, int len, struct json_out *out,
                const char *json_path, const char *json_fmt, va_list ap) WEAK;
 int json_vsetf(const char *s, int len, struct json_out *out,
                const char *json_path, const char *json_fmt, va_list ap) {
   struct json_setf_data data;
+  int off, end, del = (json_fmt == NULL);
   memset(&data, 0, sizeof(data));
   data.json_path = json_path;
   data.base = s;
   data.end = len;
   json_walk(s, len, json_vsetf_cb, &data);
-  if (json_fmt == NULL) {
-    /* Deletion codepath */
-    json_printf(out, "%.*s", data.prev, s);
-    /* Trim comma after the value that begins at object/array start */
-    if (s[data.prev - 1] == '{' || s[data.prev - 1] == '[') {
-      int i = data.end;
-      while (i < len && json_isspace(s[i])) i++;
-      if (s[i] == ',') data.end = i + 1; /* Point after comma */
-    }
-    json_printf(out, "%.*s", len - data.end, s + data.end);
-  } else {
-    /* Modification codepath */
-    int n, off = data.matched, depth = 0;
-
-    /* Print the unchanged beginning */
-    json_printf(out, "%.*s", data.pos, s);
-
-    /* Add missing keys */
-    while ((n = strcspn(&json_path[off], ".[")) > 0) {
-      if (s[data.prev - 1] != '{' && s[data.prev - 1] != '[' && depth == 0) {
-        json_printf(out, ",");
-      }
-      if (off > 0 && json_path[off - 1] != '.') break;
-      json_printf(out, "%.*Q:", n, json_path + off);
-      off += n;
-      if (json_path[off] != '\0') {
-        json_printf(out, "%c", json_path[off] == '.' ? '{' : '[');
-        depth++;
-        off++;
-      }
-    }
+  off = json_setf_head(s, out, &data, json_path, del, 0);
+  if (!del) {
     /* Print the new value */
     json_vprintf(out, json_fmt, ap);
-
-    /* Close brackets/braces of the added missing keys */
-    for (; off > data.matched; off--) {
-      int ch = json_path[off];
-      const char *p = ch == '.' ? "}" : ch == '[' ? "]" : "";
-      json_printf(out, "%s", p);
-    }
-
-    /* Print the rest of the unchanged string */
-    json_printf(out, "%.*s", len - data.end, s + data.end);
+    json_setf_tail(out, &data, json_path, off);
   }
+  /* Print the rest of the unchanged string */
+  end = json_setf_resume(s, len, &data, del);
+  json_printf(out, "%.*s", len - end, s + end);
   return data.end > data.pos ? 1 : 0;
 }
 
@@ -1326,6 +2116,181 @@ static void prettify_cb(void *userdata, const char *name, size_t name_len,
   pd->last_token = t->type;
 }
 
+struct json_setf_edit {
+  const char *path;
+  int del;
+  int val_off, val_len; /* Rendered value in the values buffer */
+  int lo, hi;           /* Replaced part of the source string */
+  struct json_setf_data data;
+};
+
+static int json_printer_realloc(struct json_out *out, const char *str,
+                                size_t len) {
+  if (len == 0) return 0;
+  if (out->u.buf.len + len > out->u.buf.size) {
+    size_t size = out->u.buf.size * 2 + len;
+    char *p = (char *) realloc(out->u.buf.buf, size);
+    if (p == NULL) return 0;
+    out->u.buf.buf = p;
+    out->u.buf.size = size;
+  }
+  memcpy(out->u.buf.buf + out->u.buf.len, str, len);
+  out->u.buf.len += len;
+  return len;
+}
+
+static void json_setf_batch_cb(void *userdata, const char *name,
+                               size_t name_len, const char *path,
+                               const struct json_token *t) {
+  struct json_out *edits = (struct json_out *) userdata;
+  struct json_setf_edit *e = (struct json_setf_edit *) edits->u.buf.buf;
+  size_t i, n = edits->u.buf.len / sizeof(*e);
+  for (i = 0; i < n; i++) {
+    json_vsetf_cb(&e[i].data, name, name_len, path, t);
+  }
+}
+
+/* Whether the value at path `a` contains the one at path `b`. */
+static int json_path_contains(const char *a, const char *b) {
+  size_t la = strlen(a);
+  return strncmp(a, b, la) == 0 &&
+         (b[la] == '\0' || b[la] == '.' || b[la] == '[');
+}
+
+/* Whether `a` deletes an array element, shifting the indices in `b`. */
+static int json_setf_shifts(const struct json_setf_edit *a,
+                            const struct json_setf_edit *b) {
+  const char *p = strrchr(a->path, '[');
+  size_t la = strlen(a->path);
+  if (!a->del || p == NULL || a->path[la - 1] != ']') return 0;
+  return strncmp(a->path, b->path, p - a->path + 1) == 0;
+}
+
+/*
+ * Whether `b` can be applied to the source string independently of `a`,
+ * which comes before it. That is the case for changes and deletions of
+ * existing values (not added keys, whose position depends on the tokens
+ * around), as long as neither value contains the other and the replaced
+ * parts do not overlap. They do when deleting the first value of an object
+ * or array, which also takes the comma after it, together with the next one.
+ * Deleting an array element shifts the indices of later edits in the array,
+ * so these are not independent either.
+ */
+static int json_setf_independent(const struct json_setf_edit *a,
+                                 const struct json_setf_edit *b) {
+  if (a->data.end <= a->data.pos || b->data.end <= b->data.pos) return 0;
+  if (json_setf_shifts(a, b)) return 0;
+  if (a->lo < b->hi && b->lo < a->hi) return 0;
+  return !json_path_contains(a->path, b->path) &&
+         !json_path_contains(b->path, a->path);
+}
+
+/* Applies edits one after another, the way chained json_setf() calls do. */
+static int json_setf_chain(const char *s, int len, struct json_out *out,
+                           const struct json_setf_edit *e, int num_edits,
+                           const char *vals) {
+  struct json_out tmp[2];
+  const char *cur = s;
+  int i, res = 0, cur_len = len;
+  memset(tmp, 0, sizeof(tmp));
+  tmp[0].printer = tmp[1].printer = json_printer_realloc;
+  for (i = 0; i < num_edits; i++) {
+    struct json_out *o = (i == num_edits - 1 ? out : &tmp[i % 2]);
+    tmp[i % 2].u.buf.len = 0;
+    if (e[i].del) {
+      res += json_setf(cur, cur_len, o, e[i].path, NULL);
+    } else {
+      res += json_setf(cur, cur_len, o, e[i].path, "%.*s", e[i].val_len,
+                       vals + e[i].val_off);
+    }
+    cur = o->u.buf.buf;
+    cur_len = o->u.buf.len;
+  }
+  free(tmp[0].u.buf.buf);
+  free(tmp[1].u.buf.buf);
+  return res;
+}
+
+int json_vsetf_batch(const char *s, int len, struct json_out *out,
+                     va_list xap) WEAK;
+int json_vsetf_batch(const char *s, int len, struct json_out *out,
+                     va_list xap) {
+  struct json_out edits, vals;
+  struct json_setf_edit e, *ep;
+  int i, j, n, res = 0, pos = 0, chain = 0;
+  va_list ap;
+
+  /* Collect the edits and render their values. */
+  memset(&edits, 0, sizeof(edits));
+  memset(&vals, 0, sizeof(vals));
+  edits.printer = vals.printer = json_printer_realloc;
+  va_copy(ap, xap);
+  while ((e.path = va_arg(ap, const char *)) != NULL) {
+    const char *fmt = va_arg(ap, const char *);
+    memset(&e.data, 0, sizeof(e.data));
+    e.data.json_path = e.path;
+    e.data.base = s;
+    e.data.end = len;
+    e.del = (fmt == NULL);
+    e.val_off = vals.u.buf.len;
+    if (!e.del) json_vprintf_ap(&vals, fmt, &ap);
+    e.val_len = vals.u.buf.len - e.val_off;
+    json_printer_realloc(&edits, (const char *) &e, sizeof(e));
+  }
+  va_end(ap);
+  ep = (struct json_setf_edit *) edits.u.buf.buf;
+  n = edits.u.buf.len / sizeof(*ep);
+
+  /* A single walk finds the mutation points of all the edits. */
+  json_walk(s, len, json_setf_batch_cb, &edits);
+  for (i = 0; i < n; i++) {
+    ep[i].lo = (ep[i].del ? ep[i].data.prev : ep[i].data.pos);
+    ep[i].hi = json_setf_resume(s, len, &ep[i].data, ep[i].del);
+    for (j = 0; j < i && !chain; j++) {
+      chain = !json_setf_independent(&ep[j], &ep[i]);
+    }
+  }
+
+  if (n == 0) {
+    json_printf(out, "%.*s", len, s);
+  } else if (chain) {
+    res = json_setf_chain(s, len, out, ep, n, vals.u.buf.buf);
+  } else {
+    /* Independent edits, splice them in order of position. */
+    for (i = 1; i < n; i++) {
+      for (j = i; j > 0 && ep[j - 1].lo > ep[j].lo; j--) {
+        e = ep[j];
+        ep[j] = ep[j - 1];
+        ep[j - 1] = e;
+      }
+    }
+    for (i = 0; i < n; i++) {
+      int off = json_setf_head(s, out, &ep[i].data, ep[i].path, ep[i].del, pos);
+      if (!ep[i].del) {
+        out->printer(out, vals.u.buf.buf + ep[i].val_off, ep[i].val_len);
+        json_setf_tail(out, &ep[i].data, ep[i].path, off);
+      }
+      pos = ep[i].hi;
+      res += ep[i].data.end > ep[i].data.pos ? 1 : 0;
+    }
+    json_printf(out, "%.*s", len - pos, s + pos);
+  }
+
+  free(edits.u.buf.buf);
+  free(vals.u.buf.buf);
+  return res;
+}
+
+int json_setf_batch(const char *s, int len, struct json_out *out, ...) WEAK;
+int json_setf_batch(const char *s, int len, struct json_out *out, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, out);
+  result = json_vsetf_batch(s, len, out, ap);
+  va_end(ap);
+  return result;
+}
+
 int json_prettify(const char *s, int len, struct json_out *out) WEAK;
 int json_prettify(const char *s, int len, struct json_out *out) {
   struct prettify_data pd = {out, 0, JSON_TYPE_INVALID};
@@ -1430,6 +2395,343 @@ void *json_next_elem(const char *s, int len, void *handle, const char *path,
   return json_next(s, len, handle, path, NULL, val, idx);
 }
 
+struct json_tape_builder {
+  struct json_tape *tape;
+  int cur; /* Innermost open container, -1 if none */
+  int failed;
+};
+
+/*
+ * While a container is open, its `len` holds the length of its path and
+ * `next` holds its last child. Both get their final values at the end.
+ */
+static void json_tape_cb(void *callback_data, const char *name,
+                         size_t name_len, const char *path,
+                         const struct json_token *token) {
+  struct json_tape_builder *b = (struct json_tape_builder *) callback_data;
+  struct json_tape *tape = b->tape;
+  struct json_tape_entry *e, *c;
+  int n = tape->num_entries, path_len = (int) strlen(path), expected;
+  enum json_token_type type = token->type;
+
+  if (b->failed) return;
+  c = (b->cur < 0 ? NULL : &tape->entries[b->cur]);
+  if (type == JSON_TYPE_OBJECT_END || type == JSON_TYPE_ARRAY_END) {
+    if (c == NULL || c->type != type) {
+      b->failed = 1;
+      return;
+    }
+    c->off = token->ptr - tape->s;
+    c->len = token->len;
+    c->next = -1;
+    b->cur = c->parent;
+    return;
+  }
+
+  if (c == NULL) {
+    /* The root value, there is only one. */
+    if (n > 0) b->failed = 1;
+  } else {
+    /*
+     * json_walk() does not report values of empty keys, and for containers
+     * that means their START and END events go missing. Catch that by the
+     * path length, which must be the parent's plus one key or index.
+     */
+    char buf[20];
+    if (c->type == JSON_TYPE_OBJECT_END) {
+      expected = c->len + 1 + (int) name_len;
+    } else {
+      expected = c->len +
+                 snprintf(buf, sizeof(buf), "[%d]",
+                          c->next < 0 ? 0 : tape->entries[c->next].key_len + 1);
+    }
+    if (path_len != expected &&
+        !(path_len == JSON_MAX_PATH_LEN - 1 && expected > path_len)) {
+      b->failed = 1;
+    }
+  }
+  if (b->failed) return;
+
+  if (n >= tape->size) {
+    int size = (tape->size == 0 ? 16 : tape->size * 2);
+    e = (struct json_tape_entry *) realloc(tape->entries, size * sizeof(*e));
+    if (e == NULL) {
+      b->failed = 1;
+      return;
+    }
+    tape->entries = e;
+    tape->size = size;
+    c = (b->cur < 0 ? NULL : &tape->entries[b->cur]);
+  }
+  e = &tape->entries[n];
+  tape->num_entries++;
+  e->type = type;
+  e->off = (token->ptr == NULL ? 0 : token->ptr - tape->s);
+  e->len = token->len;
+  e->parent = b->cur;
+  e->next = -1;
+  e->key_off = -1;
+  e->key_len = 0;
+  e->children = 0;
+  e->num_children = 0;
+  if (c != NULL) {
+    c->num_children++;
+    if (c->type == JSON_TYPE_OBJECT_END) {
+      e->key_off = name - tape->s;
+      e->key_len = (int) name_len;
+    } else if (c->next >= 0) {
+      e->key_len = tape->entries[c->next].key_len + 1;
+    }
+    if (c->next >= 0) tape->entries[c->next].next = n;
+    c->next = n;
+  }
+  if (type == JSON_TYPE_OBJECT_START || type == JSON_TYPE_ARRAY_START) {
+    e->type = (type == JSON_TYPE_OBJECT_START ? JSON_TYPE_OBJECT_END
+                                              : JSON_TYPE_ARRAY_END);
+    e->len = path_len;
+    b->cur = n;
+  }
+}
+
+/* Compares the key of the entry `i` with `key,len`. */
+static int json_tape_keycmp(const struct json_tape *tape, int i,
+                            const char *key, int len) {
+  const struct json_tape_entry *e = &tape->entries[i];
+  int n = (e->key_len < len ? e->key_len : len);
+  int r = memcmp(tape->s + e->key_off, key, n);
+  return (r != 0 ? r : e->key_len - len);
+}
+
+/* Compares keys of entries `i` and `j`. */
+static int json_tape_keycmp2(const struct json_tape *tape, int i, int j) {
+  const struct json_tape_entry *e = &tape->entries[j];
+  return json_tape_keycmp(tape, i, tape->s + e->key_off, e->key_len);
+}
+
+/* Stable merge sort of object members `a` by key, `tmp` is scratch space. */
+static void json_tape_sort_keys(const struct json_tape *tape, int *a, int n,
+                                int *tmp) {
+  int w, lo, mid, hi, i, j, k;
+  for (w = 1; w < n; w *= 2) {
+    for (lo = 0; lo < n; lo += 2 * w) {
+      mid = (lo + w < n ? lo + w : n);
+      hi = (lo + 2 * w < n ? lo + 2 * w : n);
+      for (i = lo, j = mid, k = lo; k < hi; k++) {
+        if (i < mid && (j >= hi || json_tape_keycmp2(tape, a[i], a[j]) <= 0)) {
+          tmp[k] = a[i++];
+        } else {
+          tmp[k] = a[j++];
+        }
+      }
+    }
+    memcpy(a, tmp, n * sizeof(*a));
+  }
+}
+
+/* Fills `tape->children`. Returns 0 if out of memory. */
+static int json_tape_index(struct json_tape *tape) {
+  int i, pos = 0, n = tape->num_entries, *tmp;
+  struct json_tape_entry *e;
+  tape->children = (int *) malloc(n * sizeof(*tape->children));
+  tmp = (int *) malloc(n * sizeof(*tmp));
+  if (tape->children == NULL || tmp == NULL) {
+    free(tmp);
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    e = &tape->entries[i];
+    e->children = pos;
+    pos += e->num_children;
+    e->num_children = 0;
+  }
+  /* Entries are in document order, so array elements end up in order. */
+  for (i = 1; i < n; i++) {
+    e = &tape->entries[tape->entries[i].parent];
+    tape->children[e->children + e->num_children++] = i;
+  }
+  for (i = 0; i < n; i++) {
+    e = &tape->entries[i];
+    if (e->type == JSON_TYPE_OBJECT_END && e->num_children > 1) {
+      json_tape_sort_keys(tape, tape->children + e->children, e->num_children,
+                          tmp);
+    }
+  }
+  free(tmp);
+  return 1;
+}
+
+int json_tape_init(struct json_tape *tape, const char *s, int len) WEAK;
+int json_tape_init(struct json_tape *tape, const char *s, int len) {
+  struct json_tape_builder b = {tape, -1, 0};
+  int res;
+  memset(tape, 0, sizeof(*tape));
+  tape->s = s;
+  res = json_walk(s, len, json_tape_cb, &b);
+  if (res >= 0 && (b.failed || b.cur >= 0 || tape->num_entries == 0 ||
+                   !json_tape_index(tape))) {
+    res = JSON_STRING_INVALID;
+  }
+  if (res < 0) json_tape_free(tape);
+  return res;
+}
+
+void json_tape_free(struct json_tape *tape) WEAK;
+void json_tape_free(struct json_tape *tape) {
+  free(tape->entries);
+  free(tape->children);
+  tape->entries = NULL;
+  tape->children = NULL;
+  tape->num_entries = tape->size = 0;
+}
+
+/* Returns the first child of the entry `i`, or -1. */
+static int json_tape_child(const struct json_tape *tape, int i) {
+  const struct json_tape_entry *e = &tape->entries[i];
+  if (e->type != JSON_TYPE_OBJECT_END && e->type != JSON_TYPE_ARRAY_END) {
+    return -1;
+  }
+  return (i + 1 < tape->num_entries && e[1].parent == i ? i + 1 : -1);
+}
+
+/* Returns the element `idx` of the array entry `i`, or -1. */
+static int json_tape_elem(const struct json_tape *tape, int i, long idx) {
+  const struct json_tape_entry *e = &tape->entries[i];
+  if (idx < 0 || idx >= e->num_children) return -1;
+  return tape->children[e->children + idx];
+}
+
+/*
+ * Returns the entry at `path`, in the json_walk() path syntax, or -1.
+ * With duplicate keys the last one wins, as it does with json_scanf().
+ */
+static int json_tape_find(const struct json_tape *tape, const char *path) {
+  int i = (tape->num_entries > 0 ? 0 : -1), found, n, lo, hi, mid;
+  const char *p = path;
+  while (i >= 0 && *p != '\0') {
+    const struct json_tape_entry *e = &tape->entries[i];
+    const int *children = tape->children + e->children;
+    found = -1;
+    if (*p == '.' && e->type == JSON_TYPE_OBJECT_END) {
+      n = strcspn(p + 1, ".[");
+      /* Members are sorted by key: find the last one not above it. */
+      for (lo = 0, hi = e->num_children; lo < hi;) {
+        mid = lo + (hi - lo) / 2;
+        if (json_tape_keycmp(tape, children[mid], p + 1, n) <= 0) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo > 0 && json_tape_keycmp(tape, children[lo - 1], p + 1, n) == 0) {
+        found = children[lo - 1];
+      }
+      p += n + 1;
+    } else if (*p == '[' && e->type == JSON_TYPE_ARRAY_END) {
+      char *end;
+      long idx = strtol(p + 1, &end, 10);
+      if (*end != ']' || end == p + 1) return -1;
+      found = json_tape_elem(tape, i, idx);
+      p = end + 1;
+    }
+    i = found;
+  }
+  return i;
+}
+
+static void json_tape_token(const struct json_tape *tape, int i,
+                            struct json_token *token) {
+  const struct json_tape_entry *e = &tape->entries[i];
+  token->ptr = tape->s + e->off;
+  token->len = e->len;
+  token->type = e->type;
+}
+
+static void json_tape_scan(const struct json_tape *tape,
+                           struct json_scanf_info *info) {
+  struct json_token token;
+  int i = json_tape_find(tape, info->path);
+  if (i < 0) return;
+  json_tape_token(tape, i, &token);
+  json_scanf_cb(info, NULL, 0, info->path, &token);
+}
+
+int json_tape_vscanf(const struct json_tape *tape, const char *fmt,
+                     va_list ap) WEAK;
+int json_tape_vscanf(const struct json_tape *tape, const char *fmt,
+                     va_list ap) {
+  return json_scanf_fmt(NULL, 0, tape, fmt, ap);
+}
+
+int json_tape_scanf(const struct json_tape *tape, const char *fmt, ...) WEAK;
+int json_tape_scanf(const struct json_tape *tape, const char *fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, fmt);
+  result = json_tape_vscanf(tape, fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+int json_tape_scanf_array_elem(const struct json_tape *tape, const char *path,
+                               int idx, struct json_token *token) WEAK;
+int json_tape_scanf_array_elem(const struct json_tape *tape, const char *path,
+                               int idx, struct json_token *token) {
+  int i = json_tape_find(tape, path);
+  memset(token, 0, sizeof(*token));
+  if (i < 0 || tape->entries[i].type != JSON_TYPE_ARRAY_END) return -1;
+  if ((i = json_tape_elem(tape, i, idx)) < 0) return -1;
+  json_tape_token(tape, i, token);
+  return token->len;
+}
+
+static void *json_tape_next(const struct json_tape *tape, void *handle,
+                            const char *path, struct json_token *key,
+                            struct json_token *val, int *idx) {
+  const struct json_tape_entry *e = (const struct json_tape_entry *) handle;
+  int i;
+  if (e == NULL) {
+    i = json_tape_find(tape, path);
+    if (i >= 0) i = json_tape_child(tape, i);
+  } else {
+    i = e->next;
+  }
+  if (i < 0) return NULL;
+  e = &tape->entries[i];
+  if (val != NULL) json_tape_token(tape, i, val);
+  if (e->key_off >= 0) {
+    if (key != NULL) {
+      key->ptr = tape->s + e->key_off;
+      key->len = e->key_len;
+    }
+    if (idx != NULL) *idx = -1;
+  } else {
+    if (key != NULL) {
+      key->ptr = NULL;
+      key->len = 0;
+    }
+    if (idx != NULL) *idx = e->key_len;
+  }
+  return (void *) e;
+}
+
+void *json_tape_next_key(const struct json_tape *tape, void *handle,
+                         const char *path, struct json_token *key,
+                         struct json_token *val) WEAK;
+void *json_tape_next_key(const struct json_tape *tape, void *handle,
+                         const char *path, struct json_token *key,
+                         struct json_token *val) {
+  return json_tape_next(tape, handle, path, key, val, NULL);
+}
+
+void *json_tape_next_elem(const struct json_tape *tape, void *handle,
+                          const char *path, int *idx,
+                          struct json_token *val) WEAK;
+void *json_tape_next_elem(const struct json_tape *tape, void *handle,
+                          const char *path, int *idx,
+                          struct json_token *val) {
+  return json_tape_next(tape, handle, path, NULL, val, idx);
+}
+
 static int json_sprinter(struct json_out *out, const char *str, size_t len) {
   size_t old_len = out->u.buf.buf == NULL ? 0 : strlen(out->u.buf.buf);
   size_t new_len = len + old_len;
@@ -150,6 +150,8 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
  *  - `%H` print quoted hex-encoded string. Accepts a `int`, `const char *`.
  *  - `%M` invokes a json_printf_callback_t function. That callback function
  *  can consume more parameters.
+ *  - `%D` print a double with as few digits as needed to read back the same
+ *  value, e.g. `0.1` or `1546300800.125`. Accepts a `double`.
  *
  * Return number of bytes printed. If the return value is bigger than the
  * supplied buffer, that is an indicator of overflow. In the overflow case,
@@ -158,6 +160,17 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
 int json_printf(struct json_out *, const char *fmt, ...);
 int json_vprintf(struct json_out *, const char *fmt, va_list ap);
 
+/*
+ * Same as json_printf, but collects the output in a scratch buffer `buf` of
+ * `size` bytes and passes it to `out` in chunks of up to `size` bytes,
+ * instead of calling the printer for every piece. `%M` callbacks get a
+ * different `struct json_out` that prints to the buffer.
+ */
+int json_printf_buffered(struct json_out *out, char *buf, size_t size,
+                         const char *fmt, ...);
+int json_vprintf_buffered(struct json_out *out, char *buf, size_t size,
+                          const char *fmt, va_list ap);
+
 /*
  * Same as json_printf, but prints to a file.
  * File is created if does not exist. File is truncated if already exists.
@@ -267,6 +280,24 @@ int json_setf(const char *s, int len, struct json_out *out,
 int json_vsetf(const char *s, int len, struct json_out *out,
                const char *json_path, const char *json_fmt, va_list ap);
 
+/*
+ * Apply several json_setf() edits to the JSON string `s, len` and save the
+ * result to `out`. The variable arguments are a NULL-terminated list of
+ * edits, each a path, a format (NULL deletes the path) and the arguments
+ * of the format. The result is the same as of json_setf() calls applied one
+ * after another. Changes and deletions of existing values, none inside
+ * another, take a single walk and a single copy of the string; added keys and
+ * edits that depend on each other are applied one by one. Return the number
+ * of edits that changed the string.
+ *
+ * Example:  s is a JSON string { "a": 1, "b": [ 2 ], "c": 3 }
+ *   json_setf_batch(s, len, out, ".a", "%d", 7, ".c", NULL,
+ *                   ".d", "%Q", "x", NULL);  // { "a": 7, "b": [ 2 ],"d":"x" }
+ */
+int json_setf_batch(const char *s, int len, struct json_out *out, ...);
+int json_vsetf_batch(const char *s, int len, struct json_out *out,
+                     va_list ap);
+
 /*
  * Pretty-print JSON string `s,len` into `out`.
  * Return number of processed bytes in `s`.
@@ -306,6 +337,70 @@ void *json_next_key(const char *s, int len, void *handle, const char *path,
 void *json_next_elem(const char *s, int len, void *handle, const char *path,
                      int *idx, struct json_token *val);
 
+/* An entry of `struct json_tape`: a value and its place in the document. */
+struct json_tape_entry {
+  enum json_token_type type; /* Value type, *_END for objects and arrays */
+  int off, len;              /* Value token, as json_walk() reports it */
+  int key_off;               /* Offset of the key, -1 if not in an object */
+  int key_len;               /* Length of the key, or index in an array */
+  int parent;                /* Entry of the enclosing container, or -1 */
+  int next;                  /* Entry of the next sibling, or -1 */
+  int children;              /* Containers: first child in `children` */
+  int num_children;          /* Containers: number of children */
+};
+
+/*
+ * An index of a parsed JSON document, for looking up many values in the same
+ * document without walking it each time. Entries are in document order,
+ * so the first child of a container, if any, is the entry following it.
+ * `children` lists children of each container: elements of an array
+ * in order, members of an object sorted by key (duplicates in document
+ * order). A path lookup takes O(1) per array index and O(log(width))
+ * per object key.
+ */
+struct json_tape {
+  const char *s;
+  struct json_tape_entry *entries;
+  int *children;
+  int num_entries;
+  int size;
+};
+
+/*
+ * Indexes the JSON string `s,len`, which must outlive the tape.
+ * Return what json_walk() returns; on error nothing is allocated.
+ * The tape must be freed with json_tape_free().
+ *
+ * Example:
+ *
+ * ```c
+ * struct json_tape tape;
+ * if (json_tape_init(&tape, s, len) > 0) {
+ *   json_tape_scanf(&tape, "{a: %d}", &a);
+ *   json_tape_scanf(&tape, "{b: {c: %B}}", &c);
+ *   json_tape_free(&tape);
+ * }
+ * ```
+ */
+int json_tape_init(struct json_tape *tape, const char *s, int len);
+void json_tape_free(struct json_tape *tape);
+
+/*
+ * Same as json_scanf(), json_scanf_array_elem(), json_next_key() and
+ * json_next_elem(), for an indexed document. Lookups follow the path
+ * through the tape instead of walking the whole document.
+ */
+int json_tape_scanf(const struct json_tape *tape, const char *fmt, ...);
+int json_tape_vscanf(const struct json_tape *tape, const char *fmt,
+                     va_list ap);
+int json_tape_scanf_array_elem(const struct json_tape *tape, const char *path,
+                               int index, struct json_token *token);
+void *json_tape_next_key(const struct json_tape *tape, void *handle,
+                         const char *path, struct json_token *key,
+                         struct json_token *val);
+void *json_tape_next_elem(const struct json_tape *tape, void *handle,
+                          const char *path, int *idx, struct json_token *val);
+
 #ifndef JSON_MAX_PATH_LEN
 #define JSON_MAX_PATH_LEN 256
 #endif
@@ -322,6 +417,102 @@ void *json_next_elem(const char *s, int len, void *handle, const char *path,
 #define JSON_ENABLE_HEX !JSON_MINIMAL
 #endif
 
+/*
+ * Scan strings and whitespace 16 or 32 bytes at a time with SSE2, AVX2 or
+ * NEON, when the target has them. Has no effect on other targets.
+ */
+#ifndef JSON_ENABLE_SIMD
+#define JSON_ENABLE_SIMD 1
+#endif
+
+#ifndef JSON_WALK_MAX_DEPTH
+#define JSON_WALK_MAX_DEPTH 32
+#endif
+
+/* An open object or array of the incremental parser. */
+struct json_walk_frame {
+  char type;            /* '{' or '[' */
+  int index;            /* Index of the next array element */
+  size_t path_len;      /* Path length before the container */
+  size_t elem_path_len; /* Path length before the current key or index */
+  long start;           /* Offset of the opening bracket */
+};
+
+/*
+ * State of the incremental parser, see `json_walk_ctx_init()`. All the fields
+ * are private.
+ */
+struct json_walk_ctx {
+  json_walk_callback_t callback;
+  void *callback_data;
+  int state;
+  int sub_state; /* Progress within the current token */
+  int result;
+  long offset; /* Offset of the current chunk in the document */
+
+  /* Token being parsed: its start in the current chunk, or a copy. */
+  const char *tok_begin;
+  char *tok;
+  size_t tok_len, tok_size;
+  bool tok_copied;
+  bool tok_is_key;
+
+  /* Name of the next value; keys that cross chunks are copied to `name`. */
+  const char *cur_name;
+  size_t cur_name_len;
+  char *name;
+  size_t name_size;
+
+  char path[JSON_MAX_PATH_LEN];
+  size_t path_len;
+  int depth;
+  struct json_walk_frame stack[JSON_WALK_MAX_DEPTH];
+};
+
+/*
+ * Incremental, push-style version of `json_walk()`, for input that arrives
+ * in chunks of any size. Each event is delivered as soon as its token is
+ * complete, with the same callback arguments as `json_walk()` gives, with
+ * these differences:
+ *
+ *  - a token that crosses chunks points to a copy owned by the parser;
+ *  - `JSON_TYPE_OBJECT_END` and `JSON_TYPE_ARRAY_END` tokens have `ptr` set
+ *    to NULL if the container started in a previous chunk (`len` is still
+ *    the full length).
+ *
+ * Pointers passed to the callback are only valid during the call. Memory
+ * use does not grow with the document: the parser keeps a stack of up
+ * to JSON_WALK_MAX_DEPTH open containers and copies only the token (and key)
+ * that crosses a chunk boundary.
+ *
+ * Example:
+ *
+ * ```c
+ * struct json_walk_ctx ctx;
+ * json_walk_ctx_init(&ctx, my_cb, NULL);
+ * while ((n = read(fd, buf, sizeof(buf))) > 0) {
+ *   if (json_walk_ctx_feed(&ctx, buf, n) < 0) break;
+ * }
+ * res = json_walk_ctx_finish(&ctx);
+ * ```
+ */
+void json_walk_ctx_init(struct json_walk_ctx *ctx,
+                        json_walk_callback_t callback, void *callback_data);
+
+/*
+ * Parses the next chunk of the document. Returns number of bytes consumed,
+ * which is less than `len` if the document ended within the chunk, or
+ * `JSON_STRING_INVALID`.
+ */
+int json_walk_ctx_feed(struct json_walk_ctx *ctx, const char *buf, int len);
+
+/*
+ * Finishes parsing and frees memory held by the parser. Must be called even
+ * if parsing failed. Returns what `json_walk()` would return for the whole
+ * document.
+ */
+int json_walk_ctx_finish(struct json_walk_ctx *ctx);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -41,6 +41,9 @@ extern "C" {
  *
  * For glob syntax details, see `mg_match_prefix()`.
  *
+ * ACLs are compiled on first use and a few most recently used ones are kept,
+ * so checking many keys against the same ACL is cheap.
+ *
  * Example:
  *
  * ```c
@@ -66,14 +69,76 @@ enum mgos_conf_type {
   CONF_TYPE_OBJECT = 4,
 };
 
+/*
+ * How an int or a bool value is stored. Values other than the default are
+ * only used by packed layouts (see `gen_sys_config.py --packed`).
+ */
+enum mgos_conf_storage {
+  /* int for ints and bools, double and char * for other types. */
+  CONF_STORAGE_DEFAULT = 0,
+  CONF_STORAGE_I8 = 1,
+  CONF_STORAGE_U8 = 2,
+  CONF_STORAGE_I16 = 3,
+  CONF_STORAGE_U16 = 4,
+  /* CONF_STORAGE_BIT0 + n: bit n of the byte at the entry's offset. */
+  CONF_STORAGE_BIT0 = 8,
+};
+
+/* Range of an int value, from "min" and "max" params of its schema entry. */
+struct mgos_conf_range {
+  int min;
+  int max;
+};
+
 /* Configuration entry */
 struct mgos_conf_entry {
   enum mgos_conf_type type;
   const char *key;
   uint16_t offset;
   uint16_t num_desc;
+  /* enum mgos_conf_storage */
+  uint8_t storage;
+  /* Allowed values of an int, NULL if not declared. */
+  const struct mgos_conf_range *range;
+};
+
+/*
+ * Lookup index of a schema, generated along with it.
+ * Allows finding entries by path without scanning the schema.
+ */
+struct mgos_conf_index_entry {
+  /* FNV-1a hash of the full path of the entry, e.g. "wifi.ap.ssid". */
+  uint32_t hash;
+  /* Index of the parent object entry. */
+  uint16_t parent;
+};
+
+struct mgos_conf_index {
+  const struct mgos_conf_entry *schema;
+  /* One for every schema entry. */
+  const struct mgos_conf_index_entry *entries;
+  /* Indices of all the entries but the root, sorted by hash. */
+  const uint16_t *by_hash;
+  /*
+   * Distinct non-empty defaults of string entries, NUL-terminated and packed
+   * together. String values equal to one of these point here instead of
+   * taking up RAM.
+   */
+  const char *str_defaults;
+  uint16_t str_defaults_size;
+  /* Offsets of the defaults in `str_defaults`, sorted by value. */
+  const uint16_t *str_default_offsets;
+  uint16_t num_str_defaults;
 };
 
+/*
+ * Make `index` available to `mgos_conf_find_schema_entry()` and friends.
+ * Generated schema getters do this on first call, only once even if it fails.
+ * Returns false if the index table is full, the schema is then searched
+ * linearly.
+ */
+bool mgos_conf_add_index(const struct mgos_conf_index *index);
+
 /*
  * Parses config `json` into `cfg` according to rules defined in `schema` and
  * checking keys against `acl`.
@@ -111,12 +176,88 @@ void mgos_conf_emit_cb(const void *cfg, const void *base,
 /*
  * Like mgos_conf_emit_cb, but instead of writing the output in the provided
  * mbuf and/or calling user-provided callback, it writes the result into the
- * file with the given name `fname`.
+ * file with the given name `fname`. Output is streamed, the file is replaced
+ * only if it has been written completely.
  */
 bool mgos_conf_emit_f(const void *cfg, const void *base,
                       const struct mgos_conf_entry *schema, bool pretty,
                       const char *fname);
 
+/*
+ * Sink for `mgos_conf_emit_stream()`: receives consecutive pieces of the
+ * output. Returning false stops the emitter.
+ */
+typedef bool (*mgos_conf_emit_sink_t)(const char *data, size_t len,
+                                      void *param);
+
+/*
+ * Like `mgos_conf_emit_cb()`, but the output is collected in a buffer of
+ * `chunk_size` bytes (0 means default, 256) which is passed to `sink` every
+ * time it fills up and at the end. Memory use does not depend on the size of
+ * the config. Returns false if `sink` has failed.
+ */
+bool mgos_conf_emit_stream(const void *cfg, const void *base,
+                           const struct mgos_conf_entry *schema, bool pretty,
+                           size_t chunk_size, mgos_conf_emit_sink_t sink,
+                           void *param);
+
+/* Sink that writes to a `struct json_out`, passed as `param`. */
+bool mgos_conf_emit_json_out_sink(const char *data, size_t len, void *param);
+
+/*
+ * Returns a hash of the `schema` layout: keys, types and offsets of all the
+ * entries. Binary snapshots are only valid for the schema they were made with.
+ */
+uint32_t mgos_conf_schema_hash(const struct mgos_conf_entry *schema);
+
+/*
+ * Writes a binary snapshot of `cfg` (which is `cfg_size` bytes) into the file
+ * `fname`. Snapshot is a copy of the struct with strings moved to a trailing
+ * pool and can be loaded back with `mgos_conf_load_bin()` much faster than
+ * JSON can be parsed. `tag` is an arbitrary value identifying the source of
+ * the config, loading fails if it does not match. `aux` is stored as is and
+ * returned by `mgos_conf_load_bin()`, e.g. for values that must not come from
+ * the config itself.
+ * Snapshots are not portable and are only meant to be used as a cache.
+ */
+bool mgos_conf_save_bin(const void *cfg, size_t cfg_size,
+                        const struct mgos_conf_entry *schema, uint32_t tag,
+                        int32_t aux, const char *fname);
+
+/*
+ * Loads a snapshot made by `mgos_conf_save_bin()` into `cfg`, which must be
+ * empty. Returns false, leaving `cfg` empty, if the file does not exist, is
+ * corrupted, was made with a different schema or `tag` does not match.
+ * If `aux` is not NULL, it receives the value passed to `mgos_conf_save_bin()`.
+ */
+bool mgos_conf_load_bin(const char *fname, const struct mgos_conf_entry *schema,
+                        uint32_t tag, void *cfg, size_t cfg_size,
+                        int32_t *aux);
+
+/*
+ * Appends values in `cfg` that differ from `base` to the journal file `fname`,
+ * creating it if necessary. Records are only added, never rewritten, which
+ * makes saving a few changed values much cheaper than emitting the whole
+ * config. `tag` identifies the state the journal applies to, usually the
+ * contents of the config file, and is only recorded when the journal is
+ * created: an existing journal must have been replayed with the same `tag`.
+ * Returns number of records appended or -1 in case of an error.
+ */
+int mgos_conf_journal_append(const void *cfg, const void *base,
+                             const struct mgos_conf_entry *schema, uint32_t tag,
+                             const char *fname);
+
+/*
+ * Applies records from the journal file `fname` to `cfg`, checking keys
+ * against `acl`. Returns number of records applied, 0 if there is no journal.
+ * If a corrupted record is found (e.g. last write was interrupted), it and
+ * everything after it is dropped from the file.
+ * Returns -1 and applies nothing if the journal was made for a different
+ * `tag`. Such a journal is stale and should be discarded.
+ */
+int mgos_conf_journal_replay(const char *fname, uint32_t tag, const char *acl,
+                             const struct mgos_conf_entry *schema, void *cfg);
+
 /*
  * Frees any resources allocated in `cfg`.
  */
@@ -145,6 +286,16 @@ const struct mgos_conf_entry *mgos_conf_find_schema_entry_s(
 bool mgos_config_get(const struct mg_str key, struct mg_str *value,
                      const void *cfg, const struct mgos_conf_entry *schema);
 
+/*
+ * Like `mgos_config_get()`, but instead of returning a copy of the value,
+ * passes it to `sink` in chunks of up to `chunk_size` bytes.
+ * Objects are emitted as they are serialized, see `mgos_conf_emit_stream()`.
+ */
+bool mgos_config_get_stream(const struct mg_str key, const void *cfg,
+                            const struct mgos_conf_entry *schema,
+                            size_t chunk_size, mgos_conf_emit_sink_t sink,
+                            void *param);
+
 /*
  * Set config value |key| in |cfg| according to |schema|.
  * Boolean and numeric values are converted from string, objects are parsed as
@@ -154,12 +305,76 @@ bool mgos_config_set(const struct mg_str key, const struct mg_str value,
                      void *cfg, const struct mgos_conf_entry *schema,
                      bool free_strings);
 
-/* Set string configuration entry. Frees current entry. */
+/*
+ * Set string configuration entry. Frees current entry.
+ *
+ * Values equal to one of the schema defaults point to the read-only default
+ * and short strings are kept in shared slabs, so config strings must only be
+ * freed with `mgos_conf_free()` or replaced with `mgos_conf_set_str()`.
+ * Strings are never moved.
+ */
 void mgos_conf_set_str(char **vp, const char *v);
 
+/* Returns true if the string is one of the interned schema defaults. */
+bool mgos_conf_str_is_default(const char *s);
+
+/* Config string storage statistics, see `mgos_conf_get_str_stats()`. */
+struct mgos_conf_str_stats {
+  /* Number of slabs that hold short strings. */
+  int num_slabs;
+  /* Number of bytes allocated for the slabs. */
+  size_t slabs_size;
+  /* Number of strings stored in the slabs. */
+  int num_slab_strs;
+};
+
+void mgos_conf_get_str_stats(struct mgos_conf_str_stats *stats);
+
 /* Returns true if the string is NULL or empty. */
 bool mgos_conf_str_empty(const char *s);
 
+/* Value of a config entry: `i` for ints and bools, `d` and `s`. */
+union mgos_conf_value {
+  int i;
+  double d;
+  const char *s;
+};
+
+/* Config value change, see `mgos_conf_subscribe()`. */
+struct mgos_conf_change {
+  /* Full path of the value, e.g. "wifi.ap.ssid". */
+  const char *path;
+  const struct mgos_conf_entry *entry;
+  /* Empty strings may be either "" or NULL. */
+  union mgos_conf_value old_value;
+  union mgos_conf_value new_value;
+};
+
+typedef void (*mgos_conf_change_cb_t)(const struct mgos_conf_change *ch,
+                                      void *userdata);
+
+/*
+ * Subscribe to changes of the value at `path` in `cfg`, which is described by
+ * `schema`. If `path` is an object (or "", which is the root), changes of any
+ * value under it are reported. `cb` is invoked for each value that has
+ * changed once `mgos_conf_parse()`, `mgos_conf_parse_sub()` or
+ * `mgos_config_set()` on `cfg` completes. Values are compared with the ones
+ * before the change, unchanged values are not reported. Changes made by
+ * assigning struct fields directly (including generated setters) are not
+ * reported.
+ *
+ * Old string value is a copy that is only valid during the callback.
+ * Callbacks may unsubscribe but must not change `cfg`.
+ */
+bool mgos_conf_subscribe(void *cfg, const struct mgos_conf_entry *schema,
+                         const char *path, mgos_conf_change_cb_t cb,
+                         void *userdata);
+
+/* Cancel a subscription made with the same arguments. */
+bool mgos_conf_unsubscribe(void *cfg, const struct mgos_conf_entry *schema,
+                           const char *path, mgos_conf_change_cb_t cb,
+                           void *userdata);
+
 /*
  * Returns a type of the value (this function is primarily for FFI)
  */
@@ -183,6 +398,14 @@ const char *mgos_conf_value_string_nonnull(const void *cfg,
  */
 int mgos_conf_value_int(const void *cfg, const struct mgos_conf_entry *e);
 
+/*
+ * Sets an int or bool value of the config entry. Returns false, leaving
+ * the value unchanged, if it is out of the entry's declared range or does not
+ * fit its storage.
+ */
+bool mgos_conf_set_value_int(void *cfg, const struct mgos_conf_entry *e,
+                             int v);
+
 /*
  * Returns a double value from the config entry
  */
@@ -24,6 +24,10 @@
 #define CS_FW_INCLUDE_MGOS_EVENT_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mgos_features.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -193,6 +197,129 @@ bool mgos_event_remove_handler(int ev, mgos_event_handler_t cb, void *userdata);
 bool mgos_event_remove_group_handler(int evgrp, mgos_event_handler_t cb,
                                      void *userdata);
 
+/*
+ * Maximum size of the event data copied by `mgos_event_post()`.
+ * Larger payloads can be passed with `mgos_event_post_ptr()`.
+ */
+#ifndef MGOS_EVENT_POST_MAX_DATA_SIZE
+#define MGOS_EVENT_POST_MAX_DATA_SIZE 32
+#endif
+
+/* Releases data passed to `mgos_event_post_ptr()`. */
+typedef void (*mgos_event_data_free_t)(void *ev_data);
+
+/*
+ * Post an event to be triggered asynchronously, from the Mongoose task.
+ *
+ * Unlike `mgos_event_trigger()`, this can be called from any thread and, if
+ * `from_isr` is set, from an interrupt handler. `ev_data_len` bytes of
+ * `ev_data` (up to `MGOS_EVENT_POST_MAX_DATA_SIZE`) are copied, handlers
+ * receive a pointer to the copy which is only valid during the call.
+ * If `ev_data` is NULL, handlers receive NULL.
+ *
+ * Events are queued and delivered in batches, in the order they were
+ * posted. Depth of the queue is set by `sys.event_queue_len`; if the queue
+ * is full, the event is dropped and false is returned.
+ *
+ * Example:
+ * ```c
+ * struct my_reading r = {.temp = t, .rh = rh};
+ * mgos_event_post(MY_EVENT_READING, &r, sizeof(r), false);
+ * ```
+ */
+bool mgos_event_post(int ev, const void *ev_data, size_t ev_data_len,
+                     bool from_isr);
+
+/*
+ * Like `mgos_event_post()`, but passes `ev_data` to handlers as is.
+ * After the handlers have been invoked, `free_cb` (if not NULL) is called
+ * to release it. If the event could not be queued, false is returned and
+ * the ownership of `ev_data` stays with the caller.
+ */
+bool mgos_event_post_ptr(int ev, void *ev_data, mgos_event_data_free_t free_cb,
+                         bool from_isr);
+
+/* Posted event queue counters, see `mgos_event_get_queue_stats()`. */
+struct mgos_event_queue_stats {
+  /* Number of events queued. */
+  uint32_t num_posted;
+  /* Number of posted events that have been triggered. */
+  uint32_t num_delivered;
+  /* Number of events dropped because the queue was full. */
+  uint32_t num_dropped;
+  /* Number of events rejected because the data was too large. */
+  uint32_t num_too_large;
+  /* Number of batches events were delivered in. */
+  uint32_t num_batches;
+  /* Largest number of events delivered in one batch. */
+  uint32_t max_batch;
+};
+
+/* Get posted event queue counters. */
+void mgos_event_get_queue_stats(struct mgos_event_queue_stats *stats);
+
+#if MGOS_ENABLE_EVENT_TRACE
+/*
+ * Event tracing.
+ *
+ * When started, every `mgos_event_trigger()` is timed and recorded in a
+ * ring buffer, and per-event counters are updated. Time spent in handlers
+ * of events triggered from within a handler is included in the time of the
+ * outer event as well.
+ */
+
+/* A single trigger of an event. */
+struct mgos_event_trace_record {
+  /* Uptime when the event was triggered, in microseconds. */
+  int64_t ts_us;
+  /* Total time spent in the handlers. */
+  uint32_t duration_us;
+  int ev;
+  uint16_t num_handlers;
+};
+
+/* Per-event counters. */
+struct mgos_event_stats {
+  int ev;
+  uint32_t num_triggers;
+  /* Number of handler invocations. */
+  uint32_t num_handlers;
+  uint32_t max_duration_us;
+  uint64_t total_duration_us;
+};
+
+/*
+ * Start tracing, with room for the last `num_records` triggers.
+ * Previously collected records and counters are discarded.
+ * Returns false if there is not enough memory.
+ */
+bool mgos_event_trace_start(int num_records);
+
+/* Stop tracing. Collected data is retained. */
+void mgos_event_trace_stop(void);
+
+/*
+ * Copy up to `max_records` of the most recent trace records into `records`,
+ * oldest first. Returns the number of records copied.
+ */
+int mgos_event_trace_get_records(struct mgos_event_trace_record *records,
+                                 int max_records);
+
+/*
+ * Copy counters of up to `max_stats` events into `stats`, the ones with the
+ * longest total handler time first. Returns the number of entries copied.
+ */
+int mgos_event_get_stats(struct mgos_event_stats *stats, int max_stats);
+
+/*
+ * Print trace records in the Chrome trace event format, which can be
+ * loaded in chrome://tracing or Perfetto UI.
+ * Returns number of bytes printed.
+ */
+struct json_out;
+int mgos_event_trace_print_chrome(struct json_out *out);
+#endif /* MGOS_ENABLE_EVENT_TRACE */
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -22,6 +22,10 @@
 #define MGOS_ENABLE_BITBANG 0
 #endif
 
+#ifndef MGOS_ENABLE_CONFIG_SNAPSHOT
+#define MGOS_ENABLE_CONFIG_SNAPSHOT 0
+#endif
+
 #ifndef MGOS_ENABLE_DEBUG_UDP
 #define MGOS_ENABLE_DEBUG_UDP 0
 #endif
@@ -30,6 +34,10 @@
 #define MGOS_ENABLE_SYS_SERVICE 0
 #endif
 
+#ifndef MGOS_ENABLE_EVENT_TRACE
+#define MGOS_ENABLE_EVENT_TRACE 0
+#endif
+
 #ifndef MGOS_ENABLE_MDNS
 #define MGOS_ENABLE_MDNS 0
 #endif
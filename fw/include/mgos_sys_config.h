@@ -122,6 +122,20 @@ bool mgos_config_apply_s(const struct mg_str, bool save);
 bool mgos_sys_config_parse_sub(const struct mg_str json, const char *section,
                                void *cfg);
 
+/*
+ * Subscribe to changes of the sys config value at `path`, e.g. "wifi.ap.ssid",
+ * or of any value under it if `path` is an object, e.g. "wifi.ap".
+ * `cb` is invoked with the path and the old and new values of every changed
+ * value after `mgos_config_apply()`, `mgos_sys_config_set()` or
+ * `mgos_sys_config_parse_sub()` into `mgos_sys_config`.
+ * See `mgos_conf_subscribe()` for details.
+ */
+bool mgos_sys_config_subscribe(const char *path, mgos_conf_change_cb_t cb,
+                               void *userdata);
+
+bool mgos_sys_config_unsubscribe(const char *path, mgos_conf_change_cb_t cb,
+                                 void *userdata);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
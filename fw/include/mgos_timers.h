@@ -54,6 +54,7 @@
 #ifndef CS_FW_INCLUDE_MGOS_TIMERS_H_
 #define CS_FW_INCLUDE_MGOS_TIMERS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -112,13 +113,105 @@ typedef uintptr_t mgos_timer_id;
 mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
                              void *cb_arg);
 
+/*
+ * Allow software timer `id` to fire up to `slack_ms` milliseconds late.
+ *
+ * Timers whose windows overlap are fired together on a single wakeup of
+ * the Mongoose task, which reduces the number of wakeups when there are
+ * many periodic timers running at slightly different phases. For repeating
+ * timers, the period is unaffected: lateness does not accumulate.
+ *
+ * Default slack is 0, i.e. the timer is fired as soon as possible.
+ * Returns false if `id` is not a valid software timer.
+ *
+ * Example:
+ * ```c
+ * mgos_timer_id id = mgos_set_timer(1000, MGOS_TIMER_REPEAT, poll_cb, NULL);
+ * mgos_set_timer_slack(id, 200);
+ * ```
+ */
+bool mgos_set_timer_slack(mgos_timer_id id, int slack_ms);
+
+/* Software timer counters, see `mgos_get_timer_stats()`. */
+struct mgos_timer_stats {
+  /* Number of times the timer handler has been woken up. */
+  uint32_t num_wakeups;
+  /* Number of timer callbacks invoked. */
+  uint32_t num_fired;
+  /* Number of timer records allocated, see `sys.sw_timers_pool_size`. */
+  uint32_t pool_size;
+  /* Number of timer records in use, i.e. active timers. */
+  uint32_t pool_used;
+  /* Maximum value of `pool_used` since boot. */
+  uint32_t pool_max_used;
+  /* Number of times a repeating timer was re-synced after a delay. */
+  uint32_t num_resyncs;
+  /* Number of periods skipped by the re-syncs. */
+  uint32_t num_skipped;
+};
+
+/* Get software timer counters. */
+void mgos_get_timer_stats(struct mgos_timer_stats *stats);
+
+/*
+ * Software timer instrumentation.
+ *
+ * When enabled, lateness (how long after its scheduled time a callback was
+ * invoked) and duration of every callback is recorded, globally as
+ * histograms and per timer and per callback function as maximums.
+ * This costs two clock reads per callback, so it is off by default.
+ */
+
+/* Number of histogram buckets: bucket i counts values in [2^(i-1), 2^i) us */
+#define MGOS_TIMER_INSTR_NUM_BUCKETS 24
+/* Number of slowest callbacks to keep track of. */
+#define MGOS_TIMER_INSTR_TOP_N 8
+
+struct mgos_timer_cb_instr {
+  timer_callback cb;
+  uint32_t num_calls;
+  uint32_t max_lateness_us;
+  uint32_t max_duration_us;
+};
+
+struct mgos_timer_instr {
+  uint32_t lateness_hist[MGOS_TIMER_INSTR_NUM_BUCKETS];
+  uint32_t duration_hist[MGOS_TIMER_INSTR_NUM_BUCKETS];
+  /* Callbacks with the longest max duration, slowest first. */
+  struct mgos_timer_cb_instr slowest[MGOS_TIMER_INSTR_TOP_N];
+};
+
+/* Enable or disable software timer instrumentation. */
+void mgos_timers_set_instr_enabled(bool enable);
+
+/* Get global instrumentation data. */
+void mgos_timers_get_instr(struct mgos_timer_instr *instr);
+
+/*
+ * Get instrumentation data of the software timer `id`.
+ * Returns false if `id` is not a valid software timer.
+ */
+bool mgos_timers_get_timer_instr(mgos_timer_id id,
+                                 struct mgos_timer_cb_instr *instr);
+
+/* Reset global and per-timer instrumentation data. */
+void mgos_timers_reset_instr(void);
+
+/*
+ * Print counters and instrumentation data as a JSON object.
+ * Returns number of bytes printed.
+ */
+struct json_out;
+int mgos_timers_print_instr(struct json_out *out);
+
 /*
  * Setup a hardware timer with `usecs` timeout and `cb` as a callback.
  *
  * This is similar to mgos_set_timer, but can be used for shorter intervals
  * (note that time unit is microseconds).
  *
- * Number of hardware timers is limited (ESP8266: 1, ESP32: 4, CC32xx: 4).
+ * Number of hardware timers is limited (ESP8266: 1, ESP32: 4, CC32xx: 4,
+ * Ubuntu: 4).
  *
  * Callback is executed in ISR context, with all the implications of that.
  */
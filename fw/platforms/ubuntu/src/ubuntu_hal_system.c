@@ -193,14 +193,28 @@ bool ubuntu_set_nsleep100(void) {
   return true;
 }
 
+/*
+ * The only source of "interrupts" is the HW timer thread, which runs its
+ * callbacks with this lock held (see ubuntu_hal_timers.c).
+ */
+static pthread_mutex_t s_ints_mux;
+static pthread_once_t s_ints_mux_once = PTHREAD_ONCE_INIT;
+
+static void ints_mux_init(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&s_ints_mux, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
 void mgos_ints_disable(void) {
-  // LOG(LL_INFO, ("Not implemented"));
-  return;
+  pthread_once(&s_ints_mux_once, ints_mux_init);
+  pthread_mutex_lock(&s_ints_mux);
 }
 
 void mgos_ints_enable(void) {
-  // LOG(LL_INFO, ("Not implemented"));
-  return;
+  pthread_mutex_unlock(&s_ints_mux);
 }
 
 bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr) {
@@ -14,66 +14,133 @@
  * limitations under the License.
  */
 
-#include <malloc.h>
+/*
+ * HW timers are emulated with timerfds, serviced by a dedicated thread that
+ * plays the role of the interrupt handler: it runs with real-time priority
+ * (if we are allowed to have it) and masks "interrupts" for the duration of
+ * the callback, see mgos_ints_disable().
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "mgos_hw_timers_hal.h"
+#include "mgos_system.h"
 #include "ubuntu.h"
 
-bool mgos_hw_timers_dev_set(struct mgos_hw_timer_info *ti, int usecs,
-                            int flags) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return true;
-
-  (void) ti;
-  (void) usecs;
-  (void) flags;
+static int s_epfd = -1;
+static pthread_t s_thread;
+static int s_fds[MGOS_NUM_HW_TIMERS];
+
+static void ubuntu_hw_timers_set_prio(void) {
+  struct sched_param sp;
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+  int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+  if (r != 0) {
+    LOG(LL_WARN, ("Failed to set RT priority for HW timers: %d", r));
+  }
 }
 
-void mgos_hw_timers_isr(struct mgos_hw_timer_info *ti) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return;
+static void *ubuntu_hw_timers_thread(void *arg) {
+  struct epoll_event evs[MGOS_NUM_HW_TIMERS];
+  ubuntu_hw_timers_set_prio();
+  for (;;) {
+    int n = epoll_wait(s_epfd, evs, MGOS_NUM_HW_TIMERS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      LOG(LL_ERROR, ("epoll_wait failed: %d", errno));
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      struct mgos_hw_timer_info *ti =
+          (struct mgos_hw_timer_info *) evs[i].data.ptr;
+      uint64_t num_exp = 0;
+      mgos_ints_disable();
+      /*
+       * Timer may have been cleared or re-armed since it fired, in which case
+       * there is nothing to read.
+       */
+      if (read(s_fds[ti->id - 1], &num_exp, sizeof(num_exp)) ==
+              sizeof(num_exp) &&
+          ti->cb != NULL) {
+        mgos_hw_timers_isr(ti);
+      }
+      mgos_ints_enable();
+    }
+  }
+  return NULL;
+
+  (void) arg;
+}
 
-  (void) ti;
+bool mgos_hw_timers_dev_set(struct mgos_hw_timer_info *ti, int usecs,
+                            int flags) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = usecs / 1000000;
+  its.it_value.tv_nsec = (usecs % 1000000) * 1000;
+  /* All zeroes would disarm the timer. */
+  if (usecs <= 0) its.it_value.tv_nsec = 1;
+  if (flags & MGOS_TIMER_REPEAT) its.it_interval = its.it_value;
+  if (timerfd_settime(s_fds[ti->id - 1], 0, &its, NULL) != 0) {
+    LOG(LL_ERROR, ("timerfd_settime failed: %d", errno));
+    return false;
+  }
+  return true;
 }
 
 void mgos_hw_timers_dev_isr_bottom(struct mgos_hw_timer_info *ti) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return;
-
   (void) ti;
 }
 
 void mgos_hw_timers_dev_clear(struct mgos_hw_timer_info *ti) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return;
-
-  (void) ti;
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  /* Disarming also resets the expiration count, so that ISR will not run. */
+  mgos_ints_disable();
+  timerfd_settime(s_fds[ti->id - 1], 0, &its, NULL);
+  mgos_ints_enable();
 }
 
 bool mgos_hw_timers_dev_init(struct mgos_hw_timer_info *ti) {
-  LOG(LL_INFO, ("Not implemented yet"));
+  struct epoll_event ev;
+  int fd;
+
+  if (s_epfd < 0) {
+    s_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s_epfd < 0) {
+      LOG(LL_ERROR, ("epoll_create1 failed: %d", errno));
+      return false;
+    }
+    if (pthread_create(&s_thread, NULL, ubuntu_hw_timers_thread, NULL) != 0) {
+      LOG(LL_ERROR, ("Failed to create HW timer thread"));
+      close(s_epfd);
+      s_epfd = -1;
+      return false;
+    }
+  }
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("timerfd_create failed: %d", errno));
+    return false;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = ti;
+  if (epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    LOG(LL_ERROR, ("epoll_ctl failed: %d", errno));
+    close(fd);
+    return false;
+  }
+  s_fds[ti->id - 1] = fd;
   return true;
-
-  (void) ti;
-}
-
-enum mgos_init_result mgos_hw_timers_init(void) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return MGOS_INIT_OK;
-}
-
-void mgos_hw_timers_deinit(void) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return;
-}
-
-void mgos_clear_hw_timer(mgos_timer_id id) {
-  LOG(LL_INFO, ("Not implemented yet"));
-  return;
-
-  (void) id;
 }
@@ -17,22 +17,254 @@
 
 #include "mgos_config_util.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include "common/cs_crc32.h"
 #include "common/cs_dbg.h"
+#include "common/cs_file.h"
 #include "common/json_utils.h"
 #include "common/mbuf.h"
 
 #include "mongoose.h"
 
+/*
+ * Compiled ACL. Literal patterns ("foo.bar") and literal prefixes ("foo.*",
+ * "foo.**") go into a trie, so a key can be checked against all of them in
+ * one pass over the key. Other patterns are matched with mg_match_prefix_n,
+ * in order, but only if they come before the best trie match.
+ */
+#define CONF_ACL_NONE 0xffff
+
+struct conf_acl_rule {
+  struct mg_str pattern;
+  /*
+   * Literal parts at the start and the end of a glob pattern, which a key
+   * must start and end with to match it.
+   */
+  struct mg_str head, tail;
+  bool allow;
+};
+
+struct conf_acl_node {
+  char c;
+  uint16_t first_child;
+  uint16_t next_sibling;
+  /* Indices of the first rules that match keys ending here... */
+  uint16_t exact;
+  /* ...or continuing past here: "**" and "*", which stops at a slash. */
+  uint16_t prefix;
+  uint16_t prefix_noslash;
+};
+
+struct conf_acl {
+  /* Copy of the ACL, rules point into it. */
+  struct mg_str acl;
+  struct conf_acl_rule *rules;
+  struct conf_acl_node *nodes;
+  uint16_t *glob_rules;
+  uint16_t num_rules, num_nodes, num_glob_rules;
+  /* One held by the cache, plus one by each user. */
+  int refs;
+};
+
+#ifndef MGOS_CONF_ACL_CACHE_SIZE
+#define MGOS_CONF_ACL_CACHE_SIZE 4
+#endif
+
+/* Most recently used first. */
+static struct conf_acl *s_acl_cache[MGOS_CONF_ACL_CACHE_SIZE];
+
+static void conf_acl_free(struct conf_acl *a) {
+  if (a == NULL) return;
+  free((void *) a->acl.p);
+  free(a->rules);
+  free(a->nodes);
+  free(a->glob_rules);
+  free(a);
+}
+
+static void conf_acl_unref(const struct conf_acl *ca) {
+  struct conf_acl *a = (struct conf_acl *) ca;
+  if (a != NULL && --a->refs == 0) conf_acl_free(a);
+}
+
+static int conf_acl_find_child(const struct conf_acl *a, int n, char c) {
+  int ci;
+  for (ci = a->nodes[n].first_child; ci != 0; ci = a->nodes[ci].next_sibling) {
+    if (a->nodes[ci].c == c) return ci;
+  }
+  return -1;
+}
+
+static int conf_acl_add_child(struct conf_acl *a, int n, char c) {
+  int ci = conf_acl_find_child(a, n, c);
+  if (ci > 0) return ci;
+  ci = a->num_nodes++;
+  a->nodes[ci].c = c;
+  a->nodes[ci].exact = a->nodes[ci].prefix = a->nodes[ci].prefix_noslash =
+      CONF_ACL_NONE;
+  a->nodes[ci].next_sibling = a->nodes[n].first_child;
+  a->nodes[n].first_child = ci;
+  return ci;
+}
+
+static struct conf_acl *conf_acl_compile(const struct mg_str acl) {
+  struct mg_str entry, rest;
+  size_t num_entries = 1, i;
+  struct conf_acl *a = (struct conf_acl *) calloc(1, sizeof(*a));
+  if (a == NULL) return NULL;
+  for (i = 0; i < acl.len; i++) {
+    if (acl.p[i] == ',') num_entries++;
+  }
+  /* Trie needs at most one node per character, plus the root. */
+  if (num_entries >= CONF_ACL_NONE || acl.len + 1 >= CONF_ACL_NONE) goto err;
+  a->acl = mg_strdup(acl);
+  a->rules = (struct conf_acl_rule *) calloc(num_entries, sizeof(*a->rules));
+  a->nodes = (struct conf_acl_node *) calloc(acl.len + 1, sizeof(*a->nodes));
+  a->glob_rules = (uint16_t *) calloc(num_entries, sizeof(*a->glob_rules));
+  if (a->acl.p == NULL || a->rules == NULL || a->nodes == NULL ||
+      a->glob_rules == NULL) {
+    goto err;
+  }
+  a->num_nodes = 1;
+  a->nodes[0].exact = a->nodes[0].prefix = a->nodes[0].prefix_noslash =
+      CONF_ACL_NONE;
+  rest = a->acl;
+  while (true) {
+    rest = mg_next_comma_list_entry_n(rest, &entry, NULL);
+    if (rest.p == NULL) break;
+    if (entry.len == 0) continue;
+    uint16_t ri = a->num_rules++;
+    struct conf_acl_rule *r = &a->rules[ri];
+    r->allow = (entry.p[0] != '-');
+    if (entry.p[0] == '-' || entry.p[0] == '+') {
+      entry.p++;
+      entry.len--;
+    }
+    r->pattern = entry;
+    /* Length of the literal part and the wildcard suffix, if any. */
+    size_t lit_len = 0;
+    while (lit_len < entry.len && strchr("?*$|", entry.p[lit_len]) == NULL) {
+      lit_len++;
+    }
+    struct mg_str suffix = mg_mk_str_n(entry.p + lit_len, entry.len - lit_len);
+    uint16_t *nri;
+    int n = 0;
+    if (suffix.len != 0 && mg_vcmp(&suffix, "*") != 0 &&
+        mg_vcmp(&suffix, "**") != 0) {
+      if (mg_strchr(entry, '|') == NULL) {
+        r->head = mg_mk_str_n(entry.p, lit_len);
+        r->tail = mg_mk_str_n(entry.p + entry.len, 0);
+        while (r->tail.p > entry.p && strchr("?*$", r->tail.p[-1]) == NULL) {
+          r->tail.p--;
+          r->tail.len++;
+        }
+      }
+      a->glob_rules[a->num_glob_rules++] = ri;
+      continue;
+    }
+    for (i = 0; i < lit_len; i++) {
+      n = conf_acl_add_child(a, n, tolower((unsigned char) entry.p[i]));
+    }
+    if (suffix.len == 0) {
+      nri = &a->nodes[n].exact;
+    } else if (suffix.len == 2) {
+      nri = &a->nodes[n].prefix;
+    } else {
+      nri = &a->nodes[n].prefix_noslash;
+    }
+    /* Earlier rules take precedence. */
+    if (*nri == CONF_ACL_NONE) *nri = ri;
+  }
+  return a;
+
+err:
+  conf_acl_free(a);
+  return NULL;
+}
+
+static bool conf_acl_match(const struct conf_acl *a, const struct mg_str key) {
+  uint16_t best = CONF_ACL_NONE;
+  const char *last_slash = NULL;
+  size_t d = 0;
+  int n = 0, i;
+  for (i = 0; i < (int) key.len; i++) {
+    if (key.p[i] == '/') last_slash = key.p + i;
+  }
+  while (true) {
+    const struct conf_acl_node *node = &a->nodes[n];
+    if (d == key.len) {
+      if (node->exact < best) best = node->exact;
+      break;
+    }
+    /* Wildcard has to match at least one character. */
+    if (node->prefix < best) best = node->prefix;
+    if (node->prefix_noslash < best &&
+        (last_slash == NULL || last_slash < key.p + d)) {
+      best = node->prefix_noslash;
+    }
+    n = conf_acl_find_child(a, n, tolower((unsigned char) key.p[d]));
+    if (n < 0) break;
+    d++;
+  }
+  for (i = 0; i < a->num_glob_rules && a->glob_rules[i] < best; i++) {
+    const struct conf_acl_rule *r = &a->rules[a->glob_rules[i]];
+    if (key.len < r->head.len + r->tail.len ||
+        mg_ncasecmp(key.p, r->head.p, r->head.len) != 0 ||
+        mg_ncasecmp(key.p + key.len - r->tail.len, r->tail.p, r->tail.len) !=
+            0) {
+      continue;
+    }
+    if (mg_match_prefix_n(r->pattern, key) == key.len) {
+      best = a->glob_rules[i];
+      break;
+    }
+  }
+  return (best != CONF_ACL_NONE && a->rules[best].allow);
+}
+
+/*
+ * Returns compiled `acl` from the cache, compiling it if necessary.
+ * Result stays valid, even if evicted from the cache, until released with
+ * `conf_acl_unref()`.
+ */
+static const struct conf_acl *conf_acl_get(const struct mg_str acl) {
+  struct conf_acl *a = NULL;
+  int i;
+  if (acl.len == 0) return NULL;
+  for (i = 0; i < MGOS_CONF_ACL_CACHE_SIZE; i++) {
+    a = s_acl_cache[i];
+    if (a == NULL) break;
+    if (a->acl.len == acl.len && memcmp(a->acl.p, acl.p, acl.len) == 0) break;
+    a = NULL;
+  }
+  if (a == NULL) {
+    a = conf_acl_compile(acl);
+    if (a == NULL) return NULL;
+    a->refs = 1;
+    if (i == MGOS_CONF_ACL_CACHE_SIZE) {
+      conf_acl_unref(s_acl_cache[--i]);
+    }
+  }
+  memmove(&s_acl_cache[1], &s_acl_cache[0], i * sizeof(s_acl_cache[0]));
+  s_acl_cache[0] = a;
+  a->refs++;
+  return a;
+}
+
 bool mgos_conf_check_access(const struct mg_str key, const char *acl) {
   return mgos_conf_check_access_n(key, mg_mk_str(acl));
 }
 
-bool mgos_conf_check_access_n(const struct mg_str key, struct mg_str acl) {
+static bool conf_check_access(const struct mg_str key, const struct conf_acl *a,
+                              struct mg_str acl) {
   struct mg_str entry;
   if (acl.len == 0) return false;
+  if (a != NULL) return conf_acl_match(a, key);
+  /* Could not compile, match the hard way. */
   while (true) {
     acl = mg_next_comma_list_entry_n(acl, &entry, NULL);
     if (acl.p == NULL) {
@@ -51,17 +283,104 @@ bool mgos_conf_check_access_n(const struct mg_str key, struct mg_str acl) {
   return false;
 }
 
+bool mgos_conf_check_access_n(const struct mg_str key, struct mg_str acl) {
+  const struct conf_acl *a = conf_acl_get(acl);
+  bool ret = conf_check_access(key, a, acl);
+  conf_acl_unref(a);
+  return ret;
+}
+
 struct parse_ctx {
   const struct mgos_conf_entry *schema;
   const char *acl;
+  const struct conf_acl *acl_c;
   void *cfg;
   bool result;
   int offset_adj;
 };
 
+#ifndef MGOS_CONF_MAX_INDEXES
+#define MGOS_CONF_MAX_INDEXES 4
+#endif
+
+static const struct mgos_conf_index *s_conf_indexes[MGOS_CONF_MAX_INDEXES];
+
+bool mgos_conf_add_index(const struct mgos_conf_index *index) {
+  int i;
+  for (i = 0; i < MGOS_CONF_MAX_INDEXES; i++) {
+    if (s_conf_indexes[i] == index) return true;
+    if (s_conf_indexes[i] == NULL) {
+      s_conf_indexes[i] = index;
+      return true;
+    }
+  }
+  LOG(LL_ERROR, ("Config index table is full, lookups will be slow"));
+  return false;
+}
+
+#define FNV1A_32_INIT 0x811c9dc5
+#define FNV1A_32_PRIME 0x01000193
+
+/* Returns index of the entry with the given path hash, or -1. */
+static int mgos_conf_index_find(const struct mgos_conf_index *index,
+                                uint32_t hash) {
+  int lo = 0, hi = index->schema->num_desc;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    uint32_t mh = index->entries[index->by_hash[mid]].hash;
+    if (mh == hash) return index->by_hash[mid];
+    if (mh < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Entry is looked up by the hash of its full path and then verified by
+ * walking up to `obj` and matching keys against path components, so false
+ * positives are not possible.
+ */
+static const struct mgos_conf_entry *mgos_conf_index_lookup(
+    const struct mgos_conf_index *index, const struct mgos_conf_entry *obj,
+    const struct mg_str path) {
+  const int obj_idx = obj - index->schema;
+  uint32_t hash = index->entries[obj_idx].hash;
+  size_t i, end = path.len;
+  int ei, cur;
+  if (obj_idx != 0) hash = (hash ^ '.') * FNV1A_32_PRIME;
+  for (i = 0; i < path.len; i++) {
+    hash = (hash ^ (uint8_t) path.p[i]) * FNV1A_32_PRIME;
+  }
+  ei = mgos_conf_index_find(index, hash);
+  if (ei < 0) return NULL;
+  for (cur = ei;;) {
+    const char *key = index->schema[cur].key;
+    size_t key_len = strlen(key);
+    if (key_len > end || memcmp(path.p + end - key_len, key, key_len) != 0) {
+      return NULL;
+    }
+    end -= key_len;
+    cur = index->entries[cur].parent;
+    if (cur == obj_idx) return (end == 0 ? index->schema + ei : NULL);
+    if (end == 0 || cur == 0 || path.p[end - 1] != '.') return NULL;
+    end--;
+  }
+}
+
 const struct mgos_conf_entry *mgos_conf_find_schema_entry_s(
     const struct mg_str path, const struct mgos_conf_entry *obj) {
   int i;
+  for (i = 0; i < MGOS_CONF_MAX_INDEXES && s_conf_indexes[i] != NULL; i++) {
+    const struct mgos_conf_index *index = s_conf_indexes[i];
+    const struct mgos_conf_entry *schema = index->schema;
+    if (obj >= schema && obj <= schema + schema->num_desc &&
+        obj->type == CONF_TYPE_OBJECT) {
+      return mgos_conf_index_lookup(index, obj, path);
+    }
+  }
   const char *sep = mg_strchr(path, '.');
   struct mg_str component =
       mg_mk_str_n(path.p, (sep == NULL ? path.len : (size_t)(sep - path.p)));
@@ -85,6 +404,152 @@ const struct mgos_conf_entry *mgos_conf_find_schema_entry(
   return mgos_conf_find_schema_entry_s(mg_mk_str(path), obj);
 }
 
+/*
+ * Config string storage.
+ *
+ * Values equal to one of the schema string defaults point to the default
+ * itself and take no RAM. Other short strings are kept in slabs: blocks of
+ * CONF_STR_SLAB_SLOTS equal slots, one slot size per slab, so that hundreds
+ * of small strings don't each take a heap block. Strings never move, and a
+ * slab is released once its last string is freed. Longer strings, and strings
+ * not allocated by this module, are malloc()ed and free()d as usual.
+ */
+#define CONF_STR_SLAB_SLOTS 8
+static const uint8_t s_conf_str_slot_sizes[] = {8, 16, 24, 32, 48, 64};
+#define CONF_STR_NUM_SLOT_SIZES \
+  (sizeof(s_conf_str_slot_sizes) / sizeof(s_conf_str_slot_sizes[0]))
+
+struct conf_str_slab {
+  struct conf_str_slab *next;
+  uint8_t slot_size;
+  /* Bitmap of slots in use. */
+  uint8_t used;
+  char slots[];
+};
+
+/* Slabs, separately for each slot size. */
+static struct conf_str_slab *s_conf_str_slabs[CONF_STR_NUM_SLOT_SIZES];
+
+static bool conf_str_is_default(const char *s) {
+  int i;
+  for (i = 0; i < MGOS_CONF_MAX_INDEXES && s_conf_indexes[i] != NULL; i++) {
+    const struct mgos_conf_index *index = s_conf_indexes[i];
+    if (s >= index->str_defaults &&
+        s < index->str_defaults + index->str_defaults_size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *conf_str_find_default(const char *s, size_t len) {
+  int i;
+  for (i = 0; i < MGOS_CONF_MAX_INDEXES && s_conf_indexes[i] != NULL; i++) {
+    const struct mgos_conf_index *index = s_conf_indexes[i];
+    int lo = 0, hi = index->num_str_defaults;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      const char *ds = index->str_defaults + index->str_default_offsets[mid];
+      int cmp = strncmp(ds, s, len);
+      if (cmp == 0 && ds[len] == '\0') return ds;
+      if (cmp > 0 || (cmp == 0 && ds[len] != '\0')) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+  }
+  return NULL;
+}
+
+static char *conf_str_alloc(size_t size) {
+  size_t i;
+  int j;
+  struct conf_str_slab *slab;
+  for (i = 0; i < CONF_STR_NUM_SLOT_SIZES; i++) {
+    if (size <= s_conf_str_slot_sizes[i]) break;
+  }
+  if (i == CONF_STR_NUM_SLOT_SIZES) return (char *) malloc(size);
+  for (slab = s_conf_str_slabs[i]; slab != NULL; slab = slab->next) {
+    if (slab->used != 0xff) break;
+  }
+  if (slab == NULL) {
+    slab = (struct conf_str_slab *) malloc(
+        sizeof(*slab) + CONF_STR_SLAB_SLOTS * s_conf_str_slot_sizes[i]);
+    if (slab == NULL) return NULL;
+    slab->slot_size = s_conf_str_slot_sizes[i];
+    slab->used = 0;
+    slab->next = s_conf_str_slabs[i];
+    s_conf_str_slabs[i] = slab;
+  }
+  for (j = 0; slab->used & (1 << j); j++) {
+  }
+  slab->used |= (1 << j);
+  return slab->slots + j * slab->slot_size;
+}
+
+static void conf_str_free(char *s) {
+  size_t i;
+  if (s == NULL || conf_str_is_default(s)) return;
+  for (i = 0; i < CONF_STR_NUM_SLOT_SIZES; i++) {
+    struct conf_str_slab **sp, *slab;
+    for (sp = &s_conf_str_slabs[i]; (slab = *sp) != NULL; sp = &slab->next) {
+      if (s < slab->slots ||
+          s >= slab->slots + CONF_STR_SLAB_SLOTS * slab->slot_size) {
+        continue;
+      }
+      slab->used &= ~(1 << ((s - slab->slots) / slab->slot_size));
+      if (slab->used == 0) {
+        *sp = slab->next;
+        free(slab);
+      }
+      return;
+    }
+  }
+  free(s);
+}
+
+bool mgos_conf_str_is_default(const char *s) {
+  return (s != NULL && conf_str_is_default(s));
+}
+
+void mgos_conf_get_str_stats(struct mgos_conf_str_stats *stats) {
+  size_t i;
+  int j;
+  memset(stats, 0, sizeof(*stats));
+  for (i = 0; i < CONF_STR_NUM_SLOT_SIZES; i++) {
+    const struct conf_str_slab *slab;
+    for (slab = s_conf_str_slabs[i]; slab != NULL; slab = slab->next) {
+      stats->num_slabs++;
+      stats->slabs_size +=
+          sizeof(*slab) + CONF_STR_SLAB_SLOTS * slab->slot_size;
+      for (j = 0; j < CONF_STR_SLAB_SLOTS; j++) {
+        if (slab->used & (1 << j)) stats->num_slab_strs++;
+      }
+    }
+  }
+}
+
+/*
+ * Sets `*vp` to a copy of `s`, `len` bytes long, and frees the old value.
+ * `s` may point into the old value. Empty string is stored as NULL.
+ */
+static bool conf_str_set(char **vp, const char *s, size_t len) {
+  char *new_value = NULL;
+  if (len > 0) {
+    new_value = (char *) conf_str_find_default(s, len);
+    if (new_value == NULL) {
+      new_value = conf_str_alloc(len + 1);
+      if (new_value == NULL) return false;
+      memcpy(new_value, s, len);
+      new_value[len] = '\0';
+    }
+  }
+  conf_str_free(*vp);
+  *vp = new_value;
+  return true;
+}
+
 void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
                         const char *path, const struct json_token *tok) {
   struct parse_ctx *ctx = (struct parse_ctx *) data;
@@ -109,7 +574,7 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
   }
 #ifndef MGOS_BOOT_BUILD
   if (e->type != CONF_TYPE_OBJECT &&
-      !mgos_conf_check_access(mg_mk_str(path), ctx->acl)) {
+      !conf_check_access(mg_mk_str(path), ctx->acl_c, mg_mk_str(ctx->acl))) {
     LOG(LL_ERROR, ("Not allowed to set [%s]", path));
     return;
   }
@@ -132,7 +597,12 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
       switch (e->type) {
         case CONF_TYPE_INT:
           /* NB: Using base 0 to accept hex numbers. */
-          *((int *) vp) = strtol(tok->ptr, &endptr, 0);
+          if (!mgos_conf_set_value_int(vp - e->offset, e,
+                                       strtol(tok->ptr, &endptr, 0))) {
+            LOG(LL_ERROR, ("[%s] is out of range", path));
+            ctx->result = false;
+            return;
+          }
           break;
 #ifndef MGOS_BOOT_BUILD
         case CONF_TYPE_DOUBLE:
@@ -156,7 +626,7 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
         ctx->result = false;
         return;
       }
-      *((int *) vp) = (tok->type == JSON_TYPE_TRUE);
+      mgos_conf_set_value_int(vp - e->offset, e, (tok->type == JSON_TYPE_TRUE));
       break;
     }
     case CONF_TYPE_STRING: {
@@ -166,25 +636,14 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
         return;
       }
       char **sp = (char **) vp;
-      char *s = NULL;
-      if (*sp != NULL) free(*sp);
-      if (tok->len > 0) {
-        s = (char *) malloc(tok->len + 1);
-        if (s == NULL) {
-          ctx->result = false;
-          return;
-        }
-        int n = json_unescape(tok->ptr, tok->len, s, tok->len);
-        if (n < 0) {
-          free(s);
-          ctx->result = false;
-          return;
-        }
-        s[n] = '\0';
-      } else {
-        /* Empty string - keep value as NULL. */
+      if (memchr(tok->ptr, '\\', tok->len) == NULL) {
+        if (!conf_str_set(sp, tok->ptr, tok->len)) ctx->result = false;
+        break;
       }
-      *sp = s;
+      char *s = (char *) malloc(tok->len);
+      int n = (s != NULL ? json_unescape(tok->ptr, tok->len, s, tok->len) : -1);
+      if (n < 0 || !conf_str_set(sp, s, n)) ctx->result = false;
+      free(s);
       break;
     }
     case CONF_TYPE_OBJECT: {
@@ -195,16 +654,232 @@ void mgos_conf_parse_cb(void *data, const char *name, size_t name_len,
   LOG(LL_DEBUG, ("Set [%s] = [%.*s]", path, (int) tok->len, tok->ptr));
 }
 
+/*
+ * Change subscriptions. Values covered by subscriptions are captured before
+ * a change is applied and compared with the new ones afterwards.
+ */
+struct conf_sub {
+  void *cfg;
+  const struct mgos_conf_entry *schema;
+  /* Entry subscribed to, can be an object. */
+  const struct mgos_conf_entry *e;
+  mgos_conf_change_cb_t cb; /* NULL if removed during dispatch */
+  void *userdata;
+  struct conf_sub *next;
+};
+
+struct conf_watch_entry {
+  const struct mgos_conf_entry *e;
+  union mgos_conf_value old_value;
+};
+
+struct conf_watch {
+  const void *cfg;
+  int num_entries;
+  struct conf_watch_entry *entries;
+};
+
+static struct conf_sub *s_conf_subs = NULL;
+static int s_conf_dispatch_depth = 0;
+
+static bool conf_sub_covers(const struct conf_sub *sub, const void *cfg,
+                            const struct mgos_conf_entry *e) {
+  return (sub->cb != NULL && sub->cfg == cfg && e >= sub->e &&
+          e <= sub->e + sub->e->num_desc);
+}
+
+static union mgos_conf_value conf_get_value(const void *cfg,
+                                            const struct mgos_conf_entry *e) {
+  union mgos_conf_value v;
+  const char *vp = ((const char *) cfg) + e->offset;
+  memset(&v, 0, sizeof(v));
+  switch (e->type) {
+    case CONF_TYPE_INT:
+    case CONF_TYPE_BOOL:
+      v.i = mgos_conf_value_int(cfg, e);
+      break;
+    case CONF_TYPE_DOUBLE:
+      v.d = *((const double *) vp);
+      break;
+    case CONF_TYPE_STRING:
+      v.s = *((const char **) vp);
+      break;
+    case CONF_TYPE_OBJECT:
+      break;
+  }
+  return v;
+}
+
+/* Starts watching values under `obj` in `cfg`, which is a top-level struct. */
+static void conf_watch_begin(struct conf_watch *w, const void *cfg,
+                             const struct mgos_conf_entry *obj) {
+  const struct conf_sub *sub;
+  int i;
+  memset(w, 0, sizeof(*w));
+  w->cfg = cfg;
+  for (sub = s_conf_subs; sub != NULL; sub = sub->next) {
+    if (sub->cb != NULL && sub->cfg == cfg) break;
+  }
+  if (sub == NULL) return;
+  for (i = 0; i <= obj->num_desc; i++) {
+    const struct mgos_conf_entry *e = obj + i;
+    if (e->type == CONF_TYPE_OBJECT) continue;
+    for (sub = s_conf_subs; sub != NULL; sub = sub->next) {
+      if (conf_sub_covers(sub, cfg, e)) break;
+    }
+    if (sub == NULL) continue;
+    struct conf_watch_entry *we = (struct conf_watch_entry *) realloc(
+        w->entries, (w->num_entries + 1) * sizeof(*w->entries));
+    if (we == NULL) break;
+    w->entries = we;
+    we += w->num_entries++;
+    we->e = e;
+    we->old_value = conf_get_value(cfg, e);
+    if (e->type == CONF_TYPE_STRING && we->old_value.s != NULL) {
+      we->old_value.s = strdup(we->old_value.s);
+    }
+  }
+}
+
+/* Appends path of `e` to `path`. */
+static void conf_entry_path(const struct mgos_conf_entry *obj,
+                            const struct mgos_conf_entry *e,
+                            struct mbuf *path) {
+  int i;
+  for (i = 1; i <= obj->num_desc; i++) {
+    const struct mgos_conf_entry *ce = obj + i;
+    if (e >= ce && e <= ce + ce->num_desc) {
+      if (path->len > 0) mbuf_append(path, ".", 1);
+      mbuf_append(path, ce->key, strlen(ce->key));
+      if (ce != e) conf_entry_path(ce, e, path);
+      return;
+    }
+    if (ce->type == CONF_TYPE_OBJECT) i += ce->num_desc;
+  }
+}
+
+static void conf_watch_end(struct conf_watch *w) {
+  struct conf_sub *sub, **psub;
+  int i;
+  s_conf_dispatch_depth++;
+  for (i = 0; i < w->num_entries; i++) {
+    const struct conf_watch_entry *we = &w->entries[i];
+    struct mgos_conf_change ch = {
+        .entry = we->e,
+        .old_value = we->old_value,
+        .new_value = conf_get_value(w->cfg, we->e),
+    };
+    bool changed;
+    switch (we->e->type) {
+      case CONF_TYPE_DOUBLE:
+        changed = (ch.old_value.d != ch.new_value.d);
+        break;
+      case CONF_TYPE_STRING:
+        changed = (strcmp(ch.old_value.s ? ch.old_value.s : "",
+                          ch.new_value.s ? ch.new_value.s : "") != 0);
+        break;
+      default:
+        changed = (ch.old_value.i != ch.new_value.i);
+        break;
+    }
+    if (!changed) continue;
+    struct mbuf path;
+    mbuf_init(&path, 0);
+    for (sub = s_conf_subs; sub != NULL; sub = sub->next) {
+      if (!conf_sub_covers(sub, w->cfg, we->e)) continue;
+      if (path.len == 0) {
+        conf_entry_path(sub->schema, we->e, &path);
+        mbuf_append(&path, "", 1);
+        ch.path = path.buf;
+      }
+      sub->cb(&ch, sub->userdata);
+    }
+    mbuf_free(&path);
+  }
+  for (i = 0; i < w->num_entries; i++) {
+    if (w->entries[i].e->type == CONF_TYPE_STRING) {
+      free((char *) w->entries[i].old_value.s);
+    }
+  }
+  free(w->entries);
+  memset(w, 0, sizeof(*w));
+  if (--s_conf_dispatch_depth > 0) return;
+  /* Remove subscriptions that were cancelled by callbacks. */
+  for (psub = &s_conf_subs; *psub != NULL;) {
+    sub = *psub;
+    if (sub->cb == NULL) {
+      *psub = sub->next;
+      free(sub);
+    } else {
+      psub = &sub->next;
+    }
+  }
+}
+
+bool mgos_conf_subscribe(void *cfg, const struct mgos_conf_entry *schema,
+                         const char *path, mgos_conf_change_cb_t cb,
+                         void *userdata) {
+  const struct mgos_conf_entry *e =
+      (path[0] == '\0' ? schema : mgos_conf_find_schema_entry(path, schema));
+  struct conf_sub *sub, **psub;
+  if (e == NULL || cb == NULL) return false;
+  sub = (struct conf_sub *) calloc(1, sizeof(*sub));
+  if (sub == NULL) return false;
+  sub->cfg = cfg;
+  sub->schema = schema;
+  sub->e = e;
+  sub->cb = cb;
+  sub->userdata = userdata;
+  /* Callbacks are invoked in the order of subscription. */
+  for (psub = &s_conf_subs; *psub != NULL; psub = &(*psub)->next) {
+  }
+  *psub = sub;
+  return true;
+}
+
+bool mgos_conf_unsubscribe(void *cfg, const struct mgos_conf_entry *schema,
+                           const char *path, mgos_conf_change_cb_t cb,
+                           void *userdata) {
+  const struct mgos_conf_entry *e =
+      (path[0] == '\0' ? schema : mgos_conf_find_schema_entry(path, schema));
+  struct conf_sub *sub, **psub;
+  for (psub = &s_conf_subs; *psub != NULL; psub = &(*psub)->next) {
+    sub = *psub;
+    if (sub->cfg != cfg || sub->e != e || sub->cb != cb ||
+        sub->userdata != userdata) {
+      continue;
+    }
+    if (s_conf_dispatch_depth > 0) {
+      sub->cb = NULL;
+    } else {
+      *psub = sub->next;
+      free(sub);
+    }
+    return true;
+  }
+  return false;
+}
+
 static bool mgos_conf_parse_off(const struct mg_str json, const char *acl,
                                 const struct mgos_conf_entry *schema,
                                 int offset_adj, void *cfg) {
+  struct conf_watch w;
   struct parse_ctx ctx = {.schema = schema,
                           .acl = acl,
                           .cfg = cfg,
                           .result = true,
                           .offset_adj = offset_adj};
-  return (json_walk(json.p, json.len, mgos_conf_parse_cb, &ctx) >= 0 &&
-          ctx.result == true);
+#ifndef MGOS_BOOT_BUILD
+  ctx.acl_c = conf_acl_get(mg_mk_str(acl));
+#endif
+  conf_watch_begin(&w, ((char *) cfg) - offset_adj, schema);
+  bool ret = (json_walk(json.p, json.len, mgos_conf_parse_cb, &ctx) >= 0 &&
+              ctx.result == true);
+  conf_watch_end(&w);
+#ifndef MGOS_BOOT_BUILD
+  conf_acl_unref(ctx.acl_c);
+#endif
+  return ret;
 }
 
 bool mgos_conf_parse(const struct mg_str json, const char *acl,
@@ -217,19 +892,76 @@ bool mgos_conf_parse_sub(const struct mg_str json,
   return mgos_conf_parse_off(json, "*", sub_schema, sub_schema->offset, cfg);
 }
 
+#ifndef MGOS_CONF_EMIT_CHUNK_SIZE
+#define MGOS_CONF_EMIT_CHUNK_SIZE 256
+#endif
+
+/*
+ * Streaming output: data is collected in a fixed size buffer, which is passed
+ * to the sink whenever it fills up.
+ */
+struct emit_chunker {
+  char *buf;
+  size_t size, len;
+  mgos_conf_emit_sink_t sink;
+  void *param;
+  bool ok;
+};
+
 struct emit_ctx {
   const void *cfg;
   const void *base;
   bool pretty;
-  struct mbuf *out;
+  struct json_out *out;
+  /* For mgos_conf_emit_cb(): output mbuf, callback after every entry. */
+  struct mbuf *mb;
   mgos_conf_emit_cb_t cb;
   void *cb_param;
+  /* For mgos_conf_emit_stream(). */
+  struct emit_chunker *ch;
 };
 
-static void mgos_emit_indent(struct mbuf *m, int n) {
-  mbuf_append(m, "\n", 1);
-  int j;
-  for (j = 0; j < n; j++) mbuf_append(m, " ", 1);
+static int mgos_conf_emit_chunk_printer(struct json_out *out, const char *buf,
+                                        size_t len) {
+  struct emit_chunker *ch = (struct emit_chunker *) out->u.data;
+  size_t left = len;
+  while (left > 0 && ch->ok) {
+    size_t n = ch->size - ch->len;
+    if (n > left) n = left;
+    memcpy(ch->buf + ch->len, buf, n);
+    ch->len += n;
+    buf += n;
+    left -= n;
+    if (ch->len == ch->size) {
+      ch->ok = ch->sink(ch->buf, ch->len, ch->param);
+      ch->len = 0;
+    }
+  }
+  return len;
+}
+
+static void mgos_emit(struct emit_ctx *ctx, const char *s, size_t len) {
+  ctx->out->printer(ctx->out, s, len);
+}
+
+static void mgos_emit_str(struct emit_ctx *ctx, const char *s) {
+  mgos_emit(ctx, "\"", 1);
+  if (s != NULL) json_escape(ctx->out, s, strlen(s));
+  mgos_emit(ctx, "\"", 1);
+}
+
+static void mgos_emit_indent(struct emit_ctx *ctx, int n) {
+  static const char spaces[] = "                ";
+  mgos_emit(ctx, "\n", 1);
+  while (n > 0) {
+    int len = (n < (int) sizeof(spaces) - 1 ? n : (int) sizeof(spaces) - 1);
+    mgos_emit(ctx, spaces, len);
+    n -= len;
+  }
+}
+
+static bool mgos_emit_aborted(const struct emit_ctx *ctx) {
+  return (ctx->ch != NULL && !ctx->ch->ok);
 }
 
 static bool mgos_conf_value_eq(const void *cfg, const void *base,
@@ -240,7 +972,7 @@ static bool mgos_conf_value_eq(const void *cfg, const void *base,
   switch (e->type) {
     case CONF_TYPE_INT:
     case CONF_TYPE_BOOL:
-      return *((int *) vp) == *((int *) bvp);
+      return mgos_conf_value_int(cfg, e) == mgos_conf_value_int(base, e);
     case CONF_TYPE_DOUBLE:
       return *((double *) vp) == *((double *) bvp);
     case CONF_TYPE_STRING: {
@@ -274,13 +1006,12 @@ static void mgos_conf_emit_entry(struct emit_ctx *ctx,
   int len;
   switch (e->type) {
     case CONF_TYPE_INT: {
-      len = snprintf(buf, sizeof(buf), "%d",
-                     *((int *) (((char *) ctx->cfg) + e->offset)));
-      mbuf_append(ctx->out, buf, len);
+      len = snprintf(buf, sizeof(buf), "%d", mgos_conf_value_int(ctx->cfg, e));
+      mgos_emit(ctx, buf, len);
       break;
     }
     case CONF_TYPE_BOOL: {
-      int v = *((int *) (((char *) ctx->cfg) + e->offset));
+      int v = mgos_conf_value_int(ctx->cfg, e);
       const char *s;
       int len;
       if (v != 0) {
@@ -290,18 +1021,18 @@ static void mgos_conf_emit_entry(struct emit_ctx *ctx,
         s = "false";
         len = 5;
       }
-      mbuf_append(ctx->out, s, len);
+      mgos_emit(ctx, s, len);
       break;
     }
     case CONF_TYPE_DOUBLE: {
       len = snprintf(buf, sizeof(buf), "%lf",
                      *((double *) (((char *) ctx->cfg) + e->offset)));
-      mbuf_append(ctx->out, buf, len);
+      mgos_emit(ctx, buf, len);
       break;
     }
     case CONF_TYPE_STRING: {
       const char *v = *((char **) (((char *) ctx->cfg) + e->offset));
-      mg_json_emit_str(ctx->out, mg_mk_str(v), 1);
+      mgos_emit_str(ctx, v);
       break;
     }
     case CONF_TYPE_OBJECT: {
@@ -314,10 +1045,10 @@ static void mgos_conf_emit_entry(struct emit_ctx *ctx,
 static void mgos_conf_emit_obj(struct emit_ctx *ctx,
                                const struct mgos_conf_entry *schema,
                                int num_entries, int indent) {
-  mbuf_append(ctx->out, "{", 1);
+  mgos_emit(ctx, "{", 1);
   bool first = true;
   int i;
-  for (i = 0; i < num_entries;) {
+  for (i = 0; i < num_entries && !mgos_emit_aborted(ctx);) {
     const struct mgos_conf_entry *e = schema + i;
     if (mgos_conf_value_eq(ctx->cfg, ctx->base, e)) {
       i++;
@@ -327,20 +1058,20 @@ static void mgos_conf_emit_obj(struct emit_ctx *ctx,
       continue;
     }
     if (!first) {
-      mbuf_append(ctx->out, ",", 1);
+      mgos_emit(ctx, ",", 1);
     } else {
       first = false;
     }
-    if (ctx->pretty) mgos_emit_indent(ctx->out, indent);
-    mg_json_emit_str(ctx->out, mg_mk_str(e->key), 1);
-    mbuf_append(ctx->out, ": ", (ctx->pretty ? 2 : 1));
+    if (ctx->pretty) mgos_emit_indent(ctx, indent);
+    mgos_emit_str(ctx, e->key);
+    mgos_emit(ctx, ": ", (ctx->pretty ? 2 : 1));
     mgos_conf_emit_entry(ctx, e, indent);
     i++;
     if (e->type == CONF_TYPE_OBJECT) i += e->num_desc;
-    if (ctx->cb != NULL) ctx->cb(ctx->out, ctx->cb_param);
+    if (ctx->cb != NULL) ctx->cb(ctx->mb, ctx->cb_param);
   }
-  if (ctx->pretty) mgos_emit_indent(ctx->out, indent - 2);
-  mbuf_append(ctx->out, "}", 1);
+  if (ctx->pretty) mgos_emit_indent(ctx, indent - 2);
+  mgos_emit(ctx, "}", 1);
 }
 
 void mgos_conf_emit_cb(const void *cfg, const void *base,
@@ -350,10 +1081,12 @@ void mgos_conf_emit_cb(const void *cfg, const void *base,
   struct mbuf m;
   mbuf_init(&m, 0);
   if (out == NULL) out = &m;
+  struct json_out jout = JSON_OUT_MBUF(out);
   struct emit_ctx ctx = {.cfg = cfg,
                          .base = base,
                          .pretty = pretty,
-                         .out = out,
+                         .out = &jout,
+                         .mb = out,
                          .cb = cb,
                          .cb_param = cb_param};
   mgos_conf_emit_entry(&ctx, schema, 0);
@@ -361,14 +1094,37 @@ void mgos_conf_emit_cb(const void *cfg, const void *base,
   if (out == &m) mbuf_free(out);
 }
 
-void mgos_conf_emit_f_cb(struct mbuf *data, void *param) {
-  FILE **fp = (FILE **) param;
-  if (*fp != NULL && fwrite(data->buf, 1, data->len, *fp) != data->len) {
-    LOG(LL_ERROR, ("Error writing file\n"));
-    fclose(*fp);
-    *fp = NULL;
-  }
-  mbuf_remove(data, data->len);
+bool mgos_conf_emit_stream(const void *cfg, const void *base,
+                           const struct mgos_conf_entry *schema, bool pretty,
+                           size_t chunk_size, mgos_conf_emit_sink_t sink,
+                           void *param) {
+  struct emit_chunker ch = {.size = chunk_size,
+                            .sink = sink,
+                            .param = param,
+                            .ok = true};
+  if (ch.size == 0) ch.size = MGOS_CONF_EMIT_CHUNK_SIZE;
+  ch.buf = (char *) malloc(ch.size);
+  if (ch.buf == NULL) return false;
+  struct json_out jout = {.printer = mgos_conf_emit_chunk_printer,
+                          .u = {.data = &ch}};
+  struct emit_ctx ctx = {.cfg = cfg,
+                         .base = base,
+                         .pretty = pretty,
+                         .out = &jout,
+                         .ch = &ch};
+  mgos_conf_emit_entry(&ctx, schema, 0);
+  if (ch.ok && ch.len > 0) ch.ok = sink(ch.buf, ch.len, param);
+  free(ch.buf);
+  return ch.ok;
+}
+
+bool mgos_conf_emit_json_out_sink(const char *data, size_t len, void *param) {
+  struct json_out *out = (struct json_out *) param;
+  return (out->printer(out, data, len) == (int) len);
+}
+
+static bool mgos_conf_emit_f_sink(const char *data, size_t len, void *param) {
+  return (fwrite(data, 1, len, (FILE *) param) == len);
 }
 
 bool mgos_conf_emit_f(const void *cfg, const void *base,
@@ -379,8 +1135,14 @@ bool mgos_conf_emit_f(const void *cfg, const void *base,
     LOG(LL_ERROR, ("Error opening file for writing\n"));
     return false;
   }
-  mgos_conf_emit_cb(cfg, base, schema, pretty, NULL, mgos_conf_emit_f_cb, &fp);
-  if (fp == NULL) return false;
+  if (!mgos_conf_emit_stream(cfg, base, schema, pretty,
+                             MGOS_CONF_EMIT_CHUNK_SIZE, mgos_conf_emit_f_sink,
+                             fp)) {
+    LOG(LL_ERROR, ("Error writing file\n"));
+    fclose(fp);
+    remove("tmp");
+    return false;
+  }
   if (fclose(fp) != 0) return false;
   remove(fname);
   if (rename("tmp", fname) != 0) {
@@ -390,25 +1152,335 @@ bool mgos_conf_emit_f(const void *cfg, const void *base,
   return true;
 }
 
+/*
+ * Binary snapshot: header, image of the config struct with string pointers
+ * replaced by 1-based offsets into the pool (0 for NULL) and the string pool.
+ */
+#define MGOS_CONF_BIN_MAGIC 0x3242434d /* "MCB2" */
+
+struct mgos_conf_bin_hdr {
+  uint32_t magic;
+  uint32_t schema_hash;
+  uint32_t tag;
+  uint32_t cfg_size;
+  uint32_t pool_size;
+  /* Caller's value, kept outside of the config struct. */
+  int32_t aux;
+  /* CRC32 of aux, the struct image and the pool. */
+  uint32_t crc;
+};
+
+uint32_t mgos_conf_schema_hash(const struct mgos_conf_entry *schema) {
+  uint32_t hash = FNV1A_32_INIT;
+  int i;
+  for (i = 0; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    const uint8_t *p = (const uint8_t *) e->key;
+    uint8_t hdr[6] = {(uint8_t) e->type, (uint8_t)(e->offset >> 8),
+                      (uint8_t) e->offset, (uint8_t)(e->num_desc >> 8),
+                      (uint8_t) e->num_desc, e->storage};
+    size_t j;
+    for (j = 0; j < sizeof(hdr); j++) {
+      hash = (hash ^ hdr[j]) * FNV1A_32_PRIME;
+    }
+    do {
+      hash = (hash ^ *p) * FNV1A_32_PRIME;
+    } while (*p++ != '\0');
+  }
+  return hash;
+}
+
+bool mgos_conf_save_bin(const void *cfg, size_t cfg_size,
+                        const struct mgos_conf_entry *schema, uint32_t tag,
+                        int32_t aux, const char *fname) {
+  bool res = false;
+  struct mgos_conf_bin_hdr hdr;
+  struct mbuf pool;
+  char *image = (char *) malloc(cfg_size);
+  FILE *fp = NULL;
+  int i;
+  mbuf_init(&pool, 0);
+  if (image == NULL) goto out;
+  memcpy(image, cfg, cfg_size);
+  for (i = 1; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    if (e->type != CONF_TYPE_STRING) continue;
+    char **sp = (char **) (image + e->offset);
+    uintptr_t off = 0;
+    if (*sp != NULL) {
+      off = pool.len + 1;
+      mbuf_append(&pool, *sp, strlen(*sp) + 1);
+    }
+    *sp = (char *) off;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = MGOS_CONF_BIN_MAGIC;
+  hdr.schema_hash = mgos_conf_schema_hash(schema);
+  hdr.tag = tag;
+  hdr.cfg_size = cfg_size;
+  hdr.pool_size = pool.len;
+  hdr.aux = aux;
+  hdr.crc = cs_crc32(0, &hdr.aux, sizeof(hdr.aux));
+  hdr.crc = cs_crc32(hdr.crc, image, cfg_size);
+  hdr.crc = cs_crc32(hdr.crc, pool.buf, pool.len);
+  fp = fopen("tmp", "w");
+  if (fp == NULL) {
+    LOG(LL_ERROR, ("Error opening file for writing\n"));
+    goto out;
+  }
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      fwrite(image, cfg_size, 1, fp) != 1 ||
+      (pool.len > 0 && fwrite(pool.buf, pool.len, 1, fp) != 1)) {
+    LOG(LL_ERROR, ("Error writing file\n"));
+    fclose(fp);
+    goto out;
+  }
+  if (fclose(fp) != 0) goto out;
+  remove(fname);
+  if (rename("tmp", fname) != 0) {
+    LOG(LL_ERROR, ("Error renaming file to %s\n", fname));
+    goto out;
+  }
+  res = true;
+out:
+  free(image);
+  mbuf_free(&pool);
+  return res;
+}
+
+bool mgos_conf_load_bin(const char *fname, const struct mgos_conf_entry *schema,
+                        uint32_t tag, void *cfg, size_t cfg_size,
+                        int32_t *aux) {
+  bool res = false;
+  size_t size = 0;
+  struct mgos_conf_bin_hdr hdr;
+  const char *image, *pool;
+  char *data = cs_read_file(fname, &size);
+  int i;
+  if (data == NULL || size < sizeof(hdr)) goto out;
+  memcpy(&hdr, data, sizeof(hdr));
+  if (hdr.magic != MGOS_CONF_BIN_MAGIC || hdr.tag != tag ||
+      hdr.cfg_size != cfg_size ||
+      size != sizeof(hdr) + hdr.cfg_size + hdr.pool_size ||
+      hdr.schema_hash != mgos_conf_schema_hash(schema)) {
+    goto out;
+  }
+  image = data + sizeof(hdr);
+  pool = image + cfg_size;
+  if (hdr.crc != cs_crc32(cs_crc32(0, &hdr.aux, sizeof(hdr.aux)), image,
+                          cfg_size + hdr.pool_size) ||
+      (hdr.pool_size > 0 && pool[hdr.pool_size - 1] != '\0')) {
+    LOG(LL_ERROR, ("%s is corrupted", fname));
+    goto out;
+  }
+  memcpy(cfg, image, cfg_size);
+  for (i = 1; i <= schema->num_desc; i++) {
+    const struct mgos_conf_entry *e = schema + i;
+    if (e->type != CONF_TYPE_STRING) continue;
+    char **sp = (char **) (((char *) cfg) + e->offset);
+    uintptr_t off = (uintptr_t) *sp;
+    *sp = NULL;
+    if (off == 0) continue;
+    if (off > hdr.pool_size ||
+        !conf_str_set(sp, pool + off - 1, strlen(pool + off - 1))) {
+      /* Clear the rest of the pointers before freeing. */
+      for (i++; i <= schema->num_desc; i++) {
+        e = schema + i;
+        if (e->type != CONF_TYPE_STRING) continue;
+        *((char **) (((char *) cfg) + e->offset)) = NULL;
+      }
+      mgos_conf_free(schema, cfg);
+      memset(cfg, 0, cfg_size);
+      goto out;
+    }
+  }
+  if (aux != NULL) *aux = hdr.aux;
+  res = true;
+out:
+  free(data);
+  return res;
+}
+
+/*
+ * Journal: a header (magic and tag) followed by records, each holding a key,
+ * a value in the form accepted by `mgos_config_set()` and a CRC32 of both.
+ */
+#define MGOS_CONF_JOURNAL_MAGIC 0x314a434d /* "MCJ1" */
+
+struct mgos_conf_journal_hdr {
+  uint32_t magic;
+  uint32_t tag;
+};
+
+struct mgos_conf_journal_rec_hdr {
+  uint16_t key_len;
+  uint16_t value_len;
+};
+
+static bool mgos_conf_journal_add_rec(struct mbuf *mb, const struct mg_str key,
+                                      const struct mg_str value) {
+  if (key.len > 0xffff || value.len > 0xffff) return false;
+  struct mgos_conf_journal_rec_hdr rh = {.key_len = (uint16_t) key.len,
+                                         .value_len = (uint16_t) value.len};
+  size_t start = mb->len;
+  uint32_t crc;
+  mbuf_append(mb, &rh, sizeof(rh));
+  mbuf_append(mb, key.p, key.len);
+  mbuf_append(mb, value.p, value.len);
+  crc = cs_crc32(0, mb->buf + start, mb->len - start);
+  mbuf_append(mb, &crc, sizeof(crc));
+  return true;
+}
+
+/*
+ * Adds records for all the values under `obj` that differ from `base`.
+ * Returns number of records added or -1 if a value is too long.
+ */
+static int mgos_conf_journal_add_diff(const void *cfg, const void *base,
+                                      const struct mgos_conf_entry *obj,
+                                      struct mbuf *path, struct mbuf *mb) {
+  int i, num_changed = 0;
+  size_t path_len = path->len;
+  char buf[32];
+  for (i = 1; i <= obj->num_desc; i++) {
+    const struct mgos_conf_entry *e = obj + i;
+    const char *vp = (const char *) cfg + e->offset;
+    struct mg_str value = MG_NULL_STR;
+    if (path_len > 0) mbuf_append(path, ".", 1);
+    mbuf_append(path, e->key, strlen(e->key));
+    switch (e->type) {
+      case CONF_TYPE_INT:
+        snprintf(buf, sizeof(buf), "%d", mgos_conf_value_int(cfg, e));
+        value = mg_mk_str(buf);
+        break;
+      case CONF_TYPE_BOOL:
+        value = mg_mk_str(mgos_conf_value_int(cfg, e) ? "true" : "false");
+        break;
+      case CONF_TYPE_DOUBLE:
+        snprintf(buf, sizeof(buf), "%.17g", *((const double *) vp));
+        value = mg_mk_str(buf);
+        break;
+      case CONF_TYPE_STRING:
+        value = mg_mk_str(*((const char **) vp));
+        break;
+      case CONF_TYPE_OBJECT: {
+        int n = mgos_conf_journal_add_diff(cfg, base, e, path, mb);
+        if (n < 0) return -1;
+        num_changed += n;
+        i += e->num_desc;
+        break;
+      }
+    }
+    if (e->type != CONF_TYPE_OBJECT && !mgos_conf_value_eq(cfg, base, e)) {
+      if (!mgos_conf_journal_add_rec(mb, mg_mk_str_n(path->buf, path->len),
+                                     value)) {
+        return -1;
+      }
+      num_changed++;
+    }
+    path->len = path_len;
+  }
+  return num_changed;
+}
+
+int mgos_conf_journal_append(const void *cfg, const void *base,
+                             const struct mgos_conf_entry *schema, uint32_t tag,
+                             const char *fname) {
+  int num_changed;
+  struct mbuf path, mb;
+  struct stat st;
+  FILE *fp = NULL;
+  mbuf_init(&path, 0);
+  mbuf_init(&mb, 0);
+  if (stat(fname, &st) != 0 || st.st_size == 0) {
+    struct mgos_conf_journal_hdr jh = {.magic = MGOS_CONF_JOURNAL_MAGIC,
+                                       .tag = tag};
+    mbuf_append(&mb, &jh, sizeof(jh));
+  }
+  num_changed = mgos_conf_journal_add_diff(cfg, base, schema, &path, &mb);
+  if (num_changed <= 0) goto out;
+  fp = fopen(fname, "a");
+  if (fp == NULL || fwrite(mb.buf, 1, mb.len, fp) != mb.len) {
+    LOG(LL_ERROR, ("Error writing %s", fname));
+    num_changed = -1;
+  }
+  if (fp != NULL && fclose(fp) != 0) num_changed = -1;
+out:
+  mbuf_free(&path);
+  mbuf_free(&mb);
+  return num_changed;
+}
+
+int mgos_conf_journal_replay(const char *fname, uint32_t tag, const char *acl,
+                             const struct mgos_conf_entry *schema, void *cfg) {
+  int num_applied = 0;
+  size_t size = 0, off;
+  struct mgos_conf_journal_hdr jh;
+  char *acl_copy = NULL, *data = cs_read_file(fname, &size);
+  if (data == NULL) return 0;
+  memcpy(&jh, data, (size < sizeof(jh) ? size : sizeof(jh)));
+  if (size < sizeof(jh) || jh.magic != MGOS_CONF_JOURNAL_MAGIC ||
+      jh.tag != tag) {
+    LOG(LL_INFO, ("%s is stale", fname));
+    num_applied = -1;
+    goto out;
+  }
+  /* Make a temporary copy, in case it gets overridden while loading. */
+  acl_copy = (acl != NULL ? strdup(acl) : NULL);
+  for (off = sizeof(jh); off < size;) {
+    struct mgos_conf_journal_rec_hdr rh;
+    uint32_t crc;
+    if (size - off < sizeof(rh) + sizeof(crc)) break;
+    memcpy(&rh, data + off, sizeof(rh));
+    size_t rec_len = sizeof(rh) + rh.key_len + rh.value_len;
+    if (size - off < rec_len + sizeof(crc)) break;
+    memcpy(&crc, data + off + rec_len, sizeof(crc));
+    if (crc != cs_crc32(0, data + off, rec_len)) break;
+    struct mg_str key = mg_mk_str_n(data + off + sizeof(rh), rh.key_len);
+    struct mg_str value = mg_mk_str_n(key.p + key.len, rh.value_len);
+    off += rec_len + sizeof(crc);
+    if (!mgos_conf_check_access_n(key, mg_mk_str(acl_copy))) {
+      LOG(LL_ERROR, ("Not allowed to set [%.*s]", (int) key.len, key.p));
+      continue;
+    }
+    if (!mgos_config_set(key, value, cfg, schema, true /* free_strings */)) {
+      LOG(LL_ERROR, ("Failed to set [%.*s]", (int) key.len, key.p));
+      continue;
+    }
+    num_applied++;
+  }
+  if (off < size) {
+    /* Most likely the last write was interrupted, drop the garbage. */
+    FILE *fp = fopen("tmp", "w");
+    LOG(LL_WARN, ("%s: invalid record at %d, truncating", fname, (int) off));
+    if (fp != NULL) {
+      bool ok = (fwrite(data, 1, off, fp) == off);
+      if (fclose(fp) == 0 && ok) {
+        remove(fname);
+        rename("tmp", fname);
+      }
+    }
+  }
+out:
+  free(acl_copy);
+  free(data);
+  return num_applied;
+}
+
 void mgos_conf_free(const struct mgos_conf_entry *schema, void *cfg) {
   int i;
   for (i = 1; i <= schema->num_desc; i++) {
     const struct mgos_conf_entry *e = schema + i;
     if (e->type == CONF_TYPE_STRING) {
       char **sp = ((char **) (((char *) cfg) + e->offset));
-      free(*sp);
+      conf_str_free(*sp);
       *sp = NULL;
     }
   }
 }
 
 void mgos_conf_set_str(char **vp, const char *v) {
-  free(*vp);
-  if (v != NULL && *v != '\0') {
-    *vp = strdup(v);
-  } else {
-    *vp = NULL;
-  }
+  conf_str_set(vp, v, (v != NULL ? strlen(v) : 0));
 }
 
 bool mgos_conf_str_empty(const char *s) {
@@ -439,10 +1511,60 @@ const char *mgos_conf_value_string_nonnull(const void *cfg,
 
 int mgos_conf_value_int(const void *cfg, const struct mgos_conf_entry *e) {
   char *vp = (((char *) cfg) + e->offset);
-  if (e->type == CONF_TYPE_INT || e->type == CONF_TYPE_BOOL) {
-    return *((int *) vp);
+  if (e->type != CONF_TYPE_INT && e->type != CONF_TYPE_BOOL) return 0;
+  switch (e->storage) {
+    case CONF_STORAGE_DEFAULT:
+      return *((int *) vp);
+    case CONF_STORAGE_I8:
+      return *((int8_t *) vp);
+    case CONF_STORAGE_U8:
+      return *((uint8_t *) vp);
+    case CONF_STORAGE_I16:
+      return *((int16_t *) vp);
+    case CONF_STORAGE_U16:
+      return *((uint16_t *) vp);
+    default:
+      return (*((uint8_t *) vp) >> (e->storage - CONF_STORAGE_BIT0)) & 1;
+  }
+}
+
+bool mgos_conf_set_value_int(void *cfg, const struct mgos_conf_entry *e,
+                             int v) {
+  char *vp = (((char *) cfg) + e->offset);
+  if (e->type != CONF_TYPE_INT && e->type != CONF_TYPE_BOOL) return false;
+  if (e->range != NULL && (v < e->range->min || v > e->range->max)) {
+    return false;
+  }
+  switch (e->storage) {
+    case CONF_STORAGE_DEFAULT:
+      *((int *) vp) = v;
+      return true;
+    case CONF_STORAGE_I8:
+      if (v < INT8_MIN || v > INT8_MAX) return false;
+      *((int8_t *) vp) = v;
+      return true;
+    case CONF_STORAGE_U8:
+      if (v < 0 || v > UINT8_MAX) return false;
+      *((uint8_t *) vp) = v;
+      return true;
+    case CONF_STORAGE_I16:
+      if (v < INT16_MIN || v > INT16_MAX) return false;
+      *((int16_t *) vp) = v;
+      return true;
+    case CONF_STORAGE_U16:
+      if (v < 0 || v > UINT16_MAX) return false;
+      *((uint16_t *) vp) = v;
+      return true;
+    default: {
+      uint8_t mask = (1 << (e->storage - CONF_STORAGE_BIT0));
+      if (v) {
+        *((uint8_t *) vp) |= mask;
+      } else {
+        *((uint8_t *) vp) &= ~mask;
+      }
+      return true;
+    }
   }
-  return 0;
 }
 
 double mgos_conf_value_double(const void *cfg,
@@ -494,30 +1616,57 @@ out:
   return ret;
 }
 
+bool mgos_config_get_stream(const struct mg_str key, const void *cfg,
+                            const struct mgos_conf_entry *schema,
+                            size_t chunk_size, mgos_conf_emit_sink_t sink,
+                            void *param) {
+  bool ret = false;
+  struct mg_str value = MG_NULL_STR;
+  const struct mgos_conf_entry *e = mgos_conf_find_schema_entry_s(key, schema);
+  if (e == NULL) return false;
+  if (e->type == CONF_TYPE_OBJECT) {
+    return mgos_conf_emit_stream(cfg, NULL /* base */, e, false /* pretty */,
+                                 chunk_size, sink, param);
+  }
+  /* Scalars are short, no point streaming them. */
+  if (!mgos_config_get(key, &value, cfg, schema)) return false;
+  if (chunk_size == 0) chunk_size = MGOS_CONF_EMIT_CHUNK_SIZE;
+  ret = true;
+  for (size_t i = 0; i < value.len && ret; i += chunk_size) {
+    size_t len = value.len - i;
+    if (len > chunk_size) len = chunk_size;
+    ret = sink(value.p + i, len, param);
+  }
+  free((void *) value.p);
+  return ret;
+}
+
 bool mgos_config_set(const struct mg_str key, const struct mg_str value,
                      void *cfg, const struct mgos_conf_entry *schema,
                      bool free_strings) {
   bool ret = false;
   struct mg_str value_nul = MG_NULL_STR;
+  struct conf_watch w;
   const struct mgos_conf_entry *e = mgos_conf_find_schema_entry_s(key, schema);
-  if (e == NULL) goto out;
+  if (e == NULL) return false;
 
+  /* Objects are parsed, which reports the changes. */
+  if (e->type != CONF_TYPE_OBJECT) conf_watch_begin(&w, cfg, e);
   switch (e->type) {
     case CONF_TYPE_INT: {
-      int *vp = (int *) (((char *) cfg) + e->offset);
       char *endptr;
       value_nul = mg_strdup_nul(value);
-      *vp = strtol(value_nul.p, &endptr, 10);
+      int v = strtol(value_nul.p, &endptr, 10);
+      if (!mgos_conf_set_value_int(cfg, e, v)) goto out;
       if (endptr != value_nul.p + value_nul.len) goto out;
       ret = true;
       break;
     }
     case CONF_TYPE_BOOL: {
-      int *vp = (int *) (((char *) cfg) + e->offset);
       if (mg_vcmp(&value, "true") == 0) {
-        *vp = 1;
+        mgos_conf_set_value_int(cfg, e, 1);
       } else if (mg_vcmp(&value, "false") == 0) {
-        *vp = 0;
+        mgos_conf_set_value_int(cfg, e, 0);
       } else {
         goto out;
       }
@@ -535,13 +1684,8 @@ bool mgos_config_set(const struct mg_str key, const struct mg_str value,
     }
     case CONF_TYPE_STRING: {
       char **vp = (char **) (((char *) cfg) + e->offset);
-      if (free_strings) free(*vp);
-      if (value.len > 0) {
-        *vp = (char *) mg_strdup_nul(value).p;
-      } else {
-        *vp = NULL;
-      }
-      ret = true;
+      if (!free_strings) *vp = NULL;
+      ret = conf_str_set(vp, value.p, value.len);
       break;
     }
     case CONF_TYPE_OBJECT: {
@@ -551,6 +1695,7 @@ bool mgos_config_set(const struct mg_str key, const struct mg_str value,
   }
 
 out:
+  if (e->type != CONF_TYPE_OBJECT) conf_watch_end(&w);
   free((void *) value_nul.p);
   return ret;
 }
@@ -16,13 +16,29 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "mgos_event.h"
+#include "mgos_event_internal.h"
 
 #include "common/cs_dbg.h"
 #include "common/queue.h"
 
+#include "frozen.h"
+#include "mgos_mongoose.h"
+#include "mgos_mongoose_internal.h"
+#include "mgos_system.h"
+#include "mgos_time.h"
+
+/*
+ * Handlers are indexed by base event number (`ev & ~0xff`): each base has
+ * a bucket with the list of group handlers and a list of exact event ids,
+ * each with its own chain of handlers. Buckets are kept in an array sorted
+ * by base, so triggering an event only visits handlers that match it.
+ */
+
 struct handler {
   int ev;
 
@@ -35,49 +51,124 @@ struct handler {
    */
   bool group;
 
+  /*
+   * Handlers are invoked newest first. Group and exact handlers live in
+   * separate lists, this is used to merge them in the right order.
+   */
+  uint32_t seq;
+
   SLIST_ENTRY(handler) next;
 };
 
-struct event {
+SLIST_HEAD(handlers, handler);
+
+/* Handlers of a specific event. */
+struct ev_chain {
   int ev;
+  struct handlers handlers;
+  SLIST_ENTRY(ev_chain) next;
+};
+
+struct ev_bucket {
+  int base;
+  /* Name given to mgos_event_register_base(), NULL if not registered. */
   const char *name;
-  SLIST_ENTRY(event) next;
+  struct handlers group_handlers;
+  SLIST_HEAD(ev_chains, ev_chain) chains;
 };
 
-static SLIST_HEAD(s_events, event) s_events = SLIST_HEAD_INITIALIZER(s_events);
-static SLIST_HEAD(s_handlers,
-                  handler) s_handlers = SLIST_HEAD_INITIALIZER(s_handlers);
+/* Sorted by base. Buckets themselves never move, only the pointers do. */
+static struct ev_bucket **s_buckets = NULL;
+static int s_num_buckets = 0;
+static uint32_t s_handler_seq = 0;
 
-bool mgos_event_register_base(int ev, const char *name) {
-  struct event *e;
-  SLIST_FOREACH(e, &s_events, next) {
-    if (e->ev == ev) {
-      LOG(LL_ERROR, ("conflicting event: %s", e->name));
-      return false;
+static int find_bucket_idx(int base, bool *found) {
+  int lo = 0, hi = s_num_buckets;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (s_buckets[mid]->base < base) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
-  e = calloc(1, sizeof(*e));
-  if (e == NULL) return false;
-  e->ev = ev;
-  e->name = name;
-  SLIST_INSERT_HEAD(&s_events, e, next);
+  *found = (lo < s_num_buckets && s_buckets[lo]->base == base);
+  return lo;
+}
+
+static struct ev_bucket *find_bucket(int base) {
+  bool found;
+  int i = find_bucket_idx(base, &found);
+  return (found ? s_buckets[i] : NULL);
+}
+
+static struct ev_bucket *get_bucket(int base) {
+  bool found;
+  int i = find_bucket_idx(base, &found);
+  if (found) return s_buckets[i];
+  struct ev_bucket **buckets = (struct ev_bucket **) realloc(
+      s_buckets, (s_num_buckets + 1) * sizeof(*buckets));
+  if (buckets == NULL) return NULL;
+  s_buckets = buckets;
+  struct ev_bucket *b = (struct ev_bucket *) calloc(1, sizeof(*b));
+  if (b == NULL) return NULL;
+  b->base = base;
+  memmove(&s_buckets[i + 1], &s_buckets[i],
+          (s_num_buckets - i) * sizeof(*s_buckets));
+  s_buckets[i] = b;
+  s_num_buckets++;
+  return b;
+}
+
+static struct ev_chain *find_chain(struct ev_bucket *b, int ev) {
+  struct ev_chain *c;
+  SLIST_FOREACH(c, &b->chains, next) {
+    if (c->ev == ev) break;
+  }
+  return c;
+}
+
+bool mgos_event_register_base(int ev, const char *name) {
+  struct ev_bucket *b = get_bucket(ev & ~0xff);
+  if (b == NULL) return false;
+  if (b->name != NULL) {
+    LOG(LL_ERROR, ("conflicting event: %s", b->name));
+    return false;
+  }
+  b->name = name;
   return true;
 }
 
 static bool add_handler(int ev, mgos_event_handler_t cb, void *userdata,
                         bool group) {
+  struct handlers *hl;
+  struct ev_bucket *b = get_bucket(ev & ~0xff);
+  if (b == NULL) return false;
+  if (group) {
+    hl = &b->group_handlers;
+  } else {
+    struct ev_chain *c = find_chain(b, ev);
+    if (c == NULL) {
+      c = (struct ev_chain *) calloc(1, sizeof(*c));
+      if (c == NULL) return false;
+      c->ev = ev;
+      SLIST_INSERT_HEAD(&b->chains, c, next);
+    }
+    hl = &c->handlers;
+  }
   struct handler *h = calloc(1, sizeof(*h));
   if (h == NULL) return false;
   h->ev = ev;
   h->cb = cb;
   h->userdata = userdata;
   h->group = group;
+  h->seq = ++s_handler_seq;
 
   /* When adding a group handler, make sure `ev` is a base event number */
   if (group) {
     h->ev &= ~0xff;
   }
-  SLIST_INSERT_HEAD(&s_handlers, h, next);
+  SLIST_INSERT_HEAD(hl, h, next);
   return true;
 }
 
@@ -93,20 +184,35 @@ bool mgos_event_add_group_handler(int evgrp, mgos_event_handler_t cb,
 static bool remove_handler(int ev, mgos_event_handler_t cb, void *userdata,
                            bool group) {
   struct handler *ph = NULL, *h = NULL, *th;
-  SLIST_FOREACH_SAFE(h, &s_handlers, next, th) {
-    if (h->ev == ev && h->group == group && h->cb == cb &&
-        h->userdata == userdata) {
+  struct ev_chain *c = NULL;
+  struct handlers *hl;
+  struct ev_bucket *b = find_bucket(ev & ~0xff);
+  if (b == NULL) return false;
+  if (group) {
+    hl = &b->group_handlers;
+  } else {
+    c = find_chain(b, ev);
+    if (c == NULL) return false;
+    hl = &c->handlers;
+  }
+  SLIST_FOREACH_SAFE(h, hl, next, th) {
+    if (h->ev == ev && h->cb == cb && h->userdata == userdata) {
       break;
     }
     ph = h;
   }
   if (h == NULL) return false;
   if (ph == NULL) {
-    SLIST_REMOVE_HEAD(&s_handlers, next);
+    SLIST_REMOVE_HEAD(hl, next);
   } else {
     SLIST_REMOVE_AFTER(ph, next);
   }
   free(h);
+  /* Chain is no longer referenced once it's empty, even by a trigger. */
+  if (c != NULL && SLIST_EMPTY(&c->handlers)) {
+    SLIST_REMOVE(&b->chains, c, ev_chain, next);
+    free(c);
+  }
   return true;
 }
 
@@ -120,15 +226,87 @@ bool mgos_event_remove_group_handler(int evgrp, mgos_event_handler_t cb,
   return remove_handler(evgrp, cb, userdata, true);
 }
 
+#if MGOS_ENABLE_EVENT_TRACE
+static bool s_trace_enabled = false;
+/* Ring of the last `s_trace_size` records, `s_trace_num` written so far. */
+static struct mgos_event_trace_record *s_trace = NULL;
+static uint32_t s_trace_size = 0;
+static uint32_t s_trace_num = 0;
+/* Sorted by event number. */
+static struct mgos_event_stats *s_ev_stats = NULL;
+static int s_num_ev_stats = 0;
+
+static struct mgos_event_stats *get_ev_stats(int ev) {
+  int lo = 0, hi = s_num_ev_stats;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (s_ev_stats[mid].ev < ev) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < s_num_ev_stats && s_ev_stats[lo].ev == ev) return &s_ev_stats[lo];
+  struct mgos_event_stats *evs = (struct mgos_event_stats *) realloc(
+      s_ev_stats, (s_num_ev_stats + 1) * sizeof(*evs));
+  if (evs == NULL) return NULL;
+  s_ev_stats = evs;
+  memmove(&s_ev_stats[lo + 1], &s_ev_stats[lo],
+          (s_num_ev_stats - lo) * sizeof(*s_ev_stats));
+  memset(&s_ev_stats[lo], 0, sizeof(*s_ev_stats));
+  s_ev_stats[lo].ev = ev;
+  s_num_ev_stats++;
+  return &s_ev_stats[lo];
+}
+
+static void trace_event(int ev, int num_handlers, int64_t start, int64_t end) {
+  uint32_t duration = (uint32_t)(end - start);
+  struct mgos_event_trace_record *r = &s_trace[s_trace_num % s_trace_size];
+  r->ts_us = start;
+  r->duration_us = duration;
+  r->ev = ev;
+  r->num_handlers = num_handlers;
+  s_trace_num++;
+  struct mgos_event_stats *evs = get_ev_stats(ev);
+  if (evs == NULL) return;
+  evs->num_triggers++;
+  evs->num_handlers += num_handlers;
+  evs->total_duration_us += duration;
+  if (duration > evs->max_duration_us) evs->max_duration_us = duration;
+}
+#endif /* MGOS_ENABLE_EVENT_TRACE */
+
 int mgos_event_trigger(int ev, void *ev_data) {
-  struct handler *h, *te;
+  struct handler *gh = NULL, *eh = NULL, *h;
   int count = 0;
-  SLIST_FOREACH_SAFE(h, &s_handlers, next, te) {
-    if (h->ev == ev || (h->group && ev >= h->ev && ev <= (h->ev | 0xff))) {
-      h->cb(ev, ev_data, h->userdata);
-      count++;
+  struct ev_bucket *b = find_bucket(ev & ~0xff);
+#if MGOS_ENABLE_EVENT_TRACE
+  const bool traced = s_trace_enabled;
+  const int64_t start = (traced ? mgos_uptime_micros() : 0);
+#endif
+  if (b != NULL) {
+    struct ev_chain *c = find_chain(b, ev);
+    gh = SLIST_FIRST(&b->group_handlers);
+    if (c != NULL) eh = SLIST_FIRST(&c->handlers);
+  }
+  /* Merge the two lists, newest first. Next is fetched before the call. */
+  while (gh != NULL || eh != NULL) {
+    if (eh == NULL || (gh != NULL && gh->seq > eh->seq)) {
+      h = gh;
+      gh = SLIST_NEXT(gh, next);
+    } else {
+      h = eh;
+      eh = SLIST_NEXT(eh, next);
     }
+    h->cb(ev, ev_data, h->userdata);
+    count++;
+  }
+#if MGOS_ENABLE_EVENT_TRACE
+  /* Tracing may have been stopped or restarted by a handler. */
+  if (traced && s_trace_enabled) {
+    trace_event(ev, count, start, mgos_uptime_micros());
   }
+#endif
   if (ev != MGOS_EVENT_LOG) {
     const uint8_t *u = (uint8_t *) &ev;
     LOG(LL_DEBUG,
@@ -137,3 +315,286 @@ int mgos_event_trigger(int ev, void *ev_data) {
   }
   return count;
 }
+
+#if MGOS_ENABLE_EVENT_TRACE
+bool mgos_event_trace_start(int num_records) {
+  struct mgos_event_trace_record *trace;
+  if (num_records <= 0) return false;
+  trace = (struct mgos_event_trace_record *) calloc(num_records,
+                                                    sizeof(*trace));
+  if (trace == NULL) return false;
+  free(s_trace);
+  s_trace = trace;
+  s_trace_size = num_records;
+  s_trace_num = 0;
+  free(s_ev_stats);
+  s_ev_stats = NULL;
+  s_num_ev_stats = 0;
+  s_trace_enabled = true;
+  return true;
+}
+
+void mgos_event_trace_stop(void) {
+  s_trace_enabled = false;
+}
+
+int mgos_event_trace_get_records(struct mgos_event_trace_record *records,
+                                 int max_records) {
+  uint32_t i, n = (s_trace_num < s_trace_size ? s_trace_num : s_trace_size);
+  if (max_records < 0) max_records = 0;
+  if (n > (uint32_t) max_records) n = max_records;
+  for (i = 0; i < n; i++) {
+    records[i] = s_trace[(s_trace_num - n + i) % s_trace_size];
+  }
+  return n;
+}
+
+static int ev_stats_cmp(const void *a, const void *b) {
+  const struct mgos_event_stats *sa = (const struct mgos_event_stats *) a;
+  const struct mgos_event_stats *sb = (const struct mgos_event_stats *) b;
+  if (sa->total_duration_us != sb->total_duration_us) {
+    return (sa->total_duration_us > sb->total_duration_us ? -1 : 1);
+  }
+  return (sa->ev < sb->ev ? -1 : (sa->ev > sb->ev ? 1 : 0));
+}
+
+int mgos_event_get_stats(struct mgos_event_stats *stats, int max_stats) {
+  struct mgos_event_stats *sorted;
+  int n = (s_num_ev_stats < max_stats ? s_num_ev_stats : max_stats);
+  if (n <= 0) return 0;
+  sorted = (struct mgos_event_stats *) malloc(s_num_ev_stats * sizeof(*sorted));
+  if (sorted == NULL) return 0;
+  memcpy(sorted, s_ev_stats, s_num_ev_stats * sizeof(*sorted));
+  qsort(sorted, s_num_ev_stats, sizeof(*sorted), ev_stats_cmp);
+  memcpy(stats, sorted, n * sizeof(*stats));
+  free(sorted);
+  return n;
+}
+
+/* Name is the name of the base followed by the offset, e.g. "MOS+1". */
+static int print_ev_name(struct json_out *out, int ev) {
+  char name[40];
+  struct ev_bucket *b = find_bucket(ev & ~0xff);
+  if (b != NULL && b->name != NULL) {
+    snprintf(name, sizeof(name), "%s+%d", b->name, ev & 0xff);
+  } else {
+    const uint8_t *u = (uint8_t *) &ev;
+    snprintf(name, sizeof(name), "%c%c%c+%d", u[3], u[2], u[1], u[0]);
+  }
+  return json_printf(out, "%Q", name);
+}
+
+int mgos_event_trace_print_chrome(struct json_out *out) {
+  uint32_t i, n = (s_trace_num < s_trace_size ? s_trace_num : s_trace_size);
+  int len = json_printf(out, "{traceEvents: [");
+  for (i = 0; i < n; i++) {
+    const struct mgos_event_trace_record *r =
+        &s_trace[(s_trace_num - n + i) % s_trace_size];
+    len += json_printf(out, "%s{name: ", (i == 0 ? "" : ", "));
+    len += print_ev_name(out, r->ev);
+    len += json_printf(out,
+                       ", cat: %Q, ph: %Q, ts: %lld, dur: %u, pid: 1, tid: 1, "
+                       "args: {ev: %d, handlers: %d}}",
+                       "event", "X", (long long) r->ts_us,
+                       (unsigned) r->duration_us, r->ev, r->num_handlers);
+  }
+  len += json_printf(out, "], displayTimeUnit: %Q}", "ms");
+  return len;
+}
+#endif /* MGOS_ENABLE_EVENT_TRACE */
+
+/*
+ * Posted events go through a bounded MPSC queue: a ring of slots, each with
+ * a sequence number that tells whose turn it is to use the slot. Producers
+ * claim a slot by advancing the tail with CAS, fill it and publish it by
+ * bumping the sequence. The single consumer is a Mongoose poll callback.
+ *
+ * Where atomic operations are not available natively, producers run with
+ * interrupts disabled instead.
+ */
+#ifndef MGOS_EVENT_QUEUE_LOCK_FREE
+#if defined(__GCC_ATOMIC_INT_LOCK_FREE) && __GCC_ATOMIC_INT_LOCK_FREE == 2
+#define MGOS_EVENT_QUEUE_LOCK_FREE 1
+#else
+#define MGOS_EVENT_QUEUE_LOCK_FREE 0
+#endif
+#endif
+
+#if MGOS_EVENT_QUEUE_LOCK_FREE
+#define EQ_LOCK()
+#define EQ_UNLOCK()
+#define EQ_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define EQ_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define EQ_XCHG(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define EQ_CAS(p, e, v) \
+  __atomic_compare_exchange_n((p), (e), (v), true, __ATOMIC_ACQ_REL, \
+                              __ATOMIC_RELAXED)
+#define EQ_INC(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#else
+#define EQ_LOCK() mgos_ints_disable()
+#define EQ_UNLOCK() mgos_ints_enable()
+#define EQ_LOAD(p) (*(volatile __typeof__(*(p)) *) (p))
+#define EQ_STORE(p, v) (*(volatile __typeof__(*(p)) *) (p) = (v))
+#define EQ_INC(p) ((*(p))++)
+static inline uint32_t eq_xchg(volatile uint32_t *p, uint32_t v) {
+  uint32_t old;
+  mgos_ints_disable();
+  old = *p;
+  *p = v;
+  mgos_ints_enable();
+  return old;
+}
+#define EQ_XCHG(p, v) eq_xchg((p), (v))
+/* Only called with interrupts disabled. */
+static inline bool eq_cas(uint32_t *p, uint32_t *e, uint32_t v) {
+  if (*p != *e) {
+    *e = *p;
+    return false;
+  }
+  *p = v;
+  return true;
+}
+#define EQ_CAS(p, e, v) eq_cas((p), (e), (v))
+#endif
+
+struct eq_slot {
+  uint32_t seq;
+  int ev;
+  /* If copied, data is in `data`, otherwise it's `ptr`. */
+  bool copied;
+  void *ptr;
+  mgos_event_data_free_t free_cb;
+  union {
+    uint8_t bytes[MGOS_EVENT_POST_MAX_DATA_SIZE];
+    /* For alignment. */
+    void *p;
+    double d;
+    uint64_t u64;
+  } data;
+};
+
+struct event_queue {
+  uint32_t mask;
+  uint32_t tail;
+  /* Only used by the consumer. */
+  uint32_t head;
+  /* Set when there is a delivery scheduled. */
+  uint32_t pending;
+  struct eq_slot *slots;
+};
+
+static struct event_queue *s_eq = NULL;
+static struct mgos_event_queue_stats s_eq_stats;
+
+static void event_queue_dispatcher(void *arg) {
+  struct event_queue *q = s_eq;
+  uint32_t n = 0;
+  if (EQ_LOAD(&q->pending) == 0) return;
+  /* Events posted from now on will schedule another poll. */
+  EQ_XCHG(&q->pending, 0);
+  /* Limit the batch to one lap, so that producers can't keep us here. */
+  while (n <= q->mask) {
+    struct eq_slot *s = &q->slots[q->head & q->mask];
+    if (EQ_LOAD(&s->seq) != q->head + 1) break;
+    mgos_event_trigger(s->ev, (s->copied ? s->data.bytes : s->ptr));
+    if (s->free_cb != NULL) s->free_cb(s->ptr);
+    /* Slot can be reused on the next lap. */
+    EQ_STORE(&s->seq, q->head + q->mask + 1);
+    q->head++;
+    n++;
+  }
+  if (n == 0) return;
+  s_eq_stats.num_delivered += n;
+  s_eq_stats.num_batches++;
+  if (n > s_eq_stats.max_batch) s_eq_stats.max_batch = n;
+  if (n > q->mask && EQ_XCHG(&q->pending, 1) == 0) {
+    mongoose_schedule_poll(false /* from_isr */);
+  }
+  (void) arg;
+}
+
+static bool event_post(int ev, const void *data, size_t len, void *ptr,
+                       mgos_event_data_free_t free_cb, bool from_isr) {
+  struct event_queue *q = EQ_LOAD(&s_eq);
+  struct eq_slot *s;
+  uint32_t pos;
+  EQ_LOCK();
+  if (q == NULL) goto drop;
+  pos = EQ_LOAD(&q->tail);
+  for (;;) {
+    s = &q->slots[pos & q->mask];
+    int32_t diff = (int32_t)(EQ_LOAD(&s->seq) - pos);
+    if (diff == 0) {
+      /* Slot is free, try to claim it. On failure, pos is updated. */
+      if (EQ_CAS(&q->tail, &pos, pos + 1)) break;
+    } else if (diff < 0) {
+      /* Consumer has not released the slot yet, i.e. the queue is full. */
+      goto drop;
+    } else {
+      /* Slot has been claimed by another producer. */
+      pos = EQ_LOAD(&q->tail);
+    }
+  }
+  s->ev = ev;
+  s->copied = (data != NULL);
+  if (s->copied) memcpy(s->data.bytes, data, len);
+  s->ptr = ptr;
+  s->free_cb = free_cb;
+  EQ_STORE(&s->seq, pos + 1);
+  EQ_INC(&s_eq_stats.num_posted);
+  EQ_UNLOCK();
+  if (EQ_XCHG(&q->pending, 1) == 0) {
+    mongoose_schedule_poll(from_isr);
+  }
+  return true;
+
+drop:
+  EQ_INC(&s_eq_stats.num_dropped);
+  EQ_UNLOCK();
+  return false;
+}
+
+bool mgos_event_post(int ev, const void *ev_data, size_t ev_data_len,
+                     bool from_isr) {
+  if (ev_data_len > MGOS_EVENT_POST_MAX_DATA_SIZE) {
+    EQ_LOCK();
+    EQ_INC(&s_eq_stats.num_too_large);
+    EQ_UNLOCK();
+    return false;
+  }
+  return event_post(ev, ev_data, ev_data_len, NULL, NULL, from_isr);
+}
+
+bool mgos_event_post_ptr(int ev, void *ev_data, mgos_event_data_free_t free_cb,
+                         bool from_isr) {
+  return event_post(ev, NULL, 0, ev_data, free_cb, from_isr);
+}
+
+void mgos_event_get_queue_stats(struct mgos_event_queue_stats *stats) {
+  /* Producer counters may be updated concurrently. */
+  stats->num_posted = EQ_LOAD(&s_eq_stats.num_posted);
+  stats->num_delivered = s_eq_stats.num_delivered;
+  stats->num_dropped = EQ_LOAD(&s_eq_stats.num_dropped);
+  stats->num_too_large = EQ_LOAD(&s_eq_stats.num_too_large);
+  stats->num_batches = s_eq_stats.num_batches;
+  stats->max_batch = s_eq_stats.max_batch;
+}
+
+bool mgos_event_queue_init(int queue_len) {
+  struct event_queue *q;
+  uint32_t i, num_slots = 1;
+  if (queue_len <= 0 || s_eq != NULL) return true;
+  while (num_slots < (uint32_t) queue_len) num_slots <<= 1;
+  q = (struct event_queue *) calloc(1, sizeof(*q));
+  if (q == NULL) return false;
+  q->slots = (struct eq_slot *) calloc(num_slots, sizeof(*q->slots));
+  if (q->slots == NULL) {
+    free(q);
+    return false;
+  }
+  q->mask = num_slots - 1;
+  for (i = 0; i < num_slots; i++) q->slots[i].seq = i;
+  mgos_add_poll_cb(event_queue_dispatcher, NULL);
+  EQ_STORE(&s_eq, q);
+  return true;
+}
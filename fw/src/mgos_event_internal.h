@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CS_FW_SRC_MGOS_EVENT_INTERNAL_H_
+#define CS_FW_SRC_MGOS_EVENT_INTERNAL_H_
+
+#include <stdbool.h>
+
+#include "mgos_event.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * Create the queue for events posted with `mgos_event_post()`, with room
+ * for at least `queue_len` events, and start delivering them.
+ * If `queue_len` is 0, posting events is disabled.
+ */
+bool mgos_event_queue_init(int queue_len);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* CS_FW_SRC_MGOS_EVENT_INTERNAL_H_ */
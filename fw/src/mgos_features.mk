@@ -1,6 +1,8 @@
 MGOS_ENABLE_BITBANG ?= 1
+MGOS_ENABLE_CONFIG_SNAPSHOT ?= 1
 MGOS_ENABLE_DEBUG_UDP ?= 1
 MGOS_ENABLE_SYS_SERVICE ?= 1
+MGOS_ENABLE_EVENT_TRACE ?= 0
 
 MGOS_DEBUG_UART ?= 0
 MGOS_EARLY_DEBUG_LEVEL ?= LL_INFO
@@ -23,8 +25,18 @@ ifeq "$(MGOS_ENABLE_BITBANG)" "1"
   MGOS_FEATURES += -DMGOS_ENABLE_BITBANG
 endif
 
+ifeq "$(MGOS_ENABLE_CONFIG_SNAPSHOT)" "1"
+  MGOS_FEATURES += -DMGOS_ENABLE_CONFIG_SNAPSHOT
+endif
+
+ifeq "$(MGOS_ENABLE_EVENT_TRACE)" "1"
+  MGOS_FEATURES += -DMGOS_ENABLE_EVENT_TRACE
+endif
+
 # Export all the feature switches.
 # This is required for needed make invocations (i.e. ESP32 IDF)
 export MGOS_ENABLE_BITBANG
+export MGOS_ENABLE_CONFIG_SNAPSHOT
 export MGOS_ENABLE_DEBUG_UDP
 export MGOS_ENABLE_SYS_SERVICE
+export MGOS_ENABLE_EVENT_TRACE
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "common/cs_crc32.h"
 #include "common/cs_dbg.h"
 #include "common/cs_file.h"
 #include "common/json_utils.h"
@@ -30,12 +31,14 @@
 #include "mgos_config_util.h"
 #include "mgos_debug.h"
 #include "mgos_debug_hal.h"
+#include "mgos_event_internal.h"
 #include "mgos_features.h"
 #include "mgos_gpio.h"
 #include "mgos_hal.h"
 #include "mgos_init.h"
 #include "mgos_mongoose.h"
 #include "mgos_ro_vars.h"
+#include "mgos_timers_internal.h"
 #include "mgos_utils.h"
 #include "mgos_vfs.h"
 
@@ -50,6 +53,12 @@
 
 #define CONF_FILE_TRY_SUFFIX ".try"
 
+/* Changes made to CONF_USER_FILE since it was last written. */
+#define CONF_JOURNAL_FILE "conf9.journal"
+
+/* Binary snapshot of the config loaded from all the files above. */
+#define CONF_SNAPSHOT_FILE "conf.bin"
+
 /* Must be provided externally, usually auto-generated. */
 extern const char *build_id;
 extern const char *build_timestamp;
@@ -115,6 +124,136 @@ static bool load_config_defaults_internal(struct mgos_config *cfg,
   return true;
 }
 
+#if MGOS_ENABLE_CONFIG_SNAPSHOT
+/* Updates `crc` with contents of `fname`, returns false if it can't be read. */
+static bool file_crc32(const char *fname, uint32_t *crc) {
+  char buf[128];
+  size_t n;
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) return false;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    *crc = cs_crc32(*crc, buf, n);
+  }
+  fclose(fp);
+  return true;
+}
+
+/*
+ * Snapshot is tagged with firmware build id and sizes and CRCs of all the
+ * config files, so a file replaced behind our back (e.g. by `mos put`)
+ * invalidates it. Modification times are not used: SPIFFS does not keep them.
+ * Returns false if there are files that only JSON loader knows how to handle:
+ * pending .try files or legacy user config.
+ */
+static bool config_snapshot_tag(uint32_t *tag) {
+  int i;
+  struct stat st;
+  char fname[sizeof(CONF_USER_FILE) + sizeof(CONF_FILE_TRY_SUFFIX)];
+  uint32_t crc = cs_crc32(0, build_id, strlen(build_id));
+  if (stat(CONF_USER_FILE_OLD, &st) == 0) return false;
+  for (i = 0; i <= MGOS_CONFIG_LEVEL_USER + 2; i++) {
+    int32_t size = -1;
+    if (i <= MGOS_CONFIG_LEVEL_USER) {
+      memcpy(fname, CONF_USER_FILE CONF_FILE_TRY_SUFFIX, sizeof(fname));
+      fname[CONF_USER_FILE_NUM_IDX] = '0' + i;
+      if (stat(fname, &st) == 0) return false;
+      fname[sizeof(CONF_USER_FILE) - 1] = '\0';
+    } else if (i == MGOS_CONFIG_LEVEL_USER + 1) {
+      memcpy(fname, CONF_VENDOR_FILE, sizeof(CONF_VENDOR_FILE));
+    } else {
+      memcpy(fname, CONF_JOURNAL_FILE, sizeof(CONF_JOURNAL_FILE));
+    }
+    if (stat(fname, &st) == 0 && file_crc32(fname, &crc)) {
+      size = (int32_t) st.st_size;
+    }
+    crc = cs_crc32(crc, &size, sizeof(size));
+  }
+  *tag = crc;
+  return true;
+}
+
+/*
+ * Snapshot includes user settings, so factory reset GPIO from the defaults
+ * is saved alongside: user must not be able to override it.
+ */
+static void save_config_snapshot(const struct mgos_config *cfg,
+                                 int factory_reset_gpio) {
+  uint32_t tag;
+  if (!config_snapshot_tag(&tag)) return;
+  if (!mgos_conf_save_bin(cfg, sizeof(*cfg), mgos_config_schema(), tag,
+                          factory_reset_gpio, CONF_SNAPSHOT_FILE)) {
+    LOG(LL_ERROR, ("Failed to save %s", CONF_SNAPSHOT_FILE));
+    remove(CONF_SNAPSHOT_FILE);
+  }
+}
+
+static bool load_config_snapshot(uint32_t tag, struct mgos_config *cfg,
+                                 int *factory_reset_gpio) {
+  int32_t gpio = -1;
+  memset(cfg, 0, sizeof(*cfg));
+  if (!mgos_conf_load_bin(CONF_SNAPSHOT_FILE, mgos_config_schema(), tag, cfg,
+                          sizeof(*cfg), &gpio)) {
+    return false;
+  }
+  *factory_reset_gpio = gpio;
+  LOG(LL_INFO, ("Loaded %s", CONF_SNAPSHOT_FILE));
+  return true;
+}
+#endif /* MGOS_ENABLE_CONFIG_SNAPSHOT */
+
+/* Journal applies to a particular version of CONF_USER_FILE. */
+static uint32_t user_config_file_crc(void) {
+  size_t size = 0;
+  char *data = cs_read_file(CONF_USER_FILE, &size);
+  uint32_t crc = (data != NULL ? cs_crc32(0, data, size) : 0);
+  free(data);
+  return crc;
+}
+
+/*
+ * Loads user settings on top of defaults in `cfg`: CONF_USER_FILE (or its
+ * trial version) and the journal of changes made to it since it was written.
+ */
+static void load_user_config(struct mgos_config *cfg, bool delete_try) {
+  struct stat st;
+  /* Both are subject to the same ACL. */
+  char *acl = (cfg->conf_acl != NULL ? strdup(cfg->conf_acl) : NULL);
+  bool is_try = (stat(CONF_USER_FILE CONF_FILE_TRY_SUFFIX, &st) == 0);
+  load_config_file(CONF_USER_FILE, acl, true /* check_try */, delete_try,
+                   cfg);
+  /* Trial config is complete, journal does not apply to it. */
+  if (!is_try && stat(CONF_JOURNAL_FILE, &st) == 0) {
+    LOG(LL_INFO, ("Loading %s", CONF_JOURNAL_FILE));
+    if (mgos_conf_journal_replay(CONF_JOURNAL_FILE, user_config_file_crc(),
+                                 acl, mgos_config_schema(), cfg) < 0) {
+      remove(CONF_JOURNAL_FILE);
+    }
+  }
+  free(acl);
+}
+
+/*
+ * Appends changes made since the last save to the journal. `base` contains
+ * defaults and is brought up to date.
+ * Returns false if CONF_USER_FILE needs to be written instead.
+ */
+static bool save_config_journal(const struct mgos_config *cfg,
+                                struct mgos_config *base) {
+  struct stat st;
+  int max_size = cfg->sys.conf_journal_max_size, n;
+  load_user_config(base, false /* delete_try */);
+  n = mgos_conf_journal_append(cfg, base, mgos_config_schema(),
+                               user_config_file_crc(), CONF_JOURNAL_FILE);
+  if (n < 0) return false;
+  /*
+   * Time to merge. Journal is up to date, so if we crash before it is
+   * removed, replaying it on top of the new file will do no harm.
+   */
+  if (stat(CONF_JOURNAL_FILE, &st) == 0 && st.st_size > max_size) return false;
+  LOG(LL_INFO, ("Saved %d changes to %s", n, CONF_JOURNAL_FILE));
+  return true;
+}
+
 bool load_config_defaults(struct mgos_config *cfg) {
   return load_config_defaults_internal(cfg, true /* check_try */,
                                        false /* delete_try */);
@@ -149,11 +288,39 @@ bool mgos_sys_config_save(const struct mgos_config *cfg, bool try_once,
     fname = CONF_USER_FILE;
     /* Delete stale try file that may be there. */
     remove(try_fname);
+    if (cfg->sys.conf_journal_max_size > 0) {
+      if (save_config_journal(cfg, defaults)) {
+        result = true;
+        goto clean;
+      }
+      /* Start over, the whole file will be written. */
+      mgos_conf_free(mgos_config_schema(), defaults);
+      if (!load_config_defaults_internal(defaults, true /* check_try */,
+                                         false /* delete_try */)) {
+        *msg = strdup("failed to load defaults");
+        goto clean;
+      }
+    }
   }
   if (mgos_conf_emit_f(cfg, defaults, mgos_config_schema(), true /* pretty */,
                        fname)) {
     LOG(LL_INFO, ("Saved to %s", fname));
+    if (!try_once) remove(CONF_JOURNAL_FILE);
     result = true;
+#if MGOS_ENABLE_CONFIG_SNAPSHOT
+    /*
+     * Apply user settings the same way they will be applied on boot,
+     * so that ACL is respected, and take a snapshot of the result.
+     */
+    if (!try_once) {
+      int factory_reset_gpio = defaults->debug.factory_reset_gpio;
+      if (load_config_file(CONF_USER_FILE, defaults->conf_acl,
+                           false /* check_try */, false /* delete_try */,
+                           defaults)) {
+        save_config_snapshot(defaults, factory_reset_gpio);
+      }
+    }
+#endif
   } else {
     *msg = strdup("failed to write file");
   }
@@ -180,6 +347,8 @@ void mgos_config_reset(int level) {
       LOG(LL_INFO, ("Removed %s", fname));
     }
   }
+  if (level <= MGOS_CONFIG_LEVEL_USER) remove(CONF_JOURNAL_FILE);
+  remove(CONF_SNAPSHOT_FILE);
 }
 
 static int load_config_file(const char *filename, const char *acl,
@@ -232,8 +401,18 @@ clean:
 void mbedtls_debug_set_threshold(int threshold);
 
 enum mgos_init_result mgos_sys_config_init(void) {
+  bool from_snapshot = false;
+  int factory_reset_gpio = -1;
+#if MGOS_ENABLE_CONFIG_SNAPSHOT
+  uint32_t tag = 0;
+  /* If there are pending changes, snapshot will be taken on next boot. */
+  const bool save_snapshot = config_snapshot_tag(&tag);
+  from_snapshot = save_snapshot && load_config_snapshot(tag, &mgos_sys_config,
+                                                        &factory_reset_gpio);
+#endif
   /* Load system defaults - mandatory */
-  if (!load_config_defaults_internal(&mgos_sys_config, true /* check_try */,
+  if (!from_snapshot &&
+      !load_config_defaults_internal(&mgos_sys_config, true /* check_try */,
                                      true /* delete_try */)) {
     LOG(LL_ERROR, ("Failed to load config defaults"));
     return MGOS_INIT_CONFIG_LOAD_DEFAULTS_FAILED;
@@ -243,28 +422,51 @@ enum mgos_init_result mgos_sys_config_init(void) {
    * Check factory reset GPIO. We intentionally do it before loading
    * CONF_USER_FILE
    * so that it cannot be overridden by the end user.
+   * Snapshot already has user settings applied, pin comes from its header.
    */
-  if (mgos_sys_config_get_debug_factory_reset_gpio() >= 0) {
-    int gpio = mgos_sys_config_get_debug_factory_reset_gpio();
+  if (!from_snapshot) {
+    factory_reset_gpio = mgos_sys_config_get_debug_factory_reset_gpio();
+  }
+  if (factory_reset_gpio >= 0) {
+    const int gpio = factory_reset_gpio;
     mgos_gpio_set_mode(gpio, MGOS_GPIO_MODE_INPUT);
     mgos_gpio_set_pull(gpio, MGOS_GPIO_PULL_UP);
     if (mgos_gpio_read(gpio) == 0) {
       LOG(LL_WARN, ("Factory reset requested via GPIO%d", gpio));
+      bool removed = (remove(CONF_JOURNAL_FILE) == 0);
       if (remove(CONF_USER_FILE) == 0) {
         LOG(LL_WARN, ("Removed %s", CONF_USER_FILE));
+        removed = true;
+      }
+      if (removed) {
+        /* Snapshot includes user settings, start over. */
+        if (from_snapshot) {
+          mgos_conf_free(mgos_config_schema(), &mgos_sys_config);
+          from_snapshot = false;
+          if (!load_config_defaults_internal(&mgos_sys_config,
+                                             true /* check_try */,
+                                             true /* delete_try */)) {
+            return MGOS_INIT_CONFIG_LOAD_DEFAULTS_FAILED;
+          }
+        }
       }
       /* Continue as if nothing happened, no reboot necessary. */
     }
   }
 
-  struct stat st;
-  if (stat(CONF_USER_FILE_OLD, &st) == 0) {
-    rename(CONF_USER_FILE_OLD, CONF_USER_FILE);
+  if (!from_snapshot) {
+    struct stat st;
+    if (stat(CONF_USER_FILE_OLD, &st) == 0) {
+      rename(CONF_USER_FILE_OLD, CONF_USER_FILE);
+    }
+    /* Successfully loaded system config. Try overrides - they are optional. */
+    load_user_config(&mgos_sys_config, true /* delete_try */);
+#if MGOS_ENABLE_CONFIG_SNAPSHOT
+    if (save_snapshot) {
+      save_config_snapshot(&mgos_sys_config, factory_reset_gpio);
+    }
+#endif
   }
-  /* Successfully loaded system config. Try overrides - they are optional. */
-  load_config_file(CONF_USER_FILE, mgos_sys_config_get_conf_acl(),
-                   true /* check_try */, true /* delete_try */,
-                   &mgos_sys_config);
 
   s_initialized = true;
 
@@ -332,6 +534,14 @@ enum mgos_init_result mgos_sys_config_init(void) {
   mgos_wdt_set_timeout(mgos_sys_config_get_sys_wdt_timeout());
   mgos_wdt_set_feed_on_poll(true);
 
+  if (!mgos_timers_reserve(mgos_sys_config_get_sys_sw_timers_pool_size())) {
+    return MGOS_INIT_OUT_OF_MEMORY;
+  }
+
+  if (!mgos_event_queue_init(mgos_sys_config_get_sys_event_queue_len())) {
+    return MGOS_INIT_OUT_OF_MEMORY;
+  }
+
 #if MG_ENABLE_HEXDUMP
   mgos_get_mgr()->hexdump_file =
       mgos_sys_config_get_debug_mg_mgr_hexdump_file();
@@ -384,3 +594,15 @@ bool mgos_sys_config_parse_sub(const struct mg_str json, const char *section,
   }
   return mgos_conf_parse_sub(json, sub_schema, cfg);
 }
+
+bool mgos_sys_config_subscribe(const char *path, mgos_conf_change_cb_t cb,
+                               void *userdata) {
+  return mgos_conf_subscribe(&mgos_sys_config, mgos_config_schema(), path, cb,
+                             userdata);
+}
+
+bool mgos_sys_config_unsubscribe(const char *path, mgos_conf_change_cb_t cb,
+                                 void *userdata) {
+  return mgos_conf_unsubscribe(&mgos_sys_config, mgos_config_schema(), path,
+                               cb, userdata);
+}
@@ -17,7 +17,7 @@
 
 #include "mgos_timers_internal.h"
 
-#include "common/queue.h"
+#include "frozen.h"
 
 #include "mgos_event.h"
 #include "mgos_features.h"
@@ -28,116 +28,567 @@
 
 #define MGOS_SW_TIMER_MASK 0xffff0000
 
+/*
+ * Software timer ID is a handle: the low bits are an index into the slot
+ * table and the high bits are the slot's generation, which is bumped every
+ * time the slot is released. This lets us reject stale and bogus IDs without
+ * scanning. Generation is never 0, so a valid ID always has some of the
+ * MGOS_SW_TIMER_MASK bits set and never clashes with a HW timer ID.
+ * Free slots are reused in FIFO order, so that generations advance evenly
+ * and a timer that is re-armed over and over does not wrap one of them.
+ */
+#define MGOS_SW_TIMER_SLOT_BITS 20
+#define MGOS_SW_TIMER_MAX_SLOTS (1 << MGOS_SW_TIMER_SLOT_BITS)
+#define MGOS_SW_TIMER_SLOT_MASK (MGOS_SW_TIMER_MAX_SLOTS - 1)
+#define MGOS_SW_TIMER_MAX_GEN 0xfff
+#define MGOS_SW_TIMER_MIN_SLOTS 16
+
+/* Timer records are allocated in chunks of at least this many. */
+#ifndef MGOS_SW_TIMER_POOL_CHUNK_SIZE
+#define MGOS_SW_TIMER_POOL_CHUNK_SIZE 16
+#endif
+
 #ifndef IRAM
 #define IRAM
 #endif
 
+/*
+ * Timers are scheduled on the monotonic uptime clock, in microseconds, so
+ * that wall clock changes do not affect them. Wall clock is only used to
+ * tell Mongoose when to wake us up.
+ *
+ * Every active timer is on two heaps: one ordered by the earliest time it may
+ * fire (next_invocation) and one ordered by the latest (deadline, which is
+ * next_invocation + slack). We wake up at the earliest deadline and then fire
+ * everything that is allowed to run by then, so timers with overlapping
+ * windows share a wakeup.
+ */
+enum timer_heap {
+  TIMER_HEAP_NEXT = 0,
+  TIMER_HEAP_DEADLINE = 1,
+  TIMER_HEAP_MAX,
+};
+
 struct timer_info {
   int interval_ms;
-  double next_invocation;
+  int slack_ms;
+  int64_t next_invocation;
+  int64_t deadline;
   timer_callback cb;
   void *cb_arg;
-  LIST_ENTRY(timer_info) entries;
+  int heap_idx[TIMER_HEAP_MAX];
+  int slot;
+  struct timer_info *next_free; /* Pool free list link. */
+  /* Instrumentation data, only updated when enabled. */
+  uint32_t num_calls;
+  uint32_t max_lateness_us;
+  uint32_t max_duration_us;
+};
+
+struct timer_pool_chunk {
+  struct timer_pool_chunk *next;
+  struct timer_info items[];
+};
+
+struct timer_slot {
+  struct timer_info *ti; /* NULL if the slot is free. */
+  uint16_t gen;
+  int next_free;
 };
 
 struct timer_data {
-  struct timer_info *current;
   struct mg_connection *nc;
-  LIST_HEAD(timers, timer_info) timers;
+  /* Both heaps hold all the active timers and have num_slots entries. */
+  struct timer_info **heaps[TIMER_HEAP_MAX];
+  int heap_len;
+  struct timer_slot *slots;
+  int num_slots;
+  /* Head and tail of the free slot list, -1 if there are none. */
+  int free_slot, free_slot_tail;
+  /*
+   * Timer records are never returned to the heap, so steady state timer
+   * churn does not allocate.
+   */
+  struct timer_pool_chunk *chunks;
+  struct timer_info *free_ti;
+  struct mgos_timer_stats stats;
+  bool instr_enabled;
+  struct mgos_timer_instr instr;
 };
 
 static struct timer_data *s_timer_data = NULL;
 static struct mgos_rlock_type *s_timer_data_lock = NULL;
 
+static inline int64_t timer_key(const struct timer_info *ti, int h) {
+  return (h == TIMER_HEAP_NEXT ? ti->next_invocation : ti->deadline);
+}
+
+static inline void heap_set(struct timer_data *td, int h, int i,
+                            struct timer_info *ti) {
+  td->heaps[h][i] = ti;
+  ti->heap_idx[h] = i;
+}
+
+static void heap_sift_up(struct timer_data *td, int h, int i) {
+  struct timer_info **heap = td->heaps[h];
+  struct timer_info *ti = heap[i];
+  const int64_t key = timer_key(ti, h);
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!(key < timer_key(heap[parent], h))) break;
+    heap_set(td, h, i, heap[parent]);
+    i = parent;
+  }
+  heap_set(td, h, i, ti);
+}
+
+static void heap_sift_down(struct timer_data *td, int h, int i) {
+  struct timer_info **heap = td->heaps[h];
+  struct timer_info *ti = heap[i];
+  const int64_t key = timer_key(ti, h);
+  while (true) {
+    int child = 2 * i + 1;
+    if (child >= td->heap_len) break;
+    if (child + 1 < td->heap_len &&
+        timer_key(heap[child + 1], h) < timer_key(heap[child], h)) {
+      child++;
+    }
+    if (!(timer_key(heap[child], h) < key)) break;
+    heap_set(td, h, i, heap[child]);
+    i = child;
+  }
+  heap_set(td, h, i, ti);
+}
+
+static void heap_push(struct timer_data *td, struct timer_info *ti) {
+  int i = td->heap_len++;
+  for (int h = 0; h < TIMER_HEAP_MAX; h++) {
+    heap_set(td, h, i, ti);
+    heap_sift_up(td, h, i);
+  }
+}
+
+static void heap_remove(struct timer_data *td, struct timer_info *ti) {
+  td->heap_len--;
+  for (int h = 0; h < TIMER_HEAP_MAX; h++) {
+    struct timer_info *last = td->heaps[h][td->heap_len];
+    if (last != ti) {
+      heap_set(td, h, ti->heap_idx[h], last);
+      heap_sift_up(td, h, last->heap_idx[h]);
+      heap_sift_down(td, h, last->heap_idx[h]);
+    }
+    ti->heap_idx[h] = -1;
+  }
+}
+
+/* Restore heap order after the timer's invocation time or slack changed. */
+static void heap_update(struct timer_data *td, struct timer_info *ti) {
+  ti->deadline = ti->next_invocation + (int64_t) ti->slack_ms * 1000;
+  for (int h = 0; h < TIMER_HEAP_MAX; h++) {
+    heap_sift_up(td, h, ti->heap_idx[h]);
+    heap_sift_down(td, h, ti->heap_idx[h]);
+  }
+}
+
+static bool timer_pool_grow(struct timer_data *td, int n) {
+  struct timer_pool_chunk *c = (struct timer_pool_chunk *) calloc(
+      1, sizeof(*c) + n * sizeof(struct timer_info));
+  if (c == NULL) return false;
+  c->next = td->chunks;
+  td->chunks = c;
+  for (int i = n - 1; i >= 0; i--) {
+    c->items[i].next_free = td->free_ti;
+    td->free_ti = &c->items[i];
+  }
+  td->stats.pool_size += n;
+  return true;
+}
+
+static struct timer_info *timer_alloc(struct timer_data *td) {
+  if (td->free_ti == NULL &&
+      !timer_pool_grow(td, MGOS_SW_TIMER_POOL_CHUNK_SIZE)) {
+    return NULL;
+  }
+  struct timer_info *ti = td->free_ti;
+  td->free_ti = ti->next_free;
+  memset(ti, 0, sizeof(*ti));
+  if (++td->stats.pool_used > td->stats.pool_max_used) {
+    td->stats.pool_max_used = td->stats.pool_used;
+  }
+  return ti;
+}
+
+static void timer_free(struct timer_data *td, struct timer_info *ti) {
+  ti->next_free = td->free_ti;
+  td->free_ti = ti;
+  td->stats.pool_used--;
+}
+
+static bool timer_slots_grow(struct timer_data *td, int min_slots) {
+  int i, n = (td->num_slots > 0 ? td->num_slots * 2 : MGOS_SW_TIMER_MIN_SLOTS);
+  if (n < min_slots) n = min_slots;
+  if (n > MGOS_SW_TIMER_MAX_SLOTS) n = MGOS_SW_TIMER_MAX_SLOTS;
+  if (n <= td->num_slots) return false;
+  struct timer_slot *slots =
+      (struct timer_slot *) realloc(td->slots, n * sizeof(*slots));
+  if (slots == NULL) return false;
+  td->slots = slots;
+  for (i = 0; i < TIMER_HEAP_MAX; i++) {
+    struct timer_info **heap =
+        (struct timer_info **) realloc(td->heaps[i], n * sizeof(*heap));
+    if (heap == NULL) return false;
+    td->heaps[i] = heap;
+  }
+  for (i = td->num_slots; i < n; i++) {
+    slots[i].ti = NULL;
+    slots[i].gen = 1;
+    slots[i].next_free = (i + 1 < n ? i + 1 : -1);
+  }
+  if (td->free_slot_tail >= 0) {
+    slots[td->free_slot_tail].next_free = td->num_slots;
+  } else {
+    td->free_slot = td->num_slots;
+  }
+  td->free_slot_tail = n - 1;
+  td->num_slots = n;
+  return true;
+}
+
+static mgos_timer_id timer_id(struct timer_data *td, struct timer_info *ti) {
+  return ((mgos_timer_id) td->slots[ti->slot].gen << MGOS_SW_TIMER_SLOT_BITS) |
+         ti->slot;
+}
+
+static mgos_timer_id timer_add(struct timer_data *td, struct timer_info *ti) {
+  if (td->free_slot < 0 && !timer_slots_grow(td, 0)) {
+    return MGOS_INVALID_TIMER_ID;
+  }
+  struct timer_slot *s = &td->slots[td->free_slot];
+  ti->slot = td->free_slot;
+  td->free_slot = s->next_free;
+  if (td->free_slot < 0) td->free_slot_tail = -1;
+  s->ti = ti;
+  ti->deadline = ti->next_invocation + (int64_t) ti->slack_ms * 1000;
+  heap_push(td, ti);
+  return timer_id(td, ti);
+}
+
+static struct timer_info *timer_find(struct timer_data *td, mgos_timer_id id) {
+  int slot = (int) (id & MGOS_SW_TIMER_SLOT_MASK);
+  if (slot >= td->num_slots) return NULL;
+  struct timer_slot *s = &td->slots[slot];
+  if (s->ti == NULL || s->gen != (id >> MGOS_SW_TIMER_SLOT_BITS)) return NULL;
+  return s->ti;
+}
+
+static void timer_remove(struct timer_data *td, struct timer_info *ti) {
+  struct timer_slot *s = &td->slots[ti->slot];
+  heap_remove(td, ti);
+  s->ti = NULL;
+  s->gen = (s->gen < MGOS_SW_TIMER_MAX_GEN ? s->gen + 1 : 1);
+  s->next_free = -1;
+  if (td->free_slot_tail >= 0) {
+    td->slots[td->free_slot_tail].next_free = ti->slot;
+  } else {
+    td->free_slot = ti->slot;
+  }
+  td->free_slot_tail = ti->slot;
+}
+
 static void schedule_next_timer(struct timer_data *td) {
-  struct timer_info *ti;
-  struct timer_info *min_ti = NULL;
-  LIST_FOREACH(ti, &td->timers, entries) {
-    if (min_ti == NULL || ti->next_invocation < min_ti->next_invocation) {
-      min_ti = ti;
+  if (td->heap_len == 0) {
+    td->nc->ev_timer_time = 0;
+    return;
+  }
+  const int64_t delay =
+      td->heaps[TIMER_HEAP_DEADLINE][0]->deadline - mgos_uptime_micros();
+  td->nc->ev_timer_time = mg_time() + (delay > 0 ? delay / 1000000.0 : 0);
+}
+
+/* Bucket i counts values in [2^(i-1), 2^i), the last one takes the rest. */
+static void instr_hist_add(uint32_t *hist, uint32_t v) {
+  int i = 0;
+  while (v > 0 && i < MGOS_TIMER_INSTR_NUM_BUCKETS - 1) {
+    v >>= 1;
+    i++;
+  }
+  hist[i]++;
+}
+
+static inline void instr_max(uint32_t *m, uint32_t v) {
+  if (v > *m) *m = v;
+}
+
+static void instr_record(struct timer_data *td, mgos_timer_id id,
+                         timer_callback cb, uint32_t lateness,
+                         uint32_t duration) {
+  struct mgos_timer_instr *instr = &td->instr;
+  struct mgos_timer_cb_instr *e = NULL;
+  int i;
+  instr_hist_add(instr->lateness_hist, lateness);
+  instr_hist_add(instr->duration_hist, duration);
+  /* Timer may have been cleared by its callback. */
+  struct timer_info *ti = timer_find(td, id);
+  if (ti != NULL) {
+    ti->num_calls++;
+    instr_max(&ti->max_lateness_us, lateness);
+    instr_max(&ti->max_duration_us, duration);
+  }
+  if (cb == NULL) return;
+  /*
+   * Slowest callbacks are kept sorted by max duration. If the callback is not
+   * there, it takes the place of the last one, if it is slower.
+   */
+  for (i = 0; i < MGOS_TIMER_INSTR_TOP_N; i++) {
+    if (instr->slowest[i].cb == cb) break;
+  }
+  if (i == MGOS_TIMER_INSTR_TOP_N) {
+    i = MGOS_TIMER_INSTR_TOP_N - 1;
+    if (instr->slowest[i].cb != NULL &&
+        instr->slowest[i].max_duration_us >= duration) {
+      return;
     }
+    memset(&instr->slowest[i], 0, sizeof(instr->slowest[i]));
+    instr->slowest[i].cb = cb;
+  }
+  e = &instr->slowest[i];
+  e->num_calls++;
+  instr_max(&e->max_lateness_us, lateness);
+  instr_max(&e->max_duration_us, duration);
+  for (; i > 0; i--) {
+    struct mgos_timer_cb_instr tmp = instr->slowest[i - 1];
+    if (tmp.cb != NULL && tmp.max_duration_us >= e->max_duration_us) break;
+    instr->slowest[i - 1] = *e;
+    *e = tmp;
+    e = &instr->slowest[i - 1];
   }
-  td->current = min_ti;
-  td->nc->ev_timer_time = (min_ti != NULL ? min_ti->next_invocation : 0);
 }
 
 static void mgos_timer_ev(struct mg_connection *nc, int ev, void *ev_data,
                           void *user_data) {
   if (ev != MG_EV_TIMER) return;
-  timer_callback cb = NULL;
-  void *cb_arg = NULL;
-  {
-    mgos_rlock(s_timer_data_lock);
-    struct timer_data *td = (struct timer_data *) user_data;
-    struct timer_info *ti = td->current;
-    /* Current can be NULL if it was the first to fire but was cleared. */
-    if (ti != NULL) {
-      cb = ti->cb;
-      cb_arg = ti->cb_arg;
-      if (ti->interval_ms >= 0) {
-        const double now = mg_time();
-        const double intvl = (ti->interval_ms / 1000.0);
-        ti->next_invocation += intvl;
-        /* Polling loop was delayed, re-sync the invocation. */
-        if (ti->next_invocation < now) ti->next_invocation = now + intvl;
-        ti = NULL;
-      } else {
-        LIST_REMOVE(ti, entries);
+  struct timer_data *td = (struct timer_data *) user_data;
+  mgos_rlock(s_timer_data_lock);
+  const int64_t now = mgos_uptime_micros();
+  /*
+   * Fire everything that is due. Timers (re)armed by the callbacks wait for
+   * the next wakeup, which also guarantees that we terminate.
+   */
+  int max_fire = td->heap_len;
+  td->stats.num_wakeups++;
+  while (max_fire-- > 0 && td->heap_len > 0) {
+    struct timer_info *ti = td->heaps[TIMER_HEAP_NEXT][0];
+    if (ti->next_invocation > now) break;
+    timer_callback cb = ti->cb;
+    void *cb_arg = ti->cb_arg;
+    /*
+     * RUN_NOW timers are scheduled at 0: they are never late and the next
+     * invocation is counted from now, not from 0.
+     */
+    const int64_t scheduled =
+        (ti->next_invocation > 0 ? ti->next_invocation : now);
+    const mgos_timer_id id = timer_id(td, ti);
+    if (ti->interval_ms >= 0) {
+      const int64_t intvl = (int64_t) ti->interval_ms * 1000;
+      ti->next_invocation = scheduled + intvl;
+      /* Polling loop was delayed, re-sync the invocation. */
+      if (ti->next_invocation < now) {
+        td->stats.num_resyncs++;
+        if (intvl > 0) {
+          td->stats.num_skipped += (now - ti->next_invocation) / intvl + 1;
+        }
+        ti->next_invocation = now + intvl;
       }
+      heap_update(td, ti);
+    } else {
+      timer_remove(td, ti);
+      timer_free(td, ti);
     }
-    schedule_next_timer(td);
+    td->stats.num_fired++;
+    const bool instr = td->instr_enabled;
     mgos_runlock(s_timer_data_lock);
-    if (ti != NULL) free(ti);
+    if (instr) {
+      const int64_t start = mgos_uptime_micros();
+      if (cb != NULL) cb(cb_arg);
+      const int64_t end = mgos_uptime_micros();
+      mgos_rlock(s_timer_data_lock);
+      instr_record(td, id, cb, (uint32_t)(start - scheduled),
+                   (uint32_t)(end - start));
+    } else {
+      if (cb != NULL) cb(cb_arg);
+      mgos_rlock(s_timer_data_lock);
+    }
   }
-  if (cb != NULL) cb(cb_arg);
+  schedule_next_timer(td);
+  mgos_runlock(s_timer_data_lock);
   (void) ev_data;
   (void) nc;
 }
 
 mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
                              void *arg) {
-  struct timer_info *ti = (struct timer_info *) calloc(1, sizeof(*ti));
-  if (ti == NULL) return MGOS_INVALID_TIMER_ID;
+  mgos_timer_id id = MGOS_INVALID_TIMER_ID;
+  mgos_rlock(s_timer_data_lock);
+  struct timer_info *ti = timer_alloc(s_timer_data);
+  if (ti == NULL) goto out;
   if (flags & MGOS_TIMER_REPEAT) {
     ti->interval_ms = msecs;
   } else {
     ti->interval_ms = -1;
   }
   if (flags & MGOS_TIMER_RUN_NOW) {
-    ti->next_invocation = 1;
+    ti->next_invocation = 0;
   } else {
-    ti->next_invocation = mg_time() + msecs / 1000.0;
+    ti->next_invocation = mgos_uptime_micros() + (int64_t) msecs * 1000;
   }
   ti->cb = cb;
   ti->cb_arg = arg;
-  {
-    mgos_rlock(s_timer_data_lock);
-    LIST_INSERT_HEAD(&s_timer_data->timers, ti, entries);
+  id = timer_add(s_timer_data, ti);
+  if (id == MGOS_INVALID_TIMER_ID) {
+    timer_free(s_timer_data, ti);
+    goto out;
+  }
+  schedule_next_timer(s_timer_data);
+out:
+  mgos_runlock(s_timer_data_lock);
+  if (id != MGOS_INVALID_TIMER_ID) {
+    mongoose_schedule_poll(false /* from_isr */);
+  }
+  return id;
+}
+
+bool mgos_timers_reserve(int num_timers) {
+  bool res = true;
+  mgos_rlock(s_timer_data_lock);
+  struct timer_data *td = s_timer_data;
+  int n = num_timers - (int) td->stats.pool_size;
+  if (n > 0) res = timer_pool_grow(td, n);
+  if (res && num_timers > td->num_slots) {
+    res = timer_slots_grow(td, num_timers);
+  }
+  mgos_runlock(s_timer_data_lock);
+  return res;
+}
+
+bool mgos_set_timer_slack(mgos_timer_id id, int slack_ms) {
+  if (slack_ms < 0 || !(id & MGOS_SW_TIMER_MASK)) return false;
+  mgos_rlock(s_timer_data_lock);
+  struct timer_info *ti = timer_find(s_timer_data, id);
+  if (ti != NULL) {
+    ti->slack_ms = slack_ms;
+    heap_update(s_timer_data, ti);
     schedule_next_timer(s_timer_data);
-    mgos_runlock(s_timer_data_lock);
   }
-  mongoose_schedule_poll(false /* from_isr */);
-  return (mgos_timer_id) ti;
+  mgos_runlock(s_timer_data_lock);
+  return (ti != NULL);
 }
 
-static void mgos_clear_sw_timer(mgos_timer_id id) {
-  struct timer_info *ti = (struct timer_info *) id, *ti2;
+void mgos_get_timer_stats(struct mgos_timer_stats *stats) {
+  mgos_rlock(s_timer_data_lock);
+  *stats = s_timer_data->stats;
+  mgos_runlock(s_timer_data_lock);
+}
+
+void mgos_timers_set_instr_enabled(bool enable) {
   mgos_rlock(s_timer_data_lock);
-  LIST_FOREACH(ti2, &s_timer_data->timers, entries) {
-    if (ti2 == ti) break;
+  s_timer_data->instr_enabled = enable;
+  mgos_runlock(s_timer_data_lock);
+}
+
+void mgos_timers_get_instr(struct mgos_timer_instr *instr) {
+  mgos_rlock(s_timer_data_lock);
+  *instr = s_timer_data->instr;
+  mgos_runlock(s_timer_data_lock);
+}
+
+bool mgos_timers_get_timer_instr(mgos_timer_id id,
+                                 struct mgos_timer_cb_instr *instr) {
+  if (!(id & MGOS_SW_TIMER_MASK)) return false;
+  mgos_rlock(s_timer_data_lock);
+  struct timer_info *ti = timer_find(s_timer_data, id);
+  if (ti != NULL) {
+    instr->cb = ti->cb;
+    instr->num_calls = ti->num_calls;
+    instr->max_lateness_us = ti->max_lateness_us;
+    instr->max_duration_us = ti->max_duration_us;
   }
-  if (ti2 == NULL) {
+  mgos_runlock(s_timer_data_lock);
+  return (ti != NULL);
+}
+
+void mgos_timers_reset_instr(void) {
+  struct timer_data *td = s_timer_data;
+  mgos_rlock(s_timer_data_lock);
+  memset(&td->instr, 0, sizeof(td->instr));
+  for (int i = 0; i < td->heap_len; i++) {
+    struct timer_info *ti = td->heaps[TIMER_HEAP_NEXT][i];
+    ti->num_calls = ti->max_lateness_us = ti->max_duration_us = 0;
+  }
+  mgos_runlock(s_timer_data_lock);
+}
+
+static int print_hist(struct json_out *out, va_list *ap) {
+  const uint32_t *hist = va_arg(*ap, const uint32_t *);
+  int len = json_printf(out, "[");
+  for (int i = 0; i < MGOS_TIMER_INSTR_NUM_BUCKETS; i++) {
+    len += json_printf(out, "%s%u", (i > 0 ? ", " : ""), (unsigned) hist[i]);
+  }
+  return len + json_printf(out, "]");
+}
+
+static int print_slowest(struct json_out *out, va_list *ap) {
+  const struct mgos_timer_cb_instr *slowest =
+      va_arg(*ap, const struct mgos_timer_cb_instr *);
+  int len = json_printf(out, "[");
+  for (int i = 0; i < MGOS_TIMER_INSTR_TOP_N && slowest[i].cb != NULL; i++) {
+    const struct mgos_timer_cb_instr *e = &slowest[i];
+    char addr[20];
+    snprintf(addr, sizeof(addr), "%p", (void *) (uintptr_t) e->cb);
+    len += json_printf(out,
+                       "%s{cb: %Q, num_calls: %u, max_lateness_us: %u, "
+                       "max_duration_us: %u}",
+                       (i > 0 ? ", " : ""), addr, (unsigned) e->num_calls,
+                       (unsigned) e->max_lateness_us,
+                       (unsigned) e->max_duration_us);
+  }
+  return len + json_printf(out, "]");
+}
+
+int mgos_timers_print_instr(struct json_out *out) {
+  struct mgos_timer_stats st;
+  struct mgos_timer_instr instr;
+  bool enabled;
+  mgos_rlock(s_timer_data_lock);
+  st = s_timer_data->stats;
+  instr = s_timer_data->instr;
+  enabled = s_timer_data->instr_enabled;
+  mgos_runlock(s_timer_data_lock);
+  return json_printf(
+      out,
+      "{enabled: %B, num_fired: %u, num_resyncs: %u, num_skipped: %u, "
+      "lateness_hist: %M, duration_hist: %M, slowest: %M}",
+      enabled, (unsigned) st.num_fired,
+      (unsigned) st.num_resyncs, (unsigned) st.num_skipped, print_hist,
+      instr.lateness_hist, print_hist, instr.duration_hist, print_slowest,
+      instr.slowest);
+}
+
+static void mgos_clear_sw_timer(mgos_timer_id id) {
+  mgos_rlock(s_timer_data_lock);
+  struct timer_info *ti = timer_find(s_timer_data, id);
+  if (ti == NULL) {
     /* Not a valid timer */
     mgos_runlock(s_timer_data_lock);
     return;
   }
-  LIST_REMOVE(ti, entries);
-  if (s_timer_data->current == ti) {
+  bool was_first = (ti->heap_idx[TIMER_HEAP_DEADLINE] == 0);
+  timer_remove(s_timer_data, ti);
+  if (was_first) {
     schedule_next_timer(s_timer_data);
     /* Removing a timer can only push back invocation, no need to do a poll. */
   }
+  timer_free(s_timer_data, ti);
   mgos_runlock(s_timer_data_lock);
-  free(ti);
 }
 
 void mgos_clear_hw_timer(mgos_timer_id id);
@@ -152,23 +603,26 @@ IRAM void mgos_clear_timer(mgos_timer_id id) {
   }
 }
 
+/*
+ * Timers themselves are not affected by the wall clock, but the wakeup time
+ * we gave to Mongoose is.
+ */
 static void mgos_time_change_cb(int ev, void *evd, void *arg) {
   struct timer_data *td = (struct timer_data *) arg;
-  struct mgos_time_changed_arg *ev_data = (struct mgos_time_changed_arg *) evd;
   mgos_rlock(s_timer_data_lock);
-  struct timer_info *ti;
-  LIST_FOREACH(ti, &td->timers, entries) {
-    ti->next_invocation += ev_data->delta;
-  }
+  schedule_next_timer(td);
   mgos_runlock(s_timer_data_lock);
 
   (void) ev;
+  (void) evd;
 }
 
 enum mgos_init_result mgos_hw_timers_init(void);
 
 enum mgos_init_result mgos_timers_init(void) {
   struct timer_data *td = (struct timer_data *) calloc(1, sizeof(*td));
+  if (td == NULL) return MGOS_INIT_TIMERS_INIT_FAILED;
+  td->free_slot = td->free_slot_tail = -1;
   struct mg_add_sock_opts opts;
   memset(&opts, 0, sizeof(opts));
   td->nc =
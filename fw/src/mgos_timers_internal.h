@@ -16,6 +16,12 @@ extern "C" {
 
 enum mgos_init_result mgos_timers_init(void);
 
+/*
+ * Make sure there is room for at least `num_timers` software timers,
+ * so that they can be created without allocating memory.
+ */
+bool mgos_timers_reserve(int num_timers);
+
 /* Initialize uptime */
 void mgos_uptime_init(void);
 
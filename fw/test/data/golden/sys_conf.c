@@ -7,8 +7,8 @@
 #include <stddef.h>
 #include "sys_conf.h"
 
-const struct mgos_conf_entry sys_conf_schema_[26] = {
-  {.type = CONF_TYPE_OBJECT, .key = "", .offset = 0, .num_desc = 25},
+const struct mgos_conf_entry sys_conf_schema_[27] = {
+  {.type = CONF_TYPE_OBJECT, .key = "", .offset = 0, .num_desc = 26},
   {.type = CONF_TYPE_OBJECT, .key = "wifi", .offset = offsetof(struct sys_conf, wifi), .num_desc = 8},
   {.type = CONF_TYPE_OBJECT, .key = "sta", .offset = offsetof(struct sys_conf, wifi.sta), .num_desc = 2},
   {.type = CONF_TYPE_STRING, .key = "ssid", .offset = offsetof(struct sys_conf, wifi.sta.ssid)},
@@ -22,11 +22,12 @@ const struct mgos_conf_entry sys_conf_schema_[26] = {
   {.type = CONF_TYPE_OBJECT, .key = "http", .offset = offsetof(struct sys_conf, http), .num_desc = 2},
   {.type = CONF_TYPE_BOOL, .key = "enable", .offset = offsetof(struct sys_conf, http.enable)},
   {.type = CONF_TYPE_INT, .key = "port", .offset = offsetof(struct sys_conf, http.port)},
-  {.type = CONF_TYPE_OBJECT, .key = "debug", .offset = offsetof(struct sys_conf, debug), .num_desc = 4},
+  {.type = CONF_TYPE_OBJECT, .key = "debug", .offset = offsetof(struct sys_conf, debug), .num_desc = 5},
   {.type = CONF_TYPE_INT, .key = "level", .offset = offsetof(struct sys_conf, debug.level)},
   {.type = CONF_TYPE_STRING, .key = "dest", .offset = offsetof(struct sys_conf, debug.dest)},
   {.type = CONF_TYPE_DOUBLE, .key = "test_d1", .offset = offsetof(struct sys_conf, debug.test_d1)},
   {.type = CONF_TYPE_DOUBLE, .key = "test_d2", .offset = offsetof(struct sys_conf, debug.test_d2)},
+  {.type = CONF_TYPE_INT, .key = "factory_reset_gpio", .offset = offsetof(struct sys_conf, debug.factory_reset_gpio)},
   {.type = CONF_TYPE_OBJECT, .key = "test", .offset = offsetof(struct sys_conf, test), .num_desc = 6},
   {.type = CONF_TYPE_OBJECT, .key = "bar", .offset = offsetof(struct sys_conf, test.bar), .num_desc = 2},
   {.type = CONF_TYPE_BOOL, .key = "enable", .offset = offsetof(struct sys_conf, test.bar.enable)},
@@ -36,7 +37,67 @@ const struct mgos_conf_entry sys_conf_schema_[26] = {
   {.type = CONF_TYPE_INT, .key = "param1", .offset = offsetof(struct sys_conf, test.bar1.param1)},
 };
 
+static const struct mgos_conf_index_entry sys_conf_schema_index_entries_[27] = {
+  {.hash = 0x811c9dc5, .parent = 0},
+  {.hash = 0x07286448, .parent = 0},
+  {.hash = 0xcc4e752c, .parent = 1},
+  {.hash = 0x80ad8679, .parent = 2},
+  {.hash = 0x085d67f7, .parent = 2},
+  {.hash = 0x159dcdfb, .parent = 1},
+  {.hash = 0xaab9a820, .parent = 5},
+  {.hash = 0x7de65572, .parent = 5},
+  {.hash = 0x2ef58bee, .parent = 5},
+  {.hash = 0x1bbdc9fa, .parent = 5},
+  {.hash = 0xa9f37ed7, .parent = 0},
+  {.hash = 0xc96448a5, .parent = 0},
+  {.hash = 0x9cb5555a, .parent = 11},
+  {.hash = 0xa447c712, .parent = 11},
+  {.hash = 0x5864ed98, .parent = 0},
+  {.hash = 0xd3330af0, .parent = 14},
+  {.hash = 0x24612c52, .parent = 14},
+  {.hash = 0x3eb5feb8, .parent = 14},
+  {.hash = 0x41b60371, .parent = 14},
+  {.hash = 0x4208588e, .parent = 14},
+  {.hash = 0xafd071e5, .parent = 0},
+  {.hash = 0x38f8af7e, .parent = 20},
+  {.hash = 0xcb4bf2ef, .parent = 21},
+  {.hash = 0x0434a8d0, .parent = 21},
+  {.hash = 0xfe7bf95d, .parent = 20},
+  {.hash = 0x3c22beb2, .parent = 24},
+  {.hash = 0xcb08edf5, .parent = 24},
+};
+
+static const uint16_t sys_conf_schema_by_hash_[26] = {
+  23, 1, 4, 5, 9, 16, 8, 21, 25, 17, 18, 19, 14, 7, 3, 12,
+  13, 10, 6, 20, 11, 26, 22, 2, 15, 24,
+};
+
+static const char sys_conf_str_defaults_[] =
+  "192.168.4.200" "\0"
+  "Elduderino" "\0"
+  "FW_XXXXXX" "\0"
+  "uart1" "\0";
+
+static const uint16_t sys_conf_str_default_offsets_[4] = {
+  0, 14, 25, 35,
+};
+
+static const struct mgos_conf_index sys_conf_schema_index_ = {
+  .schema = sys_conf_schema_,
+  .entries = sys_conf_schema_index_entries_,
+  .by_hash = sys_conf_schema_by_hash_,
+  .str_defaults = sys_conf_str_defaults_,
+  .str_defaults_size = 41,
+  .str_default_offsets = sys_conf_str_default_offsets_,
+  .num_str_defaults = 4,
+};
+
 const struct mgos_conf_entry *sys_conf_schema() {
+  static bool s_index_added = false;
+  if (!s_index_added) {
+    mgos_conf_add_index(&sys_conf_schema_index_);
+    s_index_added = true;
+  }
   return sys_conf_schema_;
 }
 
@@ -98,6 +159,9 @@ double      sys_conf_get_debug_test_d1(struct sys_conf *cfg) {
 double      sys_conf_get_debug_test_d2(struct sys_conf *cfg) {
   return cfg->debug.test_d2;
 }
+int         sys_conf_get_debug_factory_reset_gpio(struct sys_conf *cfg) {
+  return cfg->debug.factory_reset_gpio;
+}
 const struct sys_conf_test *sys_conf_get_test(struct sys_conf *cfg) {
   return &cfg->test;
 }
@@ -161,6 +225,9 @@ void sys_conf_set_debug_test_d1(struct sys_conf *cfg, double      val) {
 void sys_conf_set_debug_test_d2(struct sys_conf *cfg, double      val) {
   cfg->debug.test_d2 = val;
 }
+void sys_conf_set_debug_factory_reset_gpio(struct sys_conf *cfg, int         val) {
+  cfg->debug.factory_reset_gpio = val;
+}
 void sys_conf_set_test_bar_enable(struct sys_conf *cfg, int         val) {
   cfg->test.bar.enable = val;
 }
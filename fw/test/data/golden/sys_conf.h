@@ -39,6 +39,7 @@ struct sys_conf_debug {
   char *dest;
   double test_d1;
   double test_d2;
+  int factory_reset_gpio;
 };
 
 struct sys_conf_test_bar {
@@ -99,6 +100,8 @@ const char *sys_conf_get_debug_dest(struct sys_conf *cfg);
 double      sys_conf_get_debug_test_d1(struct sys_conf *cfg);
 #define SYS_CONF_HAVE_DEBUG_TEST_D2
 double      sys_conf_get_debug_test_d2(struct sys_conf *cfg);
+#define SYS_CONF_HAVE_DEBUG_FACTORY_RESET_GPIO
+int         sys_conf_get_debug_factory_reset_gpio(struct sys_conf *cfg);
 #define SYS_CONF_HAVE_TEST
 const struct sys_conf_test *sys_conf_get_test(struct sys_conf *cfg);
 #define SYS_CONF_HAVE_TEST_BAR
@@ -127,6 +130,7 @@ void sys_conf_set_debug_level(struct sys_conf *cfg, int         val);
 void sys_conf_set_debug_dest(struct sys_conf *cfg, const char *val);
 void sys_conf_set_debug_test_d1(struct sys_conf *cfg, double      val);
 void sys_conf_set_debug_test_d2(struct sys_conf *cfg, double      val);
+void sys_conf_set_debug_factory_reset_gpio(struct sys_conf *cfg, int         val);
 void sys_conf_set_test_bar_enable(struct sys_conf *cfg, int         val);
 void sys_conf_set_test_bar_param1(struct sys_conf *cfg, int         val);
 void sys_conf_set_test_bar1_enable(struct sys_conf *cfg, int         val);
@@ -174,6 +178,8 @@ static inline const char *sys_conf_global_get_debug_dest(void) { return sys_conf
 static inline double      sys_conf_global_get_debug_test_d1(void) { return sys_conf_get_debug_test_d1(&sys_conf_global); }
 #define SYS_CONF_GLOBAL_HAVE_DEBUG_TEST_D2
 static inline double      sys_conf_global_get_debug_test_d2(void) { return sys_conf_get_debug_test_d2(&sys_conf_global); }
+#define SYS_CONF_GLOBAL_HAVE_DEBUG_FACTORY_RESET_GPIO
+static inline int         sys_conf_global_get_debug_factory_reset_gpio(void) { return sys_conf_get_debug_factory_reset_gpio(&sys_conf_global); }
 #define SYS_CONF_GLOBAL_HAVE_TEST
 static inline const struct sys_conf_test *sys_conf_global_get_test(void) { return sys_conf_get_test(&sys_conf_global); }
 #define SYS_CONF_GLOBAL_HAVE_TEST_BAR
@@ -202,6 +208,7 @@ static inline void sys_conf_global_set_debug_level(int         val) { sys_conf_s
 static inline void sys_conf_global_set_debug_dest(const char *val) { sys_conf_set_debug_dest(&sys_conf_global, val); }
 static inline void sys_conf_global_set_debug_test_d1(double      val) { sys_conf_set_debug_test_d1(&sys_conf_global, val); }
 static inline void sys_conf_global_set_debug_test_d2(double      val) { sys_conf_set_debug_test_d2(&sys_conf_global, val); }
+static inline void sys_conf_global_set_debug_factory_reset_gpio(int         val) { sys_conf_set_debug_factory_reset_gpio(&sys_conf_global, val); }
 static inline void sys_conf_global_set_test_bar_enable(int         val) { sys_conf_set_test_bar_enable(&sys_conf_global, val); }
 static inline void sys_conf_global_set_test_bar_param1(int         val) { sys_conf_set_test_bar_param1(&sys_conf_global, val); }
 static inline void sys_conf_global_set_test_bar1_enable(int         val) { sys_conf_set_test_bar1_enable(&sys_conf_global, val); }
@@ -3,14 +3,29 @@
  * All rights reserved
  */
 
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "cs_dbg.h"
 #include "cs_file.h"
+#include "ubjserializer.h"
+#include "ubjson.h"
 
 #include "frozen.h"
 
 #include "mgos_config_util.h"
+#include "mgos_event_internal.h"
 #include "mgos_event.h"
+#include "mgos_mongoose.h"
+#include "mgos_system.h"
+#include "mgos_time.h"
+#include "mgos_timers_internal.h"
 
+#include "bench_conf.h"
+#include "packed_conf.h"
 #include "sys_conf.h"
 #include "test_main.h"
 #include "test_util.h"
@@ -46,12 +61,783 @@ static const char *test_config(void) {
   ASSERT(conf.wifi.ap.pass == NULL); /* Reset string - set to NULL */
   ASSERT_EQ(conf.http.enable, 0);    /* Override boolean */
 
+  mgos_conf_free(schema, &conf);
   free(json1);
   free(json2);
 
   return NULL;
 }
 
+#define MAX_CONF_PATHS 1000
+static char *s_conf_paths[MAX_CONF_PATHS];
+static const struct mgos_conf_entry *s_conf_entries[MAX_CONF_PATHS];
+static int s_num_conf_paths = 0;
+
+/* Collect full paths of all the entries in the schema. */
+static void collect_conf_paths(const struct mgos_conf_entry *obj,
+                               const char *prefix) {
+  int i;
+  for (i = 1; i <= obj->num_desc; i++) {
+    const struct mgos_conf_entry *e = obj + i;
+    char *path = NULL;
+    mg_asprintf(&path, 0, "%s%s%s", prefix, (*prefix ? "." : ""), e->key);
+    s_conf_paths[s_num_conf_paths] = path;
+    s_conf_entries[s_num_conf_paths++] = e;
+    if (e->type == CONF_TYPE_OBJECT) {
+      collect_conf_paths(e, path);
+      i += e->num_desc;
+    }
+  }
+}
+
+/* A copy of the schema is not indexed, so lookups use the slow path. */
+static struct mgos_conf_entry *copy_schema(
+    const struct mgos_conf_entry *schema) {
+  size_t size = (schema->num_desc + 1) * sizeof(*schema);
+  struct mgos_conf_entry *copy = (struct mgos_conf_entry *) malloc(size);
+  memcpy(copy, schema, size);
+  return copy;
+}
+
+static const char *test_config_lookup(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  struct mgos_conf_entry *linear = copy_schema(schema);
+  const struct mgos_conf_entry *e;
+  int i;
+
+  s_num_conf_paths = 0;
+  collect_conf_paths(schema, "");
+  ASSERT_EQ(s_num_conf_paths, schema->num_desc);
+  for (i = 0; i < s_num_conf_paths; i++) {
+    e = mgos_conf_find_schema_entry(s_conf_paths[i], schema);
+    ASSERT(e == s_conf_entries[i]);
+    e = mgos_conf_find_schema_entry(s_conf_paths[i], linear);
+    ASSERT(e == linear + (s_conf_entries[i] - schema));
+  }
+
+  static const char *bad_paths[] = {
+      "",           "nope",          "wifi.",      "wifi..ap",
+      ".wifi",      "wifi.ap.nope",  "wifi.ap.ssid.x", "foo.bar",
+      "b00.foo",    "b00.wifi.sta.", "b0.wifi",    "b00.wifi.ap.ssid2",
+      "ap.ssid",    "b33.http",
+  };
+  for (i = 0; i < (int) ARRAY_SIZE(bad_paths); i++) {
+    ASSERT(mgos_conf_find_schema_entry(bad_paths[i], schema) == NULL);
+    ASSERT(mgos_conf_find_schema_entry(bad_paths[i], linear) == NULL);
+  }
+
+  /* Lookups relative to a sub-object. */
+  const struct mgos_conf_entry *b03 =
+      mgos_conf_find_schema_entry("b03.wifi", schema);
+  ASSERT(b03 != NULL);
+  e = mgos_conf_find_schema_entry("ap.ssid", b03);
+  ASSERT(e == mgos_conf_find_schema_entry("b03.wifi.ap.ssid", schema));
+  ASSERT(mgos_conf_find_schema_entry("wifi.ap.ssid", b03) == NULL);
+  ASSERT(mgos_conf_find_schema_entry("ssid", b03) == NULL);
+  ASSERT(mgos_conf_find_schema_entry("x", e) == NULL);
+
+  for (i = 0; i < s_num_conf_paths; i++) free(s_conf_paths[i]);
+  free(linear);
+  return NULL;
+}
+
+static char *emit_conf(const void *cfg, const struct mgos_conf_entry *schema) {
+  struct mbuf mb;
+  mbuf_init(&mb, 0);
+  mgos_conf_emit_cb(cfg, NULL, schema, false, &mb, NULL, NULL);
+  mbuf_append(&mb, "", 1);
+  return mb.buf;
+}
+
+static const char *test_config_snapshot(void) {
+  const char *fname = ".build/conf.bin";
+  size_t size;
+  char *json1 = cs_read_file(".build/sys_conf_defaults.json", &size);
+  char *json2 = cs_read_file("data/overrides.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  struct mgos_conf_entry *schema2 = copy_schema(schema);
+  struct sys_conf conf, conf2;
+  char *data, *s1, *s2;
+  int32_t gpio = 0, aux = 0;
+
+  memset(&conf, 0, sizeof(conf));
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json1), "*", schema, &conf));
+  /* Factory reset GPIO must come from the defaults, not user overrides. */
+  gpio = conf.debug.factory_reset_gpio;
+  ASSERT_EQ(gpio, -1);
+  ASSERT(mgos_conf_parse(mg_mk_str(json2), "*", schema, &conf));
+  ASSERT(conf.wifi.ap.pass == NULL);
+  ASSERT_EQ(conf.debug.factory_reset_gpio, 4);
+  ASSERT(mgos_conf_save_bin(&conf, sizeof(conf), schema, 123, gpio, fname));
+
+  ASSERT(mgos_conf_load_bin(fname, schema, 123, &conf2, sizeof(conf2), &aux));
+  ASSERT_STREQ(conf2.wifi.sta.ssid, "cookadoodadoo");
+  ASSERT(conf2.wifi.sta.ssid != conf.wifi.sta.ssid);
+  ASSERT(conf2.wifi.ap.pass == NULL);
+  ASSERT_EQ(conf2.debug.level, 1);
+  ASSERT_EQ(conf2.debug.factory_reset_gpio, 4);
+  ASSERT_EQ(aux, -1);
+  s1 = emit_conf(&conf, schema);
+  s2 = emit_conf(&conf2, schema);
+  ASSERT_STREQ(s2, s1);
+  free(s1);
+  free(s2);
+  mgos_conf_free(schema, &conf2);
+
+  /* Stale snapshots are rejected and leave config empty. */
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(!mgos_conf_load_bin(fname, schema, 124, &conf2, sizeof(conf2), NULL));
+  ASSERT(!mgos_conf_load_bin(fname, schema, 123, &conf2, sizeof(conf2) - 8,
+                             NULL));
+  ASSERT(mgos_conf_schema_hash(schema2) == mgos_conf_schema_hash(schema));
+  schema2[2].offset += 4;
+  ASSERT(mgos_conf_schema_hash(schema2) != mgos_conf_schema_hash(schema));
+  ASSERT(!mgos_conf_load_bin(fname, schema2, 123, &conf2, sizeof(conf2), NULL));
+  ASSERT(!mgos_conf_load_bin("nonexistent", schema, 123, &conf2, sizeof(conf2),
+                             NULL));
+
+  /* So are corrupted ones. */
+  data = cs_read_file(fname, &size);
+  ASSERT(data != NULL);
+  data[size - 3] ^= 1;
+  FILE *fp = fopen(fname, "w");
+  ASSERT(fp != NULL);
+  ASSERT_EQ(fwrite(data, 1, size, fp), size);
+  fclose(fp);
+  ASSERT(!mgos_conf_load_bin(fname, schema, 123, &conf2, sizeof(conf2), NULL));
+  ASSERT(conf2.wifi.sta.ssid == NULL);
+  ASSERT_EQ(conf2.debug.level, 0);
+
+  remove(fname);
+  mgos_conf_free(schema, &conf);
+  free(data);
+  free(schema2);
+  free(json1);
+  free(json2);
+  return NULL;
+}
+
+static const char *test_config_packed(void) {
+  size_t size;
+  char *json1 = cs_read_file(".build/sys_conf_defaults.json", &size);
+  char *json2 = cs_read_file("data/overrides.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  const struct mgos_conf_entry *pschema = packed_conf_schema();
+  struct sys_conf conf;
+  struct packed_conf pconf;
+  struct mg_str v;
+  char *s1, *s2;
+
+  memset(&conf, 0, sizeof(conf));
+  memset(&pconf, 0, sizeof(pconf));
+  ASSERT(sizeof(pconf) < sizeof(conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json1), "*", schema, &conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json1), "*", pschema, &pconf));
+  ASSERT_EQ(packed_conf_get_wifi_ap_channel(&pconf), 6);
+  ASSERT_EQ(packed_conf_get_http_port(&pconf), 80);
+  ASSERT_EQ(packed_conf_get_http_enable(&pconf), 1);
+  ASSERT_EQ(packed_conf_get_test_bar_enable(&pconf), 0);
+  ASSERT_EQ(packed_conf_get_test_bar1_param1(&pconf), 222);
+  ASSERT_STREQ(packed_conf_get_wifi_ap_pass(&pconf), "Elduderino");
+  ASSERT(mgos_conf_parse(mg_mk_str(json2), "*", schema, &conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json2), "*", pschema, &pconf));
+  ASSERT_EQ(packed_conf_get_debug_level(&pconf), 1);
+  ASSERT_EQ(packed_conf_get_http_enable(&pconf), 0);
+
+  /* Packed and unpacked layouts hold the same values. */
+  s1 = emit_conf(&conf, schema);
+  s2 = emit_conf(&pconf, pschema);
+  ASSERT_STREQ(s2, s1);
+  free(s1);
+  free(s2);
+
+  /* Bools of an object share a byte. */
+  packed_conf_set_test_bar_enable(&pconf, 1);
+  packed_conf_set_http_enable(&pconf, 1);
+  ASSERT_EQ(packed_conf_get_test_bar_enable(&pconf), 1);
+  ASSERT_EQ(packed_conf_get_test_bar1_enable(&pconf), 0);
+  ASSERT(mgos_config_set(mg_mk_str("test.bar1.enable"), mg_mk_str("true"),
+                         &pconf, pschema, true));
+  ASSERT_EQ(packed_conf_get_test_bar1_enable(&pconf), 1);
+  ASSERT(mgos_config_set(mg_mk_str("http.enable"), mg_mk_str("false"), &pconf,
+                         pschema, true));
+  ASSERT_EQ(packed_conf_get_http_enable(&pconf), 0);
+  ASSERT_EQ(packed_conf_get_test_bar_enable(&pconf), 1);
+  ASSERT(mgos_config_get(mg_mk_str("test.bar.enable"), &v, &pconf, pschema));
+  ASSERT_EQ(mg_vcmp(&v, "true"), 0);
+  free((void *) v.p);
+
+  /* Narrow ints keep their sign and reject values out of range. */
+  ASSERT(mgos_config_set(mg_mk_str("debug.level"), mg_mk_str("-1"), &pconf,
+                         pschema, true));
+  ASSERT_EQ(packed_conf_get_debug_level(&pconf), -1);
+  ASSERT(mgos_config_set(mg_mk_str("http.port"), mg_mk_str("65535"), &pconf,
+                         pschema, true));
+  ASSERT_EQ(packed_conf_get_http_port(&pconf), 65535);
+  ASSERT(!mgos_config_set(mg_mk_str("http.port"), mg_mk_str("65536"), &pconf,
+                          pschema, true));
+  ASSERT(!mgos_conf_parse(mg_mk_str("{\"debug\": {\"level\": 200}}"), "*",
+                          pschema, &pconf));
+  ASSERT_EQ(packed_conf_get_debug_level(&pconf), -1);
+  ASSERT_EQ(packed_conf_get_http_port(&pconf), 65535);
+
+  /* Declared range is checked, not just the storage. */
+  ASSERT(!mgos_config_set(mg_mk_str("wifi.ap.channel"), mg_mk_str("200"),
+                          &pconf, pschema, true));
+  ASSERT(!mgos_conf_parse(mg_mk_str("{\"wifi\": {\"ap\": {\"channel\": 0}}}"),
+                          "*", pschema, &pconf));
+  packed_conf_set_wifi_ap_channel(&pconf, 300);
+  ASSERT_EQ(packed_conf_get_wifi_ap_channel(&pconf), 6);
+  packed_conf_set_wifi_ap_channel(&pconf, 14);
+  ASSERT_EQ(packed_conf_get_wifi_ap_channel(&pconf), 14);
+  packed_conf_set_debug_level(&pconf, 5);
+  ASSERT_EQ(packed_conf_get_debug_level(&pconf), -1);
+
+  printf("    sys_conf: %d bytes, packed: %d bytes\n", (int) sizeof(conf),
+         (int) sizeof(pconf));
+
+  mgos_conf_free(schema, &conf);
+  mgos_conf_free(pschema, &pconf);
+  free(json1);
+  free(json2);
+  return NULL;
+}
+
+static const char *test_config_strings(void) {
+  size_t size;
+  char *json = cs_read_file(".build/sys_conf_defaults.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  struct sys_conf conf, conf2;
+  struct mgos_conf_str_stats st0, st;
+  const char *ssid;
+  char buf[100];
+  int i;
+
+  mgos_conf_get_str_stats(&st0);
+  memset(&conf, 0, sizeof(conf));
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf2));
+  /* Defaults are shared and take no space. */
+  ASSERT_STREQ(conf.wifi.ap.pass, "Elduderino");
+  ASSERT(conf.wifi.ap.pass == conf2.wifi.ap.pass);
+  ASSERT(mgos_conf_str_is_default(conf.wifi.ap.pass));
+  mgos_conf_get_str_stats(&st);
+  ASSERT_EQ(st.num_slab_strs, st0.num_slab_strs);
+  mgos_conf_set_str(&conf.wifi.sta.ssid, "uart1");
+  ASSERT(conf.wifi.sta.ssid == conf.debug.dest);
+  ASSERT(mgos_config_set(mg_mk_str("wifi.ap.pass"), mg_mk_str("Elduderino"),
+                         &conf, schema, true));
+  ASSERT(conf.wifi.ap.pass == conf2.wifi.ap.pass);
+
+  /* Other values are copied. */
+  const char *json2 = "{\"wifi\": {\"ap\": {\"pass\": \"x\\ty\"}}}";
+  ASSERT(mgos_conf_parse(mg_mk_str(json2), "*", schema, &conf));
+  ASSERT_STREQ(conf.wifi.ap.pass, "x\ty");
+  ASSERT(!mgos_conf_str_is_default(conf.wifi.ap.pass));
+  mgos_conf_get_str_stats(&st);
+  ASSERT_EQ(st.num_slab_strs, st0.num_slab_strs + 1);
+  mgos_conf_set_str(&conf2.wifi.sta.pass, conf.wifi.ap.pass);
+  ASSERT_STREQ(conf2.wifi.sta.pass, "x\ty");
+  ASSERT(conf2.wifi.sta.pass != conf.wifi.ap.pass);
+  mgos_conf_set_str(&conf2.wifi.sta.pass, "");
+  ASSERT(conf2.wifi.sta.pass == NULL);
+
+  /* Setting a string to its own value or a part of it. */
+  mgos_conf_set_str(&conf.wifi.ap.pass, conf.wifi.ap.pass);
+  ASSERT_STREQ(conf.wifi.ap.pass, "x\ty");
+  mgos_conf_set_str(&conf.wifi.ap.pass, conf.wifi.ap.pass + 2);
+  ASSERT_STREQ(conf.wifi.ap.pass, "y");
+  ASSERT(mgos_config_set(mg_mk_str("wifi.ap.pass"),
+                         mg_mk_str(conf.wifi.ap.pass), &conf, schema, true));
+  ASSERT_STREQ(conf.wifi.ap.pass, "y");
+  mgos_conf_set_str(&conf.wifi.ap.ssid, conf.wifi.ap.ssid);
+  ASSERT(conf.wifi.ap.ssid == conf2.wifi.ap.ssid);
+
+  /* Values don't move when other strings change. */
+  mgos_conf_set_str(&conf.wifi.sta.ssid, "my_ssid");
+  ssid = conf.wifi.sta.ssid;
+  for (i = 0; i < 1000; i++) {
+    snprintf(buf, sizeof(buf), "ssid%d", i);
+    mgos_conf_set_str(&conf2.wifi.sta.ssid, buf);
+    /* Some of these are too long for the slabs. */
+    snprintf(buf, sizeof(buf), "%0*d", i % 90 + 1, i);
+    mgos_conf_set_str(&conf2.wifi.ap.ssid, buf);
+    if (i % 7 == 0) {
+      snprintf(buf, sizeof(buf), "dest%d", i);
+      ASSERT(mgos_config_set(mg_mk_str("debug.dest"), mg_mk_str(buf), &conf2,
+                             schema, true));
+    }
+  }
+  ASSERT_STREQ(conf2.wifi.sta.ssid, "ssid999");
+  ASSERT_STREQ(conf2.wifi.ap.ssid, "0000000999");
+  ASSERT_STREQ(conf2.debug.dest, "dest994");
+  ASSERT(conf.wifi.sta.ssid == ssid);
+  ASSERT_STREQ(ssid, "my_ssid");
+  mgos_conf_free(schema, &conf2);
+  ASSERT(conf.wifi.sta.ssid == ssid);
+  ASSERT_STREQ(ssid, "my_ssid");
+
+  mgos_conf_free(schema, &conf);
+  /* Empty slabs are released. */
+  mgos_conf_get_str_stats(&st);
+  ASSERT_EQ(st.num_slab_strs, st0.num_slab_strs);
+  ASSERT_EQ(st.num_slabs, st0.num_slabs);
+  free(json);
+  return NULL;
+}
+
+static size_t file_size(const char *fname) {
+  struct stat st;
+  return (stat(fname, &st) == 0 ? (size_t) st.st_size : 0);
+}
+
+static const char *test_config_journal(void) {
+  const char *fname = ".build/conf9.journal";
+  size_t size;
+  char *json = cs_read_file(".build/sys_conf_defaults.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  struct sys_conf base, conf, conf2;
+  char *s1, *s2;
+
+  remove(fname);
+  memset(&base, 0, sizeof(base));
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &base));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf));
+  ASSERT_EQ(mgos_conf_journal_append(&conf, &base, schema, 7, fname), 0);
+  ASSERT_EQ(file_size(fname), 0);
+
+  mgos_conf_set_str(&conf.wifi.sta.ssid, "my \"ssid\"");
+  mgos_conf_set_str(&conf.wifi.ap.pass, NULL);
+  conf.wifi.ap.channel = -3;
+  conf.http.enable = 0;
+  conf.debug.test_d1 = 0.1;
+  ASSERT_EQ(mgos_conf_journal_append(&conf, &base, schema, 7, fname), 5);
+  size = file_size(fname);
+  ASSERT(size > 0);
+
+  /* Replay. */
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf2));
+  ASSERT_EQ(mgos_conf_journal_replay(fname, 7, "*", schema, &conf2), 5);
+  s1 = emit_conf(&conf, schema);
+  s2 = emit_conf(&conf2, schema);
+  ASSERT_STREQ(s2, s1);
+  free(s2);
+  ASSERT(conf2.debug.test_d1 == 0.1);
+
+  /* Once replayed, only the changes are added. */
+  conf.wifi.ap.channel = 11;
+  ASSERT_EQ(mgos_conf_journal_append(&conf, &conf2, schema, 7, fname), 1);
+  ASSERT(file_size(fname) > size);
+  size = file_size(fname);
+  mgos_conf_free(schema, &conf2);
+
+  /* Stale journal is not applied. */
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf2));
+  ASSERT_EQ(mgos_conf_journal_replay(fname, 8, "*", schema, &conf2), -1);
+  ASSERT_EQ(conf2.wifi.ap.channel, 6);
+
+  /* ACL is respected. */
+  ASSERT_EQ(mgos_conf_journal_replay(fname, 7, "wifi.ap.*", schema, &conf2),
+            3);
+  ASSERT(conf2.wifi.sta.ssid == NULL);
+  ASSERT(conf2.wifi.ap.pass == NULL);
+  ASSERT_EQ(conf2.wifi.ap.channel, 11);
+  ASSERT_EQ(conf2.http.enable, 1);
+  mgos_conf_free(schema, &conf2);
+
+  /* Interrupted write: last record is dropped, the rest is applied. */
+  ASSERT_EQ(truncate(fname, size - 2), 0);
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf2));
+  ASSERT_EQ(mgos_conf_journal_replay(fname, 7, "*", schema, &conf2), 5);
+  ASSERT_EQ(conf2.wifi.ap.channel, -3);
+  ASSERT(file_size(fname) < size - 2);
+  ASSERT_EQ(mgos_conf_journal_append(&conf, &conf2, schema, 7, fname), 1);
+  ASSERT_EQ(file_size(fname), size);
+  mgos_conf_free(schema, &conf2);
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf2));
+  ASSERT_EQ(mgos_conf_journal_replay(fname, 7, "*", schema, &conf2), 6);
+  free(s1);
+  s1 = emit_conf(&conf, schema);
+  s2 = emit_conf(&conf2, schema);
+  ASSERT_STREQ(s2, s1);
+  free(s2);
+
+  free(s1);
+  remove(fname);
+  mgos_conf_free(schema, &conf2);
+  mgos_conf_free(schema, &conf);
+  mgos_conf_free(schema, &base);
+  free(json);
+  return NULL;
+}
+
+#define MAX_CONF_CHANGES 10
+static struct {
+  char *path;
+  char *old_value, *new_value;
+  void *userdata;
+} s_conf_changes[MAX_CONF_CHANGES];
+static int s_num_conf_changes = 0;
+
+static char *conf_value_str(const struct mgos_conf_entry *e,
+                            union mgos_conf_value v) {
+  char *s = NULL;
+  switch (e->type) {
+    case CONF_TYPE_DOUBLE:
+      mg_asprintf(&s, 0, "%g", v.d);
+      break;
+    case CONF_TYPE_STRING:
+      s = strdup(v.s != NULL ? v.s : "");
+      break;
+    default:
+      mg_asprintf(&s, 0, "%d", v.i);
+      break;
+  }
+  return s;
+}
+
+static void record_conf_change(const struct mgos_conf_change *ch,
+                               void *userdata) {
+  if (s_num_conf_changes == MAX_CONF_CHANGES) return;
+  s_conf_changes[s_num_conf_changes].path = strdup(ch->path);
+  s_conf_changes[s_num_conf_changes].old_value =
+      conf_value_str(ch->entry, ch->old_value);
+  s_conf_changes[s_num_conf_changes].new_value =
+      conf_value_str(ch->entry, ch->new_value);
+  s_conf_changes[s_num_conf_changes].userdata = userdata;
+  s_num_conf_changes++;
+}
+
+static void clear_conf_changes(void) {
+  int i;
+  for (i = 0; i < s_num_conf_changes; i++) {
+    free(s_conf_changes[i].path);
+    free(s_conf_changes[i].old_value);
+    free(s_conf_changes[i].new_value);
+  }
+  s_num_conf_changes = 0;
+}
+
+static void unsubscribe_conf_change(const struct mgos_conf_change *ch,
+                                    void *userdata) {
+  record_conf_change(ch, userdata);
+  mgos_conf_unsubscribe(userdata, sys_conf_schema(), "debug.level",
+                        unsubscribe_conf_change, userdata);
+}
+
+#define ASSERT_CONF_CHANGE(i, p, o, n, ud)               \
+  do {                                                   \
+    ASSERT_STREQ(s_conf_changes[i].path, p);             \
+    ASSERT_STREQ(s_conf_changes[i].old_value, o);        \
+    ASSERT_STREQ(s_conf_changes[i].new_value, n);        \
+    ASSERT(s_conf_changes[i].userdata == (void *) (ud)); \
+  } while (0)
+
+static const char *test_config_subscribe(void) {
+  size_t size;
+  char *json = cs_read_file(".build/sys_conf_defaults.json", &size);
+  const struct mgos_conf_entry *schema = sys_conf_schema();
+  const struct mgos_conf_entry *wifi_schema =
+      mgos_conf_find_schema_entry("wifi", schema);
+  struct sys_conf conf, conf2, conf3;
+
+  memset(&conf, 0, sizeof(conf));
+  memset(&conf2, 0, sizeof(conf2));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf2));
+
+  ASSERT_EQ(mgos_conf_subscribe(&conf, schema, "wifi.nope", record_conf_change,
+                                NULL),
+            false);
+  ASSERT(mgos_conf_subscribe(&conf, schema, "wifi.ap", record_conf_change,
+                             (void *) 1));
+  ASSERT(mgos_conf_subscribe(&conf, schema, "wifi.ap.channel",
+                             record_conf_change, (void *) 2));
+  ASSERT(mgos_conf_subscribe(&conf, schema, "", record_conf_change,
+                             (void *) 3));
+
+  /* Only changed values are reported, in schema order. */
+  ASSERT(mgos_conf_parse(
+      mg_mk_str("{\"wifi\": {\"ap\": {\"channel\": 6, \"ssid\": \"x\", "
+                "\"pass\": \"Elduderino\"}}, \"debug\": {\"test_d1\": 1.5}}"),
+      "*", schema, &conf));
+  ASSERT_EQ(s_num_conf_changes, 3);
+  ASSERT_CONF_CHANGE(0, "wifi.ap.ssid", "FW_XXXXXX", "x", 1);
+  ASSERT_CONF_CHANGE(1, "wifi.ap.ssid", "FW_XXXXXX", "x", 3);
+  ASSERT_CONF_CHANGE(2, "debug.test_d1", "2", "1.5", 3);
+  clear_conf_changes();
+
+  /* Other instances are not watched. */
+  ASSERT(mgos_conf_parse(mg_mk_str("{\"wifi\": {\"ap\": {\"channel\": 1}}}"),
+                         "*", schema, &conf2));
+  ASSERT_EQ(s_num_conf_changes, 0);
+
+  /* Keys denied by the ACL are not changed and not reported. */
+  ASSERT(mgos_conf_parse(mg_mk_str("{\"wifi\": {\"ap\": {\"channel\": 1}}}"),
+                         "-wifi.ap.channel", schema, &conf));
+  ASSERT_EQ(s_num_conf_changes, 0);
+
+  ASSERT(mgos_config_set(mg_mk_str("wifi.ap.channel"), mg_mk_str("11"), &conf,
+                         schema, true));
+  ASSERT_EQ(s_num_conf_changes, 3);
+  ASSERT_CONF_CHANGE(0, "wifi.ap.channel", "6", "11", 1);
+  ASSERT_CONF_CHANGE(1, "wifi.ap.channel", "6", "11", 2);
+  ASSERT_CONF_CHANGE(2, "wifi.ap.channel", "6", "11", 3);
+  clear_conf_changes();
+  ASSERT(mgos_config_set(mg_mk_str("wifi.ap.channel"), mg_mk_str("11"), &conf,
+                         schema, true));
+  ASSERT_EQ(s_num_conf_changes, 0);
+  ASSERT(mgos_config_set(mg_mk_str("wifi.sta"),
+                         mg_mk_str("{\"ssid\": \"foo\"}"), &conf, schema,
+                         true));
+  ASSERT_EQ(s_num_conf_changes, 1);
+  ASSERT_CONF_CHANGE(0, "wifi.sta.ssid", "", "foo", 3);
+  clear_conf_changes();
+
+  /* Sub-config parsed in place is reported, a separate copy is not. */
+  ASSERT(mgos_conf_unsubscribe(&conf, schema, "", record_conf_change,
+                               (void *) 3));
+  ASSERT(mgos_conf_parse_sub(mg_mk_str("{\"ap\": {\"pass\": \"\"}}"),
+                             wifi_schema, &conf.wifi));
+  ASSERT_EQ(s_num_conf_changes, 1);
+  ASSERT_CONF_CHANGE(0, "wifi.ap.pass", "Elduderino", "", 1);
+  clear_conf_changes();
+  memset(&conf3, 0, sizeof(conf3));
+  ASSERT(mgos_conf_parse_sub(mg_mk_str("{\"ap\": {\"pass\": \"x\"}}"),
+                             wifi_schema, &conf3.wifi));
+  ASSERT_EQ(s_num_conf_changes, 0);
+  ASSERT_STREQ(conf3.wifi.ap.pass, "x");
+  mgos_conf_free(schema, &conf3);
+
+  /* Unsubscribing from a callback. */
+  ASSERT(mgos_conf_unsubscribe(&conf, schema, "wifi.ap", record_conf_change,
+                               (void *) 1));
+  ASSERT(mgos_conf_unsubscribe(&conf, schema, "wifi.ap.channel",
+                               record_conf_change, (void *) 2));
+  ASSERT(!mgos_conf_unsubscribe(&conf, schema, "wifi.ap.channel",
+                                record_conf_change, (void *) 2));
+  ASSERT(mgos_conf_subscribe(&conf, schema, "debug.level",
+                             unsubscribe_conf_change, &conf));
+  ASSERT(mgos_config_set(mg_mk_str("debug.level"), mg_mk_str("3"), &conf,
+                         schema, true));
+  ASSERT(mgos_config_set(mg_mk_str("debug.level"), mg_mk_str("4"), &conf,
+                         schema, true));
+  ASSERT_EQ(s_num_conf_changes, 1);
+  ASSERT_CONF_CHANGE(0, "debug.level", "2", "3", &conf);
+  clear_conf_changes();
+
+  mgos_conf_free(schema, &conf2);
+  mgos_conf_free(schema, &conf);
+  free(json);
+  return NULL;
+}
+
+/* Straightforward ACL matching, for comparison with the compiled one. */
+static bool check_access_ref(const struct mg_str key, struct mg_str acl) {
+  struct mg_str entry;
+  if (acl.len == 0) return false;
+  while ((acl = mg_next_comma_list_entry_n(acl, &entry, NULL)).p != NULL) {
+    if (entry.len == 0) continue;
+    bool result = (entry.p[0] != '-');
+    if (entry.p[0] == '-' || entry.p[0] == '+') {
+      entry.p++;
+      entry.len--;
+    }
+    if (mg_match_prefix_n(entry, key) == key.len) return result;
+  }
+  return false;
+}
+
+static const char *s_bench_acl =
+    "-b00.wifi.ap.pass,-b01.wifi.ap.pass,-b02.wifi.ap.pass,-b03.wifi.ap.pass,"
+    "-b04.wifi.sta.*,-b05.wifi.sta.*,-b06.http.*,-b07.http.*,"
+    "+b08.*,+b09.**,-b1?.debug.level,-b2*.http.enable,-b3*.wifi.ap.ssid,"
+    "-*.debug.test_d2,+b1*,+b2*,+b3*,+b4*,-b5*,+*";
+
+static const char *test_config_acl(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  static const char *acls[] = {
+      "*",
+      "",
+      ",",
+      "-*",
+      "-wifi.ap.pass,+wifi.*,-*",
+      "+wifi.**,-*",
+      "-WiFi.AP.*,wifi*",
+      "b0*,-b1*.ssid,+b1*",
+      "-b00.wifi.ap,-b00.wifi.ap.ssid,b00.wifi.ap.*",
+      "b00.wifi.ap.ssid$,-b00.*",
+      "b0?.http.port,-b0*.http.*,+**",
+      "-b00.wifi.ap.ssid|b01.*,+*",
+      "b00.wifi,b00.wifi.*,-**",
+      "-a/b*,a/**",
+      "a*,-a**,a",
+      ",,-b00*,,+b*,",
+      "++b00.*,--b01.*,-+b02.*,b03.*,-*",
+  };
+  static const char *extra_keys[] = {
+      "a", "A", "ab", "a/b", "a/b/c", "ab/c", "a/", "wifi", "WIFI.AP.PASS",
+      "b00.wifi.ap.ssid.x", "b00.wifi.ap.ssi", "-b00.wifi",
+  };
+  int i, j;
+
+  s_num_conf_paths = 0;
+  collect_conf_paths(schema, "");
+  for (i = 0; i < (int) ARRAY_SIZE(extra_keys); i++) {
+    s_conf_paths[s_num_conf_paths++] = strdup(extra_keys[i]);
+  }
+  /* Both directly and with other ACLs cached in between. */
+  for (int k = 0; k < 2; k++) {
+    for (i = 0; i < (int) ARRAY_SIZE(acls) + 1; i++) {
+      const char *acl = (i < (int) ARRAY_SIZE(acls) ? acls[i] : s_bench_acl);
+      for (j = 0; j < s_num_conf_paths; j++) {
+        const struct mg_str key = mg_mk_str(s_conf_paths[j]);
+        if (mgos_conf_check_access(key, acl) !=
+            check_access_ref(key, mg_mk_str(acl))) {
+          printf("ACL [%s], key [%s]\n", acl, s_conf_paths[j]);
+          ASSERT(false);
+        }
+      }
+    }
+  }
+  ASSERT_EQ(mgos_conf_check_access(mg_mk_str("foo"), NULL), false);
+  ASSERT_EQ(mgos_conf_check_access_n(mg_mk_str("foo"), mg_mk_str_n("*", 1)),
+            true);
+
+  /* Parser checks keys against the ACL. */
+  struct bench_conf conf;
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(mgos_conf_parse(mg_mk_str("{\"b00\": {\"wifi\": {\"ap\": "
+                                   "{\"pass\": \"x\", \"ssid\": \"y\"}}}}"),
+                         s_bench_acl, schema, &conf));
+  ASSERT(conf.b00.wifi.ap.pass == NULL);
+  ASSERT_STREQ(conf.b00.wifi.ap.ssid, "y");
+  mgos_conf_free(schema, &conf);
+
+  for (i = 0; i < s_num_conf_paths; i++) free(s_conf_paths[i]);
+  return NULL;
+}
+
+struct stream_sink {
+  struct mbuf mb;
+  size_t chunk_size;
+  int num_chunks, max_chunks;
+  bool short_chunk;
+};
+
+static bool stream_sink(const char *data, size_t len, void *param) {
+  struct stream_sink *ss = (struct stream_sink *) param;
+  /* Only the last chunk can be shorter. */
+  if (len == 0 || len > ss->chunk_size || ss->short_chunk) return false;
+  ss->short_chunk = (len < ss->chunk_size);
+  mbuf_append(&ss->mb, data, len);
+  ss->num_chunks++;
+  return (ss->max_chunks == 0 || ss->num_chunks < ss->max_chunks);
+}
+
+static const char *test_config_emit_stream(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  const char *fname = ".build/conf_stream.json";
+  static const size_t chunk_sizes[] = {1, 7, 256, 1000};
+  struct bench_conf conf, base;
+  struct stream_sink ss;
+  struct mbuf mb;
+  size_t size;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+  char *long_str = (char *) calloc(1, 1000);
+  struct mg_str v1, v2;
+  int i;
+
+  memset(&conf, 0, sizeof(conf));
+  memset(&base, 0, sizeof(base));
+  ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &base));
+  memset(long_str, 'x', 999);
+  mgos_conf_set_str(&conf.b01.wifi.ap.ssid, long_str);
+  mgos_conf_set_str(&conf.b02.wifi.sta.pass, "\"q\"\n\\");
+  conf.b03.http.port = 8080;
+
+  for (int pretty = 0; pretty < 2; pretty++) {
+    for (int use_base = 0; use_base < 2; use_base++) {
+      const void *b = (use_base ? &base : NULL);
+      mbuf_init(&mb, 0);
+      mgos_conf_emit_cb(&conf, b, schema, pretty, &mb, NULL, NULL);
+      for (i = 0; i < (int) ARRAY_SIZE(chunk_sizes); i++) {
+        memset(&ss, 0, sizeof(ss));
+        ss.chunk_size = chunk_sizes[i];
+        ASSERT(mgos_conf_emit_stream(&conf, b, schema, pretty, ss.chunk_size,
+                                     stream_sink, &ss));
+        ASSERT_EQ(ss.mb.len, mb.len);
+        ASSERT(memcmp(ss.mb.buf, mb.buf, mb.len) == 0);
+        ASSERT_EQ(ss.num_chunks, (int) ((mb.len + ss.chunk_size - 1) /
+                                        ss.chunk_size));
+        mbuf_free(&ss.mb);
+      }
+      mbuf_free(&mb);
+    }
+  }
+
+  /* Sink can stop the emitter. */
+  memset(&ss, 0, sizeof(ss));
+  ss.chunk_size = 16;
+  ss.max_chunks = 3;
+  ASSERT(!mgos_conf_emit_stream(&conf, NULL, schema, false, ss.chunk_size,
+                                stream_sink, &ss));
+  ASSERT_EQ(ss.num_chunks, 3);
+  mbuf_free(&ss.mb);
+
+  /* Getter. */
+  static const char *keys[] = {"b01.wifi", "b01.wifi.ap.ssid", "b02",
+                               "b03.http.port", "b02.wifi.sta.pass"};
+  for (i = 0; i < (int) ARRAY_SIZE(keys); i++) {
+    memset(&ss, 0, sizeof(ss));
+    ss.chunk_size = 100;
+    ASSERT(mgos_config_get(mg_mk_str(keys[i]), &v1, &conf, schema));
+    ASSERT(mgos_config_get_stream(mg_mk_str(keys[i]), &conf, schema,
+                                  ss.chunk_size, stream_sink, &ss));
+    ASSERT_EQ(ss.mb.len, v1.len);
+    ASSERT(memcmp(ss.mb.buf, v1.p, v1.len) == 0);
+    free((void *) v1.p);
+    mbuf_free(&ss.mb);
+  }
+  ASSERT(!mgos_config_get_stream(mg_mk_str("b01.nope"), &conf, schema, 0,
+                                 stream_sink, &ss));
+
+  /* json_out. */
+  char buf[100];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  ASSERT(mgos_config_get(mg_mk_str("b03.http"), &v1, &conf, schema));
+  ASSERT(mgos_config_get_stream(mg_mk_str("b03.http"), &conf, schema, 8,
+                                mgos_conf_emit_json_out_sink, &out));
+  ASSERT_EQ(mg_strcmp(mg_mk_str(buf), v1), 0);
+  free((void *) v1.p);
+
+  /* File. */
+  ASSERT(mgos_conf_emit_f(&conf, &base, schema, true, fname));
+  v1.p = cs_read_file(fname, &v1.len);
+  mbuf_init(&mb, 0);
+  mgos_conf_emit_cb(&conf, &base, schema, true, &mb, NULL, NULL);
+  v2 = mg_mk_str_n(mb.buf, mb.len);
+  ASSERT(v1.p != NULL);
+  ASSERT_EQ(mg_strcmp(v1, v2), 0);
+  free((void *) v1.p);
+  mbuf_free(&mb);
+  remove(fname);
+
+  mgos_conf_free(schema, &conf);
+  mgos_conf_free(schema, &base);
+  free(long_str);
+  free(defaults);
+  return NULL;
+}
+
 static const char *test_json_scanf(void) {
   int a = 0;
   bool b = false;
@@ -68,6 +854,1085 @@ static const char *test_json_scanf(void) {
   return NULL;
 }
 
+struct walk_data {
+  int num_tokens;
+  struct json_token last_str;
+};
+
+static void walk_cb(void *callback_data, const char *name, size_t name_len,
+                    const char *path, const struct json_token *token) {
+  struct walk_data *wd = (struct walk_data *) callback_data;
+  wd->num_tokens++;
+  if (token->type == JSON_TYPE_STRING) wd->last_str = *token;
+  (void) name;
+  (void) name_len;
+  (void) path;
+}
+
+static const char *test_json_walk(void) {
+  /* Special chars at every position around the scan width. */
+  static const struct {
+    const char *s;
+    int res; /* -1: invalid, 0: string ends at the first '"' after s. */
+  } specials[] = {
+      {"", 0},           {"\\n", 0},     {"\\\"", 0},   {"\\u00e9", 0},
+      {"\xc3\xa9", 0},   {"\x01", -1},   {"\\x", -1},   {"\x7f", 0},
+      {"\\u0g", -1},     {"\t", -1},
+  };
+  char buf[300];
+  int i, j, n;
+  for (i = 0; i < (int) ARRAY_SIZE(specials); i++) {
+    for (j = 0; j < 70; j++) {
+      struct walk_data wd;
+      memset(&wd, 0, sizeof(wd));
+      n = snprintf(buf, sizeof(buf), "{%*s\"k\":%*s\"%.*s%s0123456789\"%*s}",
+                   j, "", j % 40, "", j, "abcdefghijklmnopqrstuvwxyz"
+                   "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz",
+                   specials[i].s, j, "");
+      if (specials[i].res < 0) {
+        ASSERT_EQ(json_walk(buf, n, walk_cb, &wd), JSON_STRING_INVALID);
+        continue;
+      }
+      ASSERT_EQ(json_walk(buf, n, walk_cb, &wd), n);
+      ASSERT_EQ(wd.num_tokens, 3);
+      ASSERT_EQ(wd.last_str.len,
+                (int) (j + strlen(specials[i].s) + 10));
+      /* Truncated anywhere inside the value, it is incomplete. */
+      ASSERT_EQ(json_walk(buf, n - j - 3, walk_cb, &wd),
+                JSON_STRING_INCOMPLETE);
+    }
+  }
+  /* A UTF-8 lead byte swallows the next byte, even if it is a quote. */
+  n = snprintf(buf, sizeof(buf), "[\"%s\xc3\"\", 1]",
+               "0123456789abcdef0123456789abcdef0123456789");
+  ASSERT_EQ(json_walk(buf, n, NULL, NULL), n);
+  n = snprintf(buf, sizeof(buf), "[\"%s\xc3\"]", "0123456789abcdef0123456789");
+  ASSERT_EQ(json_walk(buf, n, NULL, NULL), JSON_STRING_INCOMPLETE);
+
+  return NULL;
+}
+
+/* Records every event, END tokens by length only: their ptr can be NULL. */
+static void log_cb(void *callback_data, const char *name, size_t name_len,
+                   const char *path, const struct json_token *token) {
+  struct mbuf *mb = (struct mbuf *) callback_data;
+  char buf[100];
+  int end = (token->type == JSON_TYPE_OBJECT_END ||
+             token->type == JSON_TYPE_ARRAY_END);
+  int n = snprintf(buf, sizeof(buf), "%d %.*s %s %d ", token->type,
+                   (int) name_len, name ? name : "", path, token->len);
+  mbuf_append(mb, buf, n);
+  if (!end) mbuf_append(mb, token->ptr, token->len);
+  mbuf_append(mb, "\n", 1);
+}
+
+/* Feeds `s` to an incremental parser in chunks that end at `splits`. */
+static int walk_ctx_chunks(const char *s, int len, const int *splits,
+                           int num_splits, struct mbuf *log) {
+  struct json_walk_ctx ctx;
+  int i, from = 0, to, n = 0;
+  json_walk_ctx_init(&ctx, log_cb, log);
+  for (i = 0; i <= num_splits && n >= 0; i++) {
+    /* Each chunk is a separate copy, like a network buffer would be. */
+    char *chunk;
+    to = (i < num_splits ? splits[i] : len);
+    chunk = (char *) malloc(to - from + 1);
+    memcpy(chunk, s + from, to - from);
+    n = json_walk_ctx_feed(&ctx, chunk, to - from);
+    free(chunk);
+    from = to;
+  }
+  return json_walk_ctx_finish(&ctx);
+}
+
+static const char *test_json_walk_ctx(void) {
+  static const char *docs[] = {
+      "{\"a\": 1, \"b\": [1, 2.5e-3, {\"c\": true}], \"d\": \"x\\\"y\\u00e9\"}",
+      "{foo_1: {bar: [null, false, -0x1F, \"\xc3\xa9\"], \"\": {}}, e: []}",
+      "  [[], [[1]], {\"k\": \"0123456789abcdef0123456789abcdef0123\"}]  ",
+      "-12.5e+7",
+      "[1 2,, 3,]",
+      "{\"a\": [1, 2}",
+      "{\"a\": tru",
+      "{\"a\": \"\\u00",
+      "{\"a\": 1 \"b\"",
+  };
+  int splits[100];
+  int i, j, n, res;
+  for (i = 0; i < (int) ARRAY_SIZE(docs); i++) {
+    struct mbuf expected, log;
+    n = strlen(docs[i]);
+    mbuf_init(&expected, 0);
+    mbuf_init(&log, 0);
+    res = json_walk(docs[i], n, log_cb, &expected);
+    /* Every split point, then every byte in its own chunk. */
+    for (j = 0; j <= n + 1; j++) {
+      int num_splits = 1;
+      if (j <= n) {
+        splits[0] = j;
+      } else {
+        for (num_splits = 0; num_splits < n; num_splits++) {
+          splits[num_splits] = num_splits;
+        }
+      }
+      log.len = 0;
+      ASSERT_EQ(walk_ctx_chunks(docs[i], n, splits, num_splits, &log), res);
+      ASSERT_EQ(log.len, expected.len);
+      ASSERT(memcmp(log.buf, expected.buf, log.len) == 0);
+    }
+    mbuf_free(&expected);
+    mbuf_free(&log);
+  }
+
+  {
+    /* The parser stops at the end of the document. */
+    struct json_walk_ctx ctx;
+    json_walk_ctx_init(&ctx, NULL, NULL);
+    ASSERT_EQ(json_walk_ctx_feed(&ctx, "{\"a\"", 4), 4);
+    ASSERT_EQ(json_walk_ctx_feed(&ctx, ":1} {}", 6), 3);
+    ASSERT_EQ(json_walk_ctx_feed(&ctx, "{}", 2), 0);
+    ASSERT_EQ(json_walk_ctx_finish(&ctx), 7);
+
+    json_walk_ctx_init(&ctx, NULL, NULL);
+    ASSERT_EQ(json_walk_ctx_feed(&ctx, "[1, }", 5), JSON_STRING_INVALID);
+    ASSERT_EQ(json_walk_ctx_feed(&ctx, "]", 1), JSON_STRING_INVALID);
+    ASSERT_EQ(json_walk_ctx_finish(&ctx), JSON_STRING_INVALID);
+
+    /* The state stack is bounded. */
+    json_walk_ctx_init(&ctx, NULL, NULL);
+    for (i = 0; i < JSON_WALK_MAX_DEPTH; i++) {
+      ASSERT_EQ(json_walk_ctx_feed(&ctx, "[", 1), 1);
+    }
+    ASSERT_EQ(json_walk_ctx_feed(&ctx, "[", 1), JSON_STRING_INVALID);
+    ASSERT_EQ(json_walk_ctx_finish(&ctx), JSON_STRING_INVALID);
+  }
+
+  return NULL;
+}
+
+/* Appends `num_copies` copies of `s` to `mb`, separated by commas. */
+static void append_copies(struct mbuf *mb, const char *s, int num_copies) {
+  int i;
+  for (i = 0; i < num_copies; i++) {
+    if (i > 0) mbuf_append(mb, ",", 1);
+    mbuf_append(mb, s, strlen(s));
+  }
+}
+
+static double bench_walk(const char *s, size_t len, int num_iter) {
+  struct walk_data wd;
+  int i;
+  double t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    memset(&wd, 0, sizeof(wd));
+    if (json_walk(s, len, walk_cb, &wd) != (int) len) return 0;
+  }
+  t = cs_time() - t;
+  return len * num_iter / t / 1e6;
+}
+
+/* Same, but fed to the incremental parser in TCP segment sized chunks. */
+static double bench_walk_ctx(const char *s, size_t len, int num_iter) {
+  struct json_walk_ctx ctx;
+  struct walk_data wd;
+  size_t off, n;
+  int i;
+  double t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    memset(&wd, 0, sizeof(wd));
+    json_walk_ctx_init(&ctx, walk_cb, &wd);
+    for (off = 0; off < len; off += n) {
+      n = (len - off < 1460 ? len - off : 1460);
+      json_walk_ctx_feed(&ctx, s + off, n);
+    }
+    if (json_walk_ctx_finish(&ctx) != (int) len) return 0;
+  }
+  t = cs_time() - t;
+  return len * num_iter / t / 1e6;
+}
+
+static const char *bench_json_walk(void) {
+  const char *rpc_frame =
+      "{\"id\":1234,\"src\":\"shadow/device_0123456789\",\"tag\":\"xyz\","
+      "\"method\":\"Config.Set\",\"args\":{\"config\":{\"wifi\":{\"sta\":{"
+      "\"enable\":true,\"ssid\":\"Corporate Network 5G\",\"pass\":"
+      "\"correct horse battery staple\"}}},\"save\":true,\"reboot\":false}}";
+  const char *sample =
+      "{\"ts\": 1546300800.125, \"sensor\": \"temperature/outdoor-north\", "
+      "\"value\": -12.5, \"ok\": true, \"tags\": [\"a\", \"b\"]}";
+  struct mbuf cfg, arr;
+  size_t size;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+
+  ASSERT(defaults != NULL);
+  /* Pretty-printed config, the way conf*.json files are. */
+  mbuf_init(&cfg, 0);
+  mbuf_append(&cfg, "[", 1);
+  append_copies(&cfg, defaults, 100 * 1024 / size + 1);
+  mbuf_append(&cfg, "]", 1);
+  mbuf_init(&arr, 0);
+  mbuf_append(&arr, "[", 1);
+  append_copies(&arr, sample, 1024 * 1024 / strlen(sample) + 1);
+  mbuf_append(&arr, "]", 1);
+
+  double rpc = bench_walk(rpc_frame, strlen(rpc_frame), 100000);
+  double conf = bench_walk(cfg.buf, cfg.len, 200);
+  double array = bench_walk(arr.buf, arr.len, 20);
+  double conf_ctx = bench_walk_ctx(cfg.buf, cfg.len, 200);
+  double array_ctx = bench_walk_ctx(arr.buf, arr.len, 20);
+  ASSERT(rpc > 0 && conf > 0 && array > 0);
+  ASSERT(conf_ctx > 0 && array_ctx > 0);
+  printf("    json_walk: %d byte RPC frame %.1f MB/s, %d KB config %.1f MB/s, "
+         "%d KB array %.1f MB/s\n",
+         (int) strlen(rpc_frame), rpc, (int) (cfg.len / 1024), conf,
+         (int) (arr.len / 1024), array);
+  printf("    json_walk_ctx, 1460 byte chunks: config %.1f MB/s, "
+         "array %.1f MB/s\n",
+         conf_ctx, array_ctx);
+
+  mbuf_free(&cfg);
+  mbuf_free(&arr);
+  free(defaults);
+  return NULL;
+}
+
+static const char *test_json_tape(void) {
+  const char *s =
+      "{\"a\": 1, \"b\": {\"c\": true, \"d\": \"x\\ny\"}, "
+      "e: [10, [20, 21], {\"f\": -2.5}], \"g\": null}";
+  int len = strlen(s), a = 0, c = 0, n, idx;
+  char *d = NULL;
+  struct json_token t, key, val;
+  struct json_tape tape;
+  void *h = NULL;
+
+  ASSERT_EQ(json_tape_init(&tape, s, len), len);
+  ASSERT_EQ(json_tape_scanf(&tape, "{a: %d, b: {c: %B, d: %Q}, g: %T}", &a,
+                            &c, &d, &t),
+            4);
+  ASSERT_EQ(a, 1);
+  ASSERT_EQ(c, 1);
+  ASSERT_STREQ(d, "x\ny");
+  ASSERT_EQ(t.type, JSON_TYPE_NULL);
+  free(d);
+  /* Containers are their whole text, same as with json_scanf(). */
+  ASSERT_EQ(json_tape_scanf(&tape, "{b: %T}", &t), 1);
+  ASSERT_EQ(t.type, JSON_TYPE_OBJECT_END);
+  ASSERT_STREQ_NZ(t.ptr, "{\"c\": true, \"d\": \"x\\ny\"}");
+  ASSERT_EQ(json_tape_scanf(&tape, "{x: %d, b: {x: %d}}", &a, &a), 0);
+
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, ".e", 1, &t), 8);
+  ASSERT_EQ(t.type, JSON_TYPE_ARRAY_END);
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, ".e[1]", 0, &t), 2);
+  ASSERT_STREQ_NZ(t.ptr, "20");
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, ".e", 3, &t), -1);
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, ".e[2]", 0, &t), -1);
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, "", 0, &t), -1);
+
+  /* Iteration gives the same results as json_next_key(). */
+  n = 0;
+  while ((h = json_tape_next_key(&tape, h, "", &key, &val)) != NULL) {
+    struct json_token k2, v2;
+    void *h2 = NULL;
+    int i;
+    for (i = 0; i <= n; i++) h2 = json_next_key(s, len, h2, "", &k2, &v2);
+    ASSERT(h2 != NULL);
+    ASSERT_EQ(key.len, k2.len);
+    ASSERT(key.ptr == k2.ptr);
+    ASSERT(val.ptr == v2.ptr);
+    ASSERT_EQ(val.len, v2.len);
+    ASSERT_EQ(val.type, v2.type);
+    n++;
+  }
+  ASSERT_EQ(n, 4);
+  n = 0;
+  while ((h = json_tape_next_elem(&tape, h, ".e", &idx, &val)) != NULL) {
+    ASSERT_EQ(idx, n);
+    n++;
+  }
+  ASSERT_EQ(n, 3);
+  ASSERT(json_tape_next_elem(&tape, NULL, ".e[2]", &idx, &val) != NULL);
+  ASSERT_EQ(idx, -1);
+  ASSERT(json_tape_next_elem(&tape, NULL, ".a", &idx, &val) == NULL);
+  json_tape_free(&tape);
+
+  /* Members are looked up by key: the last duplicate wins. */
+  s = "{\"b\": 1, \"ab\": 2, \"a\": 3, \"b\": 4, \"abc\": {\"x\": [5, 6, 7]}}";
+  len = strlen(s);
+  ASSERT_EQ(json_tape_init(&tape, s, len), len);
+  a = c = n = 0;
+  ASSERT_EQ(json_tape_scanf(&tape, "{a: %d, ab: %d, b: %d}", &a, &c, &n), 3);
+  ASSERT_EQ(a, 3);
+  ASSERT_EQ(c, 2);
+  ASSERT_EQ(n, 4);
+  ASSERT_EQ(json_tape_scanf(&tape, "{aa: %d, abcd: %d, c: %d}", &a, &a, &a),
+            0);
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, ".abc.x", 2, &t), 1);
+  ASSERT_STREQ_NZ(t.ptr, "7");
+  ASSERT_EQ(json_tape_scanf_array_elem(&tape, ".abc.x", -1, &t), -1);
+  ASSERT_EQ(json_tape_scanf(&tape, "{abc: {x: %T}}", &t), 1);
+  ASSERT_EQ(t.type, JSON_TYPE_ARRAY_END);
+  /* Iteration is still in document order. */
+  ASSERT(json_tape_next_key(&tape, NULL, "", &key, &val) != NULL);
+  ASSERT_STREQ_NZ(key.ptr, "b");
+  json_tape_free(&tape);
+
+  ASSERT_EQ(json_tape_init(&tape, "{\"a\": [1, ", 10), JSON_STRING_INCOMPLETE);
+  ASSERT(tape.entries == NULL);
+  ASSERT_EQ(json_tape_init(&tape, "{\"a\": }", 7), JSON_STRING_INVALID);
+  /* json_walk() does not report containers under an empty key. */
+  ASSERT_EQ(json_tape_init(&tape, "{\"\": {\"a\": 1}}", 14),
+            JSON_STRING_INVALID);
+
+  return NULL;
+}
+
+static const char *bench_json_tape(void) {
+  struct mbuf doc;
+  struct json_tape tape;
+  char fmt[50];
+  int i, j, v, sum1 = 0, sum2 = 0, num_iter = 2000;
+  double t1, t2;
+
+  /* A 50-field object, e.g. a config section or a big RPC request. */
+  mbuf_init(&doc, 0);
+  mbuf_append(&doc, "{", 1);
+  for (i = 0; i < 50; i++) {
+    int n = snprintf(fmt, sizeof(fmt), "%s\"field%02d\": %d", i ? ", " : "",
+                     i, i * 7);
+    mbuf_append(&doc, fmt, n);
+  }
+  mbuf_append(&doc, "}", 1);
+
+  /* 20 lookups of fields across the object. */
+  t1 = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    for (j = 0; j < 20; j++) {
+      snprintf(fmt, sizeof(fmt), "{field%02d: %%d}", (j * 37) % 50);
+      v = 0;
+      json_scanf(doc.buf, doc.len, fmt, &v);
+      sum1 += v;
+    }
+  }
+  t1 = cs_time() - t1;
+
+  t2 = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    ASSERT_EQ(json_tape_init(&tape, doc.buf, doc.len), (int) doc.len);
+    for (j = 0; j < 20; j++) {
+      snprintf(fmt, sizeof(fmt), "{field%02d: %%d}", (j * 37) % 50);
+      v = 0;
+      json_tape_scanf(&tape, fmt, &v);
+      sum2 += v;
+    }
+    json_tape_free(&tape);
+  }
+  t2 = cs_time() - t2;
+  ASSERT_EQ(sum1, sum2);
+
+  printf("    20 lookups in a %d byte object: json_scanf %.1f us, "
+         "json_tape %.1f us (%.1fx)\n",
+         (int) doc.len, t1 * 1e6 / num_iter, t2 * 1e6 / num_iter, t1 / t2);
+  mbuf_free(&doc);
+  return NULL;
+}
+
+static int mbuf_printer(struct json_out *out, const char *buf, size_t len) {
+  mbuf_append((struct mbuf *) out->u.data, buf, len);
+  return len;
+}
+
+static const char *test_json_printf(void) {
+  static const struct {
+    double d;
+    const char *s;
+  } doubles[] = {
+      {0.1, "0.1"},   {-12.5, "-12.5"},     {100, "100"},   {0.001, "0.001"},
+      {1e20, "1e+20"}, {1e-7, "1e-07"},     {-0.0, "-0"},
+      {2.0 / 3, "0.6666666666666666"},      {1546300800.125, "1546300800.125"},
+      {1.7976931348623157e308, "1.7976931348623157e+308"},
+  };
+  char buf[100], scratch[8];
+  struct mbuf mb;
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  int i;
+
+  for (i = 0; i < (int) ARRAY_SIZE(doubles); i++) {
+    out.u.buf.len = 0;
+    ASSERT_EQ(json_printf(&out, "%D", doubles[i].d),
+              (int) strlen(doubles[i].s));
+    ASSERT_STREQ(buf, doubles[i].s);
+  }
+  out.u.buf.len = 0;
+  json_printf(&out, "{a: %d, b: %u, c: %ld, d: %lld, e: %zu}", -2147483647 - 1,
+              4294967295U, -7L, (long long) -9223372036854775807LL - 1,
+              (size_t) 0);
+  ASSERT_STREQ(buf, "{\"a\": -2147483648, \"b\": 4294967295, \"c\": -7, "
+                    "\"d\": -9223372036854775808, \"e\": 0}");
+  out.u.buf.len = 0;
+  json_printf(&out, "[%s, %.*s, %Q, %H]", "x", 2, "yzw", "\x01\x1f\x7f\"",
+              17, "0123456789abcdef!");
+  ASSERT_STREQ(buf, "[x, yz, \"\\u0001\\u001f\\u007f\\\"\", "
+                    "\"3031323334353637383961626364656621\"]");
+
+  /* Buffered output is the same, whatever the scratch buffer size. */
+  mbuf_init(&mb, 0);
+  for (i = 1; i <= (int) sizeof(scratch); i++) {
+    struct json_out mout = {mbuf_printer, {{(char *) &mb, 0, 0}}};
+    mb.len = 0;
+    ASSERT_EQ(json_printf_buffered(&mout, scratch, i, "[%s, %.*s, %Q, %H]",
+                                   "x", 2, "yzw", "\x01\x1f\x7f\"", 17,
+                                   "0123456789abcdef!"),
+              (int) strlen(buf));
+    ASSERT_EQ(mb.len, strlen(buf));
+    ASSERT(memcmp(mb.buf, buf, mb.len) == 0);
+  }
+  mbuf_free(&mb);
+
+  return NULL;
+}
+
+static const char *bench_json_printf(void) {
+  const char *fmt =
+      "{id: %d, seq: %llu, sensor: %Q, value: %D, ok: %B, raw: %H}\n";
+  char scratch[512];
+  struct mbuf mb;
+  struct json_out out = {mbuf_printer, {{(char *) &mb, 0, 0}}};
+  int i, num_iter = 100000;
+  size_t len;
+  double t1, t2;
+
+  mbuf_init(&mb, 0);
+  t1 = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    mb.len = 0;
+    json_printf(&out, fmt, i, (unsigned long long) i * 1000003,
+                "temperature/outdoor-north", i * 0.25 - 40, i & 1, 4,
+                "\x12\x34\xab\xcd");
+  }
+  t1 = cs_time() - t1;
+  len = mb.len;
+
+  t2 = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    mb.len = 0;
+    json_printf_buffered(&out, scratch, sizeof(scratch), fmt, i,
+                         (unsigned long long) i * 1000003,
+                         "temperature/outdoor-north", i * 0.25 - 40, i & 1,
+                         4, "\x12\x34\xab\xcd");
+  }
+  t2 = cs_time() - t2;
+  ASSERT_EQ(mb.len, len);
+
+  printf("    json_printf %d byte objects: %.0f/s, buffered %.0f/s\n",
+         (int) len, num_iter / t1, num_iter / t2);
+  mbuf_free(&mb);
+  return NULL;
+}
+
+/* Applies a json_setf() edit to `mb` in place. */
+static int setf_mbuf(struct mbuf *mb, const char *path, const char *fmt,
+                     int val) {
+  struct mbuf tmp;
+  struct json_out out = {mbuf_printer, {{(char *) &tmp, 0, 0}}};
+  int res;
+  mbuf_init(&tmp, mb->len + 100);
+  res = json_setf(mb->buf, mb->len, &out, path, fmt, val);
+  mbuf_free(mb);
+  *mb = tmp;
+  return res;
+}
+
+static const char *test_json_setf_batch(void) {
+  const char *s = "{ \"a\": 1, \"b\": [ 2 ], \"c\": 3 }";
+  static const char *docs[] = {
+      "{\"x\": {\"a\": 1, \"b\": [10, 20, {\"c\": true}]}, \"y\": \"str\", "
+      "\"z\": [], \"w\": {}}",
+      "{\"a\": {\"b\": 1, \"bc\": 2, \"d\": [1, 2, 3]}, \"e\": true, \"f\": 4, "
+      "\"g\": 5}",
+  };
+  static const char *vals[3] = {"100", "101", "102"};
+  static const struct {
+    int doc;
+    struct {
+      const char *path;
+      int del;
+    } e[3];
+  } edits[] = {
+      /* Changes and deletions of existing values, applied in one pass. */
+      {0, {{".y", 0}, {".x.b[1]", 0}, {".x.a", 0}}},
+      {0, {{".x.b[2].c", 0}, {".w", 0}, {".z", 0}}},
+      {1, {{".a.b", 0}, {".a.bc", 1}, {".f", 0}}},
+      {1, {{".e", 1}, {".a.d[1]", 0}, {".g", 1}}},
+      {1, {{".a.d[2]", 1}, {".a.b", 0}, {".f", 1}}},
+      {1, {{".f", 0}, {".g", 1}, {".a.bc", 0}}},
+      {1, {{".e", 1}, {".f", 1}, {".a.b", 0}}},
+      /* Nested, overlapping, shifted and added values, applied one by one. */
+      {0, {{".x", 0}, {".x.a", 0}, {".y", 0}}},
+      {0, {{".x.b[0]", 1}, {".x.b[1]", 0}, {".y", 1}}},
+      {0, {{".w.new", 0}, {".w.other", 0}, {".z[]", 0}}},
+      {1, {{".a.b", 1}, {".a.bc", 1}, {".g", 0}}},
+      {1, {{".a.d[1]", 1}, {".a.d[1]", 0}, {".g", 0}}},
+  };
+  struct mbuf expected, mb;
+  struct json_out out = {mbuf_printer, {{(char *) &mb, 0, 0}}};
+  int i, j, res;
+
+  mbuf_init(&mb, 0);
+  ASSERT_EQ(json_setf_batch(s, strlen(s), &out, ".a", "%d", 7, ".c", NULL,
+                            ".d", "%Q", "x", NULL),
+            2);
+  mbuf_append(&mb, "", 1);
+  ASSERT_STREQ(mb.buf, "{ \"a\": 7, \"b\": [ 2 ],\"d\":\"x\" }");
+
+  for (i = 0; i < (int) ARRAY_SIZE(edits); i++) {
+    const char *doc = docs[edits[i].doc];
+    res = 0;
+    mbuf_init(&expected, 0);
+    mbuf_append(&expected, doc, strlen(doc));
+    for (j = 0; j < 3; j++) {
+      res += setf_mbuf(&expected, edits[i].e[j].path,
+                       edits[i].e[j].del ? NULL : "%d", 100 + j);
+    }
+    mb.len = 0;
+#define BATCH_EDIT(j) edits[i].e[j].path, (edits[i].e[j].del ? NULL : vals[j])
+    ASSERT_EQ(json_setf_batch(doc, strlen(doc), &out, BATCH_EDIT(0),
+                              BATCH_EDIT(1), BATCH_EDIT(2), NULL),
+              res);
+#undef BATCH_EDIT
+    ASSERT_EQ(mb.len, expected.len);
+    ASSERT(memcmp(mb.buf, expected.buf, mb.len) == 0);
+    mbuf_free(&expected);
+  }
+  mbuf_free(&mb);
+
+  /* Keys sharing a prefix are not nested. */
+  const char *doc = docs[1];
+  mb.len = 0;
+  ASSERT_EQ(json_setf_batch(doc, strlen(doc), &out, ".a.b", "%d", 7, ".a.bc",
+                            NULL, ".e", NULL, NULL),
+            3);
+  mbuf_append(&mb, "", 1);
+  ASSERT_STREQ(mb.buf,
+               "{\"a\": {\"b\": 7, \"d\": [1, 2, 3]}, \"f\": 4, \"g\": 5}");
+  mbuf_free(&mb);
+
+  return NULL;
+}
+
+static const char *bench_json_setf_batch(void) {
+  char path[20][50];
+  struct mbuf doc, seq, batch;
+  struct json_out out = {mbuf_printer, {{(char *) &batch, 0, 0}}};
+  int i, num_iter = 100;
+  double t1, t2;
+
+  /* A device shadow with 20 KB of reported state. */
+  mbuf_init(&doc, 0);
+  mbuf_append(&doc, "{\"state\": {\"reported\": {", 24);
+  for (i = 0; doc.len < 20 * 1024; i++) {
+    char buf[100];
+    int n = snprintf(buf, sizeof(buf),
+                     "%s\"sensor_%03d\": {\"value\": %d, \"unit\": \"C\", "
+                     "\"ok\": true}",
+                     i ? ", " : "", i, i * 3);
+    mbuf_append(&doc, buf, n);
+  }
+  mbuf_append(&doc, "}}}", 3);
+  for (i = 0; i < 20; i++) {
+    snprintf(path[i], sizeof(path[i]), ".state.reported.sensor_%03d.value",
+             i * 17);
+  }
+
+  mbuf_init(&seq, 0);
+  t1 = cs_time();
+  for (int k = 0; k < num_iter; k++) {
+    mbuf_free(&seq);
+    mbuf_init(&seq, doc.len);
+    mbuf_append(&seq, doc.buf, doc.len);
+    for (i = 0; i < 20; i++) setf_mbuf(&seq, path[i], "%d", -i);
+  }
+  t1 = cs_time() - t1;
+
+  mbuf_init(&batch, 0);
+  t2 = cs_time();
+  for (int k = 0; k < num_iter; k++) {
+    batch.len = 0;
+    json_setf_batch(
+        doc.buf, doc.len, &out, path[0], "%d", 0, path[1], "%d", -1, path[2],
+        "%d", -2, path[3], "%d", -3, path[4], "%d", -4, path[5], "%d", -5,
+        path[6], "%d", -6, path[7], "%d", -7, path[8], "%d", -8, path[9], "%d",
+        -9, path[10], "%d", -10, path[11], "%d", -11, path[12], "%d", -12,
+        path[13], "%d", -13, path[14], "%d", -14, path[15], "%d", -15,
+        path[16], "%d", -16, path[17], "%d", -17, path[18], "%d", -18,
+        path[19], "%d", -19, NULL);
+  }
+  t2 = cs_time() - t2;
+  ASSERT_EQ(batch.len, seq.len);
+  ASSERT(memcmp(batch.buf, seq.buf, seq.len) == 0);
+
+  printf("    20 edits to a %d KB document: json_setf %.0f us, "
+         "json_setf_batch %.0f us\n",
+         (int) (doc.len / 1024), t1 * 1e6 / num_iter, t2 * 1e6 / num_iter);
+  mbuf_free(&doc);
+  mbuf_free(&seq);
+  mbuf_free(&batch);
+  return NULL;
+}
+
+/* Feeds `s` to the UBJSON parser in chunks that end at `splits`. */
+static int ubjson_walk_chunks(const char *s, int len, const int *splits,
+                              int num_splits, struct mbuf *log) {
+  struct cs_ubjson_walk_ctx ctx;
+  int i, from = 0, to, n = 0;
+  cs_ubjson_walk_ctx_init(&ctx, log_cb, log);
+  for (i = 0; i <= num_splits && n >= 0; i++) {
+    char *chunk;
+    to = (i < num_splits ? splits[i] : len);
+    chunk = (char *) malloc(to - from + 1);
+    memcpy(chunk, s + from, to - from);
+    n = cs_ubjson_walk_ctx_feed(&ctx, chunk, to - from);
+    free(chunk);
+    from = to;
+  }
+  return cs_ubjson_walk_ctx_finish(&ctx);
+}
+
+/* Same, without lengths of END tokens, which differ between formats. */
+static void log_values_cb(void *callback_data, const char *name,
+                          size_t name_len, const char *path,
+                          const struct json_token *token) {
+  struct json_token t = *token;
+  if (t.type == JSON_TYPE_OBJECT_END || t.type == JSON_TYPE_ARRAY_END) {
+    t.len = 0;
+  }
+  log_cb(callback_data, name, name_len, path, &t);
+}
+
+static void last_token_cb(void *callback_data, const char *name,
+                          size_t name_len, const char *path,
+                          const struct json_token *token) {
+  *(struct json_token *) callback_data = *token;
+  (void) name;
+  (void) name_len;
+  (void) path;
+}
+
+static const char *test_ubjson_walk(void) {
+#define UB(s) s, sizeof(s) - 1
+  static const struct {
+    const char *ubjson;
+    int len;
+    const char *json;
+  } docs[] = {
+      /* Optimized containers. */
+      {UB("[$i#U\x03\x01\x02\xfd"), "[1, 2, -3]"},
+      {UB("{#U\x02U\x01" "aZU\x01" "b[$U#i\x02\x05\xff"),
+       "{\"a\": null, \"b\": [5, 255]}"},
+      {UB("{$T#i\x02i\x01xi\x01y"), "{\"x\": true, \"y\": true}"},
+      {UB("[$[#i\x02#i\x01i\x07#i\x00"), "[[7], []]"},
+      {UB("[$S#i\x02i\x03" "abci\x00"), "[\"abc\", \"\"]"},
+      {UB("[#i\x00"), "[]"},
+      /* No-ops, chars and high-precision numbers. */
+      {UB("N[Ni\x01N{U\x01kCxN}NHi\x14" "12345678901234567890]"),
+       "[1, {\"k\": \"x\"}, 12345678901234567890]"},
+      /* Broken documents. */
+      {UB("[$i]"), NULL},
+      {UB("[$N#i\x01"), NULL},
+      {UB("[$T#i\x02"), NULL},
+      {UB("[$Z#l\x7f\xff\xff\xff"), NULL},
+      {UB("[i\x01X]"), NULL},
+      {UB("[Si\xff]"), NULL},
+      {UB("{U\x01" "a"), NULL},
+      {UB("[#i\x02i\x01"), NULL},
+      {UB("{i\x01" "ai\x01]"), NULL},
+  };
+#undef UB
+  struct mbuf doc, expected, log;
+  struct json_token tok;
+  int splits[100];
+  int i, j, n, res;
+
+  /* Everything the encoder emits reads back as the same JSON. */
+  mbuf_init(&doc, 0);
+  cs_ubjson_open_object(&doc);
+  cs_ubjson_emit_object_key(&doc, "a", 1);
+  cs_ubjson_emit_autoint(&doc, 1);
+  cs_ubjson_emit_object_key(&doc, "b", 1);
+  cs_ubjson_open_array(&doc);
+  cs_ubjson_emit_autonumber(&doc, 2.5);
+  cs_ubjson_emit_float32(&doc, 0.1f);
+  cs_ubjson_emit_autoint(&doc, -300);
+  cs_ubjson_emit_autoint(&doc, 70000);
+  cs_ubjson_emit_autoint(&doc, -5000000000LL);
+  cs_ubjson_emit_float64(&doc, NAN);
+  cs_ubjson_open_object(&doc);
+  cs_ubjson_emit_object_key(&doc, "c", 1);
+  cs_ubjson_emit_boolean(&doc, 1);
+  cs_ubjson_close_object(&doc);
+  cs_ubjson_close_array(&doc);
+  cs_ubjson_emit_object_key(&doc, "d", 1);
+  cs_ubjson_emit_string(&doc, "x y", 3);
+  cs_ubjson_emit_object_key(&doc, "", 0);
+  cs_ubjson_emit_bin(&doc, "\x01\x02", 2);
+  cs_ubjson_emit_object_key(&doc, "e", 1);
+  cs_ubjson_emit_null(&doc);
+  cs_ubjson_emit_object_key(&doc, "f", 1);
+  cs_ubjson_open_object(&doc);
+  cs_ubjson_close_object(&doc);
+  cs_ubjson_close_object(&doc);
+  {
+    const char *json =
+        "{\"a\": 1, \"b\": [2.5, 0.1, -300, 70000, -5000000000, null, "
+        "{\"c\": true}], \"d\": \"x y\", \"\": [1, 2], \"e\": null, "
+        "\"f\": {}}";
+    mbuf_init(&expected, 0);
+    mbuf_init(&log, 0);
+    ASSERT_EQ(json_walk(json, strlen(json), log_values_cb, &expected),
+              (int) strlen(json));
+    ASSERT_EQ(cs_ubjson_walk(doc.buf, doc.len, log_values_cb, &log),
+              (int) doc.len);
+    ASSERT_EQ(log.len, expected.len);
+    ASSERT(memcmp(log.buf, expected.buf, log.len) == 0);
+    mbuf_free(&expected);
+    mbuf_free(&log);
+  }
+
+  /* The end token covers the container. */
+  ASSERT_EQ(cs_ubjson_walk(doc.buf, doc.len, last_token_cb, &tok),
+            (int) doc.len);
+  ASSERT_EQ(tok.type, JSON_TYPE_OBJECT_END);
+  ASSERT(tok.ptr == doc.buf);
+  ASSERT_EQ(tok.len, (int) doc.len);
+  mbuf_free(&doc);
+
+  for (i = 0; i < (int) ARRAY_SIZE(docs); i++) {
+    const char *s = docs[i].ubjson;
+    n = docs[i].len;
+    /* Broken documents may give no events: allocate for memcmp(). */
+    mbuf_init(&expected, 100);
+    mbuf_init(&log, 100);
+    res = cs_ubjson_walk(s, n, log_cb, &expected);
+    if (docs[i].json != NULL) {
+      struct mbuf ub_log;
+      mbuf_init(&ub_log, 0);
+      ASSERT_EQ(res, n);
+      ASSERT_EQ(cs_ubjson_walk(s, n, log_values_cb, &ub_log), n);
+      ASSERT_EQ(json_walk(docs[i].json, strlen(docs[i].json), log_values_cb,
+                          &log),
+                (int) strlen(docs[i].json));
+      ASSERT_EQ(log.len, ub_log.len);
+      ASSERT(memcmp(log.buf, ub_log.buf, log.len) == 0);
+      mbuf_free(&ub_log);
+    } else {
+      ASSERT(res < 0);
+    }
+    /* Every split point, then every byte in its own chunk. */
+    for (j = 0; j <= n + 1; j++) {
+      int num_splits = 1;
+      if (j <= n) {
+        splits[0] = j;
+      } else {
+        for (num_splits = 0; num_splits < n; num_splits++) {
+          splits[num_splits] = num_splits;
+        }
+      }
+      log.len = 0;
+      ASSERT_EQ(ubjson_walk_chunks(s, n, splits, num_splits, &log), res);
+      ASSERT_EQ(log.len, expected.len);
+      ASSERT(memcmp(log.buf, expected.buf, log.len) == 0);
+    }
+    mbuf_free(&expected);
+    mbuf_free(&log);
+  }
+
+  {
+    /* The parser stops at the end of the document. */
+    struct cs_ubjson_walk_ctx ctx;
+    cs_ubjson_walk_ctx_init(&ctx, NULL, NULL);
+    ASSERT_EQ(cs_ubjson_walk_ctx_feed(&ctx, "[i", 2), 2);
+    ASSERT_EQ(cs_ubjson_walk_ctx_feed(&ctx, "\x01]Z", 3), 2);
+    ASSERT_EQ(cs_ubjson_walk_ctx_feed(&ctx, "Z", 1), 0);
+    ASSERT_EQ(cs_ubjson_walk_ctx_finish(&ctx), 4);
+
+    /* The state stack is bounded. */
+    cs_ubjson_walk_ctx_init(&ctx, NULL, NULL);
+    for (i = 0; i < CS_UBJSON_WALK_MAX_DEPTH; i++) {
+      ASSERT_EQ(cs_ubjson_walk_ctx_feed(&ctx, "[", 1), 1);
+    }
+    ASSERT_EQ(cs_ubjson_walk_ctx_feed(&ctx, "[[", 2), JSON_STRING_INVALID);
+    ASSERT_EQ(cs_ubjson_walk_ctx_finish(&ctx), JSON_STRING_INVALID);
+  }
+
+  return NULL;
+}
+
+static double bench_ubjson(const char *s, size_t len, int ubjson,
+                           int num_iter) {
+  struct walk_data wd;
+  int i, res;
+  double t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    memset(&wd, 0, sizeof(wd));
+    if (ubjson) {
+      res = cs_ubjson_walk(s, len, walk_cb, &wd);
+    } else {
+      res = json_walk(s, len, walk_cb, &wd);
+    }
+    if (res != (int) len) return 0;
+  }
+  t = cs_time() - t;
+  return t * 1e6 / num_iter;
+}
+
+static const char *bench_ubjson_walk(void) {
+  const char *sample =
+      "{\"ts\": 1546300800.125, \"sensor\": \"temperature/outdoor-north\", "
+      "\"value\": -12.5, \"ok\": true, \"tags\": [\"a\", \"b\"]}";
+  struct mbuf json, ub;
+  double tj, tu;
+  int i;
+
+  /* The same 1000 samples in both formats. */
+  mbuf_init(&json, 0);
+  mbuf_init(&ub, 0);
+  mbuf_append(&json, "[", 1);
+  append_copies(&json, sample, 1000);
+  mbuf_append(&json, "]", 1);
+  cs_ubjson_open_array(&ub);
+  for (i = 0; i < 1000; i++) {
+    cs_ubjson_open_object(&ub);
+    cs_ubjson_emit_object_key(&ub, "ts", 2);
+    cs_ubjson_emit_autonumber(&ub, 1546300800.125);
+    cs_ubjson_emit_object_key(&ub, "sensor", 6);
+    cs_ubjson_emit_string(&ub, "temperature/outdoor-north", 25);
+    cs_ubjson_emit_object_key(&ub, "value", 5);
+    cs_ubjson_emit_autonumber(&ub, -12.5);
+    cs_ubjson_emit_object_key(&ub, "ok", 2);
+    cs_ubjson_emit_boolean(&ub, 1);
+    cs_ubjson_emit_object_key(&ub, "tags", 4);
+    cs_ubjson_open_array(&ub);
+    cs_ubjson_emit_string(&ub, "a", 1);
+    cs_ubjson_emit_string(&ub, "b", 1);
+    cs_ubjson_close_array(&ub);
+    cs_ubjson_close_object(&ub);
+  }
+  cs_ubjson_close_array(&ub);
+  tj = bench_ubjson(json.buf, json.len, 0, 100);
+  tu = bench_ubjson(ub.buf, ub.len, 1, 100);
+  ASSERT(tj > 0 && tu > 0);
+  printf("    1000 samples: json_walk %.0f us (%d bytes), "
+         "cs_ubjson_walk %.0f us (%d bytes)\n",
+         tj, (int) json.len, tu, (int) ub.len);
+
+  /* 4096 ADC readings: a JSON array vs a typed array. */
+  json.len = ub.len = 0;
+  mbuf_append(&json, "[", 1);
+  mbuf_append(&ub, "[$I#I\x10\x00", 7);
+  for (i = 0; i < 4096; i++) {
+    char buf[10];
+    int v = (i * 7919) % 4096;
+    mbuf_append(&json, buf, snprintf(buf, sizeof(buf), "%s%d", i ? "," : "",
+                                     v));
+    buf[0] = v >> 8;
+    buf[1] = v & 0xff;
+    mbuf_append(&ub, buf, 2);
+  }
+  mbuf_append(&json, "]", 1);
+  tj = bench_ubjson(json.buf, json.len, 0, 100);
+  tu = bench_ubjson(ub.buf, ub.len, 1, 100);
+  ASSERT(tj > 0 && tu > 0);
+  printf("    4096 int16 readings: json_walk %.0f us (%d bytes), "
+         "cs_ubjson_walk %.0f us (%d bytes)\n",
+         tj, (int) json.len, tu, (int) ub.len);
+
+  mbuf_free(&json);
+  mbuf_free(&ub);
+  return NULL;
+}
+
+static void ub_mbuf_cb(char *d, size_t l, int end, void *user_data) {
+  mbuf_append((struct mbuf *) user_data, d, l);
+  (void) end;
+}
+
+/* Adds a sample to `arr`, 10 values. Properties are rendered in reverse. */
+static void ub_add_sample(struct ub_ctx *ctx, ub_val_t arr, int i) {
+  ub_val_t obj = ub_create_object(ctx), tags = ub_create_array(ctx);
+  char name[20];
+  snprintf(name, sizeof(name), "sensor_%d", i);
+  ub_add_prop(ctx, obj, "tags", tags);
+  ub_array_push(ctx, tags, ub_create_cstring(ctx, "a"));
+  ub_array_push(ctx, tags, ub_create_cstring(ctx, "b"));
+  ub_add_prop(ctx, obj, "unit", ub_create_cstring(ctx, "C"));
+  ub_add_prop(ctx, obj, "ok", ub_create_boolean(1));
+  ub_add_prop(ctx, obj, "value", ub_create_number(-12.5));
+  ub_add_prop(ctx, obj, "name", ub_create_cstring(ctx, name));
+  ub_add_prop(ctx, obj, "id", ub_create_number(i));
+  ub_array_push(ctx, arr, obj);
+}
+
+static const char *test_ub_render(void) {
+  const char *json =
+      "{\"adc\": [-1, 0, 4095], \"empty\": {}, \"s\": [{\"id\": 0, "
+      "\"name\": \"sensor_0\", \"value\": -12.5, \"ok\": true, "
+      "\"unit\": \"C\", \"tags\": [\"a\", \"b\"]}, {\"id\": 1, "
+      "\"name\": \"sensor_1\", \"value\": -12.5, \"ok\": true, "
+      "\"unit\": \"C\", \"tags\": [\"a\", \"b\"]}], "
+      "\"long\": \"0123456789012345678901234567890123456789\", \"n\": null}";
+  struct ub_ctx *ctx = ub_ctx_new();
+  ub_val_t root = ub_create_object(ctx), arr = ub_create_array(ctx);
+  const int16_t adc[] = {-1, 0, 4095};
+  struct mbuf out, expected, log;
+  int i;
+
+  ub_add_prop(ctx, root, "n", ub_create_null());
+  ub_add_prop(ctx, root, "long",
+              ub_create_string(ctx, mg_mk_str_n("0123456789012345678901234567"
+                                                "890123456789xxx",
+                                                40)));
+  ub_add_prop(ctx, root, "s", arr);
+  for (i = 0; i < 2; i++) ub_add_sample(ctx, arr, i);
+  ub_add_prop(ctx, root, "empty", ub_create_object(ctx));
+  ub_add_prop(ctx, root, "adc",
+              ub_create_typed_array(ctx, CS_UBJSON_ELEM_INT16, adc, 3));
+
+  /* Rendering frees the context. */
+  mbuf_init(&out, 0);
+  ub_render(ctx, root, ub_mbuf_cb, &out);
+
+  mbuf_init(&expected, 0);
+  mbuf_init(&log, 0);
+  ASSERT_EQ(json_walk(json, strlen(json), log_values_cb, &expected),
+            (int) strlen(json));
+  ASSERT_EQ(cs_ubjson_walk(out.buf, out.len, log_values_cb, &log),
+            (int) out.len);
+  ASSERT_EQ(log.len, expected.len);
+  ASSERT(memcmp(log.buf, expected.buf, log.len) == 0);
+  mbuf_free(&out);
+  mbuf_free(&expected);
+  mbuf_free(&log);
+
+  return NULL;
+}
+
+/* A document of 1000 samples, 10k values. */
+static struct ub_ctx *ub_build_samples(void) {
+  struct ub_ctx *ctx = ub_ctx_new();
+  ub_val_t root = ub_create_object(ctx), arr = ub_create_array(ctx);
+  int i;
+  ub_add_prop(ctx, root, "samples", arr);
+  for (i = 0; i < 1000; i++) ub_add_sample(ctx, arr, i);
+  return ctx;
+}
+
+static const char *bench_ub_build(void) {
+  int i, num_iter = 100;
+  size_t heap = 0;
+  double t;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  {
+    /* Heap held by the document is what freeing it returns. */
+    struct ub_ctx *ctx = ub_build_samples();
+    heap = mallinfo2().uordblks;
+    ub_ctx_free(ctx);
+    heap -= mallinfo2().uordblks;
+  }
+#endif
+
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) ub_ctx_free(ub_build_samples());
+  t = cs_time() - t;
+  printf("    10k values: build and free %.0f us, %d KB of heap\n",
+         t * 1e6 / num_iter, (int) (heap / 1024));
+  return NULL;
+}
+
+static const char *test_ubjson_typed_array(void) {
+  const int8_t i8[] = {-128, 0, 127};
+  const uint8_t u8[] = {0, 255};
+  const int16_t i16[] = {-32768, -2, 4095};
+  const int32_t i32[] = {INT32_MIN, 70000};
+  const int64_t i64[] = {-5000000000LL, INT64_MAX};
+  const float f32[] = {0.1f, -1.5f};
+  const double f64[] = {1546300800.125, 1e-300};
+  const char *json =
+      "[[-128, 0, 127], [0, 255], [-32768, -2, 4095], [-2147483648, "
+      "70000], [-5000000000, 9223372036854775807], [0.1, -1.5], "
+      "[1546300800.125, 1e-300], []]";
+  struct mbuf mb, expected, log;
+
+  mbuf_init(&mb, 0);
+  cs_ubjson_open_array(&mb);
+  cs_ubjson_emit_int8_array(&mb, i8, ARRAY_SIZE(i8));
+  cs_ubjson_emit_uint8_array(&mb, u8, ARRAY_SIZE(u8));
+  cs_ubjson_emit_int16_array(&mb, i16, ARRAY_SIZE(i16));
+  cs_ubjson_emit_int32_array(&mb, i32, ARRAY_SIZE(i32));
+  cs_ubjson_emit_int64_array(&mb, i64, ARRAY_SIZE(i64));
+  cs_ubjson_emit_float32_array(&mb, f32, ARRAY_SIZE(f32));
+  cs_ubjson_emit_float64_array(&mb, f64, ARRAY_SIZE(f64));
+  cs_ubjson_emit_int16_array(&mb, NULL, 0);
+  cs_ubjson_close_array(&mb);
+
+  /* Values are big-endian, with no markers. */
+  ASSERT(memcmp(mb.buf + 18, "[$I#i\x03\x80\x00\xff\xfe\x0f\xff", 12) == 0);
+
+  mbuf_init(&expected, 0);
+  mbuf_init(&log, 0);
+  ASSERT_EQ(json_walk(json, strlen(json), log_values_cb, &expected),
+            (int) strlen(json));
+  ASSERT_EQ(cs_ubjson_walk(mb.buf, mb.len, log_values_cb, &log),
+            (int) mb.len);
+  ASSERT_EQ(log.len, expected.len);
+  ASSERT(memcmp(log.buf, expected.buf, log.len) == 0);
+  mbuf_free(&mb);
+  mbuf_free(&expected);
+  mbuf_free(&log);
+
+  return NULL;
+}
+
+static const char *bench_ubjson_typed_array(void) {
+  int16_t samples[1000];
+  struct mbuf mb;
+  size_t generic_len, typed_len;
+  int i, j, num_iter = 1000;
+  double t1, t2;
+
+  for (i = 0; i < (int) ARRAY_SIZE(samples); i++) {
+    samples[i] = (int16_t)(i * 7919 - 4000000);
+  }
+  mbuf_init(&mb, 0);
+
+  t1 = cs_time();
+  for (j = 0; j < num_iter; j++) {
+    mb.len = 0;
+    cs_ubjson_open_array(&mb);
+    for (i = 0; i < (int) ARRAY_SIZE(samples); i++) {
+      cs_ubjson_emit_int16(&mb, samples[i]);
+    }
+    cs_ubjson_close_array(&mb);
+  }
+  t1 = cs_time() - t1;
+  generic_len = mb.len;
+
+  t2 = cs_time();
+  for (j = 0; j < num_iter; j++) {
+    mb.len = 0;
+    cs_ubjson_emit_int16_array(&mb, samples, ARRAY_SIZE(samples));
+  }
+  t2 = cs_time() - t2;
+  typed_len = mb.len;
+
+  printf("    1000 int16 samples: generic array %.2f us (%d bytes), "
+         "typed array %.2f us (%d bytes)\n",
+         t1 * 1e6 / num_iter, (int) generic_len, t2 * 1e6 / num_iter,
+         (int) typed_len);
+  mbuf_free(&mb);
+  return NULL;
+}
+
 #define GRP1 MGOS_EVENT_BASE('G', '0', '1')
 #define GRP2 MGOS_EVENT_BASE('G', '0', '2')
 #define GRP3 MGOS_EVENT_BASE('G', '0', '3')
@@ -201,13 +2066,1130 @@ static const char *test_events(void) {
   return NULL;
 }
 
+static char s_ev_order[8];
+
+static void ev_order_cb(int ev, void *ev_data, void *userdata) {
+  size_t n = strlen(s_ev_order);
+  if (n < sizeof(s_ev_order) - 1) s_ev_order[n] = *((char *) userdata);
+  (void) ev;
+  (void) ev_data;
+}
+
+static const char *test_events_order(void) {
+  const int base = MGOS_EVENT_BASE('T', 'E', 'O');
+  char a = 'a', b = 'b', c = 'c', d = 'd';
+  ASSERT(mgos_event_add_handler(base + 1, ev_order_cb, &a));
+  ASSERT(mgos_event_add_group_handler(base, ev_order_cb, &b));
+  ASSERT(mgos_event_add_handler(base + 1, ev_order_cb, &c));
+  ASSERT(mgos_event_add_handler(base + 2, ev_order_cb, &d));
+
+  /* Newest first, regardless of the handler type. */
+  memset(s_ev_order, 0, sizeof(s_ev_order));
+  ASSERT_EQ(mgos_event_trigger(base + 1, NULL), 3);
+  ASSERT_STREQ(s_ev_order, "cba");
+  memset(s_ev_order, 0, sizeof(s_ev_order));
+  ASSERT_EQ(mgos_event_trigger(base + 2, NULL), 2);
+  ASSERT_STREQ(s_ev_order, "db");
+
+  /* Group handler can only be removed by the base number. */
+  ASSERT(!mgos_event_remove_group_handler(base + 1, ev_order_cb, &b));
+  ASSERT(mgos_event_remove_group_handler(base, ev_order_cb, &b));
+  ASSERT(!mgos_event_remove_handler(base + 1, ev_order_cb, &d));
+  ASSERT(mgos_event_remove_handler(base + 1, ev_order_cb, &a));
+  ASSERT(mgos_event_remove_handler(base + 2, ev_order_cb, &d));
+  memset(s_ev_order, 0, sizeof(s_ev_order));
+  ASSERT_EQ(mgos_event_trigger(base + 1, NULL), 1);
+  ASSERT_STREQ(s_ev_order, "c");
+  ASSERT_EQ(mgos_event_trigger(base + 2, NULL), 0);
+  ASSERT(mgos_event_remove_handler(base + 1, ev_order_cb, &c));
+  ASSERT_EQ(mgos_event_trigger(base + 1, NULL), 0);
+
+  /* Handlers can be added before the base is registered, but only once. */
+  ASSERT(mgos_event_register_base(base, "teo"));
+  ASSERT(!mgos_event_register_base(base, "teo2"));
+  return NULL;
+}
+
+static void bench_ev_cb(int ev, void *ev_data, void *userdata) {
+  (*((int *) userdata))++;
+  (void) ev;
+  (void) ev_data;
+}
+
+static const char *bench_events(void) {
+  static const int counts[] = {10, 100, 1000};
+  const int num_iter = 100000;
+  int num_calls = 0;
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    const int n = counts[i];
+    int j;
+    /* Spread handlers over 10 bases with 16 events each, plus the one. */
+    for (j = 0; j < n; j++) {
+      int ev = MGOS_EVENT_BASE('B', 'E', 'A' + j % 10) + (j / 10) % 16;
+      ASSERT(mgos_event_add_handler(ev, bench_ev_cb, &num_calls));
+    }
+    const int ev = MGOS_EVENT_BASE('B', 'E', 'A') + 0x80;
+    ASSERT(mgos_event_add_handler(ev, bench_ev_cb, &num_calls));
+    num_calls = 0;
+    double t = cs_time();
+    for (j = 0; j < num_iter; j++) mgos_event_trigger(ev, NULL);
+    t = cs_time() - t;
+    ASSERT_EQ(num_calls, num_iter);
+    printf("    %4d handlers: trigger %.3f us\n", n, t * 1e6 / num_iter);
+    ASSERT(mgos_event_remove_handler(ev, bench_ev_cb, &num_calls));
+    for (j = 0; j < n; j++) {
+      int ev = MGOS_EVENT_BASE('B', 'E', 'A' + j % 10) + (j / 10) % 16;
+      ASSERT(mgos_event_remove_handler(ev, bench_ev_cb, &num_calls));
+    }
+  }
+  return NULL;
+}
+
+/* Minimal environment for the software timers. */
+static struct mg_mgr s_mgr;
+
+struct mg_mgr *mgos_get_mgr(void) {
+  return &s_mgr;
+}
+
+static int s_num_polls_scheduled = 0;
+
+void mongoose_schedule_poll(bool from_isr) {
+  s_num_polls_scheduled++;
+  (void) from_isr;
+}
+
+static mgos_poll_cb_t s_poll_cb = NULL;
+static void *s_poll_cb_arg = NULL;
+
+void mgos_add_poll_cb(mgos_poll_cb_t cb, void *cb_arg) {
+  s_poll_cb = cb;
+  s_poll_cb_arg = cb_arg;
+}
+
+static void run_poll_cbs(void) {
+  if (s_poll_cb != NULL) s_poll_cb(s_poll_cb_arg);
+}
+
+struct mgos_rlock_type *mgos_rlock_create(void) {
+  return (struct mgos_rlock_type *) &s_mgr;
+}
+
+void mgos_rlock(struct mgos_rlock_type *l) {
+  (void) l;
+}
+
+void mgos_runlock(struct mgos_rlock_type *l) {
+  (void) l;
+}
+
+void mgos_rlock_destroy(struct mgos_rlock_type *l) {
+  (void) l;
+}
+
+/* HW timer thread masks "interrupts" with this, see ubuntu_hal_system.c. */
+static pthread_mutex_t s_ints_mux = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void mgos_ints_disable(void) {
+  pthread_mutex_lock(&s_ints_mux);
+}
+
+void mgos_ints_enable(void) {
+  pthread_mutex_unlock(&s_ints_mux);
+}
+
+static int64_t s_uptime_offset = 0;
+
+int64_t mgos_uptime_micros(void) {
+  return (int64_t)(cs_time() * 1000000) + s_uptime_offset;
+}
+
+/*
+ * Deliver MG_EV_TIMER to the timer connection for as long as it is due.
+ * Returns the number of callbacks fired, stores the number of wakeups.
+ */
+static int run_due_timers_n(int *num_wakeups) {
+  struct mg_connection *nc = s_mgr.active_connections;
+  struct mgos_timer_stats st1, st2;
+  mgos_get_timer_stats(&st1);
+  while (nc->ev_timer_time > 0 && nc->ev_timer_time <= mg_time()) {
+    nc->ev_timer_time = 0;
+    nc->handler(nc, MG_EV_TIMER, NULL, nc->user_data);
+  }
+  mgos_get_timer_stats(&st2);
+  if (num_wakeups != NULL) *num_wakeups = st2.num_wakeups - st1.num_wakeups;
+  return st2.num_fired - st1.num_fired;
+}
+
+static int run_due_timers(void) {
+  return run_due_timers_n(NULL);
+}
+
+/*
+ * Move the uptime clock forward. Timer code only looks at the clock when
+ * (re)scheduling, so nudge it with a zero wall time change.
+ */
+static void advance_uptime(double secs) {
+  struct mgos_time_changed_arg arg;
+  s_uptime_offset += (int64_t)(secs * 1000000);
+  arg.delta = 0;
+  mgos_event_trigger(MGOS_EVENT_TIME_CHANGED, &arg);
+}
+
+static intptr_t s_fired[8];
+static int s_num_fired = 0;
+
+static void timer_cb(void *arg) {
+  s_fired[s_num_fired++ % 8] = (intptr_t) arg;
+}
+
+static const char *test_timers(void) {
+  s_num_fired = 0;
+  mgos_timer_id id1 = mgos_set_timer(3000, 0, timer_cb, (void *) 1);
+  mgos_timer_id id2 = mgos_set_timer(1000, 0, timer_cb, (void *) 2);
+  mgos_timer_id id3 =
+      mgos_set_timer(2000, MGOS_TIMER_REPEAT, timer_cb, (void *) 3);
+  mgos_timer_id id4 = mgos_set_timer(4000, 0, timer_cb, (void *) 4);
+  ASSERT(id1 > 0xffff && id2 > 0xffff && id3 > 0xffff && id4 > 0xffff);
+  ASSERT_EQ(run_due_timers(), 0);
+  mgos_clear_timer(id4);
+  mgos_clear_timer(id4); /* Stale ID must be ignored. */
+
+  advance_uptime(3.5);
+  ASSERT_EQ(run_due_timers(), 3);
+  ASSERT_EQ(s_num_fired, 3);
+  ASSERT_EQ(s_fired[0], 2);
+  ASSERT_EQ(s_fired[1], 3);
+  ASSERT_EQ(s_fired[2], 1);
+
+  /* Slot of a fired one-shot timer is reused, but not its ID. */
+  mgos_timer_id id5 = mgos_set_timer(1000, 0, timer_cb, (void *) 5);
+  ASSERT(id5 != id1 && id5 != id2 && id5 != id4);
+  mgos_clear_timer(id1);
+  mgos_clear_timer(id2);
+  advance_uptime(1.5);
+  ASSERT_EQ(run_due_timers(), 2);
+  ASSERT_EQ(s_fired[3], 3);
+  ASSERT_EQ(s_fired[4], 5);
+
+  mgos_clear_timer(id3);
+  mgos_clear_timer(id5);
+  advance_uptime(100);
+  ASSERT_EQ(run_due_timers(), 0);
+  ASSERT_EQ(s_num_fired, 5);
+
+  return NULL;
+}
+
+static mgos_timer_id s_rearm_id = MGOS_INVALID_TIMER_ID;
+
+static void rearm_timer_cb(void *arg) {
+  s_rearm_id = mgos_set_timer(10, 0, rearm_timer_cb, arg);
+}
+
+static const char *test_timers_stale_id(void) {
+  int i;
+  mgos_timer_id other = mgos_set_timer(1000000, 0, timer_cb, NULL);
+  rearm_timer_cb(NULL);
+  mgos_timer_id stale = s_rearm_id;
+  /* Many more re-arms than there are generations. */
+  for (i = 0; i < 10000; i++) {
+    advance_uptime(0.011);
+    ASSERT_EQ(run_due_timers(), 1);
+    ASSERT(s_rearm_id != stale);
+    ASSERT(!mgos_set_timer_slack(stale, 1));
+  }
+  mgos_clear_timer(stale);
+  ASSERT(mgos_set_timer_slack(other, 1));
+  ASSERT(mgos_set_timer_slack(s_rearm_id, 1));
+  mgos_clear_timer(s_rearm_id);
+  mgos_clear_timer(other);
+  return NULL;
+}
+
+static const char *test_timers_slack(void) {
+  int num_wakeups = 0;
+  s_num_fired = 0;
+  mgos_timer_id id1 = mgos_set_timer(1000, 0, timer_cb, (void *) 1);
+  mgos_timer_id id2 = mgos_set_timer(1100, 0, timer_cb, (void *) 2);
+  mgos_timer_id id3 = mgos_set_timer(1200, 0, timer_cb, (void *) 3);
+  ASSERT(mgos_set_timer_slack(id2, 500));
+  ASSERT(mgos_set_timer_slack(id3, 500));
+  ASSERT(!mgos_set_timer_slack(MGOS_INVALID_TIMER_ID, 500));
+
+  advance_uptime(1.05);
+  ASSERT_EQ(run_due_timers_n(&num_wakeups), 1);
+  ASSERT_EQ(num_wakeups, 1);
+  ASSERT_EQ(s_fired[0], 1);
+  /* Both are allowed to run but not required to yet. */
+  advance_uptime(0.25);
+  ASSERT_EQ(run_due_timers_n(&num_wakeups), 0);
+  ASSERT_EQ(num_wakeups, 0);
+  /* Deadline of the first one: both are fired on the same wakeup. */
+  advance_uptime(0.35);
+  ASSERT_EQ(run_due_timers_n(&num_wakeups), 2);
+  ASSERT_EQ(num_wakeups, 1);
+  ASSERT_EQ(s_fired[1], 2);
+  ASSERT_EQ(s_fired[2], 3);
+  ASSERT(!mgos_set_timer_slack(id1, 100));
+
+  return NULL;
+}
+
+static void bench_timer_cb(void *arg) {
+  (void) arg;
+}
+
+static const char *test_timers_time_change(void) {
+  const int n = 1000;
+  const double deltas[] = {3600, -3600, 0.5, -86400 * 365, 86400 * 365};
+  for (int i = 0; i < n; i++) {
+    mgos_set_timer(1000 + rand() % 9000, 0, bench_timer_cb, NULL);
+  }
+  /* Wall clock jumps must neither fire nor delay the timers. */
+  for (size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+    struct mgos_time_changed_arg arg;
+    arg.delta = deltas[i];
+    mgos_event_trigger(MGOS_EVENT_TIME_CHANGED, &arg);
+    const double wakeup = s_mgr.active_connections->ev_timer_time - mg_time();
+    ASSERT(wakeup > 0.9 && wakeup < 2);
+    ASSERT_EQ(run_due_timers(), 0);
+  }
+  advance_uptime(5);
+  int num_fired = run_due_timers();
+  ASSERT(num_fired > 0 && num_fired < n);
+  advance_uptime(5);
+  ASSERT_EQ(num_fired + run_due_timers(), n);
+  ASSERT_EQ(s_mgr.active_connections->ev_timer_time, 0);
+  return NULL;
+}
+
+static const char *test_timers_pool(void) {
+  struct mgos_timer_stats st1, st2;
+  ASSERT(mgos_timers_reserve(100));
+  mgos_get_timer_stats(&st1);
+  ASSERT(st1.pool_size >= 100);
+  ASSERT_EQ(st1.pool_used, 0);
+  /* One-shot churn within the reserved capacity is served from the pool. */
+  for (int i = 0; i < 10000; i++) {
+    mgos_timer_id id = mgos_set_timer(i % 100, 0, bench_timer_cb, NULL);
+    if (i % 2) mgos_clear_timer(id);
+    if (i % 50 == 0) {
+      advance_uptime(1);
+      run_due_timers();
+    }
+  }
+  advance_uptime(1);
+  run_due_timers();
+  mgos_get_timer_stats(&st2);
+  ASSERT_EQ(st2.pool_size, st1.pool_size);
+  ASSERT_EQ(st2.pool_used, 0);
+  ASSERT(st2.pool_max_used >= 25);
+  return NULL;
+}
+
+static void slow_timer_cb(void *arg) {
+  /* Pretend to be busy for `arg` milliseconds. */
+  s_uptime_offset += (intptr_t) arg * 1000;
+}
+
+static const char *test_timers_instr(void) {
+  struct mgos_timer_instr instr;
+  struct mgos_timer_cb_instr ti;
+  struct mgos_timer_stats st0, st;
+  char buf[2048];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+
+  mgos_get_timer_stats(&st0);
+  mgos_timers_reset_instr();
+  mgos_timers_set_instr_enabled(true);
+  mgos_timer_id id1 =
+      mgos_set_timer(100, MGOS_TIMER_REPEAT, slow_timer_cb, (void *) 5);
+  mgos_set_timer(100, 0, slow_timer_cb, (void *) 20);
+  mgos_set_timer(100, 0, bench_timer_cb, NULL);
+  advance_uptime(0.15);
+  ASSERT_EQ(run_due_timers(), 3);
+  mgos_get_timer_stats(&st);
+  ASSERT_EQ(st.num_resyncs - st0.num_resyncs, 0);
+  /* Repeating timer is now 300 ms late, 3 of its periods are skipped. */
+  advance_uptime(0.325);
+  ASSERT_EQ(run_due_timers(), 1);
+  mgos_timers_set_instr_enabled(false);
+
+  mgos_get_timer_stats(&st);
+  ASSERT_EQ(st.num_resyncs - st0.num_resyncs, 1);
+  ASSERT_EQ(st.num_skipped - st0.num_skipped, 3);
+  ASSERT(mgos_timers_get_timer_instr(id1, &ti));
+  ASSERT(ti.cb == slow_timer_cb);
+  ASSERT_EQ(ti.num_calls, 2);
+  ASSERT(ti.max_duration_us >= 5000 && ti.max_duration_us < 6000);
+  ASSERT(ti.max_lateness_us >= 300000);
+  mgos_clear_timer(id1);
+  ASSERT(!mgos_timers_get_timer_instr(id1, &ti));
+
+  mgos_timers_get_instr(&instr);
+  ASSERT(instr.slowest[0].cb == slow_timer_cb);
+  ASSERT_EQ(instr.slowest[0].num_calls, 3);
+  ASSERT(instr.slowest[0].max_duration_us >= 20000);
+  ASSERT(instr.slowest[1].cb == bench_timer_cb);
+  ASSERT(instr.slowest[2].cb == NULL);
+  ASSERT_EQ(instr.duration_hist[15] + instr.duration_hist[13], 3);
+
+  ASSERT(mgos_timers_print_instr(&out) < (int) sizeof(buf));
+  ASSERT(strstr(buf, "\"enabled\": false") != NULL);
+  ASSERT(strstr(buf, "\"num_calls\": 3") != NULL);
+
+  /* RUN_NOW repeating timers are scheduled from now and are not resynced. */
+  mgos_get_timer_stats(&st0);
+  id1 = mgos_set_timer(100, MGOS_TIMER_REPEAT | MGOS_TIMER_RUN_NOW,
+                       bench_timer_cb, NULL);
+  ASSERT_EQ(run_due_timers(), 1);
+  advance_uptime(0.1);
+  ASSERT_EQ(run_due_timers(), 1);
+  mgos_clear_timer(id1);
+  mgos_get_timer_stats(&st);
+  ASSERT_EQ(st.num_resyncs - st0.num_resyncs, 0);
+  ASSERT_EQ(st.num_skipped - st0.num_skipped, 0);
+
+  return NULL;
+}
+
+#define TEST_EVENT_QUEUE_LEN 8
+#define EV_POSTED MGOS_EVENT_BASE('T', 'E', 'P')
+
+struct posted_ev {
+  int producer;
+  int seq;
+};
+
+static struct posted_ev s_posted[100];
+static int s_num_posted = 0;
+static int s_num_freed = 0;
+
+static void posted_ev_cb(int ev, void *ev_data, void *userdata) {
+  if (ev_data != NULL && s_num_posted < (int) ARRAY_SIZE(s_posted)) {
+    s_posted[s_num_posted] = *((struct posted_ev *) ev_data);
+  }
+  s_num_posted++;
+  (void) ev;
+  (void) userdata;
+}
+
+static void posted_ev_free(void *ev_data) {
+  s_num_freed++;
+  (void) ev_data;
+}
+
+static const char *test_event_post(void) {
+  struct mgos_event_queue_stats st0, st;
+  struct posted_ev pe = {.producer = 1, .seq = 0};
+  mgos_event_get_queue_stats(&st0);
+  ASSERT(mgos_event_queue_init(TEST_EVENT_QUEUE_LEN));
+  ASSERT(s_poll_cb != NULL);
+  ASSERT(mgos_event_add_handler(EV_POSTED, posted_ev_cb, NULL));
+
+  /* Data is copied, a burst only needs one poll. */
+  s_num_posted = 0;
+  int num_polls = s_num_polls_scheduled;
+  for (int i = 0; i < 3; i++) {
+    pe.seq = i;
+    ASSERT(mgos_event_post(EV_POSTED, &pe, sizeof(pe), false));
+  }
+  pe.seq = 100;
+  ASSERT_EQ(s_num_posted, 0);
+  ASSERT_EQ(s_num_polls_scheduled, num_polls + 1);
+  run_poll_cbs();
+  ASSERT_EQ(s_num_posted, 3);
+  for (int i = 0; i < 3; i++) ASSERT_EQ(s_posted[i].seq, i);
+  run_poll_cbs();
+  ASSERT_EQ(s_num_posted, 3);
+
+  /* Pointers are passed as is and released after delivery. */
+  s_num_posted = s_num_freed = 0;
+  ASSERT(mgos_event_post_ptr(EV_POSTED, &pe, posted_ev_free, false));
+  ASSERT(mgos_event_post(EV_POSTED, NULL, 0, false));
+  ASSERT_EQ(s_num_freed, 0);
+  run_poll_cbs();
+  ASSERT_EQ(s_num_posted, 2);
+  ASSERT_EQ(s_posted[0].seq, 100);
+  ASSERT_EQ(s_num_freed, 1);
+
+  /* Overflow. */
+  s_num_posted = 0;
+  char big[MGOS_EVENT_POST_MAX_DATA_SIZE + 1];
+  memset(big, 0, sizeof(big));
+  ASSERT(!mgos_event_post(EV_POSTED, big, sizeof(big), false));
+  for (int i = 0; i < TEST_EVENT_QUEUE_LEN; i++) {
+    ASSERT(mgos_event_post(EV_POSTED, NULL, 0, false));
+  }
+  ASSERT(!mgos_event_post(EV_POSTED, NULL, 0, false));
+  ASSERT(!mgos_event_post_ptr(EV_POSTED, &pe, posted_ev_free, false));
+  run_poll_cbs();
+  ASSERT_EQ(s_num_posted, TEST_EVENT_QUEUE_LEN);
+  ASSERT(mgos_event_post(EV_POSTED, NULL, 0, false));
+  run_poll_cbs();
+  ASSERT_EQ(s_num_posted, TEST_EVENT_QUEUE_LEN + 1);
+
+  mgos_event_get_queue_stats(&st);
+  ASSERT_EQ(st.num_posted - st0.num_posted, TEST_EVENT_QUEUE_LEN + 6);
+  ASSERT_EQ(st.num_delivered - st0.num_delivered, TEST_EVENT_QUEUE_LEN + 6);
+  ASSERT_EQ(st.num_dropped - st0.num_dropped, 2);
+  ASSERT_EQ(st.num_too_large - st0.num_too_large, 1);
+  ASSERT_EQ(st.num_batches - st0.num_batches, 4);
+  ASSERT(st.max_batch >= TEST_EVENT_QUEUE_LEN);
+
+  ASSERT(mgos_event_remove_handler(EV_POSTED, posted_ev_cb, NULL));
+  return NULL;
+}
+
+#define NUM_PRODUCERS 4
+#define NUM_EVENTS_PER_PRODUCER 20000
+
+static int s_last_seq[NUM_PRODUCERS];
+static bool s_seq_ok = true;
+
+static void producer_ev_cb(int ev, void *ev_data, void *userdata) {
+  struct posted_ev *pe = (struct posted_ev *) ev_data;
+  if (pe->seq <= s_last_seq[pe->producer]) s_seq_ok = false;
+  s_last_seq[pe->producer] = pe->seq;
+  (*((int *) userdata))++;
+  (void) ev;
+}
+
+static void *producer_thread(void *arg) {
+  struct posted_ev pe = {.producer = (int) (intptr_t) arg, .seq = 0};
+  int num_dropped = 0;
+  for (pe.seq = 0; pe.seq < NUM_EVENTS_PER_PRODUCER; pe.seq++) {
+    if (!mgos_event_post(EV_POSTED, &pe, sizeof(pe), false)) num_dropped++;
+  }
+  return (void *) (intptr_t) num_dropped;
+}
+
+static const char *test_event_post_threads(void) {
+  pthread_t threads[NUM_PRODUCERS];
+  struct mgos_event_queue_stats st0, st;
+  int num_delivered = 0, num_dropped = 0, i;
+  ASSERT(mgos_event_queue_init(TEST_EVENT_QUEUE_LEN));
+  ASSERT(mgos_event_add_handler(EV_POSTED, producer_ev_cb, &num_delivered));
+  mgos_event_get_queue_stats(&st0);
+  for (i = 0; i < NUM_PRODUCERS; i++) {
+    s_last_seq[i] = -1;
+    pthread_create(&threads[i], NULL, producer_thread, (void *) (intptr_t) i);
+  }
+  while (num_delivered + num_dropped <
+         NUM_PRODUCERS * NUM_EVENTS_PER_PRODUCER) {
+    run_poll_cbs();
+    mgos_event_get_queue_stats(&st);
+    num_dropped = st.num_dropped - st0.num_dropped;
+  }
+  for (i = 0; i < NUM_PRODUCERS; i++) {
+    void *res;
+    pthread_join(threads[i], &res);
+    num_dropped -= (int) (intptr_t) res;
+  }
+  ASSERT_EQ(num_dropped, 0);
+  ASSERT(s_seq_ok);
+  mgos_event_get_queue_stats(&st);
+  ASSERT_EQ(st.num_delivered - st0.num_delivered, (uint32_t) num_delivered);
+  ASSERT_EQ(st.num_posted - st0.num_posted, (uint32_t) num_delivered);
+  ASSERT(mgos_event_remove_handler(EV_POSTED, producer_ev_cb, &num_delivered));
+  return NULL;
+}
+
+static void slow_ev_cb(int ev, void *ev_data, void *userdata) {
+  s_uptime_offset += (intptr_t) userdata;
+  (void) ev;
+  (void) ev_data;
+}
+
+static const char *test_event_trace(void) {
+  const int base = MGOS_EVENT_BASE('T', 'E', 'T');
+  struct mgos_event_trace_record recs[5];
+  struct mgos_event_stats evs[3];
+  char buf[1000];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  ASSERT(mgos_event_register_base(base, "tet"));
+  ASSERT(mgos_event_add_handler(base + 1, slow_ev_cb, (void *) 1000));
+  ASSERT(mgos_event_add_handler(base + 2, slow_ev_cb, (void *) 2000));
+  ASSERT(mgos_event_add_handler(base + 2, slow_ev_cb, (void *) 3000));
+
+  ASSERT(mgos_event_trace_start(4));
+  for (int i = 0; i < 3; i++) mgos_event_trigger(base + 1, NULL);
+  for (int i = 0; i < 2; i++) mgos_event_trigger(base + 2, NULL);
+  mgos_event_trigger(base + 3, NULL);
+  mgos_event_trace_stop();
+  mgos_event_trigger(base + 1, NULL);
+
+  /* Ring only keeps the last 4. */
+  ASSERT_EQ(mgos_event_trace_get_records(recs, 5), 4);
+  ASSERT_EQ(recs[0].ev, base + 1);
+  ASSERT_EQ(recs[0].num_handlers, 1);
+  ASSERT(recs[0].duration_us >= 1000 && recs[0].duration_us < 1500);
+  ASSERT_EQ(recs[1].ev, base + 2);
+  ASSERT_EQ(recs[1].num_handlers, 2);
+  ASSERT(recs[1].duration_us >= 5000 && recs[1].duration_us < 5500);
+  ASSERT(recs[2].ts_us >= recs[1].ts_us + recs[1].duration_us);
+  ASSERT_EQ(recs[3].ev, base + 3);
+  ASSERT_EQ(recs[3].num_handlers, 0);
+  ASSERT_EQ(mgos_event_trace_get_records(recs, 1), 1);
+  ASSERT_EQ(recs[0].ev, base + 3);
+
+  /* Counters are not limited by the ring size. */
+  ASSERT_EQ(mgos_event_get_stats(evs, 3), 3);
+  ASSERT_EQ(evs[0].ev, base + 2);
+  ASSERT_EQ(evs[0].num_triggers, 2);
+  ASSERT_EQ(evs[0].num_handlers, 4);
+  ASSERT(evs[0].total_duration_us >= 10000);
+  ASSERT(evs[0].max_duration_us >= 5000);
+  ASSERT_EQ(evs[1].ev, base + 1);
+  ASSERT_EQ(evs[1].num_triggers, 3);
+  ASSERT_EQ(evs[2].ev, base + 3);
+
+  ASSERT(mgos_event_trace_print_chrome(&out) < (int) sizeof(buf));
+  ASSERT(strstr(buf, "{\"traceEvents\": [{\"name\": \"tet+1\", ") == buf);
+  ASSERT(strstr(buf, "\"ph\": \"X\"") != NULL);
+  ASSERT(strstr(buf, "\"name\": \"tet+3\"") != NULL);
+  ASSERT(strstr(buf, "\"handlers\": 2}}") != NULL);
+
+  ASSERT(mgos_event_remove_handler(base + 1, slow_ev_cb, (void *) 1000));
+  ASSERT(mgos_event_remove_handler(base + 2, slow_ev_cb, (void *) 2000));
+  ASSERT(mgos_event_remove_handler(base + 2, slow_ev_cb, (void *) 3000));
+  return NULL;
+}
+
+#define MAX_HW_SAMPLES 5000
+static int64_t s_hw_ts[MAX_HW_SAMPLES];
+static int s_hw_num_samples = 0;
+
+static int64_t mono_micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hw_timer_cb(void *arg) {
+  if (s_hw_num_samples < MAX_HW_SAMPLES) {
+    s_hw_ts[s_hw_num_samples++] = mono_micros();
+  }
+  (void) arg;
+}
+
+static mgos_timer_id s_hw_stop_id = MGOS_INVALID_TIMER_ID;
+
+/* Records a sample and clears the timer after `arg` samples. */
+static void hw_timer_stop_cb(void *arg) {
+  hw_timer_cb(NULL);
+  if (s_hw_num_samples == (intptr_t) arg) mgos_clear_timer(s_hw_stop_id);
+}
+
+/* Wait for at least `n` HW timer callbacks, for up to `timeout_ms`. */
+static int wait_hw_samples(int n, int timeout_ms) {
+  int num_samples = 0;
+  for (int i = 0; i <= timeout_ms; i++) {
+    mgos_ints_disable();
+    num_samples = s_hw_num_samples;
+    mgos_ints_enable();
+    if (num_samples >= n) break;
+    usleep(1000);
+  }
+  return num_samples;
+}
+
+static void reset_hw_samples(void) {
+  mgos_ints_disable();
+  s_hw_num_samples = 0;
+  mgos_ints_enable();
+}
+
+static const char *test_hw_timers(void) {
+  mgos_timer_id ids[MGOS_NUM_HW_TIMERS + 1];
+  reset_hw_samples();
+  mgos_timer_id id = mgos_set_hw_timer(1000, 0, hw_timer_cb, NULL);
+  ASSERT(id != MGOS_INVALID_TIMER_ID);
+  ASSERT_EQ(wait_hw_samples(1, 100), 1);
+  usleep(10000);
+  ASSERT_EQ(wait_hw_samples(1, 0), 1);
+
+  /* Repeating timer that stops itself after 10 samples. */
+  reset_hw_samples();
+  mgos_ints_disable();
+  s_hw_stop_id = mgos_set_hw_timer(1000, MGOS_TIMER_REPEAT, hw_timer_stop_cb,
+                                   (void *) 10);
+  mgos_ints_enable();
+  ASSERT(s_hw_stop_id != MGOS_INVALID_TIMER_ID);
+  ASSERT_EQ(wait_hw_samples(10, 100), 10);
+  usleep(10000);
+  ASSERT_EQ(wait_hw_samples(0, 0), 10);
+
+  /* Clearing a repeating timer stops it. */
+  reset_hw_samples();
+  id = mgos_set_hw_timer(1000, MGOS_TIMER_REPEAT, hw_timer_cb, NULL);
+  ASSERT(wait_hw_samples(10, 100) >= 10);
+  mgos_clear_timer(id);
+  int n = wait_hw_samples(0, 0);
+  usleep(10000);
+  ASSERT_EQ(wait_hw_samples(0, 0), n);
+
+  /* All the slots are free again. */
+  for (int i = 0; i < MGOS_NUM_HW_TIMERS; i++) {
+    ids[i] = mgos_set_hw_timer(1000000, 0, hw_timer_cb, NULL);
+    ASSERT(ids[i] != MGOS_INVALID_TIMER_ID);
+  }
+  ids[MGOS_NUM_HW_TIMERS] = mgos_set_hw_timer(1000000, 0, hw_timer_cb, NULL);
+  ASSERT_EQ(ids[MGOS_NUM_HW_TIMERS], MGOS_INVALID_TIMER_ID);
+  for (int i = 0; i < MGOS_NUM_HW_TIMERS; i++) mgos_clear_timer(ids[i]);
+
+  return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+  int64_t va = *(const int64_t *) a, vb = *(const int64_t *) b;
+  return (va < vb ? -1 : (va > vb ? 1 : 0));
+}
+
+static const char *bench_hw_timers(void) {
+  static const int periods[] = {100, 1000, 10000};
+  static const int counts[] = {5000, 1000, 100};
+  static int64_t devs[MAX_HW_SAMPLES];
+  for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+    const int p = periods[i], n = counts[i];
+    reset_hw_samples();
+    mgos_timer_id id =
+        mgos_set_hw_timer(p, MGOS_TIMER_REPEAT, hw_timer_cb, NULL);
+    ASSERT(id != MGOS_INVALID_TIMER_ID);
+    ASSERT(wait_hw_samples(n, n * p / 1000 + 1000) >= n);
+    mgos_clear_timer(id);
+    /* Deviation of the intervals between callbacks from the period. */
+    for (int j = 1; j < n; j++) {
+      devs[j - 1] = s_hw_ts[j] - s_hw_ts[j - 1] - p;
+      if (devs[j - 1] < 0) devs[j - 1] = -devs[j - 1];
+    }
+    qsort(devs, n - 1, sizeof(devs[0]), cmp_int64);
+    printf("    %5d us period: p50 %d us, p99 %d us, max %d us\n", p,
+           (int) devs[(n - 1) / 2], (int) devs[(n - 1) * 99 / 100],
+           (int) devs[n - 2]);
+  }
+  return NULL;
+}
+
+static double bench_conf_parse(const struct mg_str json,
+                               const struct mgos_conf_entry *schema,
+                               int num_iter) {
+  struct bench_conf conf;
+  double t = cs_time();
+  for (int i = 0; i < num_iter; i++) {
+    memset(&conf, 0, sizeof(conf));
+    if (!mgos_conf_parse(json, "*", schema, &conf)) return -1;
+    mgos_conf_free(schema, &conf);
+  }
+  return (cs_time() - t) / num_iter;
+}
+
+static double bench_conf_lookup(const struct mgos_conf_entry *schema,
+                                int num_iter) {
+  double t = cs_time();
+  for (int i = 0; i < num_iter; i++) {
+    for (int j = 0; j < s_num_conf_paths; j++) {
+      if (mgos_conf_find_schema_entry(s_conf_paths[j], schema) == NULL) {
+        return -1;
+      }
+    }
+  }
+  return (cs_time() - t) / num_iter / s_num_conf_paths;
+}
+
+static const char *bench_config(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  struct mgos_conf_entry *linear = copy_schema(schema);
+  struct bench_conf conf;
+  struct mbuf mb;
+  size_t size;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+  int i;
+
+  /* Full config, with all the keys, as it would be with conf9.json. */
+  memset(&conf, 0, sizeof(conf));
+  mbuf_init(&mb, 0);
+  ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &conf));
+  mgos_conf_emit_cb(&conf, NULL, schema, false, &mb, NULL, NULL);
+  mgos_conf_free(schema, &conf);
+  const struct mg_str json = mg_mk_str_n(mb.buf, mb.len);
+
+  double t_idx = bench_conf_parse(json, schema, 100);
+  double t_lin = bench_conf_parse(json, linear, 100);
+  ASSERT(t_idx > 0 && t_lin > 0);
+  printf("    parse %d keys: indexed %.3f ms, linear %.3f ms\n",
+         schema->num_desc, t_idx * 1e3, t_lin * 1e3);
+
+  s_num_conf_paths = 0;
+  collect_conf_paths(schema, "");
+  t_idx = bench_conf_lookup(schema, 100);
+  t_lin = bench_conf_lookup(linear, 100);
+  ASSERT(t_idx > 0 && t_lin > 0);
+  printf("    lookup: indexed %.3f us, linear %.3f us\n", t_idx * 1e6,
+         t_lin * 1e6);
+
+  for (i = 0; i < s_num_conf_paths; i++) free(s_conf_paths[i]);
+  mbuf_free(&mb);
+  free(defaults);
+  free(linear);
+  return NULL;
+}
+
+static const char *bench_config_acl(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  struct bench_conf conf;
+  struct mbuf mb;
+  size_t size;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+  const struct mg_str acl = mg_mk_str(s_bench_acl);
+  int i, j, n = 0, num_allowed = 0, num_iter = 100;
+  double t;
+
+  memset(&conf, 0, sizeof(conf));
+  mbuf_init(&mb, 0);
+  ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &conf));
+  mgos_conf_emit_cb(&conf, NULL, schema, false, &mb, NULL, NULL);
+  mgos_conf_free(schema, &conf);
+  const struct mg_str json = mg_mk_str_n(mb.buf, mb.len);
+  for (i = 0; i < (int) acl.len; i++) n += (acl.p[i] == ',');
+
+  s_num_conf_paths = 0;
+  collect_conf_paths(schema, "");
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    for (j = 0; j < s_num_conf_paths; j++) {
+      num_allowed += check_access_ref(mg_mk_str(s_conf_paths[j]), acl);
+    }
+  }
+  double t_ref = (cs_time() - t) / num_iter;
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    for (j = 0; j < s_num_conf_paths; j++) {
+      num_allowed -= mgos_conf_check_access_n(mg_mk_str(s_conf_paths[j]), acl);
+    }
+  }
+  double t_comp = (cs_time() - t) / num_iter;
+  ASSERT_EQ(num_allowed, 0);
+  printf("    check %d keys, %d ACL entries: compiled %.3f ms, glob %.3f ms\n",
+         s_num_conf_paths, n + 1, t_comp * 1e3, t_ref * 1e3);
+
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    memset(&conf, 0, sizeof(conf));
+    ASSERT(mgos_conf_parse(json, s_bench_acl, schema, &conf));
+    mgos_conf_free(schema, &conf);
+  }
+  double t_acl = (cs_time() - t) / num_iter;
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    memset(&conf, 0, sizeof(conf));
+    ASSERT(mgos_conf_parse(json, "*", schema, &conf));
+    mgos_conf_free(schema, &conf);
+  }
+  double t_all = (cs_time() - t) / num_iter;
+  printf("    parse %d keys: with ACL %.3f ms, with \"*\" %.3f ms\n",
+         schema->num_desc, t_acl * 1e3, t_all * 1e3);
+
+  for (i = 0; i < s_num_conf_paths; i++) free(s_conf_paths[i]);
+  mbuf_free(&mb);
+  free(defaults);
+  return NULL;
+}
+
+static bool count_sink(const char *data, size_t len, void *param) {
+  *((size_t *) param) += len;
+  (void) data;
+  return true;
+}
+
+static const char *bench_config_emit(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  struct bench_conf conf;
+  struct mbuf mb;
+  size_t size, len = 0, peak = 0;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+  int i, num_iter = 100;
+
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &conf));
+  /* This is what mgos_config_get() does for objects. */
+  double t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    mbuf_init(&mb, 0);
+    mgos_conf_emit_cb(&conf, NULL, schema, false, &mb, NULL, NULL);
+    size = mb.len;
+    peak = mb.size;
+    mbuf_free(&mb);
+  }
+  double t_get = (cs_time() - t) / num_iter;
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    len = 0;
+    ASSERT(mgos_conf_emit_stream(&conf, NULL, schema, false, 0, count_sink,
+                                 &len));
+  }
+  double t_stream = (cs_time() - t) / num_iter;
+  ASSERT_EQ(len, size);
+  printf("    emit %d keys, %d bytes: mbuf %.3f ms, %d bytes buffer; "
+         "stream %.3f ms, 256 bytes buffer\n",
+         schema->num_desc, (int) size, t_get * 1e3, (int) peak,
+         t_stream * 1e3);
+
+  mgos_conf_free(schema, &conf);
+  free(defaults);
+  return NULL;
+}
+
+static const char *bench_config_snapshot(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  const char *json_fname = ".build/bench_conf.json";
+  const char *bin_fname = ".build/bench_conf.bin";
+  const int num_iter = 100;
+  struct bench_conf conf;
+  size_t size;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+  int i;
+
+  /* Full config, with all the keys, as it would be with conf9.json. */
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &conf));
+  ASSERT(mgos_conf_emit_f(&conf, NULL, schema, false, json_fname));
+  ASSERT(mgos_conf_save_bin(&conf, sizeof(conf), schema, 1, -1, bin_fname));
+  mgos_conf_free(schema, &conf);
+
+  double t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    char *json = cs_read_file(json_fname, &size);
+    memset(&conf, 0, sizeof(conf));
+    ASSERT(mgos_conf_parse(mg_mk_str_n(json, size), "*", schema, &conf));
+    mgos_conf_free(schema, &conf);
+    free(json);
+  }
+  double t_json = (cs_time() - t) / num_iter;
+
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    memset(&conf, 0, sizeof(conf));
+    ASSERT(mgos_conf_load_bin(bin_fname, schema, 1, &conf, sizeof(conf), NULL));
+    mgos_conf_free(schema, &conf);
+  }
+  double t_bin = (cs_time() - t) / num_iter;
+
+  printf("    load %d keys: json %.3f ms, snapshot %.3f ms\n", schema->num_desc,
+         t_json * 1e3, t_bin * 1e3);
+
+  remove(json_fname);
+  remove(bin_fname);
+  free(defaults);
+  return NULL;
+}
+
+static const char *bench_config_journal(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  const char *conf_fname = ".build/bench_conf9.json";
+  const char *journal_fname = ".build/bench_conf9.journal";
+  const int num_iter = 100;
+  struct bench_conf defaults, conf;
+  size_t size;
+  char *json = cs_read_file(".build/bench_conf_defaults.json", &size);
+  char buf[40];
+  int i, num_set = 0;
+
+  /* A config with some user settings, about a tenth of the strings. */
+  memset(&defaults, 0, sizeof(defaults));
+  memset(&conf, 0, sizeof(conf));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &defaults));
+  ASSERT(mgos_conf_parse(mg_mk_str(json), "*", schema, &conf));
+  for (i = 1; i <= schema->num_desc; i++) {
+    if (schema[i].type != CONF_TYPE_STRING || i % 10 != 0) continue;
+    snprintf(buf, sizeof(buf), "value_%d", i);
+    mgos_conf_set_str((char **) (((char *) &conf) + schema[i].offset), buf);
+    num_set++;
+  }
+
+  /* Changing one value at a time. */
+  double t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    conf.b00.http.port = i;
+    ASSERT(mgos_conf_emit_f(&conf, &defaults, schema, true, conf_fname));
+  }
+  double t_full = (cs_time() - t) / num_iter;
+  size_t full_size = file_size(conf_fname);
+
+  remove(journal_fname);
+  ASSERT(mgos_conf_journal_append(&conf, &defaults, schema, 1,
+                                  journal_fname) == num_set + 1);
+  ASSERT(mgos_conf_journal_replay(journal_fname, 1, "*", schema, &defaults) ==
+         num_set + 1);
+  size_t size0 = file_size(journal_fname);
+  t = cs_time();
+  for (i = 0; i < num_iter; i++) {
+    /* Base is normally obtained by replaying the journal. */
+    defaults.b00.http.port = conf.b00.http.port;
+    conf.b00.http.port = i + 1000;
+    ASSERT(mgos_conf_journal_append(&conf, &defaults, schema, 1,
+                                    journal_fname) > 0);
+  }
+  double t_journal = (cs_time() - t) / num_iter;
+  size_t rec_size = (file_size(journal_fname) - size0) / num_iter;
+
+  printf("    save 1 of %d changed keys: full %.3f ms, %d bytes; "
+         "journal %.3f ms, %d bytes\n",
+         num_set + 1, t_full * 1e3, (int) full_size, t_journal * 1e3,
+         (int) rec_size);
+
+  remove(conf_fname);
+  remove(journal_fname);
+  mgos_conf_free(schema, &conf);
+  mgos_conf_free(schema, &defaults);
+  free(json);
+  return NULL;
+}
+
+/* Heap taken by a block, including malloc's own header. */
+static size_t heap_block_size(void *p) {
+  return (p != NULL ? malloc_usable_size(p) + sizeof(size_t) : 0);
+}
+
+static const char *bench_config_strings(void) {
+  const struct mgos_conf_entry *schema = bench_conf_schema();
+  struct bench_conf conf;
+  struct mgos_conf_str_stats st;
+  size_t size;
+  char *defaults = cs_read_file(".build/bench_conf_defaults.json", &size);
+  char buf[40];
+  int i, pass;
+
+  memset(&conf, 0, sizeof(conf));
+  for (pass = 0; pass < 2; pass++) {
+    const char *what = "defaults";
+    ASSERT(mgos_conf_parse(mg_mk_str(defaults), "*", schema, &conf));
+    if (pass == 1) {
+      /* Set every string to a non-default value. */
+      for (i = 1; i <= schema->num_desc; i++) {
+        char **sp = (char **) (((char *) &conf) + schema[i].offset);
+        if (schema[i].type != CONF_TYPE_STRING) continue;
+        snprintf(buf, sizeof(buf), "value_%d", i);
+        mgos_conf_set_str(sp, buf);
+      }
+      what = "modified";
+    }
+
+    mgos_conf_get_str_stats(&st);
+    size_t h_slabs = st.slabs_size + st.num_slabs * sizeof(size_t);
+
+    /* What it would take to malloc each of them, as it used to be. */
+    int num_strs = 0;
+    size_t h_malloc = 0;
+    for (i = 1; i <= schema->num_desc; i++) {
+      if (schema[i].type != CONF_TYPE_STRING) continue;
+      char *s = *(char **) (((char *) &conf) + schema[i].offset);
+      if (s == NULL) continue;
+      char *dup = strdup(s);
+      h_malloc += heap_block_size(dup);
+      free(dup);
+      num_strs++;
+    }
+
+    printf("    %s, %d strings: malloc %d bytes in %d blocks, "
+           "slabs %d bytes in %d (%d strings)\n",
+           what, num_strs, (int) h_malloc, num_strs, (int) h_slabs,
+           st.num_slabs, st.num_slab_strs);
+  }
+  mgos_conf_free(schema, &conf);
+
+  free(defaults);
+  return NULL;
+}
+
+static const char *bench_timers(void) {
+  static const int counts[] = {10, 1000, 100000};
+  mgos_timer_id *ids = (mgos_timer_id *) calloc(100000, sizeof(*ids));
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    const int n = counts[i];
+    double t_set, t_clear, t_fire;
+    int j;
+
+    t_set = cs_time();
+    for (j = 0; j < n; j++) {
+      ids[j] = mgos_set_timer(1000 + rand() % 1000000, 0, bench_timer_cb, NULL);
+    }
+    t_set = cs_time() - t_set;
+    ASSERT(ids[n - 1] != MGOS_INVALID_TIMER_ID);
+    t_clear = cs_time();
+    for (j = 0; j < n; j++) mgos_clear_timer(ids[j]);
+    t_clear = cs_time() - t_clear;
+
+    for (j = 0; j < n; j++) {
+      mgos_set_timer(1000 + rand() % 1000000, 0, bench_timer_cb, NULL);
+    }
+    advance_uptime(2000);
+    t_fire = cs_time();
+    ASSERT_EQ(run_due_timers(), n);
+    t_fire = cs_time() - t_fire;
+
+    printf("    %6d timers: set %.3f us, clear %.3f us, fire %.3f us\n", n,
+           t_set * 1e6 / n, t_clear * 1e6 / n, t_fire * 1e6 / n);
+  }
+  free(ids);
+  return NULL;
+}
+
 void tests_setup(void) {
+  mgos_timers_init();
 }
 
 const char *tests_run(const char *filter) {
   RUN_TEST(test_config);
+  RUN_TEST(test_config_lookup);
+  RUN_TEST(test_config_snapshot);
+  RUN_TEST(test_config_packed);
+  RUN_TEST(test_config_strings);
+  RUN_TEST(test_config_journal);
+  RUN_TEST(test_config_subscribe);
+  RUN_TEST(test_config_acl);
+  RUN_TEST(test_config_emit_stream);
   RUN_TEST(test_json_scanf);
+  RUN_TEST(test_json_walk);
+  RUN_TEST(test_json_walk_ctx);
+  RUN_TEST(test_json_tape);
+  RUN_TEST(test_json_printf);
+  RUN_TEST(test_json_setf_batch);
+  RUN_TEST(test_ubjson_walk);
+  RUN_TEST(test_ub_render);
+  RUN_TEST(test_ubjson_typed_array);
   RUN_TEST(test_events);
+  RUN_TEST(test_events_order);
+  RUN_TEST(test_event_post);
+  RUN_TEST(test_event_post_threads);
+  RUN_TEST(test_event_trace);
+  RUN_TEST(test_timers);
+  RUN_TEST(test_timers_stale_id);
+  RUN_TEST(test_timers_slack);
+  RUN_TEST(test_timers_time_change);
+  RUN_TEST(test_timers_pool);
+  RUN_TEST(test_timers_instr);
+  RUN_TEST(test_hw_timers);
+
+  /* Benchmarks are slow and depend on the machine: run with `make bench`. */
+  if (getenv("TEST_BENCH") == NULL) return NULL;
+  RUN_TEST(bench_config);
+  RUN_TEST(bench_config_snapshot);
+  RUN_TEST(bench_config_strings);
+  RUN_TEST(bench_config_journal);
+  RUN_TEST(bench_config_acl);
+  RUN_TEST(bench_config_emit);
+  RUN_TEST(bench_json_walk);
+  RUN_TEST(bench_json_tape);
+  RUN_TEST(bench_json_printf);
+  RUN_TEST(bench_json_setf_batch);
+  RUN_TEST(bench_ubjson_walk);
+  RUN_TEST(bench_ub_build);
+  RUN_TEST(bench_ubjson_typed_array);
+  RUN_TEST(bench_events);
+  RUN_TEST(bench_timers);
+  RUN_TEST(bench_hw_timers);
   return NULL;
 }
 
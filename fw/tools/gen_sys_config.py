@@ -74,6 +74,20 @@
 # [
 #   ["foo.frombulate", true],  # Enable frombulation by default.
 # ]
+#
+# An int entry can declare its range with "min" and "max" params. Values out
+# of the range are rejected by mgos_conf_parse(), mgos_config_set() and the
+# generated setter, which logs an error and leaves the value unchanged.
+#
+# [
+#   ["foo.bar.num_quux", "i", 100, {"title": "Number of quux", "min": 0, "max": 1000}],
+# ]
+#
+# With --packed, the struct is laid out to take less RAM: bools of an object
+# are stored as bits of uint8_t fields, ints that declare a range use the
+# narrowest integer type that holds it, and fields are ordered by alignment.
+# The schema records the storage of every entry, so mgos_conf_* functions and
+# the accessors keep working.
 
 import argparse
 import collections
@@ -87,6 +101,7 @@ parser = argparse.ArgumentParser(description="Create C config boilerplate from a
 parser.add_argument("--c_name", required=True, help="name of the top-level C struct")
 parser.add_argument("--c_global_name", required=False, help="name for the global instance, also will be used as a prefix for its accessors")
 parser.add_argument("--dest_dir", default=".", help="base path of generated files")
+parser.add_argument("--packed", action="store_true", default=False, help="generate a compact struct layout")
 parser.add_argument("schema_files", nargs="+", help="YAML schema files")
 
 
@@ -334,6 +349,74 @@ class JSONSchemaWriter(object):
         return "[\n%s\n]\n" % ",\n".join(
             "  %s" % json.dumps(e, sort_keys=True) for e in self._schema)
 
+# Storage of packed ints: (storage, field type, min, max).
+PACKED_INT_STORAGE = (
+    ("CONF_STORAGE_U8", "uint8_t ", 0, 0xff),
+    ("CONF_STORAGE_I8", "int8_t ", -0x80, 0x7f),
+    ("CONF_STORAGE_U16", "uint16_t ", 0, 0xffff),
+    ("CONF_STORAGE_I16", "int16_t ", -0x8000, 0x7fff),
+)
+
+# Alignment class of a field type, used to order fields of a packed struct.
+# Pointers go after doubles, so that on 32-bit targets they fill the space
+# that would otherwise be taken by padding.
+def field_align(ctype_field):
+    if ctype_field == "double ":
+        return 8
+    if ctype_field == "char *":
+        return 5
+    if ctype_field == "int ":
+        return 4
+    if "16_t" in ctype_field:
+        return 2
+    return 1
+
+
+# Returns (min, max) declared by an int entry, or None.
+def get_int_range(e):
+    params = e.params or {}
+    vmin, vmax = params.get("min"), params.get("max")
+    if e.vtype != SchemaEntry.V_INT or not isinstance(vmin, int) or not isinstance(vmax, int):
+        return None
+    if not vmin <= e.default <= vmax:
+        raise ValueError("%s: Default value %d is out of range [%d, %d]" % (e.path, e.default, vmin, vmax))
+    return (vmin, vmax)
+
+
+# Returns (storage, field type) for an int entry in a packed struct.
+def get_packed_int_storage(e):
+    r = get_int_range(e)
+    if r is None:
+        return (None, "int ")
+    vmin, vmax = r
+    for storage, ctype_field, smin, smax in PACKED_INT_STORAGE:
+        if smin <= vmin and vmax <= smax:
+            return (storage, ctype_field)
+    return (None, "int ")
+
+
+# Assigns bools of each object to bits of uint8_t fields, in walk order.
+class BoolBits(object):
+    def __init__(self):
+        self._counts = [0]
+
+    def ObjectStart(self):
+        self._counts.append(0)
+
+    # Returns (field name, bit number) for the next bool of the current object.
+    def Add(self):
+        n = self._counts[-1]
+        self._counts[-1] += 1
+        return ("bits%d_" % (n // 8), n % 8)
+
+    # Returns the number of bit fields of the object that ended.
+    def ObjectEnd(self):
+        return (self._counts.pop() + 7) // 8
+
+    def NumFields(self):
+        return (self._counts[-1] + 7) // 8
+
+
 def get_ctype(vtype):
     if vtype in (SchemaEntry.V_BOOL, SchemaEntry.V_INT):
         ctype_api = "int         "
@@ -351,32 +434,56 @@ def get_ctype(vtype):
 # methods instead of a single GetLines() : we need some structs to be
 # present in header, and some in .c file.
 class StructDefGen(object):
-    def __init__(self, struct_name):
+    def __init__(self, struct_name, packed):
         self._struct_name = struct_name
+        self._packed = packed
         self._obj_type = "struct %s" % struct_name
         self._objs = []
+        # Each field is (alignment, declaration).
         self._fields = []
         self._stack = []
+        self._bool_bits = BoolBits()
 
     def ObjectStart(self, e):
         p = e.orig_path if e.orig_path else e.path
         new_obj_type = "struct %s_%s" % (self._struct_name, p.replace(".", "_"))
-        self._fields.append("%s %s" % (new_obj_type, e.key))
         self._stack.append((self._obj_type, self._fields))
         self._obj_type, self._fields = new_obj_type, []
+        self._bool_bits.ObjectStart()
 
     def Value(self, e):
         key = e.key
         _, ctype_field = get_ctype(e.vtype)
-        self._fields.append("%s%s" % (ctype_field, key))
+        if self._packed and e.vtype == SchemaEntry.V_BOOL:
+            self._bool_bits.Add()
+            return
+        if self._packed and e.vtype == SchemaEntry.V_INT:
+            _, ctype_field = get_packed_int_storage(e)
+        self._fields.append((field_align(ctype_field), "%s%s" % (ctype_field, key)))
+
+    def _AddBitFields(self, num_bit_fields):
+        for i in range(num_bit_fields):
+            self._fields.append((1, "uint8_t bits%d_" % i))
+
+    def _AddObj(self):
+        fields = self._fields
+        if self._packed:
+            # Stable sort, so fields of the same alignment keep schema order.
+            fields = sorted(fields, key=lambda f: -f[0])
+        self._objs.append((len(self._stack), self._obj_type, [f[1] for f in fields]))
 
     def ObjectEnd(self, e):
+        self._AddBitFields(self._bool_bits.ObjectEnd())
+        obj_type = self._obj_type
+        obj_align = max([f[0] for f in self._fields] or [1])
         if not e.orig_path:
-            self._objs.append((len(self._stack), self._obj_type, self._fields))
+            self._AddObj()
         self._obj_type, self._fields = self._stack.pop()
+        self._fields.append((obj_align, "%s %s" % (obj_type, e.key)))
 
     def GetLines(self):
-        self._objs.append((len(self._stack), self._obj_type, self._fields))
+        self._AddBitFields(self._bool_bits.NumFields())
+        self._AddObj()
         lines = []
         for _, obj_type, fields in self._objs:
             lines.append("%s {" % obj_type)
@@ -391,24 +498,39 @@ class StructDefGen(object):
 # is not None, then header will additionally contain static inline functions
 # to access a global config instance, allocated globally in the source.
 class AccessorsGen(object):
-    def __init__(self, struct_name, c_global_name):
+    def __init__(self, struct_name, c_global_name, packed):
         self._struct_name = struct_name
         self._c_global_name = c_global_name
+        self._packed = packed
+        self._bool_bits = BoolBits()
         self._getters = []
         self._setters = []
+        # Path of the bit field and bit number of packed bools.
+        self._bits = {}
+        # Schema index of ints that declare a range.
+        self._ranged = {}
+        self._num_entries = 1
 
     def ObjectStart(self, e):
+        self._num_entries += 1
         self._cur_acc_prefix = e.path
         p = e.orig_path if e.orig_path else e.path
         self._getters.append(("const struct %s_%s *" % (self._struct_name, p.replace(".", "_")), "", e.path))
+        self._bool_bits.ObjectStart()
 
     def Value(self, e):
         ctype_api, ctype_field = get_ctype(e.vtype)
+        if self._packed and e.vtype == SchemaEntry.V_BOOL:
+            field, bit = self._bool_bits.Add()
+            self._bits[e.path] = (e.path[:-len(e.key)] + field, bit)
+        if get_int_range(e) is not None:
+            self._ranged[e.path] = self._num_entries
+        self._num_entries += 1
         self._getters.append((ctype_api, ctype_field, e.path))
         self._setters.append((ctype_api, ctype_field, e.path))
 
     def ObjectEnd(self, e):
-        pass
+        self._bool_bits.ObjectEnd()
 
     def GetGetterSignature(self, path, ctype):
         name = path.replace(".", "_")
@@ -472,7 +594,10 @@ class AccessorsGen(object):
                 ampersand = "&"
 
             lines.append("%s {" % self.GetGetterSignature(path, ctype_api))
-            lines.append("  return %scfg->%s;" % (ampersand, path))
+            if path in self._bits:
+                lines.append("  return (cfg->%s >> %d) & 1;" % self._bits[path])
+            else:
+                lines.append("  return %scfg->%s;" % (ampersand, path))
             lines.append("}")
         lines.append("/* }}} */")
         lines.append("")
@@ -482,6 +607,17 @@ class AccessorsGen(object):
             lines.append("%s {" % self.GetSetterSignature(path, ctype_api))
             if "char" in ctype_api:
                 lines.append("  mgos_conf_set_str(&cfg->%s, val);" % path)
+            elif path in self._bits:
+                field, bit = self._bits[path]
+                lines.append("  if (val) {")
+                lines.append("    cfg->%s |= (1 << %d);" % (field, bit))
+                lines.append("  } else {")
+                lines.append("    cfg->%s &= ~(1 << %d);" % (field, bit))
+                lines.append("  }")
+            elif path in self._ranged:
+                lines.append("  if (!mgos_conf_set_value_int(cfg, &%s_schema_[%d], val)) {" % (self._struct_name, self._ranged[path]))
+                lines.append("    LOG(LL_ERROR, (\"[%s] is out of range: %%d\", val));" % path)
+                lines.append("  }")
             else:
                 lines.append("  cfg->%s = val;" % path)
             lines.append("}")
@@ -489,12 +625,15 @@ class AccessorsGen(object):
 
         return lines
 
+    def HaveRanges(self):
+        return bool(self._ranged)
+
 
 # Writes C header file.
 class HWriter(object):
-    def __init__(self, struct_name, c_global_name):
-        self._acc_gen = AccessorsGen(struct_name, c_global_name)
-        self._struct_def_gen = StructDefGen(struct_name)
+    def __init__(self, struct_name, c_global_name, packed):
+        self._acc_gen = AccessorsGen(struct_name, c_global_name, packed)
+        self._struct_def_gen = StructDefGen(struct_name, packed)
         self._struct_name = struct_name
 
     def ObjectStart(self, e):
@@ -540,6 +679,27 @@ const struct mgos_conf_entry *{name}_schema();
            lines="\n".join(self._acc_gen.GetHeaderLines()))
 
 
+# Hash of a config path, must match the one in mgos_config_util.c.
+def fnv1a_32(s):
+    h = 0x811c9dc5
+    for c in s.encode("utf-8"):
+        h = ((h ^ c) * 0x01000193) & 0xffffffff
+    return h
+
+
+# Escapes a string for use in a C string literal.
+def c_str_literal(s):
+    res = []
+    for c in s.encode("utf-8"):
+        if c in (0x22, 0x5c):  # " and \
+            res.append("\\" + chr(c))
+        elif 0x20 <= c < 0x7f:
+            res.append(chr(c))
+        else:
+            res.append("\\%03o" % c)
+    return '"%s"' % "".join(res)
+
+
 # Writes C source file with schema definition
 class CWriter(object):
     _CONF_TYPES = {
@@ -549,32 +709,115 @@ class CWriter(object):
         SchemaEntry.V_STRING: "CONF_TYPE_STRING",
     }
 
-    def __init__(self, struct_name, c_global_name):
-        self._acc_gen = AccessorsGen(struct_name, c_global_name)
+    def __init__(self, struct_name, c_global_name, packed):
+        self._acc_gen = AccessorsGen(struct_name, c_global_name, packed)
         self._struct_name = struct_name
+        self._packed = packed
+        self._bool_bits = BoolBits()
         self._schema_lines = []
         self._start_indices = []
+        # (path hash, parent index) for each entry, root first.
+        self._index = [(fnv1a_32(""), 0)]
+        self._str_defaults = set()
+        self._ranges = []
+
+    def _AddIndexEntry(self, e):
+        parent = self._start_indices[-1] + 1 if self._start_indices else 0
+        self._index.append((fnv1a_32(e.path), parent))
 
     def ObjectStart(self, _e):
         self._acc_gen.ObjectStart(_e)
+        self._bool_bits.ObjectStart()
+        self._AddIndexEntry(_e)
         self._start_indices.append(len(self._schema_lines))
         self._schema_lines.append(None)  # Placeholder
 
     def Value(self, e):
         self._acc_gen.Value(e)
+        self._AddIndexEntry(e)
+        if e.vtype == SchemaEntry.V_STRING and e.default:
+            self._str_defaults.add(e.default)
+        field, storage = e.path, None
+        if self._packed and e.vtype == SchemaEntry.V_BOOL:
+            bits_field, bit = self._bool_bits.Add()
+            field = e.path[:-len(e.key)] + bits_field
+            storage = "CONF_STORAGE_BIT0 + %d" % bit
+        elif self._packed and e.vtype == SchemaEntry.V_INT:
+            storage, _ = get_packed_int_storage(e)
+        r = get_int_range(e)
+        if r is not None:
+            self._ranges.append(r)
         self._schema_lines.append(
-            '  {.type = %s, .key = "%s", .offset = offsetof(struct %s, %s)},'
-            % (self._CONF_TYPES[e.vtype], e.key, self._struct_name, e.path))
+            '  {.type = %s, .key = "%s", .offset = offsetof(struct %s, %s)%s%s},'
+            % (self._CONF_TYPES[e.vtype], e.key, self._struct_name, field,
+               ", .storage = %s" % storage if storage else "",
+               ", .range = &%s_ranges_[%d]" % (self._struct_name, len(self._ranges) - 1) if r else ""))
 
     def ObjectEnd(self, e):
         self._acc_gen.ObjectEnd(e)
+        self._bool_bits.ObjectEnd()
         si = self._start_indices.pop()
         num_desc = len(self._schema_lines) - si - 1
         self._schema_lines[si] = (
             '  {.type = CONF_TYPE_OBJECT, .key = "%s", .offset = offsetof(struct %s, %s), .num_desc = %d},'
             % (e.key, self._struct_name, e.path, num_desc))
 
+    def _GetIndexLines(self):
+        by_hash = sorted(range(1, len(self._index)), key=lambda i: self._index[i][0])
+        for i, j in zip(by_hash, by_hash[1:]):
+            if self._index[i][0] == self._index[j][0]:
+                raise ValueError("Path hash collision: %d and %d" % (i, j))
+        entries = ["  {.hash = 0x%08x, .parent = %d}," % ie for ie in self._index]
+        by_hash_lines = []
+        for i in range(0, len(by_hash), 16):
+            by_hash_lines.append("  %s," % ", ".join(str(j) for j in by_hash[i:i + 16]))
+        return entries, by_hash_lines
+
+    def _GetStrDefaultsLines(self):
+        # Sorted the same way strcmp() does it.
+        values = sorted(self._str_defaults, key=lambda v: v.encode("utf-8"))
+        lines, offsets, size = [], [], 0
+        for v in values:
+            lines.append("  %s \"\\0\"" % c_str_literal(v))
+            offsets.append(size)
+            size += len(v.encode("utf-8")) + 1
+        if size > 0xffff:
+            raise ValueError("String defaults are too long (%d)" % size)
+        offset_lines = []
+        for i in range(0, len(offsets), 16):
+            offset_lines.append("  %s," % ", ".join(str(o) for o in offsets[i:i + 16]))
+        return lines, offset_lines, size
+
     def __str__(self):
+        index_entries, by_hash_lines = self._GetIndexLines()
+        str_defaults_lines, str_offset_lines, str_defaults_size = self._GetStrDefaultsLines()
+        if str_defaults_lines:
+            str_defaults = """
+static const char {name}_str_defaults_[] =
+{lines};
+
+static const uint16_t {name}_str_default_offsets_[{num}] = {{
+{offset_lines}
+}};
+""".format(name=self._struct_name, size=str_defaults_size, num=len(str_defaults_lines),
+           lines="\n".join(str_defaults_lines), offset_lines="\n".join(str_offset_lines))
+            str_defaults_fields = """
+  .str_defaults = {name}_str_defaults_,
+  .str_defaults_size = {size},
+  .str_default_offsets = {name}_str_default_offsets_,
+  .num_str_defaults = {num},""".format(name=self._struct_name, size=str_defaults_size,
+                                      num=len(str_defaults_lines))
+        else:
+            str_defaults, str_defaults_fields = "", ""
+        if self._ranges:
+            ranges = """
+static const struct mgos_conf_range {name}_ranges_[{num}] = {{
+{lines}
+}};
+""".format(name=self._struct_name, num=len(self._ranges),
+           lines="\n".join("  {.min = %d, .max = %d}," % r for r in self._ranges))
+        else:
+            ranges = ""
         return """\
 /* clang-format off */
 /*
@@ -583,14 +826,33 @@ class CWriter(object):
  */
 
 #include <stddef.h>
-#include "{name}.h"
-
+#include "{name}.h"{includes}
+{ranges}
 const struct mgos_conf_entry {name}_schema_[{num_entries}] = {{
   {{.type = CONF_TYPE_OBJECT, .key = "", .offset = 0, .num_desc = {num_desc}}},
 {schema_lines}
 }};
 
+static const struct mgos_conf_index_entry {name}_schema_index_entries_[{num_entries}] = {{
+{index_entries}
+}};
+
+static const uint16_t {name}_schema_by_hash_[{num_desc}] = {{
+{by_hash_lines}
+}};
+{str_defaults}
+static const struct mgos_conf_index {name}_schema_index_ = {{
+  .schema = {name}_schema_,
+  .entries = {name}_schema_index_entries_,
+  .by_hash = {name}_schema_by_hash_,{str_defaults_fields}
+}};
+
 const struct mgos_conf_entry *{name}_schema() {{
+  static bool s_index_added = false;
+  if (!s_index_added) {{
+    mgos_conf_add_index(&{name}_schema_index_);
+    s_index_added = true;
+  }}
   return {name}_schema_;
 }}
 
@@ -600,6 +862,12 @@ const struct mgos_conf_entry *{name}_schema() {{
            num_entries=len(self._schema_lines) + 1,
            num_desc=len(self._schema_lines),
            schema_lines="\n".join(self._schema_lines),
+           index_entries="\n".join(index_entries),
+           by_hash_lines="\n".join(by_hash_lines),
+           str_defaults=str_defaults,
+           str_defaults_fields=str_defaults_fields,
+           includes='\n#include "common/cs_dbg.h"' if self._acc_gen.HaveRanges() else "",
+           ranges=ranges,
            accessor_lines="\n".join(self._acc_gen.GetSourceLines()))
 
 
@@ -650,13 +918,13 @@ if __name__ == "__main__":
     with open_with_temp(jsfn) as jsf:
         jsf.write(str(jsw))
 
-    hw = HWriter(args.c_name, args.c_global_name)
+    hw = HWriter(args.c_name, args.c_global_name, args.packed)
     schema.Walk(hw)
     hfn = os.path.join(args.dest_dir, "%s.h" % args.c_name)
     with open_with_temp(hfn) as hf:
         hf.write(str(hw))
 
-    cw = CWriter(args.c_name, args.c_global_name)
+    cw = CWriter(args.c_name, args.c_global_name, args.packed)
     schema.Walk(cw)
     cfn = os.path.join(args.dest_dir, "%s.c" % args.c_name)
     with open_with_temp(cfn) as cf: